@@ -0,0 +1,389 @@
+/*
+ * Copyright (c) 2017 Andrew Sveikauskas
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ */
+
+#include "clwrapper.h"
+#include <stdlib.h>
+#include <string.h>
+
+//
+// Placement of compilers and linkers on processors.
+//
+// A process starts out in its parent's processor group, so on a machine
+// with more than 64 logical processors every compiler we start would share
+// one group.  CLWRAPPER_AFFINITY spreads them out:
+//
+//    group                round-robin over processor groups
+//    node                 round-robin over NUMA nodes
+//    group:least-loaded   the group with the fewest of our children per
+//                         processor
+//    node:least-loaded    likewise for NUMA nodes
+//
+// Children are started with their group affinity set to the unit chosen,
+// and for nodes, with that node preferred for memory.  The round-robin
+// position and the number of children running on each unit are kept in a
+// small shared section, so that separate cc processes under make -j spread
+// out too.
+//
+// Where the topology comes from can be replaced, before the first child is
+// started, with PlacementSetTopologySource(); and PlacementChoose() is a
+// pure function of the topology and the load, so policies can be exercised
+// against made-up machines.
+//
+
+typedef struct _PLACEMENT_SHARED
+{
+   volatile LONG Next[2];
+   volatile LONG Running[2][PLACEMENT_MAX_UNITS];
+} PLACEMENT_SHARED, *PPLACEMENT_SHARED;
+
+static INIT_ONCE PlacementOnce = INIT_ONCE_STATIC_INIT;
+static PLACEMENT_TOPOLOGY_SOURCE TopologySource = PlacementGetSystemTopology;
+static PLACEMENT_TOPOLOGY Topology;
+static PLACEMENT_POLICY Policy;
+static PPLACEMENT_SHARED Shared;
+
+//
+// Units of the real machine, from GetLogicalProcessorInformationEx().
+//
+HRESULT
+PlacementGetSystemTopology(
+   PLACEMENT_UNIT_KIND Kind,
+   PPLACEMENT_TOPOLOGY Topology
+)
+{
+   HRESULT hr = S_OK;
+   LOGICAL_PROCESSOR_RELATIONSHIP Relationship =
+      Kind == PLACEMENT_NODE ? RelationNumaNode : RelationGroup;
+   PBYTE Buffer = NULL;
+   DWORD Length = 0;
+   DWORD Offset = 0;
+
+   memset(Topology, 0, sizeof(*Topology));
+
+   if (!GetLogicalProcessorInformationEx(Relationship, NULL, &Length) &&
+       GetLastError() != ERROR_INSUFFICIENT_BUFFER)
+   {
+      hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   if (SUCCEEDED(hr))
+   {
+      Buffer = malloc(Length);
+      if (!Buffer)
+         hr = E_OUTOFMEMORY;
+   }
+
+   if (SUCCEEDED(hr) &&
+       !GetLogicalProcessorInformationEx(
+          Relationship,
+          (PVOID)Buffer,
+          &Length))
+   {
+      hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   while (SUCCEEDED(hr) && Offset < Length)
+   {
+      PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX Info =
+         (PVOID)(Buffer + Offset);
+      PPLACEMENT_UNIT Unit;
+      WORD i;
+
+      // Nodes with memory but no processors have an empty mask; nothing
+      // can run there.
+      //
+      if (Info->Relationship == RelationNumaNode &&
+          Info->NumaNode.GroupMask.Mask &&
+          Topology->Count < PLACEMENT_MAX_UNITS)
+      {
+         Unit = &Topology->Units[Topology->Count++];
+         Unit->Group = Info->NumaNode.GroupMask.Group;
+         Unit->Mask = Info->NumaNode.GroupMask.Mask;
+         Unit->Node = Info->NumaNode.NodeNumber;
+      }
+      else if (Info->Relationship == RelationGroup)
+      {
+         for (i = 0;
+              i < Info->Group.ActiveGroupCount &&
+              Topology->Count < PLACEMENT_MAX_UNITS;
+              ++i)
+         {
+            Unit = &Topology->Units[Topology->Count++];
+            Unit->Group = i;
+            Unit->Mask = Info->Group.GroupInfo[i].ActiveProcessorMask;
+            Unit->Node = 0;
+         }
+      }
+
+      Offset += Info->Size;
+   }
+
+   free(Buffer);
+   return hr;
+}
+
+VOID
+PlacementSetTopologySource(
+   PLACEMENT_TOPOLOGY_SOURCE Source
+)
+{
+   TopologySource = Source;
+}
+
+static DWORD
+CountProcessors(
+   KAFFINITY Mask
+)
+{
+   DWORD Count = 0;
+
+   for (; Mask; Mask &= Mask - 1)
+      ++Count;
+
+   return Count;
+}
+
+//
+// Picks a unit.  Ticket is a counter that increases with each call, used
+// for round-robin and to break ties.  Running gives the number of children
+// on each unit.
+//
+DWORD
+PlacementChoose(
+   const PLACEMENT_TOPOLOGY *Topology,
+   BOOL LeastLoaded,
+   const volatile LONG *Running,
+   ULONG Ticket
+)
+{
+   DWORD Best = Ticket % Topology->Count;
+   DWORD i;
+
+   if (!LeastLoaded)
+      return Best;
+
+   // Compare load per processor, without dividing: a is less loaded than b
+   // if Running[a] / Procs[a] < Running[b] / Procs[b].
+   //
+   for (i = 1; i < Topology->Count; ++i)
+   {
+      DWORD Unit = (Ticket + i) % Topology->Count;
+      ULONGLONG Load = (ULONGLONG)max(Running[Unit], 0) *
+                       CountProcessors(Topology->Units[Best].Mask);
+      ULONGLONG BestLoad = (ULONGLONG)max(Running[Best], 0) *
+                           CountProcessors(Topology->Units[Unit].Mask);
+
+      if (Load < BestLoad)
+         Best = Unit;
+   }
+
+   return Best;
+}
+
+static BOOL
+ParsePolicy(
+   PCWSTR Value,
+   PPLACEMENT_POLICY Policy
+)
+{
+   SIZE_T Length = wcscspn(Value, L":");
+
+   if (Length == 5 && !_wcsnicmp(Value, L"group", 5))
+      Policy->Kind = PLACEMENT_GROUP;
+   else if (Length == 4 && !_wcsnicmp(Value, L"node", 4))
+      Policy->Kind = PLACEMENT_NODE;
+   else
+      return FALSE;
+
+   if (!Value[Length])
+      Policy->LeastLoaded = FALSE;
+   else if (!_wcsicmp(Value + Length + 1, L"least-loaded"))
+      Policy->LeastLoaded = TRUE;
+   else if (!_wcsicmp(Value + Length + 1, L"round-robin"))
+      Policy->LeastLoaded = FALSE;
+   else
+      return FALSE;
+
+   return TRUE;
+}
+
+static BOOL CALLBACK
+OpenPlacement(
+   PINIT_ONCE Once,
+   PVOID Parameter,
+   PVOID *Context
+)
+{
+   PWSTR Value = NULL;
+   HANDLE Section = NULL;
+
+   GetEnvironmentString(L"CLWRAPPER_AFFINITY", &Value);
+
+   if (Value && *Value && wcscmp(Value, L"0") && _wcsicmp(Value, L"none"))
+   {
+      if (ParsePolicy(Value, &Policy) &&
+          SUCCEEDED(TopologySource(Policy.Kind, &Topology)) &&
+          Topology.Count > 1)
+      {
+         Section = CreateFileMapping(
+            INVALID_HANDLE_VALUE,
+            NULL,
+            PAGE_READWRITE,
+            0,
+            sizeof(PLACEMENT_SHARED),
+            L"Local\\clwrapper-placement"
+         );
+      }
+
+      // The view keeps the section alive.
+      //
+      if (Section)
+      {
+         Shared = MapViewOfFile(
+            Section,
+            FILE_MAP_READ | FILE_MAP_WRITE,
+            0,
+            0,
+            sizeof(PLACEMENT_SHARED)
+         );
+         CloseHandle(Section);
+      }
+   }
+
+   free(Value);
+   return TRUE;
+}
+
+//
+// Chooses where the next child goes.  Returns S_FALSE, and leaves
+// Placement alone, if there's no policy or nothing to choose from.
+//
+HRESULT
+PlacementAcquire(
+   PPLACEMENT Placement
+)
+{
+   DWORD Kind;
+   DWORD Unit;
+   ULONG Ticket;
+
+   InitOnceExecuteOnce(&PlacementOnce, OpenPlacement, NULL, NULL);
+   if (!Shared)
+      return S_FALSE;
+
+   Kind = Policy.Kind;
+   Ticket = (ULONG)InterlockedIncrement(&Shared->Next[Kind]);
+   Unit = PlacementChoose(
+      &Topology,
+      Policy.LeastLoaded,
+      Shared->Running[Kind],
+      Ticket
+   );
+   InterlockedIncrement(&Shared->Running[Kind][Unit]);
+
+   memset(Placement, 0, sizeof(*Placement));
+   Placement->Placed = TRUE;
+   Placement->Unit = Unit;
+   Placement->Affinity.Group = Topology.Units[Unit].Group;
+   Placement->Affinity.Mask = Topology.Units[Unit].Mask;
+   Placement->PreferNode = Kind == PLACEMENT_NODE;
+   Placement->Node = (USHORT)Topology.Units[Unit].Node;
+
+   return S_OK;
+}
+
+VOID
+PlacementRelease(
+   PPLACEMENT Placement
+)
+{
+   if (Placement->Placed)
+   {
+      InterlockedDecrement(&Shared->Running[Policy.Kind][Placement->Unit]);
+      Placement->Placed = FALSE;
+   }
+}
+
+//
+// Builds the attribute list that tells CreateProcess() about Placement.
+// Placement must outlive the list.
+//
+HRESULT
+PlacementBuildAttributes(
+   PPLACEMENT Placement,
+   LPPROC_THREAD_ATTRIBUTE_LIST *Out
+)
+{
+   HRESULT hr = S_OK;
+   LPPROC_THREAD_ATTRIBUTE_LIST List = NULL;
+   DWORD Count = Placement->PreferNode ? 2 : 1;
+   SIZE_T Size = 0;
+
+   InitializeProcThreadAttributeList(NULL, Count, 0, &Size);
+
+   List = malloc(Size);
+   if (!List)
+      hr = E_OUTOFMEMORY;
+
+   if (SUCCEEDED(hr) &&
+       !InitializeProcThreadAttributeList(List, Count, 0, &Size))
+   {
+      hr = HRESULT_FROM_WIN32(GetLastError());
+      free(List);
+      List = NULL;
+   }
+
+   if (SUCCEEDED(hr) &&
+       !UpdateProcThreadAttribute(
+          List,
+          0,
+          PROC_THREAD_ATTRIBUTE_GROUP_AFFINITY,
+          &Placement->Affinity,
+          sizeof(Placement->Affinity),
+          NULL,
+          NULL))
+   {
+      hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   if (SUCCEEDED(hr) &&
+       Placement->PreferNode &&
+       !UpdateProcThreadAttribute(
+          List,
+          0,
+          PROC_THREAD_ATTRIBUTE_PREFERRED_NODE,
+          &Placement->Node,
+          sizeof(Placement->Node),
+          NULL,
+          NULL))
+   {
+      hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   if (FAILED(hr) && List)
+   {
+      DeleteProcThreadAttributeList(List);
+      free(List);
+      List = NULL;
+   }
+
+   *Out = List;
+   return hr;
+}
+
+VOID
+PlacementFreeAttributes(
+   LPPROC_THREAD_ATTRIBUTE_LIST List
+)
+{
+   if (List)
+   {
+      DeleteProcThreadAttributeList(List);
+      free(List);
+   }
+}
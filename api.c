@@ -0,0 +1,342 @@
+/*
+ * Copyright (c) 2017 Andrew Sveikauskas
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ */
+
+#include "clwrapper.h"
+#include "libclwrapper.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct _CLWRAPPER
+{
+   CLWRAPPER_ARGS_BASE Args;
+   CLWRAPPER_TOOLSET Toolset;
+   PWSTR Environment;
+   PWSTR *Argv;
+};
+
+//
+// The argument parsers keep pointers into argv, and may be handed strings
+// the caller frees as soon as we return, so work on a private copy.
+//
+static HRESULT
+CopyArgv(
+   INT Argc,
+   PCWSTR *Argv,
+   PWSTR **Out
+)
+{
+   HRESULT hr = S_OK;
+   PWSTR *Copy = NULL;
+   INT i;
+
+   if (Argc < 0 || (Argc && !Argv))
+      return E_INVALIDARG;
+
+   Copy = malloc((Argc + 1) * sizeof(*Copy));
+   if (!Copy)
+      hr = E_OUTOFMEMORY;
+
+   if (SUCCEEDED(hr))
+      memset(Copy, 0, (Argc + 1) * sizeof(*Copy));
+
+   for (i = 0; SUCCEEDED(hr) && i < Argc; ++i)
+   {
+      if (!Argv[i])
+         hr = E_INVALIDARG;
+      else
+         hr = HeapPrintf(&Copy[i], L"%s", Argv[i]);
+   }
+
+   if (FAILED(hr) && Copy)
+   {
+      for (i = 0; i < Argc; ++i)
+         free(Copy[i]);
+      free(Copy);
+      Copy = NULL;
+   }
+
+   *Out = Copy;
+   return hr;
+}
+
+static VOID
+FreeArgv(
+   PWSTR *Argv
+)
+{
+   PWSTR *p;
+
+   if (Argv)
+   {
+      for (p = Argv; *p; ++p)
+         free(*p);
+      free(Argv);
+   }
+}
+
+HRESULT
+ClwrapperOpen(
+   INT Argc,
+   PCWSTR *Argv,
+   CLWRAPPER_HANDLE *HandleOut
+)
+{
+   HRESULT hr = S_OK;
+   CLWRAPPER_HANDLE Handle = NULL;
+   PWSTR DllDirectory = NULL;
+   INT NumConsumed = 0;
+
+   if (!HandleOut)
+      return E_INVALIDARG;
+
+   *HandleOut = NULL;
+
+   Handle = malloc(sizeof(*Handle));
+   if (!Handle)
+      hr = E_OUTOFMEMORY;
+   else
+      memset(Handle, 0, sizeof(*Handle));
+
+   if (SUCCEEDED(hr))
+      hr = CopyArgv(Argc, Argv, &Handle->Argv);
+
+   if (SUCCEEDED(hr))
+      hr = BaseParseArg(&Handle->Args, Handle->Argv, &NumConsumed);
+
+   if (SUCCEEDED(hr) && NumConsumed != Argc)
+   {
+      fprintf(
+         stderr,
+         "Unrecognized toolset argument: %ls\n",
+         Handle->Argv[NumConsumed]
+      );
+      hr = E_INVALIDARG;
+   }
+
+   if (SUCCEEDED(hr))
+      hr = ToolsetAcquire(&Handle->Args, &Handle->Toolset);
+
+   if (SUCCEEDED(hr))
+      hr = ToolsetGetDllDirectory(&Handle->Toolset, &DllDirectory);
+   if (SUCCEEDED(hr))
+      hr = BuildEnvironmentBlock(DllDirectory, &Handle->Environment);
+
+   if (SUCCEEDED(hr))
+   {
+      *HandleOut = Handle;
+      Handle = NULL;
+   }
+
+   ClwrapperClose(Handle);
+   free(DllDirectory);
+   return hr;
+}
+
+VOID
+ClwrapperClose(
+   CLWRAPPER_HANDLE Handle
+)
+{
+   if (Handle)
+   {
+      ToolsetFree(&Handle->Toolset);
+      BaseArgsFree(&Handle->Args);
+      free(Handle->Environment);
+      FreeArgv(Handle->Argv);
+      free(Handle);
+   }
+}
+
+static HRESULT
+ListToArray(
+   PSTRING_LIST List,
+   PDWORD Count,
+   PWSTR **Array
+)
+{
+   HRESULT hr = S_OK;
+   PSTRING_LIST Node;
+   DWORD n = 0;
+
+   for (Node = List; Node; Node = Node->Next)
+      ++n;
+
+   *Count = 0;
+   *Array = malloc((n + 1) * sizeof(**Array));
+   if (!*Array)
+      return E_OUTOFMEMORY;
+
+   memset(*Array, 0, (n + 1) * sizeof(**Array));
+
+   for (Node = List; SUCCEEDED(hr) && Node; Node = Node->Next)
+   {
+      hr = HeapPrintf(&(*Array)[*Count], L"%s", Node->String);
+      if (SUCCEEDED(hr))
+         ++*Count;
+   }
+
+   return hr;
+}
+
+//
+// Options cc carries out itself rather than passing to cl, by running more
+// than one command or doing something with the results.  A single command
+// line can't do what they ask, so they're refused rather than dropped.
+// Returns the first one Args has, or NULL.
+//
+static PCSTR
+GetUntranslatableOption(
+   PCC_ARGS Args
+)
+{
+   PSTRING_LIST List;
+   DWORD NumSources = 0;
+
+   for (List = Args->Inputs; List; List = List->Next)
+   {
+      if (CcIsSourceFile(List->String))
+         ++NumSources;
+   }
+
+   if (Args->Jobs)
+      return "-j";
+   if (Args->UnitySize)
+      return "-funity";
+   if (Args->Deps != CC_DEPS_NONE)
+      return Args->Deps == CC_DEPS_USER ? "-MMD" : "-MD";
+   if (Args->Restat)
+      return "-frestat";
+   if (Args->SaveTemps)
+      return "-save-temps";
+   if (Args->PchFile)
+      return "-include-pch";
+   if (Args->AutoPch)
+      return "-fpch-auto";
+   if (Args->Modules && NumSources > 1)
+      return "-fmodules-ts with several sources";
+
+   return NULL;
+}
+
+HRESULT
+ClwrapperTranslate(
+   CLWRAPPER_HANDLE Handle,
+   INT Argc,
+   PCWSTR *Argv,
+   PCLWRAPPER_COMMAND *CommandOut
+)
+{
+   HRESULT hr = S_OK;
+   PWSTR *Copy = NULL;
+   CC_ARGS Args = {0};
+   OUTPUT_STRING CommandLine = {0};
+   PSTRING_LIST Outputs = NULL;
+   PCLWRAPPER_COMMAND Command = NULL;
+   PCSTR Untranslatable = NULL;
+
+   if (!Handle || !CommandOut)
+      return E_INVALIDARG;
+
+   *CommandOut = NULL;
+
+   hr = CopyArgv(Argc, Argv, &Copy);
+
+   if (SUCCEEDED(hr))
+      hr = CcParseArgs(&Args, Copy);
+
+   if (SUCCEEDED(hr) &&
+       (Args.Base.CompilerVersion.Specified ||
+        Args.Base.SdkVersion.Specified ||
+        Args.Base.DesiredArchitecture ||
+        Args.Base.DesiredHost ||
+        Args.Base.ToolsetProfile))
+   {
+      fprintf(stderr, "Toolset options must be passed to ClwrapperOpen\n");
+      hr = E_INVALIDARG;
+   }
+
+   if (SUCCEEDED(hr))
+      Untranslatable = GetUntranslatableOption(&Args);
+   if (Untranslatable)
+   {
+      fprintf(stderr, "%s needs cc and can't be translated\n", Untranslatable);
+      hr = E_INVALIDARG;
+   }
+
+   if (SUCCEEDED(hr) && Handle->Args.StaticCrt)
+      Args.Base.StaticCrt = TRUE;
+
+   if (SUCCEEDED(hr))
+      hr = CcBuildCommandLine(&Args, &Handle->Toolset, &CommandLine);
+
+   if (SUCCEEDED(hr))
+      hr = CcGetExpectedOutputs(&Args, &Outputs);
+
+   if (SUCCEEDED(hr))
+   {
+      Command = malloc(sizeof(*Command));
+      if (!Command)
+         hr = E_OUTOFMEMORY;
+      else
+         memset(Command, 0, sizeof(*Command));
+   }
+
+   if (SUCCEEDED(hr))
+   {
+      hr = CcGetToolPath(
+         &Args,
+         &Handle->Toolset,
+         &Command->ApplicationName
+      );
+   }
+
+   if (SUCCEEDED(hr))
+   {
+      Command->CommandLine = CommandLine.Buffer;
+      CommandLine.Buffer = NULL;
+      Command->Environment = Handle->Environment;
+
+      hr = ListToArray(Outputs, &Command->NumOutputs, &Command->Outputs);
+   }
+
+   if (SUCCEEDED(hr))
+   {
+      *CommandOut = Command;
+      Command = NULL;
+   }
+
+   ClwrapperFreeCommand(Command);
+   FreeStringList(Outputs);
+   FreeString(&CommandLine);
+   CcArgsFree(&Args);
+   FreeArgv(Copy);
+   return hr;
+}
+
+VOID
+ClwrapperFreeCommand(
+   PCLWRAPPER_COMMAND Command
+)
+{
+   if (Command)
+   {
+      DWORD i;
+
+      if (Command->Outputs)
+      {
+         for (i = 0; i < Command->NumOutputs; ++i)
+            free(Command->Outputs[i]);
+         free(Command->Outputs);
+      }
+
+      free(Command->ApplicationName);
+      free(Command->CommandLine);
+      free(Command);
+   }
+}
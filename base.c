@@ -66,6 +66,31 @@ BaseParseArg(
          ++Arg;
          ++*NumConsumedOut;
       }
+      else if (!wcsncmp(*Arg, L"-toolset=", 9))
+      {
+         Context->ToolsetProfile = *Arg + 9;
+         ++Arg;
+         ++*NumConsumedOut;
+      }
+      else if (!wcscmp(*Arg, L"--no-toolset-cache"))
+      {
+         Context->NoToolsetCache = TRUE;
+         ++Arg;
+         ++*NumConsumedOut;
+      }
+      else if (!wcsncmp(*Arg, L"-host=", 6))
+      {
+         Context->DesiredHost = *Arg + 6;
+         if (wcscmp(Context->DesiredHost, L"x86") &&
+             wcscmp(Context->DesiredHost, L"amd64"))
+         {
+            fprintf(stderr, "Unrecognized host: %ls\n", Context->DesiredHost);
+            hr = E_INVALIDARG;
+            break;
+         }
+         ++Arg;
+         ++*NumConsumedOut;
+      }
       else if (!wcsncmp(*Arg, L"-m", 2))
       {
          Context->DesiredArchitecture = *Arg + 2;
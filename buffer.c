@@ -0,0 +1,499 @@
+/*
+ * Copyright (c) 2017 Andrew Sveikauskas
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ */
+
+#include "clwrapper.h"
+#include <stdlib.h>
+#include <string.h>
+#include <intsafe.h>
+
+// Makes sure there is room for at least Length more bytes.
+//
+HRESULT
+BufferReserve(
+   PBYTE_BUFFER Buffer,
+   SIZE_T Length
+)
+{
+   HRESULT hr = S_OK;
+   SIZE_T Required = 0;
+   SIZE_T Alloc = Buffer->AllocatedBytes;
+
+   if (!Alloc)
+      Alloc = 64;
+
+   hr = SizeTAdd(Buffer->Length, Length, &Required);
+
+   while (SUCCEEDED(hr) && Alloc < Required)
+   {
+      hr = SizeTMult(Alloc, 2, &Alloc);
+   }
+
+   if (SUCCEEDED(hr) &&
+       Alloc != Buffer->AllocatedBytes)
+   {
+      PVOID NewBuffer;
+
+      if (Buffer->Buffer)
+         NewBuffer = realloc(Buffer->Buffer, Alloc);
+      else
+         NewBuffer = malloc(Alloc);
+
+      if (!NewBuffer)
+         hr = E_OUTOFMEMORY;
+      else
+      {
+         Buffer->Buffer = NewBuffer;
+         Buffer->AllocatedBytes = Alloc;
+      }
+   }
+
+   return hr;
+}
+
+HRESULT
+BufferAppend(
+   PBYTE_BUFFER Buffer,
+   const VOID *Data,
+   SIZE_T Length
+)
+{
+   HRESULT hr = S_OK;
+
+   hr = BufferReserve(Buffer, Length);
+
+   if (SUCCEEDED(hr) && Length)
+   {
+      memcpy(Buffer->Buffer + Buffer->Length, Data, Length);
+      Buffer->Length += Length;
+   }
+
+   return hr;
+}
+
+HRESULT
+BufferAppendDword(
+   PBYTE_BUFFER Buffer,
+   DWORD Value
+)
+{
+   return BufferAppend(Buffer, &Value, sizeof(Value));
+}
+
+HRESULT
+BufferAppendQword(
+   PBYTE_BUFFER Buffer,
+   ULONGLONG Value
+)
+{
+   return BufferAppend(Buffer, &Value, sizeof(Value));
+}
+
+// Strings are stored as a character count followed by the characters,
+// without a terminator.  NULL is stored as a count of 0xffffffff.
+//
+HRESULT
+BufferAppendString(
+   PBYTE_BUFFER Buffer,
+   PCWSTR String
+)
+{
+   HRESULT hr = S_OK;
+   DWORD Length = String ? wcslen(String) : ~0U;
+
+   hr = BufferAppendDword(Buffer, Length);
+   if (SUCCEEDED(hr) && String)
+      hr = BufferAppend(Buffer, String, Length * sizeof(WCHAR));
+
+   return hr;
+}
+
+HRESULT
+BufferAppendStringList(
+   PBYTE_BUFFER Buffer,
+   PSTRING_LIST List
+)
+{
+   HRESULT hr = S_OK;
+   PSTRING_LIST Node;
+   DWORD Count = 0;
+
+   for (Node = List; Node; Node = Node->Next)
+      ++Count;
+
+   hr = BufferAppendDword(Buffer, Count);
+
+   for (Node = List; SUCCEEDED(hr) && Node; Node = Node->Next)
+   {
+      hr = BufferAppendString(Buffer, Node->String);
+   }
+
+   return hr;
+}
+
+VOID
+FreeBuffer(
+   PBYTE_BUFFER Buffer
+)
+{
+   free(Buffer->Buffer);
+   Buffer->Buffer = NULL;
+   Buffer->AllocatedBytes = Buffer->Length = 0;
+}
+
+HRESULT
+ReaderRead(
+   PBUFFER_READER Reader,
+   PVOID Output,
+   SIZE_T Length
+)
+{
+   if (Reader->Length - Reader->Offset < Length)
+      return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+
+   memcpy(Output, Reader->Data + Reader->Offset, Length);
+   Reader->Offset += Length;
+   return S_OK;
+}
+
+HRESULT
+ReaderReadDword(
+   PBUFFER_READER Reader,
+   PDWORD Value
+)
+{
+   return ReaderRead(Reader, Value, sizeof(*Value));
+}
+
+HRESULT
+ReaderReadQword(
+   PBUFFER_READER Reader,
+   PULONGLONG Value
+)
+{
+   return ReaderRead(Reader, Value, sizeof(*Value));
+}
+
+HRESULT
+ReaderReadString(
+   PBUFFER_READER Reader,
+   PWSTR *Output
+)
+{
+   HRESULT hr = S_OK;
+   DWORD Length = 0;
+   DWORD Bytes = 0;
+   PWSTR String = NULL;
+
+   hr = ReaderReadDword(Reader, &Length);
+
+   if (SUCCEEDED(hr) && Length == ~0U)
+   {
+      *Output = NULL;
+      return hr;
+   }
+
+   if (SUCCEEDED(hr))
+      hr = DWordMult(Length, sizeof(WCHAR), &Bytes);
+   if (SUCCEEDED(hr) &&
+       Reader->Length - Reader->Offset < Bytes)
+   {
+      hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+   }
+
+   if (SUCCEEDED(hr))
+   {
+      String = malloc(Bytes + sizeof(WCHAR));
+      if (!String)
+         hr = E_OUTOFMEMORY;
+   }
+
+   if (SUCCEEDED(hr))
+   {
+      hr = ReaderRead(Reader, String, Bytes);
+      String[Length] = 0;
+   }
+
+   if (FAILED(hr))
+   {
+      free(String);
+      String = NULL;
+   }
+
+   *Output = String;
+   return hr;
+}
+
+HRESULT
+ReaderReadStringList(
+   PBUFFER_READER Reader,
+   PSTRING_LIST *Output
+)
+{
+   HRESULT hr = S_OK;
+   PSTRING_LIST List = NULL;
+   DWORD Count = 0;
+
+   hr = ReaderReadDword(Reader, &Count);
+
+   while (SUCCEEDED(hr) && Count--)
+   {
+      PWSTR String = NULL;
+
+      hr = ReaderReadString(Reader, &String);
+      if (SUCCEEDED(hr) && !String)
+         hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+      if (SUCCEEDED(hr))
+         hr = StringListAllocString(String, List, &List);
+
+      free(String);
+   }
+
+   if (SUCCEEDED(hr))
+   {
+      StringListReverse(&List);
+   }
+   else
+   {
+      FreeStringList(List);
+      List = NULL;
+   }
+
+   *Output = List;
+   return hr;
+}
+
+HRESULT
+ReadFileContents(
+   PCWSTR Path,
+   PBYTE_BUFFER Output
+)
+{
+   HRESULT hr = S_OK;
+   HANDLE File = INVALID_HANDLE_VALUE;
+   LARGE_INTEGER Size = {0};
+
+   File = CreateFile(
+      Path,
+      GENERIC_READ,
+      FILE_SHARE_READ | FILE_SHARE_DELETE,
+      NULL,
+      OPEN_EXISTING,
+      FILE_FLAG_SEQUENTIAL_SCAN,
+      NULL
+   );
+   if (File == INVALID_HANDLE_VALUE)
+      hr = HRESULT_FROM_WIN32(GetLastError());
+
+   if (SUCCEEDED(hr) &&
+       !GetFileSizeEx(File, &Size))
+   {
+      hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   if (SUCCEEDED(hr) &&
+       (ULONGLONG)Size.QuadPart > 0x7fffffff)
+   {
+      hr = E_OUTOFMEMORY;
+   }
+
+   while (SUCCEEDED(hr))
+   {
+      BYTE Chunk[16384];
+      DWORD Read = 0;
+
+      if (!ReadFile(File, Chunk, sizeof(Chunk), &Read, NULL))
+      {
+         hr = HRESULT_FROM_WIN32(GetLastError());
+         break;
+      }
+
+      if (!Read)
+         break;
+
+      hr = BufferAppend(Output, Chunk, Read);
+   }
+
+   if (File != INVALID_HANDLE_VALUE)
+      CloseHandle(File);
+   return hr;
+}
+
+HRESULT
+WriteAll(
+   HANDLE Handle,
+   const VOID *Data,
+   DWORD Length
+)
+{
+   const BYTE *p = Data;
+
+   while (Length)
+   {
+      DWORD Written = 0;
+
+      if (!WriteFile(Handle, p, Length, &Written, NULL))
+         return HRESULT_FROM_WIN32(GetLastError());
+
+      p += Written;
+      Length -= Written;
+   }
+
+   return S_OK;
+}
+
+// Writes to a temporary file in the same directory and renames it over the
+// destination, so that concurrent readers see either the old or the new
+// contents and never a partial file.
+//
+HRESULT
+WriteFileAtomic(
+   PCWSTR Path,
+   const VOID *Data,
+   SIZE_T Length
+)
+{
+   HRESULT hr = S_OK;
+   PWSTR TempPath = NULL;
+   HANDLE File = INVALID_HANDLE_VALUE;
+   const BYTE *p = Data;
+
+   hr = HeapPrintf(
+      &TempPath,
+      L"%s.%u.%u.tmp",
+      Path,
+      GetCurrentProcessId(),
+      GetCurrentThreadId()
+   );
+
+   if (SUCCEEDED(hr))
+   {
+      File = CreateFile(
+         TempPath,
+         GENERIC_WRITE,
+         0,
+         NULL,
+         CREATE_ALWAYS,
+         FILE_ATTRIBUTE_NORMAL,
+         NULL
+      );
+      if (File == INVALID_HANDLE_VALUE)
+         hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   while (SUCCEEDED(hr) && Length)
+   {
+      DWORD Chunk = Length > 0x10000000 ? 0x10000000 : (DWORD)Length;
+
+      hr = WriteAll(File, p, Chunk);
+      p += Chunk;
+      Length -= Chunk;
+   }
+
+   if (File != INVALID_HANDLE_VALUE)
+      CloseHandle(File);
+
+   if (SUCCEEDED(hr) &&
+       !MoveFileEx(TempPath, Path, MOVEFILE_REPLACE_EXISTING))
+   {
+      hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   if (FAILED(hr) && TempPath)
+      DeleteFile(TempPath);
+
+   free(TempPath);
+   return hr;
+}
+
+HRESULT
+MapFile(
+   PCWSTR Path,
+   BOOL Writable,
+   PMAPPED_FILE Output
+)
+{
+   HRESULT hr = S_OK;
+   LARGE_INTEGER Size = {0};
+
+   memset(Output, 0, sizeof(*Output));
+   Output->File = INVALID_HANDLE_VALUE;
+
+   Output->File = CreateFile(
+      Path,
+      GENERIC_READ | (Writable ? GENERIC_WRITE : 0),
+      FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+      NULL,
+      OPEN_EXISTING,
+      FILE_ATTRIBUTE_NORMAL,
+      NULL
+   );
+   if (Output->File == INVALID_HANDLE_VALUE)
+      hr = HRESULT_FROM_WIN32(GetLastError());
+
+   if (SUCCEEDED(hr) &&
+       !GetFileSizeEx(Output->File, &Size))
+   {
+      hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   if (SUCCEEDED(hr) &&
+       (!Size.QuadPart || (ULONGLONG)Size.QuadPart > 0x7fffffff))
+   {
+      hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+   }
+
+   if (SUCCEEDED(hr))
+   {
+      Output->Mapping = CreateFileMapping(
+         Output->File,
+         NULL,
+         Writable ? PAGE_READWRITE : PAGE_READONLY,
+         0,
+         0,
+         NULL
+      );
+      if (!Output->Mapping)
+         hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   if (SUCCEEDED(hr))
+   {
+      Output->Data = MapViewOfFile(
+         Output->Mapping,
+         Writable ? FILE_MAP_WRITE : FILE_MAP_READ,
+         0,
+         0,
+         0
+      );
+      if (!Output->Data)
+         hr = HRESULT_FROM_WIN32(GetLastError());
+      else
+         Output->Length = (SIZE_T)Size.QuadPart;
+   }
+
+   if (FAILED(hr))
+      UnmapFile(Output);
+
+   return hr;
+}
+
+VOID
+UnmapFile(
+   PMAPPED_FILE File
+)
+{
+   if (File->Data)
+      UnmapViewOfFile(File->Data);
+   if (File->Mapping)
+      CloseHandle(File->Mapping);
+   if (File->File && File->File != INVALID_HANDLE_VALUE)
+      CloseHandle(File->File);
+
+   memset(File, 0, sizeof(*File));
+   File->File = INVALID_HANDLE_VALUE;
+}
@@ -0,0 +1,2241 @@
+/*
+ * Copyright (c) 2017 Andrew Sveikauskas
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ */
+
+#include "clwrapper.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//
+// Object file cache.
+//
+// A compile of one source file to an object is keyed on a hash of the
+// compiler's identity, the options that affect code generation, and the
+// preprocessed source.  Entries live in CLWRAPPER_CACHE_DIR (or the cache
+// directory under our data directory), spread over 256 shard directories
+// named after the first byte of the key:
+//
+//    <dir>\ab\ab...cd.obj    the object file
+//    <dir>\ab\ab...cd.out    metadata and the compiler's output
+//
+// Both are written to a temporary name and renamed into place, .obj first,
+// so the presence of the .out means the entry is complete.  Nothing else
+// needs to be locked, so any number of cc processes can share a directory.
+//
+// Direct mode manifests (see manifest.c) are kept alongside, as
+// <key>.man.
+//
+// The .out and .man files' modification times are bumped on every hit, and
+// are what eviction uses to find the least recently used entries.
+//
+
+#define CACHE_ENTRY_MAGIC    0x434f4c43 // 'CLOC'
+#define CACHE_ENTRY_VERSION  1
+#define CACHE_SHARDS         256
+#define CACHE_DEFAULT_SIZE   (5ULL * 1024 * 1024 * 1024)
+
+// Temporary files older than this were left behind by a process that died
+// while storing an entry.
+//
+#define CACHE_STALE_TEMP_AGE (60ULL * 60 * 10000000)
+
+// Remote entries are the .out and .obj files of a local entry, packed
+// together and compressed.
+//
+#define CACHE_REMOTE_MAGIC   0x45524c43 // 'CLRE'
+#define CACHE_REMOTE_VERSION 1
+#define CACHE_REMOTE_TIMEOUT 2000
+
+typedef struct _CACHE_CONFIG
+{
+   PWSTR Directory;
+   ULONGLONG MaxSize;
+   BOOL Hardlink;
+   BOOL Direct;
+   BOOL Link;
+
+   //
+   // Base URL of the shared cache, if there is one.
+   //
+   PWSTR Remote;
+   BOOL RemoteWritable;
+   DWORD RemoteTimeout;
+} CACHE_CONFIG, *PCACHE_CONFIG;
+
+// What a cache entry says the compiler printed: stdout, then stderr.
+//
+typedef struct _CACHED_OUTPUT
+{
+   const BYTE *Data[2];
+   DWORD Length[2];
+} CACHED_OUTPUT, *PCACHED_OUTPUT;
+
+typedef struct _CACHE_ENTRY
+{
+   FILETIME LastUse;
+   WCHAR Key[HASH_STRING_LENGTH];
+} CACHE_ENTRY, *PCACHE_ENTRY;
+
+static BOOL
+IsEnvironmentSet(
+   PCWSTR Name
+)
+{
+   PWSTR Value = NULL;
+   BOOL Set = FALSE;
+
+   GetEnvironmentString(Name, &Value);
+   Set = Value && *Value && wcscmp(Value, L"0");
+
+   free(Value);
+   return Set;
+}
+
+static HRESULT
+GetCacheConfig(
+   PCACHE_CONFIG Config
+)
+{
+   HRESULT hr = S_OK;
+   PWSTR Size = NULL;
+
+   if (!IsEnvironmentSet(L"CLWRAPPER_CACHE"))
+      return S_FALSE;
+
+   hr = GetEnvironmentString(L"CLWRAPPER_CACHE_DIR", &Config->Directory);
+   if (hr == S_FALSE)
+   {
+      hr = GetDataDirectory(L"cache", &Config->Directory);
+   }
+   else if (SUCCEEDED(hr) &&
+            !CreateDirectory(Config->Directory, NULL) &&
+            GetLastError() != ERROR_ALREADY_EXISTS)
+   {
+      hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   // Size is given in megabytes.
+   //
+   if (SUCCEEDED(hr))
+   {
+      Config->MaxSize = CACHE_DEFAULT_SIZE;
+
+      GetEnvironmentString(L"CLWRAPPER_CACHE_SIZE", &Size);
+      if (Size && wcstoul(Size, NULL, 10))
+         Config->MaxSize = wcstoul(Size, NULL, 10) * 1024ULL * 1024ULL;
+
+      Config->Hardlink = IsEnvironmentSet(L"CLWRAPPER_CACHE_HARDLINK");
+      Config->Direct = !IsEnvironmentSet(L"CLWRAPPER_CACHE_NO_DIRECT");
+      Config->Link = !IsEnvironmentSet(L"CLWRAPPER_CACHE_NO_LINK");
+      hr = S_OK;
+   }
+
+   if (SUCCEEDED(hr))
+      hr = GetEnvironmentString(L"CLWRAPPER_CACHE_REMOTE", &Config->Remote);
+
+   if (SUCCEEDED(hr) && Config->Remote)
+   {
+      PWSTR Mode = NULL;
+      PWSTR Timeout = NULL;
+
+      GetEnvironmentString(L"CLWRAPPER_CACHE_REMOTE_MODE", &Mode);
+      Config->RemoteWritable = !Mode || _wcsicmp(Mode, L"read");
+
+      // Milliseconds.
+      //
+      Config->RemoteTimeout = CACHE_REMOTE_TIMEOUT;
+      GetEnvironmentString(L"CLWRAPPER_CACHE_REMOTE_TIMEOUT", &Timeout);
+      if (Timeout && wcstoul(Timeout, NULL, 10))
+         Config->RemoteTimeout = wcstoul(Timeout, NULL, 10);
+
+      free(Timeout);
+      free(Mode);
+   }
+
+   if (SUCCEEDED(hr))
+      hr = S_OK;
+
+   free(Size);
+   return hr;
+}
+
+static VOID
+FreeCacheConfig(
+   PCACHE_CONFIG Config
+)
+{
+   free(Config->Directory);
+   free(Config->Remote);
+   Config->Directory = NULL;
+   Config->Remote = NULL;
+}
+
+// Only the simple case of one source file to one object is cached.  An
+// object built with a PCH refers to the PCH's object, which isn't cached
+// with it.  What a module import brings in isn't in the preprocessor
+// output; modules.c has a cache of its own.
+//
+static BOOL
+IsCacheable(
+   PCC_ARGS Args
+)
+{
+   return Args->OutputType == CC_OBJECT_FILE &&
+          !Args->PchThrough &&
+          !Args->Modules &&
+          Args->Inputs &&
+          !Args->Inputs->Next &&
+          CcIsSourceFile(Args->Inputs->String);
+}
+
+// Entries for a key are at <cache>\<first byte of key>\<key>.*
+//
+static HRESULT
+GetKeyPaths(
+   PCACHE_CONFIG Config,
+   PCWSTR Key,
+   PWSTR *ShardDirectory,
+   PWSTR *Stem
+)
+{
+   HRESULT hr = S_OK;
+
+   hr = HeapPrintf(ShardDirectory, L"%s\\%.2s", Config->Directory, Key);
+   if (SUCCEEDED(hr))
+      hr = HeapPrintf(Stem, L"%s\\%s", *ShardDirectory, Key);
+
+   return hr;
+}
+
+static HRESULT
+GetEntryPaths(
+   PCACHE_CONFIG Config,
+   const BYTE Digest[HASH_LENGTH],
+   PWSTR *ShardDirectory,
+   PWSTR *Stem
+)
+{
+   WCHAR Key[HASH_STRING_LENGTH];
+
+   HashToString(Digest, Key);
+   return GetKeyPaths(Config, Key, ShardDirectory, Stem);
+}
+
+static HRESULT
+GetFileSize64(
+   PCWSTR Path,
+   PULONGLONG Size
+)
+{
+   WIN32_FILE_ATTRIBUTE_DATA Attributes = {0};
+
+   if (!GetFileAttributesEx(Path, GetFileExInfoStandard, &Attributes))
+      return HRESULT_FROM_WIN32(GetLastError());
+
+   *Size = ((ULONGLONG)Attributes.nFileSizeHigh << 32) |
+           Attributes.nFileSizeLow;
+   return S_OK;
+}
+
+//
+// Hashes what determines how a source file compiles, other than the source
+// itself: which compiler and SDK, and the options that affect code
+// generation.
+//
+HRESULT
+CacheHashCompileContext(
+   PHASH_CONTEXT Hash,
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset
+)
+{
+   HRESULT hr = S_OK;
+   PCWSTR Variables[] = {L"CL", L"_CL_"};
+   PSTRING_LIST List;
+   DWORD i;
+
+   hr = HashDword(Hash, CACHE_ENTRY_VERSION);
+   if (SUCCEEDED(hr))
+      hr = HashFileIdentity(Hash, Toolset->Compiler->ClPaths->String);
+   if (SUCCEEDED(hr))
+      hr = HashString(Hash, Toolset->Sdk ? Toolset->Sdk->InstallDir : NULL);
+   if (SUCCEEDED(hr))
+      hr = HashString(Hash, Toolset->Win10SdkVersion);
+
+   if (SUCCEEDED(hr))
+      hr = HashDword(Hash, Args->Optimization);
+   if (SUCCEEDED(hr))
+      hr = HashDword(Hash, Args->Wall);
+   if (SUCCEEDED(hr))
+      hr = HashDword(Hash, Args->Werror);
+   if (SUCCEEDED(hr))
+      hr = HashDword(Hash, Args->DisableRtti);
+   if (SUCCEEDED(hr))
+      hr = HashDword(Hash, Args->Base.StaticCrt);
+   if (SUCCEEDED(hr))
+      hr = HashDword(Hash, Args->DebugInfo);
+
+   // With /showIncludes, the notes are in the output we keep and replay.
+   //
+   if (SUCCEEDED(hr))
+      hr = HashDword(Hash, Args->ShowIncludes);
+
+   if (SUCCEEDED(hr))
+      hr = HashStringList(Hash, Args->Macros);
+
+   // What the headers say is in the preprocessor output; which ones are
+   // forced in is part of the command line.
+   //
+   if (SUCCEEDED(hr))
+      hr = HashStringList(Hash, Args->ForcedIncludes);
+
+   // Only where paths are mapped to matters; where they're mapped from is
+   // what differs between two checkouts.
+   //
+   for (List = Args->PrefixMaps; SUCCEEDED(hr) && List; List = List->Next)
+      hr = HashString(Hash, wcschr(List->String, L'=') + 1);
+
+   // cl takes extra options from these.
+   //
+   for (i = 0; SUCCEEDED(hr) && i < ARRAYSIZE(Variables); ++i)
+   {
+      PWSTR Value = NULL;
+
+      hr = GetEnvironmentString(Variables[i], &Value);
+      if (SUCCEEDED(hr))
+         hr = HashString(Hash, Value);
+
+      free(Value);
+   }
+
+   return hr;
+}
+
+//
+// With prefix maps, paths in the preprocessor output are rewritten before
+// it's hashed, so that the same sources checked out in two places get the
+// same key.  cl's #line directives double the backslashes in a path, so
+// each prefix is looked for both as given and in that form.
+//
+typedef struct _PATH_PREFIX
+{
+   PSTR From;
+   PSTR FromEscaped;
+   PSTR To;
+} PATH_PREFIX, *PPATH_PREFIX;
+
+typedef struct _PREPROCESS_CONTEXT
+{
+   PHASH_CONTEXT Hash;
+
+   //
+   // Set if we're collecting the /showIncludes notes, which may come on
+   // either stream.
+   //
+   PDEPS_PARSER Stdout;
+   PDEPS_PARSER Stderr;
+
+   //
+   // Set if paths need rewriting.  The output is collected here and hashed
+   // once the preprocessor is done.
+   //
+   PBYTE_BUFFER Output;
+} PREPROCESS_CONTEXT, *PPREPROCESS_CONTEXT;
+
+static HRESULT
+ToNarrow(
+   PCWSTR String,
+   INT Length,
+   PSTR *Out
+)
+{
+   HRESULT hr = S_OK;
+   INT Bytes = 0;
+
+   Bytes = WideCharToMultiByte(CP_ACP, 0, String, Length, NULL, 0, NULL, NULL);
+
+   *Out = malloc(Bytes + 1);
+   if (!*Out)
+      hr = E_OUTOFMEMORY;
+
+   if (SUCCEEDED(hr))
+   {
+      WideCharToMultiByte(CP_ACP, 0, String, Length, *Out, Bytes, NULL, NULL);
+      (*Out)[Bytes] = 0;
+   }
+
+   return hr;
+}
+
+static VOID
+FreePathPrefixes(
+   PPATH_PREFIX Prefixes,
+   DWORD Count
+)
+{
+   DWORD i;
+
+   for (i = 0; Prefixes && i < Count; ++i)
+   {
+      free(Prefixes[i].From);
+      free(Prefixes[i].FromEscaped);
+      free(Prefixes[i].To);
+   }
+
+   free(Prefixes);
+}
+
+static HRESULT
+GetPathPrefixes(
+   PSTRING_LIST PrefixMaps,
+   PPATH_PREFIX *PrefixesOut,
+   PDWORD CountOut
+)
+{
+   HRESULT hr = S_OK;
+   PPATH_PREFIX Prefixes = NULL;
+   PSTRING_LIST List;
+   DWORD Count = 0;
+
+   for (List = PrefixMaps; List; List = List->Next)
+      ++Count;
+
+   Prefixes = calloc(Count, sizeof(*Prefixes));
+   if (!Prefixes)
+      hr = E_OUTOFMEMORY;
+
+   for (List = PrefixMaps, Count = 0;
+        SUCCEEDED(hr) && List;
+        List = List->Next, ++Count)
+   {
+      PPATH_PREFIX Prefix = &Prefixes[Count];
+      PCWSTR Equals = wcschr(List->String, L'=');
+      PCSTR p;
+      PSTR q;
+
+      hr = ToNarrow(
+         List->String,
+         (INT)(Equals - List->String),
+         &Prefix->From
+      );
+      if (SUCCEEDED(hr))
+         hr = ToNarrow(Equals + 1, -1, &Prefix->To);
+
+      if (SUCCEEDED(hr))
+      {
+         Prefix->FromEscaped = malloc(strlen(Prefix->From) * 2 + 1);
+         if (!Prefix->FromEscaped)
+            hr = E_OUTOFMEMORY;
+      }
+
+      if (SUCCEEDED(hr))
+      {
+         for (p = Prefix->From, q = Prefix->FromEscaped; *p; ++p)
+         {
+            *q++ = *p;
+            if (*p == '\\')
+               *q++ = '\\';
+         }
+         *q = 0;
+      }
+   }
+
+   if (FAILED(hr))
+   {
+      FreePathPrefixes(Prefixes, Count);
+      Prefixes = NULL;
+      Count = 0;
+   }
+
+   *PrefixesOut = Prefixes;
+   *CountOut = Count;
+   return hr;
+}
+
+// Length of Prefix if Data starts with it, ignoring case, or 0.
+//
+static SIZE_T
+MatchPrefix(
+   const BYTE *Data,
+   SIZE_T Length,
+   PCSTR Prefix
+)
+{
+   SIZE_T PrefixLength = 0;
+
+   if (!*Prefix || tolower(*Data) != tolower(*Prefix))
+      return 0;
+
+   PrefixLength = strlen(Prefix);
+   if (PrefixLength > Length ||
+       _strnicmp((PCSTR)Data, Prefix, PrefixLength))
+   {
+      return 0;
+   }
+
+   return PrefixLength;
+}
+
+static HRESULT
+HashMappedPaths(
+   PHASH_CONTEXT Hash,
+   const BYTE *Data,
+   SIZE_T Length,
+   PPATH_PREFIX Prefixes,
+   DWORD Count
+)
+{
+   HRESULT hr = S_OK;
+   SIZE_T Start = 0;
+   SIZE_T i = 0;
+
+   while (SUCCEEDED(hr) && i < Length)
+   {
+      SIZE_T Matched = 0;
+      DWORD j;
+
+      for (j = 0; !Matched && j < Count; ++j)
+      {
+         Matched = MatchPrefix(Data + i, Length - i, Prefixes[j].From);
+         if (!Matched)
+         {
+            Matched = MatchPrefix(
+               Data + i,
+               Length - i,
+               Prefixes[j].FromEscaped
+            );
+         }
+
+         if (Matched)
+         {
+            hr = HashData(Hash, Data + Start, i - Start);
+            if (SUCCEEDED(hr))
+               hr = HashData(Hash, Prefixes[j].To, strlen(Prefixes[j].To));
+         }
+      }
+
+      if (Matched)
+      {
+         i += Matched;
+         Start = i;
+      }
+      else
+      {
+         ++i;
+      }
+   }
+
+   if (SUCCEEDED(hr))
+      hr = HashData(Hash, Data + Start, Length - Start);
+
+   return hr;
+}
+
+static HRESULT
+ConsumePreprocessed(
+   PVOID Context,
+   const BYTE *Data,
+   DWORD Length
+)
+{
+   PPREPROCESS_CONTEXT Preprocess = Context;
+
+   if (Preprocess->Output)
+      return BufferAppend(Preprocess->Output, Data, Length);
+   return HashData(Preprocess->Hash, Data, Length);
+}
+
+// The preprocessor's stdout is the source; stderr has the file name and
+// any warnings, which the real compile will produce again.
+//
+static HRESULT
+HashPreprocessed(
+   PVOID Context,
+   DWORD Stream,
+   const BYTE *Data,
+   DWORD Length
+)
+{
+   PPREPROCESS_CONTEXT Preprocess = Context;
+
+   if (Stream == LAUNCH_STDOUT && Preprocess->Stdout)
+      return DepsParse(Preprocess->Stdout, Data, Length);
+   if (Stream == LAUNCH_STDOUT)
+      return ConsumePreprocessed(Preprocess, Data, Length);
+   if (Preprocess->Stderr)
+      return DepsParse(Preprocess->Stderr, Data, Length);
+   return S_OK;
+}
+
+//
+// Returns S_FALSE if the source didn't preprocess, in which case the real
+// compile should be left to report why.
+//
+// If Includes is given, it receives the headers the source pulled in.
+//
+static HRESULT
+ComputeKey(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   const LAUNCH_PARAMS *Launch,
+   PSTRING_LIST *Includes,
+   BYTE Digest[HASH_LENGTH]
+)
+{
+   HRESULT hr = S_OK;
+   HASH_CONTEXT Hash = {0};
+   OUTPUT_STRING CommandLine = {0};
+   LAUNCH_PARAMS Preprocess = {0};
+   PREPROCESS_CONTEXT Context = {0};
+   DEPS_PARSER Stdout = {0};
+   DEPS_PARSER Stderr = {0};
+   BYTE_BUFFER NotePrefix = {0};
+   BYTE_BUFFER Output = {0};
+   BOOL ShowIncludes = Args->ShowIncludes;
+   PPATH_PREFIX Prefixes = NULL;
+   DWORD PrefixCount = 0;
+   DWORD ExitCode = 0;
+
+   hr = HashInit(&Hash);
+
+   if (SUCCEEDED(hr) && Args->PrefixMaps)
+   {
+      hr = GetPathPrefixes(Args->PrefixMaps, &Prefixes, &PrefixCount);
+      Context.Output = &Output;
+   }
+
+   if (SUCCEEDED(hr))
+      hr = CacheHashCompileContext(&Hash, Args, Toolset);
+
+   if (SUCCEEDED(hr))
+   {
+      Args->PreprocessOnly = TRUE;
+      Args->ShowIncludes = Includes != NULL;
+      hr = CcBuildCommandLine(Args, Toolset, &CommandLine);
+      Args->PreprocessOnly = FALSE;
+      Args->ShowIncludes = ShowIncludes;
+   }
+
+   // If cl can't be asked what its notes look like, assume English.
+   //
+   if (SUCCEEDED(hr) &&
+       Includes &&
+       SUCCEEDED(DepsGetNotePrefix(Toolset, Launch, &NotePrefix)))
+   {
+      Stdout.Prefix = Stderr.Prefix = NotePrefix.Buffer;
+      Stdout.PrefixLength = Stderr.PrefixLength = NotePrefix.Length;
+   }
+
+   if (SUCCEEDED(hr))
+   {
+      Context.Hash = &Hash;
+      if (Includes)
+      {
+         Stdout.Passthrough = ConsumePreprocessed;
+         Stdout.Context = &Context;
+         Context.Stdout = &Stdout;
+         Context.Stderr = &Stderr;
+      }
+
+      if (Launch)
+         Preprocess = *Launch;
+
+      Preprocess.OutputCallback = HashPreprocessed;
+      Preprocess.CallbackContext = &Context;
+
+      hr = LaunchProcessEx(CommandLine.Buffer, &Preprocess, &ExitCode);
+   }
+
+   if (SUCCEEDED(hr) && ExitCode)
+      hr = S_FALSE;
+
+   if (hr == S_OK && Includes)
+   {
+      PSTRING_LIST *Tail = &Stdout.Includes;
+
+      hr = DepsFinish(&Stdout);
+      if (SUCCEEDED(hr))
+         hr = DepsFinish(&Stderr);
+
+      if (SUCCEEDED(hr))
+      {
+         while (*Tail)
+            Tail = &(*Tail)->Next;
+
+         *Tail = Stderr.Includes;
+         Stderr.Includes = NULL;
+
+         *Includes = Stdout.Includes;
+         Stdout.Includes = NULL;
+      }
+   }
+
+   if (hr == S_OK && Context.Output)
+   {
+      hr = HashMappedPaths(
+         &Hash,
+         Output.Buffer,
+         Output.Length,
+         Prefixes,
+         PrefixCount
+      );
+   }
+
+   if (hr == S_OK)
+      hr = HashFinish(&Hash, Digest);
+
+   FreePathPrefixes(Prefixes, PrefixCount);
+   FreeBuffer(&NotePrefix);
+   FreeBuffer(&Output);
+   DepsFree(&Stdout);
+   DepsFree(&Stderr);
+   FreeString(&CommandLine);
+   HashFree(&Hash);
+   return hr;
+}
+
+// Puts a copy of the cached object at Destination.
+//
+static HRESULT
+PlaceObject(
+   PCACHE_CONFIG Config,
+   PCWSTR Source,
+   PCWSTR Destination,
+   ULONGLONG ExpectedSize
+)
+{
+   HRESULT hr = S_OK;
+   ULONGLONG Size = 0;
+
+   // Never write through an existing file; it may be a hard link to
+   // another entry.
+   //
+   DeleteFile(Destination);
+
+   if (!(Config->Hardlink && CreateHardLink(Destination, Source, NULL)) &&
+       !CopyFile(Source, Destination, FALSE))
+   {
+      hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   if (SUCCEEDED(hr))
+      hr = GetFileSize64(Destination, &Size);
+   if (SUCCEEDED(hr) && Size != ExpectedSize)
+      hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+
+   // CopyFile() keeps the source's timestamp, which would leave the object
+   // looking older than its source to make.
+   //
+   if (SUCCEEDED(hr))
+      hr = TouchFile(Destination);
+
+   if (FAILED(hr))
+      DeleteFile(Destination);
+
+   return hr;
+}
+
+// Entries end with what the compiler printed, so that a hit can print it
+// again.
+//
+static HRESULT
+AppendCapturedOutput(
+   PBYTE_BUFFER Metadata,
+   PLAUNCH_OUTPUT Capture
+)
+{
+   HRESULT hr = S_OK;
+
+   hr = BufferAppendDword(Metadata, (DWORD)Capture->Stdout.Length);
+   if (SUCCEEDED(hr))
+   {
+      hr = BufferAppend(
+         Metadata,
+         Capture->Stdout.Buffer,
+         Capture->Stdout.Length
+      );
+   }
+   if (SUCCEEDED(hr))
+      hr = BufferAppendDword(Metadata, (DWORD)Capture->Stderr.Length);
+   if (SUCCEEDED(hr))
+   {
+      hr = BufferAppend(
+         Metadata,
+         Capture->Stderr.Buffer,
+         Capture->Stderr.Length
+      );
+   }
+
+   return hr;
+}
+
+static HRESULT
+ReadCapturedOutput(
+   PBUFFER_READER Reader,
+   PCACHED_OUTPUT Output
+)
+{
+   HRESULT hr = S_OK;
+   DWORD i;
+
+   for (i = 0; SUCCEEDED(hr) && i < ARRAYSIZE(Output->Data); ++i)
+   {
+      hr = ReaderReadDword(Reader, &Output->Length[i]);
+      if (SUCCEEDED(hr) && Reader->Length - Reader->Offset < Output->Length[i])
+         hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+      if (SUCCEEDED(hr))
+      {
+         Output->Data[i] = Reader->Data + Reader->Offset;
+         Reader->Offset += Output->Length[i];
+      }
+   }
+
+   return hr;
+}
+
+static HRESULT
+ReplayCapturedOutput(
+   PCACHED_OUTPUT Output,
+   const LAUNCH_PARAMS *Launch
+)
+{
+   HRESULT hr = S_OK;
+   DWORD Streams[] = {LAUNCH_STDOUT, LAUNCH_STDERR};
+   DWORD i;
+
+   for (i = 0; SUCCEEDED(hr) && i < ARRAYSIZE(Streams); ++i)
+   {
+      hr = LaunchWriteOutput(
+         Launch,
+         Streams[i],
+         Output->Data[i],
+         Output->Length[i]
+      );
+   }
+
+   return hr;
+}
+
+// Copies Source into the cache as Path, via a temporary file so that
+// nobody sees it half written.
+//
+static HRESULT
+StoreFile(
+   PCWSTR Source,
+   PCWSTR Path
+)
+{
+   HRESULT hr = S_OK;
+   PWSTR TempPath = NULL;
+
+   hr = HeapPrintf(
+      &TempPath,
+      L"%s.%u.%u.tmp",
+      Path,
+      GetCurrentProcessId(),
+      GetCurrentThreadId()
+   );
+
+   if (SUCCEEDED(hr) &&
+       !CopyFile(Source, TempPath, FALSE))
+   {
+      hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   if (SUCCEEDED(hr) &&
+       !MoveFileEx(TempPath, Path, MOVEFILE_REPLACE_EXISTING))
+   {
+      hr = HRESULT_FROM_WIN32(GetLastError());
+      DeleteFile(TempPath);
+   }
+
+   free(TempPath);
+   return hr;
+}
+
+// Returns S_FALSE on a miss.
+//
+static HRESULT
+CacheLookup(
+   PCACHE_CONFIG Config,
+   PCWSTR Stem,
+   PCWSTR Destination,
+   const LAUNCH_PARAMS *Launch,
+   PDWORD ReturnValue
+)
+{
+   HRESULT hr = S_OK;
+   PWSTR ObjectPath = NULL;
+   PWSTR MetadataPath = NULL;
+   BYTE_BUFFER Metadata = {0};
+   BUFFER_READER Reader = {0};
+   DWORD Magic = 0;
+   DWORD Version = 0;
+   DWORD ExitCode = 0;
+   ULONGLONG ObjectSize = 0;
+   CACHED_OUTPUT Output = {0};
+
+   hr = HeapPrintf(&ObjectPath, L"%s.obj", Stem);
+   if (SUCCEEDED(hr))
+      hr = HeapPrintf(&MetadataPath, L"%s.out", Stem);
+
+   if (SUCCEEDED(hr) &&
+       FAILED(ReadFileContents(MetadataPath, &Metadata)))
+   {
+      hr = S_FALSE;
+   }
+
+   if (hr == S_OK)
+   {
+      Reader.Data = Metadata.Buffer;
+      Reader.Length = Metadata.Length;
+
+      hr = ReaderReadDword(&Reader, &Magic);
+      if (SUCCEEDED(hr))
+         hr = ReaderReadDword(&Reader, &Version);
+      if (SUCCEEDED(hr) &&
+          (Magic != CACHE_ENTRY_MAGIC || Version != CACHE_ENTRY_VERSION))
+      {
+         hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+      }
+      if (SUCCEEDED(hr))
+         hr = ReaderReadDword(&Reader, &ExitCode);
+      if (SUCCEEDED(hr))
+         hr = ReaderReadQword(&Reader, &ObjectSize);
+      if (SUCCEEDED(hr))
+         hr = ReadCapturedOutput(&Reader, &Output);
+
+      if (SUCCEEDED(hr))
+         hr = PlaceObject(Config, ObjectPath, Destination, ObjectSize);
+
+      // Anything wrong with the entry is just a miss; another process may
+      // be evicting it.
+      //
+      if (FAILED(hr))
+         hr = S_FALSE;
+   }
+
+   if (hr == S_OK)
+   {
+      TouchFile(MetadataPath);
+
+      hr = ReplayCapturedOutput(&Output, Launch);
+      if (SUCCEEDED(hr))
+         *ReturnValue = ExitCode;
+   }
+
+   FreeBuffer(&Metadata);
+   free(MetadataPath);
+   free(ObjectPath);
+   return hr;
+}
+
+static HRESULT
+CacheStore(
+   PCWSTR ShardDirectory,
+   PCWSTR Stem,
+   PCWSTR Object,
+   DWORD ExitCode,
+   PLAUNCH_OUTPUT Capture
+)
+{
+   HRESULT hr = S_OK;
+   PWSTR ObjectPath = NULL;
+   PWSTR MetadataPath = NULL;
+   ULONGLONG ObjectSize = 0;
+   BYTE_BUFFER Metadata = {0};
+
+   if (!CreateDirectory(ShardDirectory, NULL) &&
+       GetLastError() != ERROR_ALREADY_EXISTS)
+   {
+      hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   if (SUCCEEDED(hr))
+      hr = HeapPrintf(&ObjectPath, L"%s.obj", Stem);
+   if (SUCCEEDED(hr))
+      hr = HeapPrintf(&MetadataPath, L"%s.out", Stem);
+
+   if (SUCCEEDED(hr))
+      hr = GetFileSize64(Object, &ObjectSize);
+   if (SUCCEEDED(hr))
+      hr = StoreFile(Object, ObjectPath);
+
+   if (SUCCEEDED(hr))
+      hr = BufferAppendDword(&Metadata, CACHE_ENTRY_MAGIC);
+   if (SUCCEEDED(hr))
+      hr = BufferAppendDword(&Metadata, CACHE_ENTRY_VERSION);
+   if (SUCCEEDED(hr))
+      hr = BufferAppendDword(&Metadata, ExitCode);
+   if (SUCCEEDED(hr))
+      hr = BufferAppendQword(&Metadata, ObjectSize);
+   if (SUCCEEDED(hr))
+      hr = AppendCapturedOutput(&Metadata, Capture);
+
+   if (SUCCEEDED(hr))
+      hr = WriteFileAtomic(MetadataPath, Metadata.Buffer, Metadata.Length);
+
+   FreeBuffer(&Metadata);
+   free(MetadataPath);
+   free(ObjectPath);
+   return hr;
+}
+
+static int __cdecl
+CompareEntries(
+   const void *A,
+   const void *B
+)
+{
+   return CompareFileTime(
+      &((const CACHE_ENTRY *)A)->LastUse,
+      &((const CACHE_ENTRY *)B)->LastUse
+   );
+}
+
+//
+// Keeps each shard under its share of the total size, by throwing out the
+// least recently used entries.  Only the shard that was just written to is
+// looked at, so the cost of this stays proportional to one directory.
+//
+static HRESULT
+EvictShard(
+   PCACHE_CONFIG Config,
+   PCWSTR ShardDirectory
+)
+{
+   HRESULT hr = S_OK;
+   PWSTR Pattern = NULL;
+   HANDLE Find = INVALID_HANDLE_VALUE;
+   WIN32_FIND_DATA FindData = {0};
+   BYTE_BUFFER EntryBuffer = {0};
+   PCACHE_ENTRY Entries = NULL;
+   SIZE_T NumEntries = 0;
+   SIZE_T i;
+   ULONGLONG Total = 0;
+   ULONGLONG Limit = Config->MaxSize / CACHE_SHARDS;
+   ULARGE_INTEGER Now;
+   FILETIME NowFileTime;
+
+   GetSystemTimeAsFileTime(&NowFileTime);
+   Now.LowPart = NowFileTime.dwLowDateTime;
+   Now.HighPart = NowFileTime.dwHighDateTime;
+
+   hr = HeapPrintf(&Pattern, L"%s\\*", ShardDirectory);
+
+   if (SUCCEEDED(hr))
+   {
+      Find = FindFirstFile(Pattern, &FindData);
+      if (Find == INVALID_HANDLE_VALUE)
+         hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   while (SUCCEEDED(hr))
+   {
+      ULONGLONG Size = ((ULONGLONG)FindData.nFileSizeHigh << 32) |
+                       FindData.nFileSizeLow;
+      PCWSTR Extension = wcsrchr(FindData.cFileName, L'.');
+
+      if (!(FindData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) &&
+          Extension)
+      {
+         Total += Size;
+
+         if (!wcscmp(Extension, L".tmp"))
+         {
+            ULARGE_INTEGER Written;
+
+            Written.LowPart = FindData.ftLastWriteTime.dwLowDateTime;
+            Written.HighPart = FindData.ftLastWriteTime.dwHighDateTime;
+
+            if (Now.QuadPart - Written.QuadPart > CACHE_STALE_TEMP_AGE)
+            {
+               PWSTR Path = NULL;
+
+               if (SUCCEEDED(HeapPrintf(
+                      &Path,
+                      L"%s\\%s",
+                      ShardDirectory,
+                      FindData.cFileName)) &&
+                   DeleteFile(Path))
+               {
+                  Total -= Size;
+               }
+
+               free(Path);
+            }
+         }
+         else if ((!wcscmp(Extension, L".out") ||
+                   !wcscmp(Extension, L".man")) &&
+                  Extension - FindData.cFileName == HASH_LENGTH * 2)
+         {
+            CACHE_ENTRY Entry = {0};
+
+            Entry.LastUse = FindData.ftLastWriteTime;
+            memcpy(
+               Entry.Key,
+               FindData.cFileName,
+               HASH_LENGTH * 2 * sizeof(WCHAR)
+            );
+
+            hr = BufferAppend(&EntryBuffer, &Entry, sizeof(Entry));
+         }
+      }
+
+      if (SUCCEEDED(hr) && !FindNextFile(Find, &FindData))
+      {
+         if (GetLastError() != ERROR_NO_MORE_FILES)
+            hr = HRESULT_FROM_WIN32(GetLastError());
+         break;
+      }
+   }
+
+   if (SUCCEEDED(hr) && Total > Limit)
+   {
+      Entries = (PCACHE_ENTRY)EntryBuffer.Buffer;
+      NumEntries = EntryBuffer.Length / sizeof(*Entries);
+
+      qsort(Entries, NumEntries, sizeof(*Entries), CompareEntries);
+
+      // Go a little under the limit, so that we aren't back here on the
+      // next store.
+      //
+      for (i = 0; i < NumEntries && Total > Limit / 10 * 9; ++i)
+      {
+         PCWSTR Extensions[] =
+         {
+            L"out", L"obj", L"man", L"bin", L"pdb", L"lib", L"exp"
+         };
+         DWORD j;
+
+         for (j = 0; j < ARRAYSIZE(Extensions); ++j)
+         {
+            PWSTR Path = NULL;
+            ULONGLONG Size = 0;
+
+            if (SUCCEEDED(HeapPrintf(
+                   &Path,
+                   L"%s\\%s.%s",
+                   ShardDirectory,
+                   Entries[i].Key,
+                   Extensions[j])) &&
+                SUCCEEDED(GetFileSize64(Path, &Size)) &&
+                DeleteFile(Path))
+            {
+               Total -= Size < Total ? Size : Total;
+            }
+
+            free(Path);
+         }
+      }
+   }
+
+   if (Find != INVALID_HANDLE_VALUE)
+      FindClose(Find);
+   FreeBuffer(&EntryBuffer);
+   free(Pattern);
+   return hr;
+}
+
+static HRESULT
+CompileAndStore(
+   PCACHE_CONFIG Config,
+   PCWSTR ShardDirectory,
+   PCWSTR Stem,
+   PCWSTR Destination,
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   const LAUNCH_PARAMS *Launch,
+   PDWORD ReturnValue
+)
+{
+   HRESULT hr = S_OK;
+   OUTPUT_STRING CommandLine = {0};
+   LAUNCH_PARAMS Compile = {0};
+   LAUNCH_OUTPUT Capture = {0};
+
+   // Cached objects have to carry their own debug info; a shared
+   // vcNNN.pdb can't be restored along with them.
+   //
+   Args->EmbedDebugInfo = TRUE;
+   hr = CcBuildCommandLine(Args, Toolset, &CommandLine);
+   Args->EmbedDebugInfo = FALSE;
+
+   if (SUCCEEDED(hr))
+   {
+      if (Launch)
+         Compile = *Launch;
+
+      Capture.Forward = TRUE;
+      Capture.Launch = Launch;
+      Compile.OutputCallback = LaunchBufferOutput;
+      Compile.CallbackContext = &Capture;
+
+      if (Config->Hardlink)
+         DeleteFile(Destination);
+
+      // An object from a worker is stored just like one compiled here.
+      //
+      hr = DistExecute(Args, Toolset, &Compile, ReturnValue);
+      if (hr == S_FALSE)
+         hr = LaunchProcessEx(CommandLine.Buffer, &Compile, ReturnValue);
+   }
+
+   // Failing to store is not an error; the compile already happened.
+   //
+   if (SUCCEEDED(hr) && !*ReturnValue &&
+       SUCCEEDED(CacheStore(
+          ShardDirectory,
+          Stem,
+          Destination,
+          *ReturnValue,
+          &Capture)))
+   {
+      EvictShard(Config, ShardDirectory);
+   }
+
+   LaunchFreeOutput(&Capture);
+   FreeString(&CommandLine);
+   return hr;
+}
+
+//
+// Remote cache.
+//
+// The remote side only ever sees whole entries, by object key.  Fetched
+// entries are unpacked into the local cache and used from there; stored
+// entries are uploaded from the local cache by a separate process, so the
+// compile doesn't wait for the upload.
+//
+
+// Returns S_FALSE if the remote cache doesn't have it, or can't be reached
+// in time.
+//
+static HRESULT
+RemoteFetch(
+   PCACHE_CONFIG Config,
+   PCWSTR Key,
+   PCWSTR ShardDirectory,
+   PCWSTR Stem
+)
+{
+   HRESULT hr = S_OK;
+   BYTE_BUFFER Compressed = {0};
+   BYTE_BUFFER Packed = {0};
+   BUFFER_READER Reader = {0};
+   DWORD Magic = 0;
+   DWORD Version = 0;
+   DWORD MetadataLength = 0;
+   PWSTR ObjectPath = NULL;
+   PWSTR MetadataPath = NULL;
+
+   hr = RemoteRequest(
+      Config->Remote,
+      L"GET",
+      Key,
+      Config->RemoteTimeout,
+      NULL,
+      0,
+      &Compressed
+   );
+
+   if (hr == S_OK)
+      hr = RemoteDecompress(Compressed.Buffer, Compressed.Length, &Packed);
+
+   if (hr == S_OK)
+   {
+      Reader.Data = Packed.Buffer;
+      Reader.Length = Packed.Length;
+
+      hr = ReaderReadDword(&Reader, &Magic);
+      if (SUCCEEDED(hr))
+         hr = ReaderReadDword(&Reader, &Version);
+      if (SUCCEEDED(hr) &&
+          (Magic != CACHE_REMOTE_MAGIC || Version != CACHE_REMOTE_VERSION))
+      {
+         hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+      }
+      if (SUCCEEDED(hr))
+         hr = ReaderReadDword(&Reader, &MetadataLength);
+      if (SUCCEEDED(hr) && Reader.Length - Reader.Offset < MetadataLength)
+         hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+   }
+
+   if (hr == S_OK)
+      hr = HeapPrintf(&ObjectPath, L"%s.obj", Stem);
+   if (hr == S_OK)
+      hr = HeapPrintf(&MetadataPath, L"%s.out", Stem);
+
+   if (hr == S_OK &&
+       !CreateDirectory(ShardDirectory, NULL) &&
+       GetLastError() != ERROR_ALREADY_EXISTS)
+   {
+      hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   // Object first, as in CacheStore().
+   //
+   if (hr == S_OK)
+   {
+      hr = WriteFileAtomic(
+         ObjectPath,
+         Reader.Data + Reader.Offset + MetadataLength,
+         Reader.Length - Reader.Offset - MetadataLength
+      );
+   }
+   if (hr == S_OK)
+   {
+      hr = WriteFileAtomic(
+         MetadataPath,
+         Reader.Data + Reader.Offset,
+         MetadataLength
+      );
+   }
+
+   if (hr == S_OK)
+      EvictShard(Config, ShardDirectory);
+
+   // The remote cache being broken or unreachable is no reason to fail the
+   // compile.
+   //
+   if (FAILED(hr))
+      hr = S_FALSE;
+
+   free(MetadataPath);
+   free(ObjectPath);
+   FreeBuffer(&Packed);
+   FreeBuffer(&Compressed);
+   return hr;
+}
+
+// Starts "cc --cache-upload <key>" in the background.  It doesn't inherit
+// any handles, so nothing waiting on our output waits for it.
+//
+static VOID
+StartUpload(
+   PCWSTR Key
+)
+{
+   WCHAR Self[MAX_PATH];
+   PWSTR CommandLine = NULL;
+   STARTUPINFO StartupInfo = {0};
+   PROCESS_INFORMATION ProcessInfo = {0};
+   DWORD Length = 0;
+
+   StartupInfo.cb = sizeof(StartupInfo);
+
+   Length = GetModuleFileName(NULL, Self, ARRAYSIZE(Self));
+   if (!Length || Length == ARRAYSIZE(Self))
+      return;
+
+   if (FAILED(HeapPrintf(
+          &CommandLine,
+          L"\"%s\" --cache-upload %s",
+          Self,
+          Key)))
+   {
+      return;
+   }
+
+   if (CreateProcess(
+          NULL,
+          CommandLine,
+          NULL,
+          NULL,
+          FALSE,
+          DETACHED_PROCESS | CREATE_NEW_PROCESS_GROUP,
+          NULL,
+          NULL,
+          &StartupInfo,
+          &ProcessInfo))
+   {
+      CloseHandle(ProcessInfo.hThread);
+      CloseHandle(ProcessInfo.hProcess);
+   }
+
+   free(CommandLine);
+}
+
+//
+// The other end of StartUpload(): packs up a local entry and sends it to
+// the remote cache.
+//
+HRESULT
+CacheUploadMain(
+   PCWSTR Key
+)
+{
+   HRESULT hr = S_OK;
+   CACHE_CONFIG Config = {0};
+   PWSTR ShardDirectory = NULL;
+   PWSTR Stem = NULL;
+   PWSTR ObjectPath = NULL;
+   PWSTR MetadataPath = NULL;
+   BYTE_BUFFER Object = {0};
+   BYTE_BUFFER Metadata = {0};
+   BYTE_BUFFER Packed = {0};
+   BYTE_BUFFER Compressed = {0};
+
+   if (wcslen(Key) != HASH_LENGTH * 2 ||
+       wcsspn(Key, L"0123456789abcdef") != HASH_LENGTH * 2)
+   {
+      return E_INVALIDARG;
+   }
+
+   hr = GetCacheConfig(&Config);
+   if (hr == S_OK && (!Config.Remote || !Config.RemoteWritable))
+      hr = S_FALSE;
+
+   if (hr == S_OK)
+      hr = GetKeyPaths(&Config, Key, &ShardDirectory, &Stem);
+   if (hr == S_OK)
+      hr = HeapPrintf(&ObjectPath, L"%s.obj", Stem);
+   if (hr == S_OK)
+      hr = HeapPrintf(&MetadataPath, L"%s.out", Stem);
+   if (hr == S_OK)
+      hr = ReadFileContents(MetadataPath, &Metadata);
+   if (hr == S_OK)
+      hr = ReadFileContents(ObjectPath, &Object);
+
+   if (hr == S_OK)
+      hr = BufferAppendDword(&Packed, CACHE_REMOTE_MAGIC);
+   if (hr == S_OK)
+      hr = BufferAppendDword(&Packed, CACHE_REMOTE_VERSION);
+   if (hr == S_OK)
+      hr = BufferAppendDword(&Packed, (DWORD)Metadata.Length);
+   if (hr == S_OK)
+      hr = BufferAppend(&Packed, Metadata.Buffer, Metadata.Length);
+   if (hr == S_OK)
+      hr = BufferAppend(&Packed, Object.Buffer, Object.Length);
+
+   if (hr == S_OK)
+      hr = RemoteCompress(Packed.Buffer, Packed.Length, &Compressed);
+
+   if (hr == S_OK)
+   {
+      hr = RemoteRequest(
+         Config.Remote,
+         L"PUT",
+         Key,
+         Config.RemoteTimeout,
+         Compressed.Buffer,
+         (DWORD)Compressed.Length,
+         NULL
+      );
+   }
+
+   FreeBuffer(&Compressed);
+   FreeBuffer(&Packed);
+   FreeBuffer(&Metadata);
+   FreeBuffer(&Object);
+   free(MetadataPath);
+   free(ObjectPath);
+   free(Stem);
+   free(ShardDirectory);
+   FreeCacheConfig(&Config);
+   return hr;
+}
+
+//
+// Tries to find the object without running the preprocessor.  Returns S_OK
+// on a hit, or S_FALSE on a miss; on a miss, WantManifest says whether
+// ManifestDigest is where a manifest for this compile should be written.
+//
+static HRESULT
+DirectLookup(
+   PCACHE_CONFIG Config,
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   PCWSTR Cwd,
+   PCWSTR Destination,
+   const LAUNCH_PARAMS *Launch,
+   BYTE ManifestDigest[HASH_LENGTH],
+   PBOOL WantManifest,
+   PDWORD ReturnValue
+)
+{
+   HRESULT hr = S_OK;
+   PWSTR ManifestShard = NULL;
+   PWSTR ManifestStem = NULL;
+   PWSTR ManifestPath = NULL;
+   PWSTR ObjectShard = NULL;
+   PWSTR ObjectStem = NULL;
+   BYTE ObjectDigest[HASH_LENGTH];
+
+   *WantManifest = FALSE;
+
+   hr = ManifestComputeKey(Args, Toolset, Cwd, ManifestDigest);
+   if (hr == S_OK)
+   {
+      hr = GetEntryPaths(
+         Config,
+         ManifestDigest,
+         &ManifestShard,
+         &ManifestStem
+      );
+   }
+   if (hr == S_OK)
+      hr = HeapPrintf(&ManifestPath, L"%s.man", ManifestStem);
+
+   if (hr == S_OK)
+   {
+      *WantManifest = TRUE;
+      hr = ManifestLookup(ManifestPath, Cwd, ObjectDigest);
+   }
+
+   if (hr == S_OK)
+      hr = GetEntryPaths(Config, ObjectDigest, &ObjectShard, &ObjectStem);
+
+   // Up to here, any problem is a miss.
+   //
+   if (FAILED(hr))
+      hr = S_FALSE;
+
+   if (hr == S_OK)
+   {
+      hr = CacheLookup(Config, ObjectStem, Destination, Launch, ReturnValue);
+      if (hr == S_OK)
+         TouchFile(ManifestPath);
+   }
+
+   free(ObjectStem);
+   free(ObjectShard);
+   free(ManifestPath);
+   free(ManifestStem);
+   free(ManifestShard);
+   return hr;
+}
+
+static VOID
+StoreManifest(
+   PCACHE_CONFIG Config,
+   const BYTE ManifestDigest[HASH_LENGTH],
+   PCWSTR Cwd,
+   const BYTE ObjectDigest[HASH_LENGTH],
+   PSTRING_LIST Includes,
+   ULONGLONG Started
+)
+{
+   PWSTR ShardDirectory = NULL;
+   PWSTR Stem = NULL;
+   PWSTR Path = NULL;
+
+   if (SUCCEEDED(GetEntryPaths(
+          Config,
+          ManifestDigest,
+          &ShardDirectory,
+          &Stem)) &&
+       SUCCEEDED(HeapPrintf(&Path, L"%s.man", Stem)) &&
+       (CreateDirectory(ShardDirectory, NULL) ||
+        GetLastError() == ERROR_ALREADY_EXISTS))
+   {
+      ManifestStore(Path, Cwd, ObjectDigest, Includes, Started);
+   }
+
+   free(Path);
+   free(Stem);
+   free(ShardDirectory);
+}
+
+//
+// Link cache.
+//
+// A link whose inputs are all objects and libraries is keyed on their
+// contents, the libraries it will search, and the toolset.  Its entry is a
+// .out file like a compile's, plus whatever the link produced, each stored
+// as <key>.<role>:
+//
+//    bin   the .exe or .dll
+//    pdb   its debug info
+//    lib   the import library, if a DLL exports anything
+//    exp   the exports file, likewise
+//
+// These are in the order CcGetExpectedOutputs() lists them.
+//
+
+#define CACHE_LINK_MAGIC     0x4b4c4c43 // 'CLLK'
+#define CACHE_LINK_VERSION   2
+#define CACHE_LINK_ABSENT    (~0ULL)
+
+static PCWSTR LinkOutputRoles[] = {L"bin", L"pdb", L"lib", L"exp"};
+
+static BOOL
+IsLinkCacheable(
+   PCC_ARGS Args
+)
+{
+   PSTRING_LIST Input;
+
+   // A /DEBUG:FASTLINK .pdb only points at the debug info in the objects,
+   // which the cache doesn't keep.
+   //
+   if (Args->OutputType == CC_OBJECT_FILE ||
+       !Args->Inputs ||
+       Args->LinkDebug == CC_LINK_DEBUG_FASTLINK)
+   {
+      return FALSE;
+   }
+
+   for (Input = Args->Inputs; Input; Input = Input->Next)
+   {
+      if (CcIsSourceFile(Input->String))
+         return FALSE;
+   }
+
+   return TRUE;
+}
+
+// Returns S_FALSE if Name.lib isn't in Directory.
+//
+static HRESULT
+FindLibrary(
+   PCWSTR Cwd,
+   PCWSTR Directory,
+   PCWSTR Name,
+   PWSTR *Path
+)
+{
+   HRESULT hr = S_OK;
+   PWSTR Absolute = NULL;
+
+   hr = MakeAbsolute(Cwd, Directory, &Absolute);
+   if (SUCCEEDED(hr))
+      hr = HeapPrintf(Path, L"%s\\%s.lib", Absolute, Name);
+
+   if (SUCCEEDED(hr) && GetFileAttributes(*Path) == INVALID_FILE_ATTRIBUTES)
+   {
+      free(*Path);
+      *Path = NULL;
+      hr = S_FALSE;
+   }
+
+   free(Absolute);
+   return hr;
+}
+
+//
+// Hashes the library link will use for Name.  The current directory and
+// those given with -L are searched first, as link does, and what's found
+// there is hashed by contents.  The toolset's own libraries are hashed by
+// identity, which is much cheaper.  Anything in neither comes from %LIB%,
+// which the caller hashes.
+//
+static HRESULT
+HashLibrary(
+   PHASH_CONTEXT Hash,
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   PCWSTR Cwd,
+   PCWSTR Name
+)
+{
+   HRESULT hr = S_OK;
+   PSTRING_LIST List;
+   PWSTR Path = NULL;
+   BOOL FromToolset = FALSE;
+
+   hr = HashString(Hash, Name);
+
+   if (SUCCEEDED(hr))
+      hr = FindLibrary(Cwd, L".", Name, &Path);
+
+   for (List = Args->Base.LibraryPaths;
+        hr == S_FALSE && List;
+        List = List->Next)
+   {
+      hr = FindLibrary(Cwd, List->String, Name, &Path);
+   }
+
+   for (List = Toolset->LibraryPaths;
+        hr == S_FALSE && List;
+        List = List->Next)
+   {
+      hr = FindLibrary(Cwd, List->String, Name, &Path);
+      FromToolset = TRUE;
+   }
+
+   if (hr == S_FALSE)
+      hr = HashDword(Hash, 0);
+   else if (SUCCEEDED(hr))
+      hr = HashDword(Hash, 1);
+
+   if (SUCCEEDED(hr) && Path)
+   {
+      if (FromToolset)
+         hr = HashFileIdentity(Hash, Path);
+      else
+         hr = HashFileContents(Hash, Path);
+   }
+
+   free(Path);
+   return hr;
+}
+
+static HRESULT
+ComputeLinkKey(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   PCWSTR Cwd,
+   BYTE Digest[HASH_LENGTH]
+)
+{
+   HRESULT hr = S_OK;
+   HASH_CONTEXT Hash = {0};
+   PCWSTR Variables[] = {L"LINK", L"_LINK_", L"LIB"};
+   PSTRING_LIST List;
+   DWORD i;
+
+   hr = HashInit(&Hash);
+   if (SUCCEEDED(hr))
+      hr = HashDword(&Hash, CACHE_LINK_VERSION);
+   if (SUCCEEDED(hr))
+      hr = CacheHashCompileContext(&Hash, Args, Toolset);
+   if (SUCCEEDED(hr))
+      hr = HashDword(&Hash, Args->OutputType);
+   if (SUCCEEDED(hr))
+      hr = HashString(&Hash, Args->OutputName);
+
+   // The image names its .pdb by full path, unless prefix maps have us
+   // leave the directory out.
+   //
+   if (SUCCEEDED(hr) && !Args->PrefixMaps)
+      hr = HashString(&Hash, Cwd);
+
+   if (SUCCEEDED(hr))
+      hr = HashStringList(&Hash, Args->LinkerOptions);
+   if (SUCCEEDED(hr))
+      hr = HashDword(&Hash, Args->LinkDebug);
+   if (SUCCEEDED(hr))
+      hr = HashString(&Hash, Args->PdbFile);
+
+   for (List = Args->Inputs; SUCCEEDED(hr) && List; List = List->Next)
+   {
+      PWSTR Path = NULL;
+
+      hr = HashString(&Hash, List->String);
+      if (SUCCEEDED(hr))
+         hr = MakeAbsolute(Cwd, List->String, &Path);
+      if (SUCCEEDED(hr))
+         hr = HashFileContents(&Hash, Path);
+
+      free(Path);
+   }
+
+   if (SUCCEEDED(hr))
+      hr = HashStringList(&Hash, Args->Base.LibraryPaths);
+
+   for (List = Args->Base.Libraries;
+        SUCCEEDED(hr) && List;
+        List = List->Next)
+   {
+      hr = HashLibrary(&Hash, Args, Toolset, Cwd, List->String);
+   }
+
+   for (i = 0; SUCCEEDED(hr) && i < ARRAYSIZE(Variables); ++i)
+   {
+      PWSTR Value = NULL;
+
+      hr = GetEnvironmentString(Variables[i], &Value);
+      if (SUCCEEDED(hr))
+         hr = HashString(&Hash, Value);
+
+      free(Value);
+   }
+
+   if (SUCCEEDED(hr))
+      hr = HashFinish(&Hash, Digest);
+
+   HashFree(&Hash);
+   return hr;
+}
+
+// Returns S_FALSE on a miss.
+//
+static HRESULT
+LinkLookup(
+   PCACHE_CONFIG Config,
+   PCWSTR Stem,
+   PCWSTR Cwd,
+   PSTRING_LIST Outputs,
+   const LAUNCH_PARAMS *Launch,
+   PDWORD ReturnValue
+)
+{
+   HRESULT hr = S_OK;
+   PWSTR MetadataPath = NULL;
+   BYTE_BUFFER Metadata = {0};
+   BUFFER_READER Reader = {0};
+   DWORD Magic = 0;
+   DWORD Version = 0;
+   DWORD ExitCode = 0;
+   DWORD Count = 0;
+   ULONGLONG Sizes[ARRAYSIZE(LinkOutputRoles)];
+   CACHED_OUTPUT Output = {0};
+   PSTRING_LIST List;
+   DWORD i;
+
+   hr = HeapPrintf(&MetadataPath, L"%s.out", Stem);
+
+   if (SUCCEEDED(hr) &&
+       FAILED(ReadFileContents(MetadataPath, &Metadata)))
+   {
+      hr = S_FALSE;
+   }
+
+   if (hr == S_OK)
+   {
+      Reader.Data = Metadata.Buffer;
+      Reader.Length = Metadata.Length;
+
+      hr = ReaderReadDword(&Reader, &Magic);
+      if (SUCCEEDED(hr))
+         hr = ReaderReadDword(&Reader, &Version);
+      if (SUCCEEDED(hr) &&
+          (Magic != CACHE_LINK_MAGIC || Version != CACHE_LINK_VERSION))
+      {
+         hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+      }
+      if (SUCCEEDED(hr))
+         hr = ReaderReadDword(&Reader, &ExitCode);
+      if (SUCCEEDED(hr))
+         hr = ReaderReadDword(&Reader, &Count);
+      if (SUCCEEDED(hr) && Count > ARRAYSIZE(Sizes))
+         hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+      for (i = 0; SUCCEEDED(hr) && i < Count; ++i)
+         hr = ReaderReadQword(&Reader, &Sizes[i]);
+      if (SUCCEEDED(hr))
+         hr = ReadCapturedOutput(&Reader, &Output);
+
+      for (List = Outputs, i = 0;
+           SUCCEEDED(hr) && List;
+           List = List->Next, ++i)
+      {
+         PWSTR Destination = NULL;
+         PWSTR Source = NULL;
+
+         if (i >= Count)
+            hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+         if (SUCCEEDED(hr))
+            hr = MakeAbsolute(Cwd, List->String, &Destination);
+
+         // Leave no stale import library where this link didn't make one.
+         //
+         if (SUCCEEDED(hr) && Sizes[i] == CACHE_LINK_ABSENT)
+         {
+            DeleteFile(Destination);
+         }
+         else if (SUCCEEDED(hr))
+         {
+            hr = HeapPrintf(&Source, L"%s.%s", Stem, LinkOutputRoles[i]);
+            if (SUCCEEDED(hr))
+               hr = PlaceObject(Config, Source, Destination, Sizes[i]);
+         }
+
+         free(Source);
+         free(Destination);
+      }
+
+      // As with compiles, a damaged or half-evicted entry is a miss.
+      //
+      if (FAILED(hr))
+         hr = S_FALSE;
+   }
+
+   if (hr == S_OK)
+   {
+      PCWSTR Image = Outputs->String;
+      PCWSTR Dot = wcsrchr(Image, L'.');
+      PWSTR Ilk = NULL;
+
+      TouchFile(MetadataPath);
+
+      // An incremental link database from some earlier link no longer
+      // describes the image.
+      //
+      if (SUCCEEDED(HeapPrintf(
+             &Ilk,
+             L"%.*s.ilk",
+             Dot ? (INT)(Dot - Image) : (INT)wcslen(Image),
+             Image)))
+      {
+         DeleteFile(Ilk);
+      }
+      free(Ilk);
+
+      hr = ReplayCapturedOutput(&Output, Launch);
+      if (SUCCEEDED(hr))
+         *ReturnValue = ExitCode;
+   }
+
+   FreeBuffer(&Metadata);
+   free(MetadataPath);
+   return hr;
+}
+
+static HRESULT
+LinkStore(
+   PCWSTR ShardDirectory,
+   PCWSTR Stem,
+   PCWSTR Cwd,
+   PSTRING_LIST Outputs,
+   DWORD ExitCode,
+   PLAUNCH_OUTPUT Capture
+)
+{
+   HRESULT hr = S_OK;
+   PWSTR MetadataPath = NULL;
+   BYTE_BUFFER Metadata = {0};
+   PSTRING_LIST List;
+   DWORD Count = 0;
+   DWORD i;
+
+   for (List = Outputs; List; List = List->Next)
+      ++Count;
+
+   if (!CreateDirectory(ShardDirectory, NULL) &&
+       GetLastError() != ERROR_ALREADY_EXISTS)
+   {
+      hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   if (SUCCEEDED(hr))
+      hr = HeapPrintf(&MetadataPath, L"%s.out", Stem);
+   if (SUCCEEDED(hr))
+      hr = BufferAppendDword(&Metadata, CACHE_LINK_MAGIC);
+   if (SUCCEEDED(hr))
+      hr = BufferAppendDword(&Metadata, CACHE_LINK_VERSION);
+   if (SUCCEEDED(hr))
+      hr = BufferAppendDword(&Metadata, ExitCode);
+   if (SUCCEEDED(hr))
+      hr = BufferAppendDword(&Metadata, Count);
+
+   // Outputs go in before the .out that points at them.
+   //
+   for (List = Outputs, i = 0;
+        SUCCEEDED(hr) && List;
+        List = List->Next, ++i)
+   {
+      PWSTR Source = NULL;
+      PWSTR Path = NULL;
+      ULONGLONG Size = CACHE_LINK_ABSENT;
+
+      hr = MakeAbsolute(Cwd, List->String, &Source);
+      if (SUCCEEDED(hr) && FAILED(GetFileSize64(Source, &Size)))
+         Size = CACHE_LINK_ABSENT;
+
+      if (SUCCEEDED(hr) && Size != CACHE_LINK_ABSENT)
+      {
+         hr = HeapPrintf(&Path, L"%s.%s", Stem, LinkOutputRoles[i]);
+         if (SUCCEEDED(hr))
+            hr = StoreFile(Source, Path);
+      }
+
+      if (SUCCEEDED(hr))
+         hr = BufferAppendQword(&Metadata, Size);
+
+      free(Path);
+      free(Source);
+   }
+
+   if (SUCCEEDED(hr))
+      hr = AppendCapturedOutput(&Metadata, Capture);
+   if (SUCCEEDED(hr))
+      hr = WriteFileAtomic(MetadataPath, Metadata.Buffer, Metadata.Length);
+
+   FreeBuffer(&Metadata);
+   free(MetadataPath);
+   return hr;
+}
+
+static HRESULT
+LinkAndStore(
+   PCACHE_CONFIG Config,
+   PCWSTR ShardDirectory,
+   PCWSTR Stem,
+   PCWSTR Cwd,
+   PSTRING_LIST Outputs,
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   const LAUNCH_PARAMS *Launch,
+   PDWORD ReturnValue
+)
+{
+   HRESULT hr = S_OK;
+   OUTPUT_STRING CommandLine = {0};
+   LAUNCH_PARAMS Link = {0};
+   LAUNCH_OUTPUT Capture = {0};
+   PSTRING_LIST List;
+
+   hr = CcBuildCommandLine(Args, Toolset, &CommandLine);
+
+   // link updates the image and .pdb in place when it can, which would
+   // write through a hard link into the cache.
+   //
+   for (List = Outputs;
+        SUCCEEDED(hr) && Config->Hardlink && List;
+        List = List->Next)
+   {
+      PWSTR Path = NULL;
+
+      hr = MakeAbsolute(Cwd, List->String, &Path);
+      if (SUCCEEDED(hr))
+         DeleteFile(Path);
+
+      free(Path);
+   }
+
+   if (SUCCEEDED(hr))
+   {
+      if (Launch)
+         Link = *Launch;
+
+      Capture.Forward = TRUE;
+      Capture.Launch = Launch;
+      Link.OutputCallback = LaunchBufferOutput;
+      Link.CallbackContext = &Capture;
+
+      hr = LaunchProcessEx(CommandLine.Buffer, &Link, ReturnValue);
+   }
+
+   if (SUCCEEDED(hr) && !*ReturnValue &&
+       SUCCEEDED(LinkStore(
+          ShardDirectory,
+          Stem,
+          Cwd,
+          Outputs,
+          *ReturnValue,
+          &Capture)))
+   {
+      EvictShard(Config, ShardDirectory);
+   }
+
+   LaunchFreeOutput(&Capture);
+   FreeString(&CommandLine);
+   return hr;
+}
+
+static HRESULT
+LinkCacheExecute(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   const LAUNCH_PARAMS *Launch,
+   PDWORD ReturnValue
+)
+{
+   HRESULT hr = S_OK;
+   CACHE_CONFIG Config = {0};
+   PSTRING_LIST Outputs = NULL;
+   PSTRING_LIST List;
+   PWSTR Cwd = NULL;
+   PWSTR ShardDirectory = NULL;
+   PWSTR Stem = NULL;
+   BYTE Digest[HASH_LENGTH];
+   DWORD Count = 0;
+
+   hr = GetCacheConfig(&Config);
+   if (hr == S_OK && !Config.Link)
+      hr = S_FALSE;
+
+   if (hr == S_OK)
+      hr = CcGetExpectedOutputs(Args, &Outputs);
+   for (List = Outputs; hr == S_OK && List; List = List->Next)
+      ++Count;
+   if (hr == S_OK && Count > ARRAYSIZE(LinkOutputRoles))
+      hr = S_FALSE;
+
+   if (hr == S_OK)
+      hr = GetLaunchDirectory(Launch, &Cwd);
+   if (hr == S_OK)
+      hr = ComputeLinkKey(Args, Toolset, Cwd, Digest);
+   if (hr == S_OK)
+      hr = GetEntryPaths(&Config, Digest, &ShardDirectory, &Stem);
+
+   // An input that can't be read is for link to complain about.
+   //
+   if (FAILED(hr))
+      hr = S_FALSE;
+
+   if (hr == S_OK)
+   {
+      hr = LinkLookup(&Config, Stem, Cwd, Outputs, Launch, ReturnValue);
+      if (hr == S_FALSE)
+      {
+         hr = LinkAndStore(
+            &Config,
+            ShardDirectory,
+            Stem,
+            Cwd,
+            Outputs,
+            Args,
+            Toolset,
+            Launch,
+            ReturnValue
+         );
+      }
+   }
+
+   FreeStringList(Outputs);
+   free(Cwd);
+   free(ShardDirectory);
+   free(Stem);
+   FreeCacheConfig(&Config);
+   return hr;
+}
+
+//
+// Runs a compile through the cache, if the cache is enabled and the compile
+// is something it can handle.  Returns S_FALSE if it did nothing, and the
+// caller should compile as usual.
+//
+HRESULT
+CacheExecute(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   const LAUNCH_PARAMS *Launch,
+   PDWORD ReturnValue
+)
+{
+   HRESULT hr = S_OK;
+   CACHE_CONFIG Config = {0};
+   PSTRING_LIST Outputs = NULL;
+   PSTRING_LIST Includes = NULL;
+   PWSTR Cwd = NULL;
+   PWSTR Destination = NULL;
+   PWSTR ShardDirectory = NULL;
+   PWSTR Stem = NULL;
+   BYTE Digest[HASH_LENGTH];
+   BYTE ManifestDigest[HASH_LENGTH];
+   BOOL WantManifest = FALSE;
+   BOOL Done = FALSE;
+   BOOL Compiled = FALSE;
+   WCHAR Key[HASH_STRING_LENGTH];
+   FILETIME StartedFileTime = {0};
+
+   if (IsLinkCacheable(Args))
+      return LinkCacheExecute(Args, Toolset, Launch, ReturnValue);
+   if (!IsCacheable(Args))
+      return S_FALSE;
+
+   hr = GetCacheConfig(&Config);
+
+   if (hr == S_OK)
+      hr = CcGetExpectedOutputs(Args, &Outputs);
+   if (hr == S_OK)
+      hr = GetLaunchDirectory(Launch, &Cwd);
+   if (hr == S_OK)
+      hr = MakeAbsolute(Cwd, Outputs->String, &Destination);
+
+   if (FAILED(hr))
+      hr = S_FALSE;
+
+   if (hr == S_OK && Config.Direct)
+   {
+      hr = DirectLookup(
+         &Config,
+         Args,
+         Toolset,
+         Cwd,
+         Destination,
+         Launch,
+         ManifestDigest,
+         &WantManifest,
+         ReturnValue
+      );
+
+      // A hit, or a failure replaying the output of one, is the end of it.
+      //
+      if (hr == S_FALSE)
+         hr = S_OK;
+      else
+         Done = TRUE;
+   }
+
+   // The manifest lists the headers this preprocessor run reads; one
+   // written after it starts may not be what it saw.
+   //
+   if (hr == S_OK && !Done)
+   {
+      GetSystemTimeAsFileTime(&StartedFileTime);
+
+      hr = ComputeKey(
+         Args,
+         Toolset,
+         Launch,
+         WantManifest ? &Includes : NULL,
+         Digest
+      );
+   }
+   if (hr == S_OK && !Done)
+      hr = GetEntryPaths(&Config, Digest, &ShardDirectory, &Stem);
+
+   // Problems up to here mean we can't use the cache, but the compile can
+   // still go ahead without it.
+   //
+   if (FAILED(hr))
+      hr = S_FALSE;
+
+   if (hr == S_OK && !Done)
+   {
+      HashToString(Digest, Key);
+
+      hr = CacheLookup(&Config, Stem, Destination, Launch, ReturnValue);
+
+      if (hr == S_FALSE &&
+          Config.Remote &&
+          RemoteFetch(&Config, Key, ShardDirectory, Stem) == S_OK)
+      {
+         hr = CacheLookup(&Config, Stem, Destination, Launch, ReturnValue);
+      }
+
+      if (hr == S_FALSE)
+      {
+         Compiled = TRUE;
+         hr = CompileAndStore(
+            &Config,
+            ShardDirectory,
+            Stem,
+            Destination,
+            Args,
+            Toolset,
+            Launch,
+            ReturnValue
+         );
+      }
+   }
+
+   if (hr == S_OK && Compiled && !*ReturnValue &&
+       Config.Remote && Config.RemoteWritable)
+   {
+      StartUpload(Key);
+   }
+
+   // Either way the object is now cached under Digest, so next time we can
+   // go straight to it.
+   //
+   if (hr == S_OK && !Done && !*ReturnValue && WantManifest)
+   {
+      StoreManifest(
+         &Config,
+         ManifestDigest,
+         Cwd,
+         Digest,
+         Includes,
+         FileTimeToQword(&StartedFileTime)
+      );
+   }
+
+   FreeStringList(Includes);
+   FreeStringList(Outputs);
+   free(Cwd);
+   free(Destination);
+   free(ShardDirectory);
+   free(Stem);
+   FreeCacheConfig(&Config);
+   return hr;
+}
@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2017 Andrew Sveikauskas
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ */
+
+//
+// clwrapper-cachesrv [-a address] [-p port] [-d directory]
+//
+// A minimal server for the remote object cache: GET /.../<key> returns what
+// was last PUT to the same key.  Entries are kept as files named after
+// their keys, and nothing is ever evicted.  It's meant for trying out the
+// remote cache on one machine, not for serving a build farm.
+//
+
+#include "clwrapper.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CACHESRV_DEFAULT_ADDRESS L"127.0.0.1"
+#define CACHESRV_DEFAULT_PORT    L"8380"
+
+static PCWSTR StoreDirectory;
+
+// Requests are for /.../<key>.
+//
+static VOID
+HandleRequest(
+   PVOID Context,
+   const HTTP_REQUEST *Request,
+   PHTTP_RESPONSE Response
+)
+{
+   HRESULT hr = S_OK;
+   PCSTR Key = NULL;
+   PWSTR Path = NULL;
+
+   Key = strrchr(Request->Target, '/');
+   Key = Key ? Key + 1 : Request->Target;
+
+   if (strlen(Key) != HASH_LENGTH * 2 ||
+       strspn(Key, "0123456789abcdef") != HASH_LENGTH * 2)
+   {
+      hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+      Key = NULL;
+   }
+
+   if (SUCCEEDED(hr))
+      hr = HeapPrintf(&Path, L"%s\\%hs", StoreDirectory, Key);
+
+   if (SUCCEEDED(hr) && !strcmp(Request->Method, "GET"))
+   {
+      if (SUCCEEDED(ReadFileContents(Path, &Response->Body)))
+      {
+         Response->Status = 200;
+         Response->Reason = "OK";
+      }
+      else
+      {
+         Response->Status = 404;
+         Response->Reason = "Not Found";
+      }
+   }
+   else if (SUCCEEDED(hr) && !strcmp(Request->Method, "PUT"))
+   {
+      hr = WriteFileAtomic(Path, Request->Body, Request->BodyLength);
+      if (SUCCEEDED(hr))
+      {
+         Response->Status = 201;
+         Response->Reason = "Created";
+      }
+      else
+      {
+         Response->Status = 500;
+         Response->Reason = "Internal Server Error";
+      }
+   }
+   else if (SUCCEEDED(hr))
+   {
+      Response->Status = 405;
+      Response->Reason = "Method Not Allowed";
+   }
+
+   if (Key)
+      fprintf(stderr, "%s %s %d\n", Request->Method, Key, Response->Status);
+
+   free(Path);
+}
+
+static HRESULT
+CacheServerMain(
+   INT Argc,
+   PWSTR *Argv
+)
+{
+   HRESULT hr = S_OK;
+   PCWSTR Address = CACHESRV_DEFAULT_ADDRESS;
+   PCWSTR Port = CACHESRV_DEFAULT_PORT;
+   PWSTR DefaultDirectory = NULL;
+   INT i;
+
+   for (i = 1; SUCCEEDED(hr) && i < Argc; ++i)
+   {
+      if (i + 1 < Argc && !wcscmp(Argv[i], L"-a"))
+         Address = Argv[++i];
+      else if (i + 1 < Argc && !wcscmp(Argv[i], L"-p"))
+         Port = Argv[++i];
+      else if (i + 1 < Argc && !wcscmp(Argv[i], L"-d"))
+         StoreDirectory = Argv[++i];
+      else
+      {
+         fprintf(
+            stderr,
+            "usage: %ls [-a address] [-p port] [-d directory]\n",
+            Argv[0]
+         );
+         hr = E_INVALIDARG;
+      }
+   }
+
+   if (SUCCEEDED(hr) && !StoreDirectory)
+   {
+      hr = GetDataDirectory(L"cachesrv", &DefaultDirectory);
+      StoreDirectory = DefaultDirectory;
+   }
+   else if (SUCCEEDED(hr) &&
+            !CreateDirectory(StoreDirectory, NULL) &&
+            GetLastError() != ERROR_ALREADY_EXISTS)
+   {
+      hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   if (SUCCEEDED(hr))
+   {
+      printf(
+         "Serving %ls on %ls port %ls\n",
+         StoreDirectory,
+         Address,
+         Port
+      );
+      fflush(stdout);
+   }
+
+   if (SUCCEEDED(hr))
+      hr = HttpServe(Address, Port, HandleRequest, NULL);
+
+   free(DefaultDirectory);
+   return hr;
+}
+
+int main()
+{
+   INT Argc = 0;
+   PWSTR *Args = CommandLineToArgvW(GetCommandLine(), &Argc);
+   HRESULT hr = S_OK;
+
+   if (!Args)
+   {
+      DWORD Err = GetLastError();
+      fprintf(stderr, "CommandLineToArgvW failed, GetLastError=0x%.8x\n", Err);
+      return Err;
+   }
+
+   hr = CacheServerMain(Argc, Args);
+
+   LocalFree(Args);
+   if (FAILED(hr))
+   {
+      fprintf(stderr, "Failed with 0x%.8x\n", hr);
+      return hr;
+   }
+   return 0;
+}
@@ -11,6 +11,15 @@
 
 #include <windows.h>
 
+#if _M_IX86
+#define WOW64NODE
+#else
+#define WOW64NODE L"Wow6432Node\\"
+#endif
+
+#define VS_ROOT_KEY  L"SOFTWARE\\" WOW64NODE L"Microsoft\\VisualStudio"
+#define SDK_ROOT_KEY L"SOFTWARE\\" WOW64NODE L"Microsoft\\Microsoft SDKs\\Windows"
+
 #if defined(__cplusplus)
 extern "C" {
 #endif
@@ -28,6 +37,53 @@ typedef struct _STRING_LIST
    WCHAR String[0];
 } STRING_LIST, *PSTRING_LIST;
 
+typedef struct _BYTE_BUFFER
+{
+   PBYTE Buffer;
+   SIZE_T AllocatedBytes;
+   SIZE_T Length;
+} BYTE_BUFFER, *PBYTE_BUFFER;
+
+typedef struct _BUFFER_READER
+{
+   const BYTE *Data;
+   SIZE_T Length;
+   SIZE_T Offset;
+} BUFFER_READER, *PBUFFER_READER;
+
+typedef struct _MAPPED_FILE
+{
+   HANDLE File;
+   HANDLE Mapping;
+   PBYTE Data;
+   SIZE_T Length;
+} MAPPED_FILE, *PMAPPED_FILE;
+
+#define HASH_LENGTH 32
+#define HASH_STRING_LENGTH (HASH_LENGTH * 2 + 1)
+
+typedef struct _HASH_CONTEXT
+{
+   PVOID Algorithm;
+   PVOID Hash;
+} HASH_CONTEXT, *PHASH_CONTEXT;
+
+//
+// What a file held when ManifestGetFileDigest() looked at it.
+//
+typedef struct _FILE_DIGEST
+{
+   ULONGLONG Size;
+   ULONGLONG WriteTime;
+   BYTE Digest[HASH_LENGTH];
+   BOOL UsesTimeMacros;
+} FILE_DIGEST, *PFILE_DIGEST;
+
+// A file written this recently (in 100ns units) could be written again
+// without its timestamp changing, so its timestamp isn't to be trusted.
+//
+#define FILE_RACY_AGE (2ULL * 10000000)
+
 typedef struct _CLWRAPPER_VERSION_SPEC
 {
    BOOL Specified;
@@ -39,11 +95,16 @@ typedef struct _CLWRAPPER_ARGS_BASE
    CLWRAPPER_VERSION_SPEC CompilerVersion;
    CLWRAPPER_VERSION_SPEC SdkVersion;
    PCWSTR DesiredArchitecture;
+   PCWSTR DesiredHost;
    BOOL StaticCrt;
+   BOOL NoToolsetCache;
+   PCWSTR ToolsetProfile;
    PSTRING_LIST LibraryPaths;
    PSTRING_LIST Libraries;
 } CLWRAPPER_ARGS_BASE, *PCLWRAPPER_ARGS_BASE;
 
+#define UNITY_DEFAULT_SIZE 8
+
 typedef struct _CC_ARGS
 {
    CLWRAPPER_ARGS_BASE Base;
@@ -58,10 +119,138 @@ typedef struct _CC_ARGS
    BOOL Wall;
    BOOL Werror;
    BOOL DisableRtti;
+
+   //
+   // -jN: how many sources to compile at once.
+   //
+   DWORD Jobs;
+
+   //
+   // -funity[=N]: compile sources in batches of about N, each batch being
+   // one generated file that includes them.  Sources named by
+   // -funity-exclude= are compiled on their own.
+   //
+   DWORD UnitySize;
+   PSTRING_LIST UnityExcludes;
+
+   //
+   // -save-temps: keep the intermediate objects of a multi-source link.
+   //
+   BOOL SaveTemps;
+
+   //
+   // -MD/-MMD: write a make rule giving the headers the object depends on,
+   // to -MF or next to the object, with -MT or the object as its target.
+   // -MMD leaves out headers from the toolset's own include directories.
+   //
+   enum
+   {
+      CC_DEPS_NONE,
+      CC_DEPS_ALL,
+      CC_DEPS_USER
+   } Deps;
+   PCWSTR DepsFile;
+   PCWSTR DepsTarget;
+
+   //
+   // -frestat: if a rebuilt object or import library is the same as the
+   // one it replaces, keep the old one, so its write time doesn't change.
+   //
+   BOOL Restat;
+
+   //
+   // -g0, -g1 (or -gline-tables-only) and -g: how much debug info to
+   // compile in.  -gembed is -g with the debug info in each object (/Z7),
+   // so that parallel compiles don't queue on one .pdb.  -s and
+   // -Wl,/DEBUG:... say what link does with it, and -Wl,--pdb= where its
+   // .pdb goes; other -Wl, options are passed to link as they are.
+   //
+   enum
+   {
+      CC_DEBUG_FULL,
+      CC_DEBUG_NONE,
+      CC_DEBUG_LINES,
+      CC_DEBUG_EMBED
+   } DebugInfo;
+   enum
+   {
+      CC_LINK_DEBUG_DEFAULT,
+      CC_LINK_DEBUG_NONE,
+      CC_LINK_DEBUG_FASTLINK,
+      CC_LINK_DEBUG_FULL
+   } LinkDebug;
+   PWSTR PdbFile;
+
+   //
+   // -include: headers included ahead of each source (cl's /FI).
+   // -include-pch: a precompiled header of the first of them, built when
+   // it's missing or out of date.  -fpch-auto: when linking, precompile
+   // the #include lines all the sources start with.
+   //
+   PSTRING_LIST ForcedIncludes;
+   PCWSTR PchFile;
+   BOOL AutoPch;
+
+   //
+   // -fmodules-ts: C++20 modules.  -fmodule-file= names the .ifc of a
+   // module or header unit to use, -fprebuilt-module-path= a directory to
+   // look in for them, and -fmodule-output= where to write the one being
+   // compiled.  -fmodule-header[=user|system] compiles headers into header
+   // units.  -fdeps-file= only scans the source for the modules it
+   // provides and imports, and writes them out as P1689 JSON.
+   //
+   BOOL Modules;
+   PSTRING_LIST ModuleFiles;
+   PSTRING_LIST ModulePaths;
+   PCWSTR ModuleOutput;
+   enum
+   {
+      CC_HEADER_UNIT_NONE,
+      CC_HEADER_UNIT_PATH,
+      CC_HEADER_UNIT_USER,
+      CC_HEADER_UNIT_SYSTEM
+   } HeaderUnit;
+   PCWSTR ScanFile;
+
+   //
+   // Not set from the command line; these let the object cache ask for a
+   // preprocessor run, or for debug info that lives in the object file.
+   //
+   BOOL PreprocessOnly;
+   BOOL EmbedDebugInfo;
+   BOOL ShowIncludes;
+
+   //
+   // Set once the PCH is there: the header it ends with, and whether this
+   // is the compile that builds it (/Yc) or one that uses it (/Yu).
+   //
+   PCWSTR PchThrough;
+   BOOL PchCreate;
+
+   //
+   // Set by PchExecute() on links: where the library holding the objects
+   // of the toolset's system header PCHs is, or would be.
+   //
+   PCWSTR PchLibrary;
+
+   //
+   // Set by ModulesExecute() on the compiles it runs: the sources are in
+   // order already, this compile isn't to be looked up again, and where cl
+   // should list the files it read (/sourceDependencies).
+   //
+   BOOL ModulesOrdered;
+   BOOL ModuleCompile;
+   PCWSTR SourceDepsFile;
+
    PSTRING_LIST Macros;
    PSTRING_LIST IncludePaths;
    PSTRING_LIST LinkerOptions;
    PSTRING_LIST Inputs;
+
+   //
+   // OLD=NEW pairs from -ffile-prefix-map and friends.
+   //
+   PSTRING_LIST PrefixMaps;
 } CC_ARGS, *PCC_ARGS;
 
 typedef struct _VS_VERSION
@@ -73,17 +262,182 @@ typedef struct _VS_VERSION
    struct _VS_VERSION *Next;
 } VS_VERSION, *PVS_VERSION;
 
+typedef struct _CLWRAPPER_TOOLSET
+{
+   PVS_VERSION Compiler;
+   PVS_VERSION Sdk;
+   PWSTR Win10SdkVersion;
+   PSTRING_LIST IncludePaths;
+   PSTRING_LIST LibraryPaths;
+} CLWRAPPER_TOOLSET, *PCLWRAPPER_TOOLSET;
+
 typedef struct _ARCHITECTURE
 {
    PCWSTR ClFile;
    PCWSTR ConfigurationName;
    PCWSTR ClArchName;
    PCWSTR SdkArchName;
+
+   //
+   // What cl.exe itself runs on, and for the 64-bit ones, the directory
+   // with the DLLs it needs; the x86 ones get theirs from VS's IDE dir.
+   //
+   PCWSTR HostArchName;
+   PCWSTR HostDirectory;
 } ARCHITECTURE, *PARCHITECTURE;
 
+typedef struct _DEPS_PARSER
+{
+   HRESULT (*Passthrough)(
+      PVOID Context,
+      const BYTE *Data,
+      DWORD Length
+   );
+   PVOID Context;
+
+   //
+   // What the notes start with, if not the English "Note: including
+   // file:"; see DepsGetNotePrefix().
+   //
+   const BYTE *Prefix;
+   SIZE_T PrefixLength;
+
+   BYTE_BUFFER Line;
+   PSTRING_LIST Includes;
+} DEPS_PARSER, *PDEPS_PARSER;
+
+#define PLACEMENT_MAX_UNITS 64
+
+typedef enum _PLACEMENT_UNIT_KIND
+{
+   PLACEMENT_GROUP,
+   PLACEMENT_NODE
+} PLACEMENT_UNIT_KIND;
+
+typedef struct _PLACEMENT_UNIT
+{
+   WORD Group;
+   KAFFINITY Mask;
+   DWORD Node;
+} PLACEMENT_UNIT, *PPLACEMENT_UNIT;
+
+typedef struct _PLACEMENT_TOPOLOGY
+{
+   DWORD Count;
+   PLACEMENT_UNIT Units[PLACEMENT_MAX_UNITS];
+} PLACEMENT_TOPOLOGY, *PPLACEMENT_TOPOLOGY;
+
+typedef HRESULT (*PLACEMENT_TOPOLOGY_SOURCE)(
+   PLACEMENT_UNIT_KIND Kind,
+   PPLACEMENT_TOPOLOGY Topology
+);
+
+typedef struct _PLACEMENT_POLICY
+{
+   PLACEMENT_UNIT_KIND Kind;
+   BOOL LeastLoaded;
+} PLACEMENT_POLICY, *PPLACEMENT_POLICY;
+
+//
+// Where one child process was put.
+//
+typedef struct _PLACEMENT
+{
+   BOOL Placed;
+   DWORD Unit;
+   GROUP_AFFINITY Affinity;
+   BOOL PreferNode;
+   USHORT Node;
+} PLACEMENT, *PPLACEMENT;
+
+typedef struct _MEMORY_BUDGET
+{
+   ULONGLONG Estimate;
+   ULONGLONG Peak;
+} MEMORY_BUDGET, *PMEMORY_BUDGET;
+
+#define LAUNCH_STDOUT 1
+#define LAUNCH_STDERR 2
+
+typedef struct _LAUNCH_PARAMS
+{
+   PCWSTR CurrentDirectory;
+   PWSTR Environment;
+
+   //
+   // If set, the child's stdout and stderr are captured and handed to this
+   // callback as they arrive, instead of being inherited.  Calls are never
+   // concurrent.
+   //
+   HRESULT (*OutputCallback)(
+      PVOID Context,
+      DWORD Stream,
+      const BYTE *Data,
+      DWORD Length
+   );
+   PVOID CallbackContext;
+
+   //
+   // If set, the child is put in this job object before it runs.
+   //
+   HANDLE Job;
+
+   //
+   // If set, the child waits for Estimate bytes to be free in the memory
+   // pool shared by all cc processes, and Peak is raised to its peak commit
+   // charge.
+   //
+   PMEMORY_BUDGET Memory;
+} LAUNCH_PARAMS, *PLAUNCH_PARAMS;
+
+//
+// Output held back from a child, for LaunchBufferOutput().  If Forward is
+// set, it's also passed on to Launch as it arrives.  Runs records which
+// stream each stretch of output went to, so that LaunchReplayOutput() can
+// interleave them as they were.
+//
+typedef struct _LAUNCH_OUTPUT
+{
+   BYTE_BUFFER Stdout;
+   BYTE_BUFFER Stderr;
+   BYTE_BUFFER Runs;
+   BOOL Forward;
+   const LAUNCH_PARAMS *Launch;
+} LAUNCH_OUTPUT, *PLAUNCH_OUTPUT;
+
+//
+// For HttpServe().  Body is empty unless the request had a Content-Length.
+//
+typedef struct _HTTP_REQUEST
+{
+   PCSTR Method;
+   PCSTR Target;
+   const BYTE *Body;
+   SIZE_T BodyLength;
+} HTTP_REQUEST, *PHTTP_REQUEST;
+
+typedef struct _HTTP_RESPONSE
+{
+   INT Status;
+   PCSTR Reason;
+   BYTE_BUFFER Body;
+} HTTP_RESPONSE, *PHTTP_RESPONSE;
+
+typedef VOID (*HTTP_HANDLER)(
+   PVOID Context,
+   const HTTP_REQUEST *Request,
+   PHTTP_RESPONSE Response
+);
+
 const ARCHITECTURE *
 FindArchByConfiguration(PCWSTR ConfigurationName);
 
+const ARCHITECTURE *
+FindArchByClPath(
+   PCWSTR InstallDir,
+   PCWSTR ClPath
+);
+
 HRESULT
 BaseParseArg(
    PCLWRAPPER_ARGS_BASE Context,
@@ -108,6 +462,413 @@ CcArgsFree(
    PCC_ARGS Context
 );
 
+HRESULT
+CcParseArgs(
+   PCC_ARGS Args,
+   PWSTR *CurrentArg
+);
+
+HRESULT
+CcBuildCommandLine(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   POUTPUT_STRING CommandLine
+);
+
+HRESULT
+CcGetToolPath(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   PWSTR *Out
+);
+
+HRESULT
+CcGetObjectName(
+   PCC_ARGS Args,
+   PWSTR *Out
+);
+
+HRESULT
+CcGetExpectedOutputs(
+   PCC_ARGS Args,
+   PSTRING_LIST *Outputs
+);
+
+PCWSTR
+CcBaseName(
+   PCWSTR Path
+);
+
+BOOL
+CcIsSourceFile(
+   PCWSTR Path
+);
+
+BOOL
+CcIsModuleInterface(
+   PCWSTR Path
+);
+
+HRESULT
+CcExecute(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   const LAUNCH_PARAMS *Launch,
+   PDWORD ReturnValue
+);
+
+HRESULT
+UnityExecute(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   const LAUNCH_PARAMS *Launch,
+   PDWORD ReturnValue
+);
+
+HRESULT
+PchExecute(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   const LAUNCH_PARAMS *Launch,
+   PDWORD ReturnValue
+);
+
+HRESULT
+PchGetIncludes(
+   PCC_ARGS Args,
+   PSTRING_LIST *Includes
+);
+
+HRESULT
+PipelineExecute(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   const LAUNCH_PARAMS *Launch,
+   PDWORD ReturnValue
+);
+
+HRESULT
+ModulesExecute(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   const LAUNCH_PARAMS *Launch,
+   PDWORD ReturnValue
+);
+
+HRESULT
+JobsExecute(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   const LAUNCH_PARAMS *Launch,
+   PDWORD ReturnValue
+);
+
+typedef struct _JOBSERVER *PJOBSERVER;
+
+HRESULT
+JobserverOpen(
+   PJOBSERVER *Out
+);
+
+VOID
+JobserverClose(
+   PJOBSERVER Jobserver
+);
+
+HRESULT
+JobserverAcquire(
+   PJOBSERVER Jobserver,
+   HANDLE Wake
+);
+
+VOID
+JobserverRelease(
+   PJOBSERVER Jobserver
+);
+
+HRESULT
+UpToDateExecute(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   const LAUNCH_PARAMS *Launch,
+   PDWORD ReturnValue
+);
+
+HRESULT
+RestatExecute(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   const LAUNCH_PARAMS *Launch,
+   PDWORD ReturnValue
+);
+
+HRESULT
+DepsExecute(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   const LAUNCH_PARAMS *Launch,
+   PDWORD ReturnValue
+);
+
+HRESULT
+MemoryExecute(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   const LAUNCH_PARAMS *Launch,
+   PDWORD ReturnValue
+);
+
+HRESULT
+MemoryOpen(
+   PULONGLONG PoolSize
+);
+
+VOID
+MemoryReserve(
+   PMEMORY_BUDGET Budget,
+   PLONG Slot
+);
+
+VOID
+MemoryRelease(
+   LONG Slot
+);
+
+VOID
+MemoryRecordPeak(
+   PMEMORY_BUDGET Budget,
+   HANDLE Process
+);
+
+HRESULT
+PlacementGetSystemTopology(
+   PLACEMENT_UNIT_KIND Kind,
+   PPLACEMENT_TOPOLOGY Topology
+);
+
+VOID
+PlacementSetTopologySource(
+   PLACEMENT_TOPOLOGY_SOURCE Source
+);
+
+DWORD
+PlacementChoose(
+   const PLACEMENT_TOPOLOGY *Topology,
+   BOOL LeastLoaded,
+   const volatile LONG *Running,
+   ULONG Ticket
+);
+
+HRESULT
+PlacementAcquire(
+   PPLACEMENT Placement
+);
+
+VOID
+PlacementRelease(
+   PPLACEMENT Placement
+);
+
+HRESULT
+PlacementBuildAttributes(
+   PPLACEMENT Placement,
+   LPPROC_THREAD_ATTRIBUTE_LIST *List
+);
+
+VOID
+PlacementFreeAttributes(
+   LPPROC_THREAD_ATTRIBUTE_LIST List
+);
+
+HRESULT
+CacheExecute(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   const LAUNCH_PARAMS *Launch,
+   PDWORD ReturnValue
+);
+
+HRESULT
+CacheUploadMain(
+   PCWSTR Key
+);
+
+HRESULT
+RemoteRequest(
+   PCWSTR Base,
+   PCWSTR Verb,
+   PCWSTR Key,
+   DWORD Timeout,
+   const VOID *Body,
+   DWORD BodyLength,
+   PBYTE_BUFFER Response
+);
+
+HRESULT
+RemoteRequestEx(
+   PCWSTR Base,
+   PCWSTR Verb,
+   PCWSTR Key,
+   DWORD ConnectTimeout,
+   DWORD Timeout,
+   const VOID *Body,
+   DWORD BodyLength,
+   PBYTE_BUFFER Response
+);
+
+HRESULT
+DistExecute(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   const LAUNCH_PARAMS *Launch,
+   PDWORD ReturnValue
+);
+
+HRESULT
+DistServe(
+   PCWSTR Address,
+   PCWSTR Port,
+   PCLWRAPPER_TOOLSET Toolset,
+   DWORD MaxRunning
+);
+
+HRESULT
+HttpServe(
+   PCWSTR Address,
+   PCWSTR Port,
+   HTTP_HANDLER Handler,
+   PVOID Context
+);
+
+HRESULT
+RemoteCompress(
+   const BYTE *Data,
+   SIZE_T Length,
+   PBYTE_BUFFER Output
+);
+
+HRESULT
+RemoteDecompress(
+   const BYTE *Data,
+   SIZE_T Length,
+   PBYTE_BUFFER Output
+);
+
+HRESULT
+CacheHashCompileContext(
+   PHASH_CONTEXT Hash,
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset
+);
+
+HRESULT
+ManifestComputeKey(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   PCWSTR Cwd,
+   BYTE Digest[HASH_LENGTH]
+);
+
+HRESULT
+ManifestGetFileDigest(
+   PCWSTR Path,
+   PFILE_DIGEST Digest
+);
+
+HRESULT
+ManifestLookup(
+   PCWSTR Path,
+   PCWSTR Cwd,
+   BYTE ObjectDigest[HASH_LENGTH]
+);
+
+HRESULT
+ManifestGetIncludes(
+   PCWSTR Path,
+   PSTRING_LIST *Includes
+);
+
+HRESULT
+ManifestStore(
+   PCWSTR Path,
+   PCWSTR Cwd,
+   const BYTE ObjectDigest[HASH_LENGTH],
+   PSTRING_LIST Includes,
+   ULONGLONG Started
+);
+
+HRESULT
+DepsParse(
+   PDEPS_PARSER Parser,
+   const BYTE *Data,
+   DWORD Length
+);
+
+HRESULT
+DepsFinish(
+   PDEPS_PARSER Parser
+);
+
+VOID
+DepsFree(
+   PDEPS_PARSER Parser
+);
+
+HRESULT
+DepsGetNotePrefix(
+   PCLWRAPPER_TOOLSET Toolset,
+   const LAUNCH_PARAMS *Launch,
+   PBYTE_BUFFER Prefix
+);
+
+HRESULT
+DepsCompile(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   const LAUNCH_PARAMS *Launch,
+   PDWORD ReturnValue,
+   PSTRING_LIST *Includes
+);
+
+HRESULT
+DepsWriteRule(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   const LAUNCH_PARAMS *Launch,
+   PSTRING_LIST Includes
+);
+
+HRESULT
+DepsWriteLinkRule(
+   PCC_ARGS Args,
+   const LAUNCH_PARAMS *Launch,
+   PSTRING_LIST Rules
+);
+
+HRESULT
+ServerMain(VOID);
+
+HRESULT
+ServerClientRun(
+   PWSTR *Argv,
+   PDWORD ExitCode
+);
+
+HRESULT
+PipeWriteFrame(
+   HANDLE Pipe,
+   DWORD Type,
+   const VOID *Data,
+   DWORD Length
+);
+
+HRESULT
+PipeReadFrame(
+   HANDLE Pipe,
+   PDWORD Type,
+   PBYTE_BUFFER Payload
+);
+
 HRESULT
 StringListAlloc(
    DWORD NChars,
@@ -122,6 +883,12 @@ StringListAllocString(
    PSTRING_LIST *Output
 );
 
+HRESULT
+StringListAppendCopy(
+   PSTRING_LIST *Head,
+   PSTRING_LIST Source
+);
+
 VOID
 StringListReverse(
    PSTRING_LIST *Head
@@ -150,6 +917,170 @@ FreeString(
    POUTPUT_STRING Str
 );
 
+HRESULT
+BufferReserve(
+   PBYTE_BUFFER Buffer,
+   SIZE_T Length
+);
+
+HRESULT
+BufferAppend(
+   PBYTE_BUFFER Buffer,
+   const VOID *Data,
+   SIZE_T Length
+);
+
+HRESULT
+BufferAppendDword(
+   PBYTE_BUFFER Buffer,
+   DWORD Value
+);
+
+HRESULT
+BufferAppendQword(
+   PBYTE_BUFFER Buffer,
+   ULONGLONG Value
+);
+
+HRESULT
+BufferAppendString(
+   PBYTE_BUFFER Buffer,
+   PCWSTR String
+);
+
+HRESULT
+BufferAppendStringList(
+   PBYTE_BUFFER Buffer,
+   PSTRING_LIST List
+);
+
+VOID
+FreeBuffer(
+   PBYTE_BUFFER Buffer
+);
+
+HRESULT
+ReaderRead(
+   PBUFFER_READER Reader,
+   PVOID Output,
+   SIZE_T Length
+);
+
+HRESULT
+ReaderReadDword(
+   PBUFFER_READER Reader,
+   PDWORD Value
+);
+
+HRESULT
+ReaderReadQword(
+   PBUFFER_READER Reader,
+   PULONGLONG Value
+);
+
+HRESULT
+ReaderReadString(
+   PBUFFER_READER Reader,
+   PWSTR *Output
+);
+
+HRESULT
+ReaderReadStringList(
+   PBUFFER_READER Reader,
+   PSTRING_LIST *Output
+);
+
+HRESULT
+ReadFileContents(
+   PCWSTR Path,
+   PBYTE_BUFFER Output
+);
+
+HRESULT
+WriteAll(
+   HANDLE Handle,
+   const VOID *Data,
+   DWORD Length
+);
+
+HRESULT
+WriteFileAtomic(
+   PCWSTR Path,
+   const VOID *Data,
+   SIZE_T Length
+);
+
+HRESULT
+MapFile(
+   PCWSTR Path,
+   BOOL Writable,
+   PMAPPED_FILE Output
+);
+
+VOID
+UnmapFile(
+   PMAPPED_FILE File
+);
+
+HRESULT
+HashInit(
+   PHASH_CONTEXT Context
+);
+
+HRESULT
+HashData(
+   PHASH_CONTEXT Context,
+   const VOID *Data,
+   SIZE_T Length
+);
+
+HRESULT
+HashDword(
+   PHASH_CONTEXT Context,
+   DWORD Value
+);
+
+HRESULT
+HashString(
+   PHASH_CONTEXT Context,
+   PCWSTR String
+);
+
+HRESULT
+HashStringList(
+   PHASH_CONTEXT Context,
+   PSTRING_LIST List
+);
+
+HRESULT
+HashFileIdentity(
+   PHASH_CONTEXT Context,
+   PCWSTR Path
+);
+
+HRESULT
+HashFileContents(
+   PHASH_CONTEXT Context,
+   PCWSTR Path
+);
+
+HRESULT
+HashFinish(
+   PHASH_CONTEXT Context,
+   BYTE Digest[HASH_LENGTH]
+);
+
+VOID
+HashFree(
+   PHASH_CONTEXT Context
+);
+
+VOID
+HashToString(
+   const BYTE Digest[HASH_LENGTH],
+   WCHAR String[HASH_STRING_LENGTH]
+);
+
 HRESULT
 GetInstalledVsVersions(
    PVS_VERSION *Out
@@ -173,6 +1104,79 @@ FreeVsVersions(
    PVS_VERSION Version
 );
 
+HRESULT
+ToolsetAcquire(
+   PCLWRAPPER_ARGS_BASE Args,
+   PCLWRAPPER_TOOLSET Toolset
+);
+
+VOID
+ToolsetFree(
+   PCLWRAPPER_TOOLSET Toolset
+);
+
+HRESULT
+ToolsetGetToolPath(
+   PCLWRAPPER_TOOLSET Toolset,
+   PCWSTR ToolName,
+   PWSTR *Out
+);
+
+HRESULT
+ToolsetGetIdentity(
+   PCLWRAPPER_TOOLSET Toolset,
+   PWSTR *Out
+);
+
+BOOL
+ToolsetIsSystemHeader(
+   PCLWRAPPER_TOOLSET Toolset,
+   PCWSTR Path
+);
+
+HRESULT
+ToolsetGetDllDirectory(
+   PCLWRAPPER_TOOLSET Toolset,
+   PWSTR *Out
+);
+
+HRESULT
+ToolsetExport(
+   PCLWRAPPER_TOOLSET Toolset,
+   PCWSTR Path
+);
+
+HRESULT
+ToolsetImport(
+   PCWSTR Path,
+   PCLWRAPPER_TOOLSET Toolset
+);
+
+HRESULT
+WriteVsVersions(
+   PVS_VERSION Versions,
+   PBYTE_BUFFER Buffer
+);
+
+HRESULT
+ReadVsVersions(
+   PBUFFER_READER Reader,
+   PVS_VERSION *Out
+);
+
+HRESULT
+GetCachedVsVersionsAndSdks(
+   BOOL UseCache,
+   PVS_VERSION *Compilers,
+   PVS_VERSION *Sdks
+);
+
+VOID
+GetToolsetCacheCounters(
+   PDWORD Hits,
+   PDWORD Misses
+);
+
 HRESULT
 HeapPrintf(
    PWSTR *Output,
@@ -195,17 +1199,110 @@ EnumKey(
    HRESULT (*Fn)(PVOID Context, HKEY Key, PCWSTR ChildKey)
 );
 
+VOID
+SetThreadEnvironment(
+   PCWSTR Environment
+);
+
+PCWSTR
+GetThreadEnvironment(VOID);
+
+HRESULT
+GetEnvironmentString(
+   PCWSTR Name,
+   PWSTR *Out
+);
+
+HRESULT
+GetDataDirectory(
+   PCWSTR Child,
+   PWSTR *Out
+);
+
 HRESULT
 AddToPath(
    PCWSTR Path
 );
 
+ULONGLONG
+FileTimeToQword(
+   const FILETIME *Time
+);
+
+BOOL
+IsAbsolutePath(
+   PCWSTR Path
+);
+
+BOOL
+IsDirectoryName(
+   PCWSTR Path
+);
+
+HRESULT
+TouchFile(
+   PCWSTR Path
+);
+
+HRESULT
+MakeAbsolute(
+   PCWSTR Cwd,
+   PCWSTR Path,
+   PWSTR *Out
+);
+
+HRESULT
+GetLaunchDirectory(
+   const LAUNCH_PARAMS *Launch,
+   PWSTR *Out
+);
+
+HRESULT
+BuildEnvironmentBlock(
+   PCWSTR Directory,
+   PWSTR *Output
+);
+
 HRESULT
 LaunchProcess(
    PCWSTR CommandLine,
    PDWORD ExitCode
 );
 
+HRESULT
+LaunchProcessEx(
+   PCWSTR CommandLine,
+   const LAUNCH_PARAMS *Params,
+   PDWORD ExitCode
+);
+
+HRESULT
+LaunchWriteOutput(
+   const LAUNCH_PARAMS *Launch,
+   DWORD Stream,
+   const VOID *Data,
+   SIZE_T Length
+);
+
+HRESULT
+LaunchBufferOutput(
+   PVOID Context,
+   DWORD Stream,
+   const BYTE *Data,
+   DWORD Length
+);
+
+HRESULT
+LaunchReplayOutput(
+   const LAUNCH_PARAMS *Launch,
+   PLAUNCH_OUTPUT Output
+);
+
+VOID
+LaunchFreeOutput(
+   PLAUNCH_OUTPUT Output
+);
+
 #if defined(__cplusplus)
 }
 #endif
@@ -0,0 +1,951 @@
+/*
+ * Copyright (c) 2017 Andrew Sveikauskas
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ */
+
+#include "clwrapper.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+//
+// Picks the /showIncludes notes out of cl's output.  cl prints one line
+// per file it opens, indented by include depth:
+//
+//    Note: including file: C:\...\stdio.h
+//    Note: including file:  C:\...\corecrt.h
+//
+// The prefix is localized along with the rest of cl's messages.  Unless
+// told otherwise the parser looks for the English one; DepsGetNotePrefix()
+// finds out what a given cl actually prints.
+//
+
+#define DEPS_NOTE_PREFIX  "Note: including file:"
+#define DEPS_PROBE_HEADER "clwrapper-probe.h"
+
+static const BYTE *
+GetPrefix(
+   PDEPS_PARSER Parser,
+   PSIZE_T Length
+)
+{
+   if (Parser->Prefix)
+   {
+      *Length = Parser->PrefixLength;
+      return Parser->Prefix;
+   }
+
+   *Length = sizeof(DEPS_NOTE_PREFIX) - 1;
+   return (const BYTE *)DEPS_NOTE_PREFIX;
+}
+
+static BOOL
+IsNote(
+   PDEPS_PARSER Parser,
+   const BYTE *Line,
+   SIZE_T Length
+)
+{
+   SIZE_T PrefixLength = 0;
+   const BYTE *Prefix = GetPrefix(Parser, &PrefixLength);
+
+   return Length >= PrefixLength && !memcmp(Line, Prefix, PrefixLength);
+}
+
+static HRESULT
+AddInclude(
+   PDEPS_PARSER Parser,
+   const BYTE *Line,
+   SIZE_T Length
+)
+{
+   HRESULT hr = S_OK;
+   SIZE_T PrefixLength = 0;
+   const BYTE *Start = Line;
+   const BYTE *End = Line + Length;
+   INT Chars = 0;
+   PSTRING_LIST Node = NULL;
+
+   GetPrefix(Parser, &PrefixLength);
+   Start += PrefixLength;
+
+   while (Start < End && *Start == ' ')
+      ++Start;
+   while (End > Start &&
+          (End[-1] == '\n' || End[-1] == '\r' || End[-1] == ' '))
+   {
+      --End;
+   }
+
+   if (Start == End)
+      return S_OK;
+
+   Chars = MultiByteToWideChar(
+      CP_ACP,
+      0,
+      (LPCSTR)Start,
+      (INT)(End - Start),
+      NULL,
+      0
+   );
+   if (!Chars)
+      hr = HRESULT_FROM_WIN32(GetLastError());
+
+   if (SUCCEEDED(hr))
+      hr = StringListAlloc(Chars, Parser->Includes, &Node);
+
+   if (SUCCEEDED(hr))
+   {
+      MultiByteToWideChar(
+         CP_ACP,
+         0,
+         (LPCSTR)Start,
+         (INT)(End - Start),
+         Node->String,
+         Chars
+      );
+      Node->String[Chars] = 0;
+      Parser->Includes = Node;
+   }
+
+   return hr;
+}
+
+static HRESULT
+Passthrough(
+   PDEPS_PARSER Parser,
+   const BYTE *Data,
+   SIZE_T Length
+)
+{
+   if (!Parser->Passthrough || !Length)
+      return S_OK;
+   return Parser->Passthrough(Parser->Context, Data, (DWORD)Length);
+}
+
+static HRESULT
+ProcessLine(
+   PDEPS_PARSER Parser,
+   const BYTE *Line,
+   SIZE_T Length
+)
+{
+   if (IsNote(Parser, Line, Length))
+      return AddInclude(Parser, Line, Length);
+   return Passthrough(Parser, Line, Length);
+}
+
+//
+// Feeds a chunk of output to the parser.  Everything that isn't an include
+// note goes to the passthrough callback, if there is one.  Runs of ordinary
+// lines are passed along together rather than a line at a time.
+//
+HRESULT
+DepsParse(
+   PDEPS_PARSER Parser,
+   const BYTE *Data,
+   DWORD Length
+)
+{
+   HRESULT hr = S_OK;
+   const BYTE *End = Data + Length;
+   const BYTE *Pending = Data;
+   const BYTE *p = Data;
+
+   while (SUCCEEDED(hr) && p < End)
+   {
+      const BYTE *Newline = memchr(p, '\n', End - p);
+      const BYTE *LineEnd = Newline ? Newline + 1 : End;
+
+      if (Parser->Line.Length || !Newline)
+      {
+         // Either this finishes a line started by an earlier chunk, or it
+         // starts one that finishes in a later chunk.
+         //
+         hr = Passthrough(Parser, Pending, p - Pending);
+         if (SUCCEEDED(hr))
+            hr = BufferAppend(&Parser->Line, p, LineEnd - p);
+         if (SUCCEEDED(hr) && Newline)
+         {
+            hr = ProcessLine(
+               Parser,
+               Parser->Line.Buffer,
+               Parser->Line.Length
+            );
+            Parser->Line.Length = 0;
+         }
+         Pending = LineEnd;
+      }
+      else if (IsNote(Parser, p, LineEnd - p))
+      {
+         hr = Passthrough(Parser, Pending, p - Pending);
+         if (SUCCEEDED(hr))
+            hr = AddInclude(Parser, p, LineEnd - p);
+         Pending = LineEnd;
+      }
+
+      p = LineEnd;
+   }
+
+   if (SUCCEEDED(hr))
+      hr = Passthrough(Parser, Pending, End - Pending);
+
+   return hr;
+}
+
+static ULONG
+HashPath(
+   PCWSTR Path
+)
+{
+   ULONG Hash = 2166136261;
+
+   for (; *Path; ++Path)
+   {
+      Hash ^= towlower(*Path);
+      Hash *= 16777619;
+   }
+
+   return Hash;
+}
+
+//
+// Deals with any unterminated last line, and leaves Includes in the order
+// files were first opened, without duplicates.  A big translation unit can
+// have tens of thousands of notes, mostly repeats, so duplicates are found
+// with a hash table rather than by looking back through the list.
+//
+HRESULT
+DepsFinish(
+   PDEPS_PARSER Parser
+)
+{
+   HRESULT hr = S_OK;
+   PSTRING_LIST *Node;
+   PSTRING_LIST *Table = NULL;
+   PSTRING_LIST List;
+   SIZE_T Count = 0;
+   SIZE_T Size = 16;
+
+   if (Parser->Line.Length)
+   {
+      hr = ProcessLine(Parser, Parser->Line.Buffer, Parser->Line.Length);
+      Parser->Line.Length = 0;
+   }
+
+   StringListReverse(&Parser->Includes);
+
+   for (List = Parser->Includes; List; List = List->Next)
+      ++Count;
+   while (Size < Count * 2)
+      Size *= 2;
+
+   if (SUCCEEDED(hr))
+   {
+      Table = calloc(Size, sizeof(*Table));
+      if (!Table)
+         hr = E_OUTOFMEMORY;
+   }
+
+   for (Node = &Parser->Includes; SUCCEEDED(hr) && *Node; )
+   {
+      SIZE_T Slot = HashPath((*Node)->String) & (Size - 1);
+
+      while (Table[Slot] && _wcsicmp(Table[Slot]->String, (*Node)->String))
+         Slot = (Slot + 1) & (Size - 1);
+
+      if (Table[Slot])
+      {
+         PSTRING_LIST Next = (*Node)->Next;
+
+         (*Node)->Next = NULL;
+         FreeStringList(*Node);
+         *Node = Next;
+      }
+      else
+      {
+         Table[Slot] = *Node;
+         Node = &(*Node)->Next;
+      }
+   }
+
+   free(Table);
+   return hr;
+}
+
+VOID
+DepsFree(
+   PDEPS_PARSER Parser
+)
+{
+   FreeBuffer(&Parser->Line);
+   FreeStringList(Parser->Includes);
+   Parser->Includes = NULL;
+}
+
+//
+// Where what a toolset's cl prints before each include is kept.  cl picks
+// its language from VSLANG, or failing that the user's UI language.
+//
+static HRESULT
+GetPrefixPath(
+   PCLWRAPPER_TOOLSET Toolset,
+   PWSTR *Out
+)
+{
+   HRESULT hr = S_OK;
+   HASH_CONTEXT Hash = {0};
+   PWSTR Identity = NULL;
+   PWSTR Language = NULL;
+   PWSTR Directory = NULL;
+   BYTE Digest[HASH_LENGTH];
+   WCHAR Key[HASH_STRING_LENGTH];
+
+   hr = HashInit(&Hash);
+   if (SUCCEEDED(hr))
+      hr = ToolsetGetIdentity(Toolset, &Identity);
+   if (SUCCEEDED(hr))
+      hr = HashString(&Hash, Identity);
+   if (SUCCEEDED(hr))
+      hr = GetEnvironmentString(L"VSLANG", &Language);
+   if (SUCCEEDED(hr))
+      hr = HashString(&Hash, Language);
+   if (SUCCEEDED(hr))
+      hr = HashDword(&Hash, GetUserDefaultUILanguage());
+   if (SUCCEEDED(hr))
+      hr = HashFinish(&Hash, Digest);
+
+   if (SUCCEEDED(hr))
+      hr = GetDataDirectory(L"deps", &Directory);
+   if (SUCCEEDED(hr))
+   {
+      HashToString(Digest, Key);
+      hr = HeapPrintf(Out, L"%s\\%s", Directory, Key);
+   }
+
+   free(Directory);
+   free(Language);
+   free(Identity);
+   HashFree(&Hash);
+   return hr;
+}
+
+static HRESULT
+CollectOutput(
+   PVOID Context,
+   DWORD Stream,
+   const BYTE *Data,
+   DWORD Length
+)
+{
+   return BufferAppend(Context, Data, Length);
+}
+
+// Where the path starts in a note about Name: at a drive letter or UNC
+// name if there is one, or else at the start of the word Name is in.
+//
+static const BYTE *
+FindPathStart(
+   const BYTE *Line,
+   const BYTE *Name
+)
+{
+   const BYTE *p;
+
+   for (p = Line; p + 2 < Name; ++p)
+   {
+      BYTE Letter = p[0] | 0x20;
+
+      if (Letter >= 'a' && Letter <= 'z' &&
+          p[1] == ':' &&
+          (p[2] == '\\' || p[2] == '/'))
+      {
+         return p;
+      }
+      if (p[0] == '\\' && p[1] == '\\')
+         return p;
+   }
+
+   for (p = Name; p > Line && p[-1] != ' '; --p)
+      ;
+
+   return p;
+}
+
+// Picks the prefix out of the note about the probe's header.
+//
+static HRESULT
+FindPrefix(
+   const BYTE_BUFFER *Output,
+   PBYTE_BUFFER Prefix
+)
+{
+   const SIZE_T NameLength = sizeof(DEPS_PROBE_HEADER) - 1;
+   const BYTE *Line = Output->Buffer;
+   const BYTE *End = Line + Output->Length;
+
+   while (Line < End)
+   {
+      const BYTE *Newline = memchr(Line, '\n', End - Line);
+      const BYTE *LineEnd = Newline ? Newline : End;
+      const BYTE *p;
+
+      for (p = Line; p + NameLength <= LineEnd; ++p)
+      {
+         if (!memcmp(p, DEPS_PROBE_HEADER, NameLength))
+         {
+            const BYTE *PathStart = FindPathStart(Line, p);
+
+            while (PathStart > Line && PathStart[-1] == ' ')
+               --PathStart;
+            if (PathStart > Line)
+               return BufferAppend(Prefix, Line, PathStart - Line);
+            break;
+         }
+      }
+
+      Line = LineEnd + (Newline ? 1 : 0);
+   }
+
+   return HRESULT_FROM_WIN32(ERROR_NOT_FOUND);
+}
+
+// Has cl tell us about including a header we know the name of.
+//
+static HRESULT
+ProbePrefix(
+   PCLWRAPPER_TOOLSET Toolset,
+   const LAUNCH_PARAMS *Launch,
+   PBYTE_BUFFER Prefix
+)
+{
+   HRESULT hr = S_OK;
+   static const char Source[] = "#include \"" DEPS_PROBE_HEADER "\"\n";
+   static volatile LONG Counter;
+   WCHAR Temp[MAX_PATH];
+   PWSTR Directory = NULL;
+   PWSTR SourcePath = NULL;
+   PWSTR HeaderPath = NULL;
+   PWSTR CommandLine = NULL;
+   LAUNCH_PARAMS Probe = {0};
+   BYTE_BUFFER Output = {0};
+   DWORD ExitCode = 0;
+
+   if (!GetTempPath(ARRAYSIZE(Temp), Temp))
+      hr = HRESULT_FROM_WIN32(GetLastError());
+
+   if (SUCCEEDED(hr))
+   {
+      hr = HeapPrintf(
+         &Directory,
+         L"%sclwrapper-deps-%u-%u",
+         Temp,
+         GetCurrentProcessId(),
+         (DWORD)InterlockedIncrement(&Counter)
+      );
+   }
+   if (SUCCEEDED(hr) && !CreateDirectory(Directory, NULL))
+   {
+      hr = HRESULT_FROM_WIN32(GetLastError());
+      free(Directory);
+      Directory = NULL;
+   }
+
+   if (SUCCEEDED(hr))
+      hr = HeapPrintf(&SourcePath, L"%s\\clwrapper-probe.c", Directory);
+   if (SUCCEEDED(hr))
+      hr = HeapPrintf(&HeaderPath, L"%s\\" TEXT(DEPS_PROBE_HEADER), Directory);
+   if (SUCCEEDED(hr))
+      hr = WriteFileAtomic(SourcePath, Source, sizeof(Source) - 1);
+   if (SUCCEEDED(hr))
+      hr = WriteFileAtomic(HeaderPath, "\n", 1);
+
+   if (SUCCEEDED(hr))
+   {
+      hr = HeapPrintf(
+         &CommandLine,
+         L"\"%s\" /nologo /showIncludes /Zs clwrapper-probe.c",
+         Toolset->Compiler->ClPaths->String
+      );
+   }
+
+   if (SUCCEEDED(hr))
+   {
+      if (Launch)
+         Probe.Environment = Launch->Environment;
+      Probe.CurrentDirectory = Directory;
+      Probe.OutputCallback = CollectOutput;
+      Probe.CallbackContext = &Output;
+
+      hr = LaunchProcessEx(CommandLine, &Probe, &ExitCode);
+   }
+
+   if (SUCCEEDED(hr))
+      hr = FindPrefix(&Output, Prefix);
+
+   if (SourcePath)
+      DeleteFile(SourcePath);
+   if (HeaderPath)
+      DeleteFile(HeaderPath);
+   if (Directory)
+      RemoveDirectory(Directory);
+
+   FreeBuffer(&Output);
+   free(CommandLine);
+   free(HeaderPath);
+   free(SourcePath);
+   free(Directory);
+   return hr;
+}
+
+//
+// Finds what this toolset's cl puts before each /showIncludes note, in
+// whatever language it speaks.  It's asked once; the answer is kept in
+// the data directory.
+//
+HRESULT
+DepsGetNotePrefix(
+   PCLWRAPPER_TOOLSET Toolset,
+   const LAUNCH_PARAMS *Launch,
+   PBYTE_BUFFER Prefix
+)
+{
+   HRESULT hr = S_OK;
+   PWSTR Path = NULL;
+
+   Prefix->Length = 0;
+
+   hr = GetPrefixPath(Toolset, &Path);
+
+   if (SUCCEEDED(hr) &&
+       (FAILED(ReadFileContents(Path, Prefix)) || !Prefix->Length))
+   {
+      Prefix->Length = 0;
+      hr = ProbePrefix(Toolset, Launch, Prefix);
+
+      // Failing to keep it only means asking again next time.
+      //
+      if (SUCCEEDED(hr))
+         WriteFileAtomic(Path, Prefix->Buffer, Prefix->Length);
+   }
+
+   free(Path);
+   return hr;
+}
+
+typedef struct _DEPS_CONTEXT
+{
+   const LAUNCH_PARAMS *Launch;
+   DEPS_PARSER Parser;
+} DEPS_CONTEXT, *PDEPS_CONTEXT;
+
+static HRESULT
+ForwardStdout(
+   PVOID Context,
+   const BYTE *Data,
+   DWORD Length
+)
+{
+   PDEPS_CONTEXT Deps = Context;
+
+   return LaunchWriteOutput(Deps->Launch, LAUNCH_STDOUT, Data, Length);
+}
+
+// cl prints its notes on stdout; everything else goes where it would have
+// without them.
+//
+static HRESULT
+ParseOutput(
+   PVOID Context,
+   DWORD Stream,
+   const BYTE *Data,
+   DWORD Length
+)
+{
+   PDEPS_CONTEXT Deps = Context;
+
+   if (Stream == LAUNCH_STDERR)
+      return LaunchWriteOutput(Deps->Launch, Stream, Data, Length);
+
+   return DepsParse(&Deps->Parser, Data, Length);
+}
+
+// A single source to an object.  Several sources are split up by
+// JobsExecute() before they get here.
+//
+static BOOL
+IsDepsCompile(
+   PCC_ARGS Args
+)
+{
+   return Args->Deps != CC_DEPS_NONE &&
+          Args->OutputType == CC_OBJECT_FILE &&
+          !Args->PreprocessOnly &&
+          !Args->ShowIncludes &&
+          Args->Inputs &&
+          !Args->Inputs->Next &&
+          CcIsSourceFile(Args->Inputs->String);
+}
+
+// -MF, or the object with its extension changed to .d.
+//
+static HRESULT
+GetDepsPath(
+   PCC_ARGS Args,
+   const LAUNCH_PARAMS *Launch,
+   PCWSTR Object,
+   PWSTR *Out
+)
+{
+   HRESULT hr = S_OK;
+   PWSTR Name = NULL;
+   PCWSTR Dot = wcsrchr(CcBaseName(Object), L'.');
+
+   if (Args->DepsFile)
+      hr = HeapPrintf(&Name, L"%s", Args->DepsFile);
+   else if (Dot)
+      hr = HeapPrintf(&Name, L"%.*s.d", (INT)(Dot - Object), Object);
+   else
+      hr = HeapPrintf(&Name, L"%s.d", Object);
+
+   if (SUCCEEDED(hr) && Launch && Launch->CurrentDirectory)
+   {
+      hr = MakeAbsolute(Launch->CurrentDirectory, Name, Out);
+      free(Name);
+   }
+   else
+   {
+      *Out = Name;
+   }
+
+   return hr;
+}
+
+// Appends Path in the ANSI code page, which is what cl's notes and make
+// both use.  Unless it's an -MT target, which goes in as given, spaces,
+// '#' and '$' are escaped the way make wants, and backslashes become
+// forward slashes.
+//
+static HRESULT
+AppendMakePath(
+   PBYTE_BUFFER Rule,
+   PCWSTR Path,
+   BOOL Escape
+)
+{
+   HRESULT hr = S_OK;
+   PWSTR Escaped = malloc((wcslen(Path) * 2 + 1) * sizeof(WCHAR));
+   PWSTR p = Escaped;
+   INT Bytes = 0;
+
+   if (!Escaped)
+      return E_OUTOFMEMORY;
+
+   for (; *Path; ++Path)
+   {
+      if (!Escape)
+      {
+         *p++ = *Path;
+         continue;
+      }
+
+      if (*Path == L' ' || *Path == L'#')
+         *p++ = L'\\';
+      else if (*Path == L'$')
+         *p++ = L'$';
+      *p++ = *Path == L'\\' ? L'/' : *Path;
+   }
+
+   if (p != Escaped)
+   {
+      Bytes = WideCharToMultiByte(
+         CP_ACP,
+         0,
+         Escaped,
+         (INT)(p - Escaped),
+         NULL,
+         0,
+         NULL,
+         NULL
+      );
+      if (!Bytes)
+         hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   if (SUCCEEDED(hr))
+      hr = BufferReserve(Rule, Bytes);
+
+   if (SUCCEEDED(hr) && Bytes)
+   {
+      WideCharToMultiByte(
+         CP_ACP,
+         0,
+         Escaped,
+         (INT)(p - Escaped),
+         (LPSTR)Rule->Buffer + Rule->Length,
+         Bytes,
+         NULL,
+         NULL
+      );
+      Rule->Length += Bytes;
+   }
+
+   free(Escaped);
+   return hr;
+}
+
+//
+// target: source \
+//  header \
+//  header
+//
+static HRESULT
+BuildRule(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   PCWSTR Object,
+   PSTRING_LIST Includes,
+   PBYTE_BUFFER Rule
+)
+{
+   HRESULT hr = S_OK;
+   PSTRING_LIST List;
+
+   if (Args->DepsTarget)
+      hr = AppendMakePath(Rule, Args->DepsTarget, FALSE);
+   else
+      hr = AppendMakePath(Rule, Object, TRUE);
+
+   if (SUCCEEDED(hr))
+      hr = BufferAppend(Rule, ": ", 2);
+   if (SUCCEEDED(hr))
+      hr = AppendMakePath(Rule, Args->Inputs->String, TRUE);
+
+   for (List = Includes; SUCCEEDED(hr) && List; List = List->Next)
+   {
+      // -MMD leaves out the toolset's own headers.
+      //
+      if (Args->Deps == CC_DEPS_USER &&
+          ToolsetIsSystemHeader(Toolset, List->String))
+      {
+         continue;
+      }
+
+      hr = BufferAppend(Rule, " \\\n ", 4);
+      if (SUCCEEDED(hr))
+         hr = AppendMakePath(Rule, List->String, TRUE);
+   }
+
+   if (SUCCEEDED(hr))
+      hr = BufferAppend(Rule, "\n", 1);
+
+   return hr;
+}
+
+//
+// Compiles with /showIncludes, taking the notes out of cl's output as it
+// comes.  On return, *Includes lists the files the source included, in
+// the order they were first opened.
+//
+HRESULT
+DepsCompile(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   const LAUNCH_PARAMS *Launch,
+   PDWORD ReturnValue,
+   PSTRING_LIST *Includes
+)
+{
+   HRESULT hr = S_OK;
+   DEPS_CONTEXT Context = {0};
+   LAUNCH_PARAMS Compile = {0};
+   BYTE_BUFFER NotePrefix = {0};
+   PSTRING_LIST Precompiled = NULL;
+
+   // If cl can't be asked what its notes look like, assume English.
+   //
+   if (SUCCEEDED(DepsGetNotePrefix(Toolset, Launch, &NotePrefix)))
+   {
+      Context.Parser.Prefix = NotePrefix.Buffer;
+      Context.Parser.PrefixLength = NotePrefix.Length;
+   }
+
+   Context.Launch = Launch;
+   Context.Parser.Passthrough = ForwardStdout;
+   Context.Parser.Context = &Context;
+
+   if (Launch)
+      Compile = *Launch;
+   Compile.OutputCallback = ParseOutput;
+   Compile.CallbackContext = &Context;
+
+   Args->ShowIncludes = TRUE;
+   hr = CcExecute(Args, Toolset, &Compile, ReturnValue);
+   Args->ShowIncludes = FALSE;
+
+   if (SUCCEEDED(hr))
+      hr = DepsFinish(&Context.Parser);
+
+   // A compile using a PCH doesn't mention the headers in it; they were
+   // recorded when it was built, and came first.
+   //
+   if (SUCCEEDED(hr) &&
+       Args->PchThrough &&
+       !Args->PchCreate &&
+       SUCCEEDED(PchGetIncludes(Args, &Precompiled)))
+   {
+      hr = StringListAppendCopy(&Precompiled, Context.Parser.Includes);
+      if (SUCCEEDED(hr))
+      {
+         FreeStringList(Context.Parser.Includes);
+         Context.Parser.Includes = Precompiled;
+         Precompiled = NULL;
+      }
+   }
+
+   if (SUCCEEDED(hr))
+   {
+      *Includes = Context.Parser.Includes;
+      Context.Parser.Includes = NULL;
+   }
+
+   FreeStringList(Precompiled);
+   FreeBuffer(&NotePrefix);
+   DepsFree(&Context.Parser);
+   return hr;
+}
+
+//
+// Writes the make rule for a single-source compile that included
+// Includes.  A rule that hasn't changed is left alone.
+//
+HRESULT
+DepsWriteRule(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   const LAUNCH_PARAMS *Launch,
+   PSTRING_LIST Includes
+)
+{
+   HRESULT hr = S_OK;
+   BYTE_BUFFER Rule = {0};
+   BYTE_BUFFER Existing = {0};
+   PWSTR Object = NULL;
+   PWSTR DepsPath = NULL;
+
+   hr = CcGetObjectName(Args, &Object);
+   if (SUCCEEDED(hr))
+      hr = GetDepsPath(Args, Launch, Object, &DepsPath);
+   if (SUCCEEDED(hr))
+      hr = BuildRule(Args, Toolset, Object, Includes, &Rule);
+
+   if (SUCCEEDED(hr) &&
+       (FAILED(ReadFileContents(DepsPath, &Existing)) ||
+        Existing.Length != Rule.Length ||
+        memcmp(Existing.Buffer, Rule.Buffer, Rule.Length)))
+   {
+      hr = WriteFileAtomic(DepsPath, Rule.Buffer, Rule.Length);
+   }
+
+   FreeBuffer(&Existing);
+   FreeBuffer(&Rule);
+   free(DepsPath);
+   free(Object);
+   return hr;
+}
+
+//
+// Writes the make rule for a link that compiled its sources itself, from
+// the rules those compiles left in Rules.  Each is kept, with the link's
+// output as its target instead of the object, so the output depends on
+// every source and every header they included.  A rule that hasn't
+// changed is left alone.
+//
+HRESULT
+DepsWriteLinkRule(
+   PCC_ARGS Args,
+   const LAUNCH_PARAMS *Launch,
+   PSTRING_LIST Rules
+)
+{
+   HRESULT hr = S_OK;
+   BYTE_BUFFER Rule = {0};
+   BYTE_BUFFER Existing = {0};
+   PCWSTR Output = Args->OutputName ? Args->OutputName : L"a.exe";
+   PWSTR DepsPath = NULL;
+   PSTRING_LIST List;
+
+   hr = GetDepsPath(Args, Launch, Output, &DepsPath);
+
+   for (List = Rules; SUCCEEDED(hr) && List; List = List->Next)
+   {
+      BYTE_BUFFER Source = {0};
+      const char *p, *End;
+
+      hr = ReadFileContents(List->String, &Source);
+
+      // The target is a path, so ": " can only be where it ends.
+      //
+      p = (const char *)Source.Buffer;
+      End = p + Source.Length;
+      while (SUCCEEDED(hr) && p + 1 < End && (p[0] != ':' || p[1] != ' '))
+         ++p;
+      if (SUCCEEDED(hr) && p + 1 >= End)
+         hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+
+      if (SUCCEEDED(hr) && Args->DepsTarget)
+         hr = AppendMakePath(&Rule, Args->DepsTarget, FALSE);
+      else if (SUCCEEDED(hr))
+         hr = AppendMakePath(&Rule, Output, TRUE);
+      if (SUCCEEDED(hr))
+         hr = BufferAppend(&Rule, p, End - p);
+
+      FreeBuffer(&Source);
+   }
+
+   if (SUCCEEDED(hr) &&
+       (FAILED(ReadFileContents(DepsPath, &Existing)) ||
+        Existing.Length != Rule.Length ||
+        memcmp(Existing.Buffer, Rule.Buffer, Rule.Length)))
+   {
+      hr = WriteFileAtomic(DepsPath, Rule.Buffer, Rule.Length);
+   }
+
+   FreeBuffer(&Existing);
+   FreeBuffer(&Rule);
+   free(DepsPath);
+   return hr;
+}
+
+//
+// Handles -MD and -MMD: compiles with /showIncludes, and writes the notes
+// out as a make rule once the compile has succeeded.  The notes are part
+// of what the object cache keeps, so a cache hit gives the same rule.
+// Returns S_FALSE if it did nothing, and the caller should compile as
+// usual.
+//
+HRESULT
+DepsExecute(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   const LAUNCH_PARAMS *Launch,
+   PDWORD ReturnValue
+)
+{
+   HRESULT hr = S_OK;
+   PSTRING_LIST Includes = NULL;
+
+   if (!IsDepsCompile(Args))
+      return S_FALSE;
+
+   hr = DepsCompile(Args, Toolset, Launch, ReturnValue, &Includes);
+
+   if (SUCCEEDED(hr) && !*ReturnValue)
+      hr = DepsWriteRule(Args, Toolset, Launch, Includes);
+
+   FreeStringList(Includes);
+   return hr;
+}
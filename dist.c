@@ -0,0 +1,759 @@
+/*
+ * Copyright (c) 2017 Andrew Sveikauskas
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ */
+
+#include "clwrapper.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//
+// Distributed compilation.
+//
+// CLWRAPPER_DIST names one or more workers, as base URLs separated by
+// spaces or semicolons.  A single-source compile to an object is then
+// preprocessed here, and the preprocessed source is POSTed to
+// <url>/compile on a worker along with the options that still matter after
+// preprocessing.  The worker compiles it with its own cl and sends back
+// the object and whatever cl printed.  #line directives in the preprocessed
+// source keep diagnostics and debug info pointing at the original files.
+//
+// A worker only takes the compile if its toolset identity (see
+// ToolsetGetIdentity()) is the same as ours; otherwise it answers 409.  A
+// worker that's running as many compiles as it's willing to answers 503.
+// Either way, or if it can't be reached, we try the next one, and if none
+// will have it, the compile happens here as usual.
+//
+// Remote compiles always put debug info, if any, in the object (/Z7),
+// since there's no shared PDB they could write to.
+//
+// Both directions are packed like this, then compressed with
+// RemoteCompress():
+//
+//    request:    DWORD Magic, Version
+//                STRING Identity, SourceName
+//                DWORD Optimization, Wall, Werror, DisableRtti, StaticCrt,
+//                      DebugInfo
+//                STRING_LIST PrefixMaps
+//                QWORD length, preprocessed source
+//
+//    response:   DWORD Magic, Version, ExitCode
+//                QWORD length, stdout
+//                QWORD length, stderr
+//                QWORD length, object (empty if the compile failed)
+//
+
+#define DIST_MAGIC           0x53444c43 // 'CLDS'
+#define DIST_VERSION         2
+#define DIST_CONNECT_TIMEOUT 2000
+#define DIST_TIMEOUT         (10 * 60 * 1000)
+
+typedef struct _DIST_WORKER
+{
+   PCLWRAPPER_TOOLSET Toolset;
+   PWSTR Identity;
+   LONG MaxRunning;
+   volatile LONG Running;
+   volatile LONG NextDirectory;
+} DIST_WORKER, *PDIST_WORKER;
+
+static HRESULT
+GetWorkers(
+   PSTRING_LIST *Workers,
+   PDWORD Timeout
+)
+{
+   HRESULT hr = S_OK;
+   PWSTR Value = NULL;
+   PWSTR TimeoutValue = NULL;
+   PWSTR Url = NULL;
+   PWSTR Next = NULL;
+
+   *Workers = NULL;
+
+   hr = GetEnvironmentString(L"CLWRAPPER_DIST", &Value);
+
+   for (Url = Value ? wcstok_s(Value, L" ;", &Next) : NULL;
+        hr == S_OK && Url;
+        Url = wcstok_s(NULL, L" ;", &Next))
+   {
+      hr = StringListAllocString(Url, *Workers, Workers);
+   }
+
+   if (hr == S_OK && !*Workers)
+      hr = S_FALSE;
+
+   if (hr == S_OK)
+   {
+      StringListReverse(Workers);
+
+      // Milliseconds, for the whole compile.
+      //
+      *Timeout = DIST_TIMEOUT;
+      GetEnvironmentString(L"CLWRAPPER_DIST_TIMEOUT", &TimeoutValue);
+      if (TimeoutValue && wcstoul(TimeoutValue, NULL, 10))
+         *Timeout = wcstoul(TimeoutValue, NULL, 10);
+   }
+
+   if (hr != S_OK)
+   {
+      FreeStringList(*Workers);
+      *Workers = NULL;
+   }
+
+   free(TimeoutValue);
+   free(Value);
+   return hr;
+}
+
+// A single source to an object.  cl takes extra options from CL and _CL_,
+// which we have no way of passing on, so if they're set the compile stays
+// here.  So does one that needs a PCH, or imports modules, whose files
+// are only here.
+//
+static BOOL
+IsDistributable(
+   PCC_ARGS Args
+)
+{
+   PCWSTR Variables[] = {L"CL", L"_CL_"};
+   DWORD i;
+
+   if (Args->OutputType != CC_OBJECT_FILE ||
+       Args->PreprocessOnly ||
+       Args->ShowIncludes ||
+       Args->PchThrough ||
+       Args->Modules ||
+       !Args->Inputs ||
+       Args->Inputs->Next ||
+       !CcIsSourceFile(Args->Inputs->String))
+   {
+      return FALSE;
+   }
+
+   for (i = 0; i < ARRAYSIZE(Variables); ++i)
+   {
+      PWSTR Value = NULL;
+      BOOL Set = FALSE;
+
+      GetEnvironmentString(Variables[i], &Value);
+      Set = Value && *Value;
+      free(Value);
+
+      if (Set)
+         return FALSE;
+   }
+
+   return TRUE;
+}
+
+static HRESULT
+AppendBlob(
+   PBYTE_BUFFER Buffer,
+   const BYTE *Data,
+   SIZE_T Length
+)
+{
+   HRESULT hr = S_OK;
+
+   hr = BufferAppendQword(Buffer, Length);
+   if (SUCCEEDED(hr) && Length)
+      hr = BufferAppend(Buffer, Data, Length);
+
+   return hr;
+}
+
+// Points into the reader's data; nothing is copied.
+//
+static HRESULT
+ReadBlob(
+   PBUFFER_READER Reader,
+   const BYTE **Data,
+   PSIZE_T Length
+)
+{
+   HRESULT hr = S_OK;
+   ULONGLONG BlobLength = 0;
+
+   hr = ReaderReadQword(Reader, &BlobLength);
+   if (SUCCEEDED(hr) && Reader->Length - Reader->Offset < BlobLength)
+      hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+
+   if (SUCCEEDED(hr))
+   {
+      *Data = Reader->Data + Reader->Offset;
+      *Length = (SIZE_T)BlobLength;
+      Reader->Offset += (SIZE_T)BlobLength;
+   }
+
+   return hr;
+}
+
+// Runs the preprocessor here.  S_FALSE means it failed, and the compile
+// should go ahead locally so that the errors are reported as usual.
+//
+static HRESULT
+Preprocess(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   const LAUNCH_PARAMS *Launch,
+   PBYTE_BUFFER Preprocessed
+)
+{
+   HRESULT hr = S_OK;
+   OUTPUT_STRING CommandLine = {0};
+   LAUNCH_PARAMS Params = {0};
+   LAUNCH_OUTPUT Output = {0};
+   DWORD ExitCode = 0;
+
+   Args->PreprocessOnly = TRUE;
+   hr = CcBuildCommandLine(Args, Toolset, &CommandLine);
+   Args->PreprocessOnly = FALSE;
+
+   // The memory budget is for the compile, not for this.
+   //
+   if (SUCCEEDED(hr))
+   {
+      if (Launch)
+         Params = *Launch;
+      Params.Memory = NULL;
+      Params.OutputCallback = LaunchBufferOutput;
+      Params.CallbackContext = &Output;
+
+      hr = LaunchProcessEx(CommandLine.Buffer, &Params, &ExitCode);
+   }
+
+   if (SUCCEEDED(hr) && ExitCode)
+      hr = S_FALSE;
+
+   if (hr == S_OK)
+   {
+      *Preprocessed = Output.Stdout;
+      Output.Stdout.Buffer = NULL;
+   }
+
+   LaunchFreeOutput(&Output);
+   FreeString(&CommandLine);
+   return hr;
+}
+
+static HRESULT
+PackRequest(
+   PCC_ARGS Args,
+   PCWSTR Identity,
+   PBYTE_BUFFER Preprocessed,
+   PBYTE_BUFFER Compressed
+)
+{
+   HRESULT hr = S_OK;
+   BYTE_BUFFER Packed = {0};
+
+   hr = BufferAppendDword(&Packed, DIST_MAGIC);
+   if (SUCCEEDED(hr))
+      hr = BufferAppendDword(&Packed, DIST_VERSION);
+   if (SUCCEEDED(hr))
+      hr = BufferAppendString(&Packed, Identity);
+   if (SUCCEEDED(hr))
+      hr = BufferAppendString(&Packed, CcBaseName(Args->Inputs->String));
+   if (SUCCEEDED(hr))
+      hr = BufferAppendDword(&Packed, Args->Optimization);
+   if (SUCCEEDED(hr))
+      hr = BufferAppendDword(&Packed, Args->Wall);
+   if (SUCCEEDED(hr))
+      hr = BufferAppendDword(&Packed, Args->Werror);
+   if (SUCCEEDED(hr))
+      hr = BufferAppendDword(&Packed, Args->DisableRtti);
+   if (SUCCEEDED(hr))
+      hr = BufferAppendDword(&Packed, Args->Base.StaticCrt);
+   if (SUCCEEDED(hr))
+      hr = BufferAppendDword(&Packed, Args->DebugInfo);
+   if (SUCCEEDED(hr))
+      hr = BufferAppendStringList(&Packed, Args->PrefixMaps);
+   if (SUCCEEDED(hr))
+   {
+      hr = AppendBlob(
+         &Packed,
+         Preprocessed->Buffer,
+         Preprocessed->Length
+      );
+   }
+
+   if (SUCCEEDED(hr))
+      hr = RemoteCompress(Packed.Buffer, Packed.Length, Compressed);
+
+   FreeBuffer(&Packed);
+   return hr;
+}
+
+// Writes out what a worker sent back.  Returns S_FALSE if the response
+// doesn't make sense, so that another worker can be tried.
+//
+static HRESULT
+UnpackResponse(
+   PBYTE_BUFFER Compressed,
+   PCWSTR Destination,
+   const LAUNCH_PARAMS *Launch,
+   PDWORD ReturnValue
+)
+{
+   HRESULT hr = S_OK;
+   BYTE_BUFFER Packed = {0};
+   BUFFER_READER Reader = {0};
+   DWORD Magic = 0;
+   DWORD Version = 0;
+   DWORD ExitCode = 0;
+   const BYTE *Stdout = NULL;
+   const BYTE *Stderr = NULL;
+   const BYTE *Object = NULL;
+   SIZE_T StdoutLength = 0;
+   SIZE_T StderrLength = 0;
+   SIZE_T ObjectLength = 0;
+
+   hr = RemoteDecompress(Compressed->Buffer, Compressed->Length, &Packed);
+
+   if (SUCCEEDED(hr))
+   {
+      Reader.Data = Packed.Buffer;
+      Reader.Length = Packed.Length;
+
+      hr = ReaderReadDword(&Reader, &Magic);
+   }
+   if (SUCCEEDED(hr))
+      hr = ReaderReadDword(&Reader, &Version);
+   if (SUCCEEDED(hr) && (Magic != DIST_MAGIC || Version != DIST_VERSION))
+      hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+   if (SUCCEEDED(hr))
+      hr = ReaderReadDword(&Reader, &ExitCode);
+   if (SUCCEEDED(hr))
+      hr = ReadBlob(&Reader, &Stdout, &StdoutLength);
+   if (SUCCEEDED(hr))
+      hr = ReadBlob(&Reader, &Stderr, &StderrLength);
+   if (SUCCEEDED(hr))
+      hr = ReadBlob(&Reader, &Object, &ObjectLength);
+   if (SUCCEEDED(hr) && !ExitCode && !ObjectLength)
+      hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+
+   if (SUCCEEDED(hr) && !ExitCode)
+      hr = WriteFileAtomic(Destination, Object, ObjectLength);
+
+   if (FAILED(hr))
+   {
+      hr = S_FALSE;
+   }
+   else
+   {
+      hr = LaunchWriteOutput(Launch, LAUNCH_STDOUT, Stdout, StdoutLength);
+      if (SUCCEEDED(hr))
+      {
+         hr = LaunchWriteOutput(
+            Launch,
+            LAUNCH_STDERR,
+            Stderr,
+            StderrLength
+         );
+      }
+
+      *ReturnValue = ExitCode;
+   }
+
+   FreeBuffer(&Packed);
+   return hr;
+}
+
+//
+// Sends a single-source compile to a worker, if CLWRAPPER_DIST names any.
+// Returns S_FALSE if it did nothing, and the caller should compile here.
+//
+HRESULT
+DistExecute(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   const LAUNCH_PARAMS *Launch,
+   PDWORD ReturnValue
+)
+{
+   HRESULT hr = S_OK;
+   PSTRING_LIST Workers = NULL;
+   PSTRING_LIST Outputs = NULL;
+   PSTRING_LIST List = NULL;
+   PWSTR Identity = NULL;
+   PWSTR Destination = NULL;
+   BYTE_BUFFER Preprocessed = {0};
+   BYTE_BUFFER Request = {0};
+   DWORD Timeout = 0;
+   DWORD NumWorkers = 0;
+   DWORD Start = 0;
+   BOOL Done = FALSE;
+   DWORD i;
+
+   if (!IsDistributable(Args))
+      return S_FALSE;
+
+   hr = GetWorkers(&Workers, &Timeout);
+
+   if (hr == S_OK)
+      hr = ToolsetGetIdentity(Toolset, &Identity);
+   if (hr == S_OK)
+      hr = CcGetExpectedOutputs(Args, &Outputs);
+
+   // Relative to where the compiler would have run.
+   //
+   if (hr == S_OK && Launch && Launch->CurrentDirectory)
+   {
+      hr = MakeAbsolute(
+         Launch->CurrentDirectory,
+         Outputs->String,
+         &Destination
+      );
+   }
+   else if (hr == S_OK)
+   {
+      hr = HeapPrintf(&Destination, L"%s", Outputs->String);
+   }
+
+   if (hr == S_OK)
+      hr = Preprocess(Args, Toolset, Launch, &Preprocessed);
+   if (hr == S_OK)
+      hr = PackRequest(Args, Identity, &Preprocessed, &Request);
+
+   if (FAILED(hr))
+      hr = S_FALSE;
+
+   // Start somewhere different in each process and thread, so that
+   // parallel compiles spread over the workers.
+   //
+   for (List = Workers; List; List = List->Next)
+      ++NumWorkers;
+   if (NumWorkers)
+      Start = (GetCurrentProcessId() ^ GetCurrentThreadId()) % NumWorkers;
+
+   for (i = 0; hr == S_OK && !Done && i < NumWorkers; ++i)
+   {
+      BYTE_BUFFER Response = {0};
+      DWORD j;
+
+      List = Workers;
+      for (j = 0; j < (Start + i) % NumWorkers; ++j)
+         List = List->Next;
+
+      if (RemoteRequestEx(
+             List->String,
+             L"POST",
+             L"compile",
+             DIST_CONNECT_TIMEOUT,
+             Timeout,
+             Request.Buffer,
+             (DWORD)Request.Length,
+             &Response) == S_OK)
+      {
+         hr = UnpackResponse(&Response, Destination, Launch, ReturnValue);
+         if (hr == S_OK)
+            Done = TRUE;
+         else if (hr == S_FALSE)
+            hr = S_OK;
+      }
+
+      FreeBuffer(&Response);
+   }
+
+   // Nobody would take it.
+   //
+   if (hr == S_OK && !Done)
+      hr = S_FALSE;
+
+   FreeBuffer(&Request);
+   FreeBuffer(&Preprocessed);
+   FreeStringList(Outputs);
+   FreeStringList(Workers);
+   free(Destination);
+   free(Identity);
+   return hr;
+}
+
+//
+// The worker side: compiles what DistExecute() sends, each in a directory
+// of its own under %TEMP%, named after the original source so that cl
+// picks the same language and prints the same name.
+//
+
+static HRESULT
+CompileForClient(
+   PDIST_WORKER Worker,
+   PBUFFER_READER Reader,
+   PBYTE_BUFFER Packed
+)
+{
+   HRESULT hr = S_OK;
+   CC_ARGS Args = {0};
+   LAUNCH_PARAMS Launch = {0};
+   LAUNCH_OUTPUT Output = {0};
+   OUTPUT_STRING CommandLine = {0};
+   BYTE_BUFFER Object = {0};
+   PSTRING_LIST Inputs = NULL;
+   PWSTR SourceName = NULL;
+   PWSTR Directory = NULL;
+   PWSTR SourcePath = NULL;
+   PWSTR ObjectPath = NULL;
+   const BYTE *Source = NULL;
+   SIZE_T SourceLength = 0;
+   DWORD Value = 0;
+   DWORD ExitCode = 0;
+   WCHAR Temp[MAX_PATH];
+
+   Args.OutputType = CC_OBJECT_FILE;
+   Args.EmbedDebugInfo = TRUE;
+
+   hr = ReaderReadString(Reader, &SourceName);
+   if (SUCCEEDED(hr) && (!SourceName || !CcIsSourceFile(SourceName)))
+      hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+   if (SUCCEEDED(hr))
+      hr = ReaderReadDword(Reader, &Value);
+   if (SUCCEEDED(hr))
+   {
+      Args.Optimization = (WCHAR)Value;
+      hr = ReaderReadDword(Reader, &Value);
+   }
+   if (SUCCEEDED(hr))
+   {
+      Args.Wall = Value;
+      hr = ReaderReadDword(Reader, &Value);
+   }
+   if (SUCCEEDED(hr))
+   {
+      Args.Werror = Value;
+      hr = ReaderReadDword(Reader, &Value);
+   }
+   if (SUCCEEDED(hr))
+   {
+      Args.DisableRtti = Value;
+      hr = ReaderReadDword(Reader, &Value);
+   }
+   if (SUCCEEDED(hr))
+   {
+      Args.Base.StaticCrt = Value;
+      hr = ReaderReadDword(Reader, &Value);
+   }
+   if (SUCCEEDED(hr))
+   {
+      Args.DebugInfo = Value;
+      hr = ReaderReadStringList(Reader, &Args.PrefixMaps);
+   }
+   if (SUCCEEDED(hr))
+      hr = ReadBlob(Reader, &Source, &SourceLength);
+
+   if (SUCCEEDED(hr) && !GetTempPath(ARRAYSIZE(Temp), Temp))
+      hr = HRESULT_FROM_WIN32(GetLastError());
+   if (SUCCEEDED(hr))
+   {
+      hr = HeapPrintf(
+         &Directory,
+         L"%sclwrapper-dist-%u-%u",
+         Temp,
+         GetCurrentProcessId(),
+         (DWORD)InterlockedIncrement(&Worker->NextDirectory)
+      );
+   }
+   if (SUCCEEDED(hr) && !CreateDirectory(Directory, NULL))
+   {
+      hr = HRESULT_FROM_WIN32(GetLastError());
+      free(Directory);
+      Directory = NULL;
+   }
+
+   // Only the name is kept, so a client can't write outside Directory.
+   //
+   if (SUCCEEDED(hr))
+   {
+      hr = HeapPrintf(
+         &SourcePath,
+         L"%s\\%s",
+         Directory,
+         CcBaseName(SourceName)
+      );
+   }
+   if (SUCCEEDED(hr))
+      hr = HeapPrintf(&ObjectPath, L"%s\\out.obj", Directory);
+   if (SUCCEEDED(hr))
+      hr = WriteFileAtomic(SourcePath, Source, SourceLength);
+   if (SUCCEEDED(hr))
+      hr = StringListAllocString(CcBaseName(SourceName), NULL, &Inputs);
+
+   if (SUCCEEDED(hr))
+   {
+      Args.Inputs = Inputs;
+      Args.OutputName = L"out.obj";
+
+      hr = CcBuildCommandLine(&Args, Worker->Toolset, &CommandLine);
+   }
+
+   if (SUCCEEDED(hr))
+   {
+      Launch.CurrentDirectory = Directory;
+      Launch.OutputCallback = LaunchBufferOutput;
+      Launch.CallbackContext = &Output;
+
+      hr = LaunchProcessEx(CommandLine.Buffer, &Launch, &ExitCode);
+   }
+
+   if (SUCCEEDED(hr) && !ExitCode)
+      hr = ReadFileContents(ObjectPath, &Object);
+
+   if (SUCCEEDED(hr))
+      hr = BufferAppendDword(Packed, DIST_MAGIC);
+   if (SUCCEEDED(hr))
+      hr = BufferAppendDword(Packed, DIST_VERSION);
+   if (SUCCEEDED(hr))
+      hr = BufferAppendDword(Packed, ExitCode);
+   if (SUCCEEDED(hr))
+      hr = AppendBlob(Packed, Output.Stdout.Buffer, Output.Stdout.Length);
+   if (SUCCEEDED(hr))
+      hr = AppendBlob(Packed, Output.Stderr.Buffer, Output.Stderr.Length);
+   if (SUCCEEDED(hr))
+      hr = AppendBlob(Packed, Object.Buffer, Object.Length);
+
+   if (SourcePath)
+      DeleteFile(SourcePath);
+   if (ObjectPath)
+      DeleteFile(ObjectPath);
+   if (Directory)
+      RemoveDirectory(Directory);
+
+   FreeBuffer(&Object);
+   LaunchFreeOutput(&Output);
+   FreeString(&CommandLine);
+   FreeStringList(Inputs);
+   FreeStringList(Args.PrefixMaps);
+   free(ObjectPath);
+   free(SourcePath);
+   free(Directory);
+   free(SourceName);
+   return hr;
+}
+
+static VOID
+HandleCompile(
+   PVOID Context,
+   const HTTP_REQUEST *Request,
+   PHTTP_RESPONSE Response
+)
+{
+   HRESULT hr = S_OK;
+   PDIST_WORKER Worker = Context;
+   BYTE_BUFFER Packed = {0};
+   BYTE_BUFFER Result = {0};
+   BUFFER_READER Reader = {0};
+   PWSTR Identity = NULL;
+   DWORD Magic = 0;
+   DWORD Version = 0;
+   PCSTR Name = strrchr(Request->Target, '/');
+
+   Name = Name ? Name + 1 : Request->Target;
+
+   if (strcmp(Request->Method, "POST") || strcmp(Name, "compile"))
+   {
+      Response->Status = 404;
+      Response->Reason = "Not Found";
+      return;
+   }
+
+   hr = RemoteDecompress(Request->Body, Request->BodyLength, &Packed);
+
+   if (SUCCEEDED(hr))
+   {
+      Reader.Data = Packed.Buffer;
+      Reader.Length = Packed.Length;
+
+      hr = ReaderReadDword(&Reader, &Magic);
+   }
+   if (SUCCEEDED(hr))
+      hr = ReaderReadDword(&Reader, &Version);
+   if (SUCCEEDED(hr) && (Magic != DIST_MAGIC || Version != DIST_VERSION))
+      hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+   if (SUCCEEDED(hr))
+      hr = ReaderReadString(&Reader, &Identity);
+
+   if (FAILED(hr))
+   {
+      Response->Status = 400;
+      Response->Reason = "Bad Request";
+   }
+   else if (!Identity || wcscmp(Identity, Worker->Identity))
+   {
+      Response->Status = 409;
+      Response->Reason = "Conflict";
+   }
+   else if (InterlockedIncrement(&Worker->Running) > Worker->MaxRunning)
+   {
+      InterlockedDecrement(&Worker->Running);
+      Response->Status = 503;
+      Response->Reason = "Service Unavailable";
+   }
+   else
+   {
+      hr = CompileForClient(Worker, &Reader, &Result);
+      InterlockedDecrement(&Worker->Running);
+
+      if (SUCCEEDED(hr))
+         hr = RemoteCompress(Result.Buffer, Result.Length, &Response->Body);
+
+      if (SUCCEEDED(hr))
+      {
+         Response->Status = 200;
+         Response->Reason = "OK";
+      }
+      else
+      {
+         FreeBuffer(&Response->Body);
+         Response->Status = 500;
+         Response->Reason = "Internal Server Error";
+      }
+   }
+
+   fprintf(stderr, "%ls %d\n", Identity ? Identity : L"?", Response->Status);
+
+   FreeBuffer(&Result);
+   FreeBuffer(&Packed);
+   free(Identity);
+}
+
+//
+// Takes compiles for Toolset, up to MaxRunning at once.  Only returns if
+// something goes wrong.
+//
+HRESULT
+DistServe(
+   PCWSTR Address,
+   PCWSTR Port,
+   PCLWRAPPER_TOOLSET Toolset,
+   DWORD MaxRunning
+)
+{
+   HRESULT hr = S_OK;
+   DIST_WORKER Worker = {0};
+
+   Worker.Toolset = Toolset;
+   Worker.MaxRunning = (LONG)MaxRunning;
+
+   hr = ToolsetGetIdentity(Toolset, &Worker.Identity);
+
+   if (SUCCEEDED(hr))
+   {
+      printf(
+         "Compiling for %ls on %ls port %ls, %u at a time\n",
+         Worker.Identity,
+         Address,
+         Port,
+         MaxRunning
+      );
+      fflush(stdout);
+
+      hr = HttpServe(Address, Port, HandleCompile, &Worker);
+   }
+
+   free(Worker.Identity);
+   return hr;
+}
@@ -10,10 +10,96 @@
 
 #include <stdio.h>
 
+//
+// dumpinfo --export-profile FILE [-V ...] [-sdkversion ...] [-m...]
+//
+// Resolves a toolset the same way cc would, and writes it to FILE for use
+// with -toolset=FILE.
+//
+static HRESULT
+ExportProfile(
+   PCWSTR Path,
+   PWSTR *Arg
+)
+{
+   HRESULT hr = S_OK;
+   CLWRAPPER_ARGS_BASE Args = {0};
+   CLWRAPPER_TOOLSET Toolset = {0};
+   INT NumConsumed = 0;
+
+   hr = BaseParseArg(&Args, Arg, &NumConsumed);
+   if (SUCCEEDED(hr) && Arg[NumConsumed])
+   {
+      fprintf(stderr, "Unrecognized argument: %ls\n", Arg[NumConsumed]);
+      hr = E_INVALIDARG;
+   }
+
+   if (SUCCEEDED(hr) && Args.ToolsetProfile)
+   {
+      fprintf(stderr, "-toolset= can't be used with --export-profile\n");
+      hr = E_INVALIDARG;
+   }
+
+   if (SUCCEEDED(hr))
+      hr = ToolsetAcquire(&Args, &Toolset);
+
+   if (SUCCEEDED(hr))
+      hr = ToolsetExport(&Toolset, Path);
+
+   if (SUCCEEDED(hr))
+   {
+      PSTRING_LIST String;
+
+      printf(
+         "Wrote %ls:\n   Compiler: %d.%d (%ls)\n   SDK: %d.%d at %ls\n",
+         Path,
+         Toolset.Compiler->Major,
+         Toolset.Compiler->Minor,
+         Toolset.Compiler->ClPaths->String,
+         Toolset.Sdk->Major,
+         Toolset.Sdk->Minor,
+         Toolset.Sdk->InstallDir
+      );
+      if (Toolset.Win10SdkVersion)
+         printf("   Win10 SDK: %ls\n", Toolset.Win10SdkVersion);
+      for (String = Toolset.IncludePaths; String; String = String->Next)
+         printf("   Include: %ls\n", String->String);
+      for (String = Toolset.LibraryPaths; String; String = String->Next)
+         printf("   Lib: %ls\n", String->String);
+   }
+
+   ToolsetFree(&Toolset);
+   BaseArgsFree(&Args);
+   return hr;
+}
+
 int main()
 {
    HRESULT hr = S_OK;
    PVS_VERSION List = NULL;
+   INT Argc = 0;
+   PWSTR *Argv = CommandLineToArgvW(GetCommandLine(), &Argc);
+
+   if (Argv && Argc >= 2 && !wcscmp(Argv[1], L"--export-profile"))
+   {
+      if (Argc < 3)
+      {
+         fprintf(stderr, "--export-profile expects an argument\n");
+         hr = E_INVALIDARG;
+      }
+      else
+      {
+         hr = ExportProfile(Argv[2], Argv + 3);
+      }
+
+      LocalFree(Argv);
+      if (FAILED(hr))
+         fprintf(stderr, "Failed with 0x%.8x\n", hr);
+      return hr;
+   }
+
+   if (Argv)
+      LocalFree(Argv);
 
    hr = GetInstalledVsVersions(&List);   
 
@@ -23,13 +109,25 @@ int main()
       while (Current)
       {
          PSTRING_LIST String = Current->Configurations;
+         PSTRING_LIST ClPath = Current->ClPaths;
          printf("%d.%d:\n", Current->Major, Current->Minor);
          printf("   Install Dir: %ls\n", Current->InstallDir);
          printf("   Configurations:");
-         while (String)
+         while (String && ClPath)
          {
-            printf(" %ls", String->String);
+            const ARCHITECTURE *Arch = FindArchByClPath(
+               Current->InstallDir,
+               ClPath->String
+            );
+
+            // Say which ones have a 64-bit cl.exe.
+            //
+            if (Arch && Arch->HostDirectory)
+               printf(" %ls(%ls)", String->String, Arch->HostArchName);
+            else
+               printf(" %ls", String->String);
             String = String->Next;
+            ClPath = ClPath->Next;
          }
          puts("");
          Current = Current->Next;
@@ -90,6 +188,14 @@ int main()
 
    FreeVsVersions(List);
 
+   if (SUCCEEDED(hr))
+   {
+      DWORD Hits = 0, Misses = 0;
+
+      GetToolsetCacheCounters(&Hits, &Misses);
+      printf("Toolset cache: %u hits, %u misses\n", Hits, Misses);
+   }
+
    if (FAILED(hr))
       fprintf(stderr, "Failed with 0x%.8x\n", hr);
    return hr;
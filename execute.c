@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2017 Andrew Sveikauskas
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ */
+
+#include "clwrapper.h"
+
+//
+// Runs a compile or link through each stage that might want it, in order.
+// Stages return S_FALSE to pass it along; whatever's left is handed to the
+// real tool.
+//
+HRESULT
+CcExecute(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   const LAUNCH_PARAMS *Launch,
+   PDWORD ReturnValue
+)
+{
+   HRESULT hr = S_OK;
+   OUTPUT_STRING CommandLine = {0};
+
+   hr = UnityExecute(Args, Toolset, Launch, ReturnValue);
+   if (hr != S_FALSE)
+      return hr;
+
+   hr = PchExecute(Args, Toolset, Launch, ReturnValue);
+   if (hr != S_FALSE)
+      return hr;
+
+   hr = PipelineExecute(Args, Toolset, Launch, ReturnValue);
+   if (hr != S_FALSE)
+      return hr;
+
+   hr = ModulesExecute(Args, Toolset, Launch, ReturnValue);
+   if (hr != S_FALSE)
+      return hr;
+
+   hr = JobsExecute(Args, Toolset, Launch, ReturnValue);
+   if (hr != S_FALSE)
+      return hr;
+
+   hr = UpToDateExecute(Args, Toolset, Launch, ReturnValue);
+   if (hr != S_FALSE)
+      return hr;
+
+   hr = RestatExecute(Args, Toolset, Launch, ReturnValue);
+   if (hr != S_FALSE)
+      return hr;
+
+   hr = DepsExecute(Args, Toolset, Launch, ReturnValue);
+   if (hr != S_FALSE)
+      return hr;
+
+   hr = MemoryExecute(Args, Toolset, Launch, ReturnValue);
+   if (hr != S_FALSE)
+      return hr;
+
+   hr = CacheExecute(Args, Toolset, Launch, ReturnValue);
+   if (hr != S_FALSE)
+      return hr;
+
+   hr = DistExecute(Args, Toolset, Launch, ReturnValue);
+   if (hr != S_FALSE)
+      return hr;
+
+   hr = CcBuildCommandLine(Args, Toolset, &CommandLine);
+
+   if (SUCCEEDED(hr))
+   {
+      hr = LaunchProcessEx(CommandLine.Buffer, Launch, ReturnValue);
+   }
+
+   FreeString(&CommandLine);
+   return hr;
+}
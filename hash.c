@@ -0,0 +1,231 @@
+/*
+ * Copyright (c) 2017 Andrew Sveikauskas
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ */
+
+#include "clwrapper.h"
+#include <bcrypt.h>
+#include <string.h>
+
+//
+// SHA-256, via CNG.
+//
+
+static HRESULT
+HresultFromNtStatus(
+   NTSTATUS Status
+)
+{
+   return BCRYPT_SUCCESS(Status) ? S_OK : HRESULT_FROM_NT(Status);
+}
+
+HRESULT
+HashInit(
+   PHASH_CONTEXT Context
+)
+{
+   HRESULT hr = S_OK;
+   BCRYPT_ALG_HANDLE Algorithm = NULL;
+   BCRYPT_HASH_HANDLE Hash = NULL;
+
+   memset(Context, 0, sizeof(*Context));
+
+   hr = HresultFromNtStatus(
+      BCryptOpenAlgorithmProvider(
+         &Algorithm,
+         BCRYPT_SHA256_ALGORITHM,
+         NULL,
+         0
+      )
+   );
+
+   if (SUCCEEDED(hr))
+   {
+      hr = HresultFromNtStatus(
+         BCryptCreateHash(Algorithm, &Hash, NULL, 0, NULL, 0, 0)
+      );
+   }
+
+   if (SUCCEEDED(hr))
+   {
+      Context->Algorithm = Algorithm;
+      Context->Hash = Hash;
+   }
+   else if (Algorithm)
+   {
+      BCryptCloseAlgorithmProvider(Algorithm, 0);
+   }
+
+   return hr;
+}
+
+HRESULT
+HashData(
+   PHASH_CONTEXT Context,
+   const VOID *Data,
+   SIZE_T Length
+)
+{
+   HRESULT hr = S_OK;
+   const BYTE *p = Data;
+
+   while (SUCCEEDED(hr) && Length)
+   {
+      ULONG Chunk = Length > 0x10000000 ? 0x10000000 : (ULONG)Length;
+
+      hr = HresultFromNtStatus(
+         BCryptHashData(Context->Hash, (PUCHAR)p, Chunk, 0)
+      );
+
+      p += Chunk;
+      Length -= Chunk;
+   }
+
+   return hr;
+}
+
+HRESULT
+HashDword(
+   PHASH_CONTEXT Context,
+   DWORD Value
+)
+{
+   return HashData(Context, &Value, sizeof(Value));
+}
+
+// Strings are hashed with their length in front, so that adjacent strings
+// can't run together.
+//
+HRESULT
+HashString(
+   PHASH_CONTEXT Context,
+   PCWSTR String
+)
+{
+   HRESULT hr = S_OK;
+   DWORD Length = String ? (DWORD)wcslen(String) : ~0U;
+
+   hr = HashDword(Context, Length);
+   if (SUCCEEDED(hr) && String)
+      hr = HashData(Context, String, Length * sizeof(WCHAR));
+
+   return hr;
+}
+
+HRESULT
+HashStringList(
+   PHASH_CONTEXT Context,
+   PSTRING_LIST List
+)
+{
+   HRESULT hr = S_OK;
+   PSTRING_LIST Node;
+   DWORD Count = 0;
+
+   for (Node = List; Node; Node = Node->Next)
+      ++Count;
+
+   hr = HashDword(Context, Count);
+
+   for (Node = List; SUCCEEDED(hr) && Node; Node = Node->Next)
+   {
+      hr = HashString(Context, Node->String);
+   }
+
+   return hr;
+}
+
+// Identifies a file by path, size and modification time, without reading
+// it.
+//
+HRESULT
+HashFileIdentity(
+   PHASH_CONTEXT Context,
+   PCWSTR Path
+)
+{
+   HRESULT hr = S_OK;
+   WIN32_FILE_ATTRIBUTE_DATA Attributes = {0};
+
+   if (!GetFileAttributesEx(Path, GetFileExInfoStandard, &Attributes))
+      hr = HRESULT_FROM_WIN32(GetLastError());
+
+   if (SUCCEEDED(hr))
+      hr = HashString(Context, Path);
+   if (SUCCEEDED(hr))
+      hr = HashDword(Context, Attributes.nFileSizeLow);
+   if (SUCCEEDED(hr))
+      hr = HashDword(Context, Attributes.nFileSizeHigh);
+   if (SUCCEEDED(hr))
+      hr = HashDword(Context, Attributes.ftLastWriteTime.dwLowDateTime);
+   if (SUCCEEDED(hr))
+      hr = HashDword(Context, Attributes.ftLastWriteTime.dwHighDateTime);
+
+   return hr;
+}
+
+// Hashes what's in a file, with its length first.
+//
+HRESULT
+HashFileContents(
+   PHASH_CONTEXT Context,
+   PCWSTR Path
+)
+{
+   HRESULT hr = S_OK;
+   MAPPED_FILE File = {0};
+
+   hr = MapFile(Path, FALSE, &File);
+   if (SUCCEEDED(hr))
+      hr = HashData(Context, &File.Length, sizeof(File.Length));
+   if (SUCCEEDED(hr))
+      hr = HashData(Context, File.Data, File.Length);
+
+   UnmapFile(&File);
+   return hr;
+}
+
+HRESULT
+HashFinish(
+   PHASH_CONTEXT Context,
+   BYTE Digest[HASH_LENGTH]
+)
+{
+   return HresultFromNtStatus(
+      BCryptFinishHash(Context->Hash, Digest, HASH_LENGTH, 0)
+   );
+}
+
+VOID
+HashFree(
+   PHASH_CONTEXT Context
+)
+{
+   if (Context->Hash)
+      BCryptDestroyHash(Context->Hash);
+   if (Context->Algorithm)
+      BCryptCloseAlgorithmProvider(Context->Algorithm, 0);
+
+   memset(Context, 0, sizeof(*Context));
+}
+
+VOID
+HashToString(
+   const BYTE Digest[HASH_LENGTH],
+   WCHAR String[HASH_STRING_LENGTH]
+)
+{
+   static const WCHAR Hex[] = L"0123456789abcdef";
+   INT i;
+
+   for (i = 0; i < HASH_LENGTH; ++i)
+   {
+      String[i * 2] = Hex[Digest[i] >> 4];
+      String[i * 2 + 1] = Hex[Digest[i] & 0xf];
+   }
+
+   String[HASH_LENGTH * 2] = 0;
+}
@@ -0,0 +1,395 @@
+/*
+ * Copyright (c) 2017 Andrew Sveikauskas
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ */
+
+//
+// A minimal HTTP/1.1 server, enough for the stand-in servers we ship:
+// one request per connection, each on its own thread, with the body read
+// in full (when there's a Content-Length) before the handler sees it.
+//
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include "clwrapper.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HTTP_MAX_HEADER      16384
+#define HTTP_MAX_BODY        (256 * 1024 * 1024)
+
+typedef struct _HTTP_SERVER
+{
+   HTTP_HANDLER Handler;
+   PVOID Context;
+} HTTP_SERVER, *PHTTP_SERVER;
+
+typedef struct _HTTP_CONNECTION
+{
+   PHTTP_SERVER Server;
+   SOCKET Socket;
+} HTTP_CONNECTION, *PHTTP_CONNECTION;
+
+static HRESULT
+SendAll(
+   SOCKET Socket,
+   const VOID *Data,
+   SIZE_T Length
+)
+{
+   const char *p = Data;
+
+   while (Length)
+   {
+      INT Chunk = Length > 0x10000000 ? 0x10000000 : (INT)Length;
+      INT Sent = send(Socket, p, Chunk, 0);
+
+      if (Sent == SOCKET_ERROR)
+         return HRESULT_FROM_WIN32(WSAGetLastError());
+
+      p += Sent;
+      Length -= Sent;
+   }
+
+   return S_OK;
+}
+
+static HRESULT
+SendResponse(
+   SOCKET Socket,
+   INT Status,
+   PCSTR Reason,
+   const BYTE *Body,
+   SIZE_T Length
+)
+{
+   HRESULT hr = S_OK;
+   char Header[256];
+   INT HeaderLength = 0;
+
+   HeaderLength = _snprintf(
+      Header,
+      sizeof(Header),
+      "HTTP/1.1 %d %s\r\n"
+      "Content-Length: %lu\r\n"
+      "Connection: close\r\n"
+      "\r\n",
+      Status,
+      Reason,
+      (unsigned long)Length
+   );
+
+   hr = SendAll(Socket, Header, HeaderLength);
+   if (SUCCEEDED(hr) && Length)
+      hr = SendAll(Socket, Body, Length);
+
+   return hr;
+}
+
+// Receives at least the request line and headers.  Some of the body may
+// come along too, after HeaderLength bytes.
+//
+static HRESULT
+ReceiveHeader(
+   SOCKET Socket,
+   PBYTE_BUFFER Request,
+   PSIZE_T HeaderLength
+)
+{
+   HRESULT hr = S_OK;
+
+   for (;;)
+   {
+      SIZE_T i;
+      INT Received = 0;
+
+      for (i = 3; i < Request->Length; ++i)
+      {
+         if (!memcmp(Request->Buffer + i - 3, "\r\n\r\n", 4))
+         {
+            *HeaderLength = i + 1;
+            return S_OK;
+         }
+      }
+
+      if (Request->Length >= HTTP_MAX_HEADER)
+         return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+
+      hr = BufferReserve(Request, 4096);
+      if (FAILED(hr))
+         return hr;
+
+      Received = recv(
+         Socket,
+         (char*)Request->Buffer + Request->Length,
+         4096,
+         0
+      );
+      if (Received == SOCKET_ERROR)
+         return HRESULT_FROM_WIN32(WSAGetLastError());
+      if (!Received)
+         return HRESULT_FROM_WIN32(ERROR_BROKEN_PIPE);
+
+      Request->Length += Received;
+   }
+}
+
+static HRESULT
+ReceiveBody(
+   SOCKET Socket,
+   PBYTE_BUFFER Request,
+   SIZE_T Total
+)
+{
+   HRESULT hr = S_OK;
+
+   hr = BufferReserve(Request, Total - Request->Length);
+
+   while (SUCCEEDED(hr) && Request->Length < Total)
+   {
+      SIZE_T Want = Total - Request->Length;
+      INT Received = recv(
+         Socket,
+         (char*)Request->Buffer + Request->Length,
+         Want > 0x10000000 ? 0x10000000 : (INT)Want,
+         0
+      );
+
+      if (Received == SOCKET_ERROR)
+         hr = HRESULT_FROM_WIN32(WSAGetLastError());
+      else if (!Received)
+         hr = HRESULT_FROM_WIN32(ERROR_BROKEN_PIPE);
+      else
+         Request->Length += Received;
+   }
+
+   return hr;
+}
+
+// Finds a header's value in the header block, which is NUL terminated.
+//
+static PCSTR
+FindHeader(
+   PCSTR Headers,
+   PCSTR Name
+)
+{
+   SIZE_T NameLength = strlen(Name);
+   PCSTR Line = strstr(Headers, "\r\n");
+
+   while (Line && Line[2])
+   {
+      Line += 2;
+
+      if (!_strnicmp(Line, Name, NameLength) && Line[NameLength] == ':')
+      {
+         Line += NameLength + 1;
+         while (*Line == ' ')
+            ++Line;
+         return Line;
+      }
+
+      Line = strstr(Line, "\r\n");
+   }
+
+   return NULL;
+}
+
+static DWORD WINAPI
+ServeConnection(
+   PVOID Context
+)
+{
+   HRESULT hr = S_OK;
+   PHTTP_CONNECTION Connection = Context;
+   SOCKET Socket = Connection->Socket;
+   BYTE_BUFFER Request = {0};
+   SIZE_T HeaderLength = 0;
+   PSTR Method = NULL;
+   PSTR Target = NULL;
+   PSTR p = NULL;
+   PCSTR ContentLength = NULL;
+   HTTP_REQUEST Parsed = {0};
+   HTTP_RESPONSE Response = {0};
+
+   Response.Status = 400;
+   Response.Reason = "Bad Request";
+
+   hr = ReceiveHeader(Socket, &Request, &HeaderLength);
+
+   // Request line is "METHOD TARGET HTTP/1.1".
+   //
+   if (SUCCEEDED(hr))
+   {
+      Request.Buffer[HeaderLength - 1] = 0;
+      Method = (PSTR)Request.Buffer;
+
+      Target = strchr(Method, ' ');
+      if (Target)
+      {
+         *Target++ = 0;
+         p = strchr(Target, ' ');
+      }
+      if (p)
+         *p++ = 0;
+      if (!p)
+         hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+   }
+
+   if (SUCCEEDED(hr))
+   {
+      ContentLength = FindHeader(p, "Content-Length");
+
+      if (ContentLength &&
+          strtoul(ContentLength, NULL, 10) > HTTP_MAX_BODY)
+      {
+         Response.Status = 413;
+         Response.Reason = "Payload Too Large";
+         hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+      }
+      else if (ContentLength)
+      {
+         hr = ReceiveBody(
+            Socket,
+            &Request,
+            HeaderLength + strtoul(ContentLength, NULL, 10)
+         );
+      }
+   }
+
+   if (SUCCEEDED(hr))
+   {
+      Parsed.Method = Method;
+      Parsed.Target = Target;
+      Parsed.Body = Request.Buffer + HeaderLength;
+      Parsed.BodyLength = Request.Length - HeaderLength;
+
+      Connection->Server->Handler(
+         Connection->Server->Context,
+         &Parsed,
+         &Response
+      );
+   }
+
+   SendResponse(
+      Socket,
+      Response.Status,
+      Response.Reason,
+      Response.Body.Buffer,
+      Response.Body.Length
+   );
+
+   shutdown(Socket, SD_SEND);
+   closesocket(Socket);
+   FreeBuffer(&Response.Body);
+   FreeBuffer(&Request);
+   free(Connection);
+   return 0;
+}
+
+//
+// Listens on Address and Port, and calls Handler for each request, on a
+// thread of its own.  Only returns if something goes wrong.
+//
+HRESULT
+HttpServe(
+   PCWSTR Address,
+   PCWSTR Port,
+   HTTP_HANDLER Handler,
+   PVOID Context
+)
+{
+   HRESULT hr = S_OK;
+   HTTP_SERVER Server = {Handler, Context};
+   WSADATA WsaData;
+   ADDRINFOW Hints = {0};
+   PADDRINFOW Addresses = NULL;
+   SOCKET Listener = INVALID_SOCKET;
+   INT Err = 0;
+
+   Err = WSAStartup(MAKEWORD(2, 2), &WsaData);
+   if (Err)
+      hr = HRESULT_FROM_WIN32(Err);
+
+   if (SUCCEEDED(hr))
+   {
+      Hints.ai_family = AF_UNSPEC;
+      Hints.ai_socktype = SOCK_STREAM;
+      Hints.ai_protocol = IPPROTO_TCP;
+      Hints.ai_flags = AI_PASSIVE;
+
+      Err = GetAddrInfoW(Address, Port, &Hints, &Addresses);
+      if (Err)
+         hr = HRESULT_FROM_WIN32(Err);
+   }
+
+   if (SUCCEEDED(hr))
+   {
+      Listener = socket(
+         Addresses->ai_family,
+         Addresses->ai_socktype,
+         Addresses->ai_protocol
+      );
+      if (Listener == INVALID_SOCKET)
+         hr = HRESULT_FROM_WIN32(WSAGetLastError());
+   }
+
+   if (SUCCEEDED(hr) &&
+       (bind(
+           Listener,
+           Addresses->ai_addr,
+           (INT)Addresses->ai_addrlen) == SOCKET_ERROR ||
+        listen(Listener, SOMAXCONN) == SOCKET_ERROR))
+   {
+      hr = HRESULT_FROM_WIN32(WSAGetLastError());
+   }
+
+   while (SUCCEEDED(hr))
+   {
+      SOCKET Client = accept(Listener, NULL, NULL);
+      PHTTP_CONNECTION Connection = NULL;
+      HANDLE Thread = NULL;
+
+      if (Client == INVALID_SOCKET)
+      {
+         hr = HRESULT_FROM_WIN32(WSAGetLastError());
+         break;
+      }
+
+      Connection = malloc(sizeof(*Connection));
+      if (Connection)
+      {
+         Connection->Server = &Server;
+         Connection->Socket = Client;
+
+         Thread = CreateThread(
+            NULL,
+            0,
+            ServeConnection,
+            Connection,
+            0,
+            NULL
+         );
+      }
+
+      if (Thread)
+      {
+         CloseHandle(Thread);
+      }
+      else
+      {
+         closesocket(Client);
+         free(Connection);
+      }
+   }
+
+   if (Listener != INVALID_SOCKET)
+      closesocket(Listener);
+   if (Addresses)
+      FreeAddrInfoW(Addresses);
+   return hr;
+}
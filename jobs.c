@@ -0,0 +1,339 @@
+/*
+ * Copyright (c) 2017 Andrew Sveikauskas
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ */
+
+#include "clwrapper.h"
+#include <stdlib.h>
+#include <string.h>
+
+//
+// `cc -jN -c a.c b.c ...` compiles each source in its own cl process, up to
+// N at a time.  Each one goes through CcExecute() on its own, so it gets
+// the object cache just like a single-file compile would.
+//
+// Every compile uses /Z7, so that the processes don't all queue up on one
+// vcNNN.pdb.  Their output is held until the compile finishes, then
+// written out in one piece, so diagnostics from different files don't
+// interleave.
+//
+// The compilers are started in a job object.  After the first failure no
+// more compiles are started, the job is terminated, and anything the
+// killed compilers printed is thrown away.
+//
+// Under make -j, the first compile runs on the token make gave us, and
+// each other one takes a token from make's jobserver (see jobserver.c), so
+// the whole build stays within make's limit.
+//
+
+typedef struct _JOB_SET
+{
+   PCC_ARGS Args;
+   PCLWRAPPER_TOOLSET Toolset;
+   const LAUNCH_PARAMS *Launch;
+   HANDLE Job;
+   PJOBSERVER Jobserver;
+
+   //
+   // The compile server's environment for this request, if any; the
+   // threads we start need it as well.
+   //
+   PCWSTR Environment;
+
+   //
+   // Signalled once there's nothing left to start, to wake up threads
+   // waiting for a jobserver token.
+   //
+   HANDLE Wake;
+
+   //
+   // Protected by Lock.  Writes to the caller's output are also made
+   // while holding it.
+   //
+   CRITICAL_SECTION Lock;
+   PSTRING_LIST NextInput;
+   BOOL Cancelled;
+   DWORD ExitCode;
+   HRESULT Result;
+} JOB_SET, *PJOB_SET;
+
+// Several sources to objects, with the objects either in the current
+// directory or in the directory named by -o.  With -MD, each source needs
+// its own cl anyway, so they're split up even without -j.
+//
+static BOOL
+IsParallelizable(
+   PCC_ARGS Args
+)
+{
+   PSTRING_LIST List;
+
+   if ((Args->Jobs < 2 && !Args->Deps) ||
+       Args->OutputType != CC_OBJECT_FILE ||
+       Args->PreprocessOnly ||
+       !Args->Inputs ||
+       !Args->Inputs->Next)
+   {
+      return FALSE;
+   }
+
+   if (Args->OutputName && !IsDirectoryName(Args->OutputName))
+      return FALSE;
+
+   for (List = Args->Inputs; List; List = List->Next)
+   {
+      if (!CcIsSourceFile(List->String))
+         return FALSE;
+   }
+
+   return TRUE;
+}
+
+static HRESULT
+RunOneJob(
+   PJOB_SET Set,
+   PCWSTR Input
+)
+{
+   HRESULT hr = S_OK;
+   CC_ARGS Args = *Set->Args;
+   LAUNCH_PARAMS Launch = {0};
+   LAUNCH_OUTPUT Output = {0};
+   PSTRING_LIST Inputs = NULL;
+   PWSTR ObjectName = NULL;
+   DWORD ExitCode = 0;
+
+   hr = StringListAllocString(Input, NULL, &Inputs);
+
+   // -o names a directory; the object goes in it, named after the source.
+   //
+   if (SUCCEEDED(hr) && Args.OutputName)
+   {
+      PCWSTR Base = CcBaseName(Input);
+      PCWSTR Dot = wcsrchr(Base, L'.');
+
+      hr = HeapPrintf(
+         &ObjectName,
+         L"%s%.*s.obj",
+         Args.OutputName,
+         (INT)(Dot - Base),
+         Base
+      );
+   }
+
+   if (SUCCEEDED(hr))
+   {
+      Args.Inputs = Inputs;
+      Args.Jobs = 1;
+      Args.EmbedDebugInfo = TRUE;
+
+      // -MF and -MT can only describe one object; each gets the default,
+      // a .d file next to it.
+      //
+      Args.DepsFile = NULL;
+      Args.DepsTarget = NULL;
+      if (ObjectName)
+         Args.OutputName = ObjectName;
+
+      if (Set->Launch)
+         Launch = *Set->Launch;
+      Launch.Job = Set->Job;
+      Launch.OutputCallback = LaunchBufferOutput;
+      Launch.CallbackContext = &Output;
+
+      hr = CcExecute(&Args, Set->Toolset, &Launch, &ExitCode);
+   }
+
+   EnterCriticalSection(&Set->Lock);
+
+   // Once we've given up, whatever the other compiles say is likely to be
+   // the result of being killed.
+   //
+   if (!Set->Cancelled)
+   {
+      HRESULT hr2 = S_OK;
+
+      hr2 = LaunchReplayOutput(Set->Launch, &Output);
+      if (SUCCEEDED(hr))
+         hr = hr2;
+
+      if (FAILED(hr) || ExitCode)
+      {
+         Set->Cancelled = TRUE;
+         Set->Result = hr;
+         Set->ExitCode = ExitCode;
+
+         if (Set->Job)
+            TerminateJobObject(Set->Job, ERROR_CANCELLED);
+         if (Set->Wake)
+            SetEvent(Set->Wake);
+      }
+   }
+
+   LeaveCriticalSection(&Set->Lock);
+
+   LaunchFreeOutput(&Output);
+   FreeStringList(Inputs);
+   free(ObjectName);
+   return hr;
+}
+
+static VOID
+RunJobs(
+   PJOB_SET Set,
+   BOOL NeedToken
+)
+{
+   for (;;)
+   {
+      PCWSTR Input = NULL;
+
+      if (NeedToken &&
+          Set->Jobserver &&
+          JobserverAcquire(Set->Jobserver, Set->Wake) != S_OK)
+      {
+         break;
+      }
+
+      EnterCriticalSection(&Set->Lock);
+      if (!Set->Cancelled && Set->NextInput)
+      {
+         Input = Set->NextInput->String;
+         Set->NextInput = Set->NextInput->Next;
+         if (!Set->NextInput && Set->Wake)
+            SetEvent(Set->Wake);
+      }
+      LeaveCriticalSection(&Set->Lock);
+
+      if (Input)
+         RunOneJob(Set, Input);
+
+      if (NeedToken && Set->Jobserver)
+         JobserverRelease(Set->Jobserver);
+
+      if (!Input)
+         break;
+   }
+}
+
+static DWORD WINAPI
+JobThread(
+   PVOID Context
+)
+{
+   PJOB_SET Set = Context;
+
+   SetThreadEnvironment(Set->Environment);
+   RunJobs(Set, TRUE);
+   return 0;
+}
+
+// If we can't have a job object (say, we're already in one that doesn't
+// allow nesting), compiles still run in parallel; they just can't be
+// killed early.
+//
+static HANDLE
+CreateCompilerJob(VOID)
+{
+   HANDLE Job = CreateJobObject(NULL, NULL);
+   JOBOBJECT_EXTENDED_LIMIT_INFORMATION Limits = {0};
+
+   // If we die, so should the compilers.
+   //
+   if (Job)
+   {
+      Limits.BasicLimitInformation.LimitFlags =
+         JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE;
+
+      SetInformationJobObject(
+         Job,
+         JobObjectExtendedLimitInformation,
+         &Limits,
+         sizeof(Limits)
+      );
+   }
+
+   return Job;
+}
+
+//
+// Runs a multi-source compile as parallel single-source compiles, if -j
+// asked for that and the compile is one we can split up.  Returns S_FALSE
+// if it did nothing, and the caller should compile as usual.
+//
+HRESULT
+JobsExecute(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   const LAUNCH_PARAMS *Launch,
+   PDWORD ReturnValue
+)
+{
+   JOB_SET Set = {0};
+   PHANDLE Threads = NULL;
+   DWORD NumInputs = 0;
+   DWORD NumThreads = 0;
+   DWORD i;
+   PSTRING_LIST List;
+
+   if (!IsParallelizable(Args))
+      return S_FALSE;
+
+   for (List = Args->Inputs; List; List = List->Next)
+      ++NumInputs;
+
+   Set.Args = Args;
+   Set.Toolset = Toolset;
+   Set.Launch = Launch;
+   Set.Job = CreateCompilerJob();
+   Set.NextInput = Args->Inputs;
+   Set.Environment = GetThreadEnvironment();
+   InitializeCriticalSection(&Set.Lock);
+
+   // Without an event to wake them, threads could sit waiting for a token
+   // long after the last compile was handed out.
+   //
+   if (JobserverOpen(&Set.Jobserver) == S_OK)
+   {
+      Set.Wake = CreateEvent(NULL, TRUE, FALSE, NULL);
+      if (!Set.Wake)
+      {
+         JobserverClose(Set.Jobserver);
+         Set.Jobserver = NULL;
+      }
+   }
+
+   // This thread is one of the workers.
+   //
+   NumThreads = min(max(Args->Jobs, 1), NumInputs) - 1;
+   Threads = malloc(NumThreads * sizeof(*Threads));
+   for (i = 0; Threads && i < NumThreads; ++i)
+   {
+      Threads[i] = CreateThread(NULL, 0, JobThread, &Set, 0, NULL);
+      if (!Threads[i])
+         break;
+   }
+   NumThreads = Threads ? i : 0;
+
+   RunJobs(&Set, FALSE);
+
+   for (i = 0; i < NumThreads; ++i)
+   {
+      WaitForSingleObject(Threads[i], INFINITE);
+      CloseHandle(Threads[i]);
+   }
+
+   if (Set.Job)
+      CloseHandle(Set.Job);
+   if (Set.Wake)
+      CloseHandle(Set.Wake);
+   JobserverClose(Set.Jobserver);
+   DeleteCriticalSection(&Set.Lock);
+   free(Threads);
+
+   *ReturnValue = Set.ExitCode;
+   return Set.Result;
+}
@@ -0,0 +1,486 @@
+/*
+ * Copyright (c) 2017 Andrew Sveikauskas
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ */
+
+#include "clwrapper.h"
+#include <stdlib.h>
+#include <string.h>
+
+//
+// GNU make jobserver client.
+//
+// make passes its jobserver to children in MAKEFLAGS, as one of:
+//
+//    --jobserver-auth=gmake_semaphore_NNN   a named semaphore (Windows)
+//    --jobserver-auth=fifo:PATH             a named pipe (make 4.4 and up)
+//
+// Older makes say --jobserver-fds instead.  A job gets one implicit token
+// from make just by being started; every compile cc runs beyond the first
+// has to take a token first, and give it back when done.  The POSIX
+// "R,W" descriptor form can't be inherited by a Windows process, so it's
+// ignored, as are jobservers we can't open.
+//
+// Each make has its own jobserver.  A process normally only sees one, but
+// the compile server sees one per client build, so they're kept in a list
+// while compiles are using them.  Tokens we hold are counted, and given
+// back if we crash or are interrupted, so that make doesn't lose them.
+//
+
+typedef struct _JOBSERVER
+{
+   struct _JOBSERVER *Next;
+   LONG RefCount;
+   PWSTR Auth;
+   HANDLE Semaphore;
+   HANDLE Fifo;
+
+   //
+   // Tokens read from the fifo, so the same bytes can be written back.
+   // For the semaphore only Held.Length matters.  Protected by
+   // JobserverLock.
+   //
+   BYTE_BUFFER Held;
+} JOBSERVER;
+
+static INIT_ONCE JobserverOnce = INIT_ONCE_STATIC_INIT;
+static CRITICAL_SECTION JobserverLock;
+static PJOBSERVER Jobservers;
+
+// Finds the last --jobserver-auth= (or --jobserver-fds=) in MAKEFLAGS;
+// with recursive make, the innermost one comes last.
+//
+static HRESULT
+GetJobserverAuth(
+   PWSTR *Out
+)
+{
+   HRESULT hr = S_OK;
+   PCWSTR Options[] = {L"--jobserver-auth=", L"--jobserver-fds="};
+   PWSTR MakeFlags = NULL;
+   PCWSTR Found = NULL;
+   PCWSTR p;
+   DWORD i;
+
+   *Out = NULL;
+
+   hr = GetEnvironmentString(L"MAKEFLAGS", &MakeFlags);
+
+   for (i = 0; hr == S_OK && i < ARRAYSIZE(Options); ++i)
+   {
+      for (p = MakeFlags; (p = wcsstr(p, Options[i])); ++p)
+      {
+         if (p > Found)
+            Found = p;
+      }
+   }
+
+   if (hr == S_OK && Found)
+   {
+      PCWSTR Value = wcschr(Found, L'=') + 1;
+
+      hr = HeapPrintf(Out, L"%.*s", (INT)wcscspn(Value, L" \t"), Value);
+   }
+   else if (SUCCEEDED(hr))
+   {
+      hr = S_FALSE;
+   }
+
+   free(MakeFlags);
+   return hr;
+}
+
+// The fifo is opened for overlapped I/O, so that a wait for a token can be
+// abandoned; writes have to be overlapped too.
+//
+static VOID
+WriteFifo(
+   PJOBSERVER Jobserver,
+   const BYTE *Data,
+   DWORD Length
+)
+{
+   OVERLAPPED Overlapped = {0};
+   DWORD Written = 0;
+
+   Overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+   if (!Overlapped.hEvent)
+      return;
+
+   if (WriteFile(Jobserver->Fifo, Data, Length, NULL, &Overlapped) ||
+       GetLastError() == ERROR_IO_PENDING)
+   {
+      GetOverlappedResult(Jobserver->Fifo, &Overlapped, &Written, TRUE);
+   }
+
+   CloseHandle(Overlapped.hEvent);
+}
+
+// Called with JobserverLock held.
+//
+static VOID
+ReleaseHeld(
+   PJOBSERVER Jobserver
+)
+{
+   if (Jobserver->Held.Length)
+   {
+      if (Jobserver->Semaphore)
+      {
+         ReleaseSemaphore(
+            Jobserver->Semaphore,
+            (LONG)Jobserver->Held.Length,
+            NULL
+         );
+      }
+      else
+      {
+         WriteFifo(
+            Jobserver,
+            Jobserver->Held.Buffer,
+            (DWORD)Jobserver->Held.Length
+         );
+      }
+
+      Jobserver->Held.Length = 0;
+   }
+}
+
+static VOID
+ReleaseAllHeld(VOID)
+{
+   PJOBSERVER Jobserver;
+
+   EnterCriticalSection(&JobserverLock);
+
+   for (Jobserver = Jobservers; Jobserver; Jobserver = Jobserver->Next)
+      ReleaseHeld(Jobserver);
+
+   LeaveCriticalSection(&JobserverLock);
+}
+
+static LPTOP_LEVEL_EXCEPTION_FILTER PreviousFilter;
+
+static LONG WINAPI
+CrashFilter(
+   PEXCEPTION_POINTERS Exception
+)
+{
+   ReleaseAllHeld();
+
+   if (PreviousFilter)
+      return PreviousFilter(Exception);
+   return EXCEPTION_CONTINUE_SEARCH;
+}
+
+// Let the default handler end the process once the tokens are back.
+//
+static BOOL WINAPI
+CtrlHandler(
+   DWORD Type
+)
+{
+   ReleaseAllHeld();
+   return FALSE;
+}
+
+static BOOL CALLBACK
+InitJobservers(
+   PINIT_ONCE Once,
+   PVOID Parameter,
+   PVOID *Context
+)
+{
+   InitializeCriticalSection(&JobserverLock);
+
+   PreviousFilter = SetUnhandledExceptionFilter(CrashFilter);
+   SetConsoleCtrlHandler(CtrlHandler, TRUE);
+   return TRUE;
+}
+
+static VOID
+FreeJobserver(
+   PJOBSERVER Jobserver
+)
+{
+   if (Jobserver->Semaphore)
+      CloseHandle(Jobserver->Semaphore);
+   if (Jobserver->Fifo)
+      CloseHandle(Jobserver->Fifo);
+   FreeBuffer(&Jobserver->Held);
+   free(Jobserver->Auth);
+   free(Jobserver);
+}
+
+// Returns S_FALSE if make didn't give us a jobserver, or gave us one we
+// can't open.
+//
+static HRESULT
+CreateJobserver(
+   PWSTR Auth,
+   PJOBSERVER *Out
+)
+{
+   PJOBSERVER Jobserver = malloc(sizeof(*Jobserver));
+
+   if (!Jobserver)
+   {
+      free(Auth);
+      return E_OUTOFMEMORY;
+   }
+
+   memset(Jobserver, 0, sizeof(*Jobserver));
+   Jobserver->RefCount = 1;
+   Jobserver->Auth = Auth;
+
+   if (!wcsncmp(Auth, L"fifo:", 5))
+   {
+      Jobserver->Fifo = CreateFile(
+         Auth + 5,
+         GENERIC_READ | GENERIC_WRITE,
+         FILE_SHARE_READ | FILE_SHARE_WRITE,
+         NULL,
+         OPEN_EXISTING,
+         FILE_FLAG_OVERLAPPED,
+         NULL
+      );
+      if (Jobserver->Fifo == INVALID_HANDLE_VALUE)
+         Jobserver->Fifo = NULL;
+   }
+   else if (!wcschr(Auth, L','))
+   {
+      Jobserver->Semaphore = OpenSemaphore(
+         SEMAPHORE_MODIFY_STATE | SYNCHRONIZE,
+         FALSE,
+         Auth
+      );
+   }
+
+   if (!Jobserver->Semaphore && !Jobserver->Fifo)
+   {
+      FreeJobserver(Jobserver);
+      Jobserver = NULL;
+   }
+
+   *Out = Jobserver;
+   return Jobserver ? S_OK : S_FALSE;
+}
+
+//
+// Opens the jobserver named by MAKEFLAGS, or takes another reference to it
+// if it's open already.  Returns S_FALSE and NULL if make didn't give us
+// one.
+//
+HRESULT
+JobserverOpen(
+   PJOBSERVER *Out
+)
+{
+   HRESULT hr = S_OK;
+   PWSTR Auth = NULL;
+   PJOBSERVER Jobserver = NULL;
+
+   *Out = NULL;
+
+   hr = GetJobserverAuth(&Auth);
+   if (hr != S_OK)
+      return hr;
+
+   InitOnceExecuteOnce(&JobserverOnce, InitJobservers, NULL, NULL);
+   EnterCriticalSection(&JobserverLock);
+
+   for (Jobserver = Jobservers; Jobserver; Jobserver = Jobserver->Next)
+   {
+      if (!wcscmp(Jobserver->Auth, Auth))
+      {
+         ++Jobserver->RefCount;
+         break;
+      }
+   }
+
+   if (Jobserver)
+   {
+      free(Auth);
+   }
+   else
+   {
+      hr = CreateJobserver(Auth, &Jobserver);
+      if (hr == S_OK)
+      {
+         Jobserver->Next = Jobservers;
+         Jobservers = Jobserver;
+      }
+   }
+
+   LeaveCriticalSection(&JobserverLock);
+
+   *Out = Jobserver;
+   return hr;
+}
+
+VOID
+JobserverClose(
+   PJOBSERVER Jobserver
+)
+{
+   PJOBSERVER *Link;
+
+   if (!Jobserver)
+      return;
+
+   EnterCriticalSection(&JobserverLock);
+
+   if (--Jobserver->RefCount)
+   {
+      Jobserver = NULL;
+   }
+   else
+   {
+      for (Link = &Jobservers; *Link != Jobserver; Link = &(*Link)->Next)
+         ;
+      *Link = Jobserver->Next;
+
+      ReleaseHeld(Jobserver);
+   }
+
+   LeaveCriticalSection(&JobserverLock);
+
+   if (Jobserver)
+      FreeJobserver(Jobserver);
+}
+
+static HRESULT
+ReadFifoToken(
+   PJOBSERVER Jobserver,
+   HANDLE Wake,
+   PBYTE Token
+)
+{
+   HRESULT hr = S_OK;
+   OVERLAPPED Overlapped = {0};
+   DWORD Read = 0;
+
+   Overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+   if (!Overlapped.hEvent)
+      return HRESULT_FROM_WIN32(GetLastError());
+
+   if (!ReadFile(Jobserver->Fifo, Token, 1, NULL, &Overlapped) &&
+       GetLastError() != ERROR_IO_PENDING)
+   {
+      hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   if (SUCCEEDED(hr))
+   {
+      HANDLE Handles[] = {Overlapped.hEvent, Wake};
+
+      if (WaitForMultipleObjects(
+             Wake ? 2 : 1,
+             Handles,
+             FALSE,
+             INFINITE) != WAIT_OBJECT_0)
+      {
+         CancelIoEx(Jobserver->Fifo, &Overlapped);
+      }
+
+      // A read that completed anyway still took a token.
+      //
+      if (!GetOverlappedResult(Jobserver->Fifo, &Overlapped, &Read, TRUE))
+      {
+         hr = GetLastError() == ERROR_OPERATION_ABORTED ?
+            S_FALSE :
+            HRESULT_FROM_WIN32(GetLastError());
+      }
+      else if (!Read)
+      {
+         hr = HRESULT_FROM_WIN32(ERROR_HANDLE_EOF);
+      }
+   }
+
+   CloseHandle(Overlapped.hEvent);
+   return hr;
+}
+
+//
+// Waits for a token.  Returns S_FALSE without one if Wake is signalled
+// first.
+//
+HRESULT
+JobserverAcquire(
+   PJOBSERVER Jobserver,
+   HANDLE Wake
+)
+{
+   HRESULT hr = S_OK;
+   BYTE Token = '+';
+
+   if (Jobserver->Semaphore)
+   {
+      HANDLE Handles[] = {Jobserver->Semaphore, Wake};
+
+      switch (WaitForMultipleObjects(Wake ? 2 : 1, Handles, FALSE, INFINITE))
+      {
+      case WAIT_OBJECT_0:
+         break;
+      case WAIT_OBJECT_0 + 1:
+         hr = S_FALSE;
+         break;
+      default:
+         hr = HRESULT_FROM_WIN32(GetLastError());
+      }
+   }
+   else
+   {
+      hr = ReadFifoToken(Jobserver, Wake, &Token);
+   }
+
+   if (hr == S_OK)
+   {
+      EnterCriticalSection(&JobserverLock);
+      hr = BufferAppend(&Jobserver->Held, &Token, 1);
+      LeaveCriticalSection(&JobserverLock);
+
+      if (FAILED(hr))
+      {
+         if (Jobserver->Semaphore)
+            ReleaseSemaphore(Jobserver->Semaphore, 1, NULL);
+         else
+            WriteFifo(Jobserver, &Token, 1);
+      }
+   }
+
+   return hr;
+}
+
+// Gives back one token taken by JobserverAcquire().
+//
+VOID
+JobserverRelease(
+   PJOBSERVER Jobserver
+)
+{
+   EnterCriticalSection(&JobserverLock);
+
+   if (Jobserver->Held.Length)
+   {
+      --Jobserver->Held.Length;
+
+      if (Jobserver->Semaphore)
+      {
+         ReleaseSemaphore(Jobserver->Semaphore, 1, NULL);
+      }
+      else
+      {
+         WriteFifo(
+            Jobserver,
+            Jobserver->Held.Buffer + Jobserver->Held.Length,
+            1
+         );
+      }
+   }
+
+   LeaveCriticalSection(&JobserverLock);
+}
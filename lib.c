@@ -26,52 +26,34 @@ LibMain(
    HRESULT hr = S_OK;
    CLWRAPPER_ARGS_BASE Args = {0};
    OUTPUT_STRING CommandLine = {0};
-   PVS_VERSION CompilerInfo = NULL;
-   PVS_VERSION SdkInfo = NULL;
-   PWSTR ClPath = NULL;
+   CLWRAPPER_TOOLSET Toolset = {0};
    PWSTR LibPath = NULL;
+   PWSTR DllDirectory = NULL;
    PSTRING_LIST Inputs = NULL;
 
    hr = LibParseArgs(&Args, Argv + 1, &Inputs);
 
    if (SUCCEEDED(hr))
    {
-      hr = FindToolset(&Args, &CompilerInfo, &SdkInfo);
+      hr = ToolsetAcquire(&Args, &Toolset);
    }
 
    if (SUCCEEDED(hr))
    {
-      const ARCHITECTURE *Arch = FindArchByConfiguration(
-         Args.DesiredArchitecture
-      );
-
-      if (Arch)
-      {
-         hr = HeapPrintf(&ClPath, L"%s", Arch->ClFile);
-         if (SUCCEEDED(hr))
-            ClPath[wcslen(ClPath) - 5] = 0;
-      }
-      else
-      {
-         hr = HeapPrintf(&ClPath, L"..\\..\\VC\\bin\\");
-      }
+      hr = ToolsetGetToolPath(&Toolset, L"lib.exe", &LibPath);
    }
 
    if (SUCCEEDED(hr))
-   {
-      hr = AddToPath(CompilerInfo->InstallDir);
-   }
+      hr = ToolsetGetDllDirectory(&Toolset, &DllDirectory);
+   if (SUCCEEDED(hr))
+      hr = AddToPath(DllDirectory);
 
    if (SUCCEEDED(hr))
       hr = AppendString(L"\"", &CommandLine);
    if (SUCCEEDED(hr))
-      hr = AppendString(CompilerInfo->InstallDir, &CommandLine);
-   if (SUCCEEDED(hr))
-      hr = AppendString(L"\\", &CommandLine);
-   if (SUCCEEDED(hr))
-      hr = AppendString(ClPath, &CommandLine);
+      hr = AppendString(LibPath, &CommandLine);
    if (SUCCEEDED(hr))
-      hr = AppendString(L"lib.exe\" ", &CommandLine);
+      hr = AppendString(L"\" ", &CommandLine);
 
    if (SUCCEEDED(hr))
    {
@@ -94,10 +76,10 @@ LibMain(
 
    FreeString(&CommandLine);
    FreeStringList(Inputs);
-   FreeVsVersions(CompilerInfo);
-   FreeVsVersions(SdkInfo);
+   ToolsetFree(&Toolset);
    BaseArgsFree(&Args);
-   free(ClPath);
+   free(LibPath);
+   free(DllDirectory);
 
    return hr;
 }
@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2017 Andrew Sveikauskas
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ */
+
+//
+// Public interface to clwrapper.lib, for build tools that want to turn a
+// gcc-style command line into a cl.exe invocation without spawning cc.exe.
+//
+// Typical use:
+//
+//    CLWRAPPER_HANDLE Handle;
+//    PCLWRAPPER_COMMAND Command;
+//
+//    ClwrapperOpen(ToolsetArgc, ToolsetArgv, &Handle);   // once
+//    ...
+//    ClwrapperTranslate(Handle, Argc, Argv, &Command);   // per compile
+//    CreateProcess(
+//       Command->ApplicationName,
+//       Command->CommandLine,
+//       ...,
+//       CREATE_UNICODE_ENVIRONMENT,
+//       Command->Environment,
+//       ...
+//    );
+//    ClwrapperFreeCommand(Command);
+//    ...
+//    ClwrapperClose(Handle);
+//
+// Everything here is safe to call from multiple threads, as long as a given
+// handle is not closed while it's in use.
+//
+
+#ifndef libclwrapper_h
+#define libclwrapper_h
+
+#include <windows.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+typedef struct _CLWRAPPER *CLWRAPPER_HANDLE;
+
+typedef struct _CLWRAPPER_COMMAND
+{
+   //
+   // Full path to the program to run: cl.exe, or link.exe if there's
+   // nothing to compile.
+   //
+   PWSTR ApplicationName;
+
+   //
+   // Complete command line, starting with the quoted ApplicationName.  This
+   // is writable, as CreateProcess() wants.
+   //
+   PWSTR CommandLine;
+
+   //
+   // Environment block for CREATE_UNICODE_ENVIRONMENT.  Shared by every
+   // command from the same handle.
+   //
+   PCWSTR Environment;
+
+   //
+   // Files the command is expected to produce, relative to the directory it
+   // is run from, unless the arguments gave absolute paths.
+   //
+   DWORD NumOutputs;
+   PWSTR *Outputs;
+} CLWRAPPER_COMMAND, *PCLWRAPPER_COMMAND;
+
+//
+// Resolves a compiler and SDK.  Argv may contain only the toolset selection
+// options cc accepts (-V, -sdkversion, -m*, -host=, -static-crt, -toolset=,
+// --no-toolset-cache); Argc may be 0.
+//
+HRESULT
+ClwrapperOpen(
+   INT Argc,
+   PCWSTR *Argv,
+   CLWRAPPER_HANDLE *Handle
+);
+
+//
+// Translates the arguments that would follow "cc" on a command line.
+// Toolset selection options are rejected here; they belong to
+// ClwrapperOpen().  So are options that cc carries out itself, around or
+// after cl, and that one command can't: -j, -funity, -MD and -MMD,
+// -frestat, -save-temps, -include-pch, -fpch-auto, and -fmodules-ts with
+// more than one source.  These fail with E_INVALIDARG.
+//
+HRESULT
+ClwrapperTranslate(
+   CLWRAPPER_HANDLE Handle,
+   INT Argc,
+   PCWSTR *Argv,
+   PCLWRAPPER_COMMAND *Command
+);
+
+VOID
+ClwrapperFreeCommand(
+   PCLWRAPPER_COMMAND Command
+);
+
+VOID
+ClwrapperClose(
+   CLWRAPPER_HANDLE Handle
+);
+
+#if defined(__cplusplus)
+}
+#endif
+#endif
@@ -0,0 +1,465 @@
+/*
+ * Copyright (c) 2017 Andrew Sveikauskas
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ */
+
+#include "clwrapper.h"
+#include <stdlib.h>
+#include <string.h>
+
+//
+// Direct mode manifests.
+//
+// The object cache normally keys on preprocessor output, which means
+// running the preprocessor on every lookup.  A manifest remembers, for a
+// given source file and set of options, which headers the last compile read
+// and what they contained.  If none of them have changed, the object key
+// recorded in the manifest is still good, and cl doesn't need to run at
+// all.
+//
+// Format:
+//
+//    DWORD Magic, Version
+//    BYTE ObjectKey[HASH_LENGTH]
+//    DWORD Count
+//    Count times:
+//       String Path
+//       ULONGLONG Size, WriteTime
+//       BYTE Digest[HASH_LENGTH]
+//
+
+#define MANIFEST_MAGIC   0x464d4c43 // 'CLMF'
+#define MANIFEST_VERSION 1
+
+// A file that expands __DATE__ or __TIME__ preprocesses differently every
+// time, so nothing that depends on it can be looked up without running the
+// preprocessor.
+//
+static BOOL
+UsesTimeMacros(
+   const BYTE *Data,
+   SIZE_T Length
+)
+{
+   static const char *Macros[] = {"__DATE__", "__TIME__", "__TIMESTAMP__"};
+   const BYTE *p = Data;
+   const BYTE *End = Data + Length;
+   DWORD i;
+
+   while (End - p >= 8 && (p = memchr(p, '_', End - p - 7)))
+   {
+      if (p[1] == '_')
+      {
+         for (i = 0; i < ARRAYSIZE(Macros); ++i)
+         {
+            SIZE_T MacroLength = strlen(Macros[i]);
+
+            if ((SIZE_T)(End - p) >= MacroLength &&
+                !memcmp(p, Macros[i], MacroLength))
+            {
+               return TRUE;
+            }
+         }
+      }
+
+      ++p;
+   }
+
+   return FALSE;
+}
+
+//
+// Hashes what's in Path now, noting its size and write time alongside.
+//
+HRESULT
+ManifestGetFileDigest(
+   PCWSTR Path,
+   PFILE_DIGEST Digest
+)
+{
+   HRESULT hr = S_OK;
+   WIN32_FILE_ATTRIBUTE_DATA Attributes = {0};
+   BYTE_BUFFER Contents = {0};
+   HASH_CONTEXT Hash = {0};
+
+   memset(Digest, 0, sizeof(*Digest));
+
+   if (!GetFileAttributesEx(Path, GetFileExInfoStandard, &Attributes))
+      hr = HRESULT_FROM_WIN32(GetLastError());
+
+   if (SUCCEEDED(hr))
+   {
+      Digest->Size = ((ULONGLONG)Attributes.nFileSizeHigh << 32) |
+                     Attributes.nFileSizeLow;
+      Digest->WriteTime = FileTimeToQword(&Attributes.ftLastWriteTime);
+
+      hr = ReadFileContents(Path, &Contents);
+   }
+
+   if (SUCCEEDED(hr))
+      hr = HashInit(&Hash);
+   if (SUCCEEDED(hr))
+      hr = HashData(&Hash, Contents.Buffer, Contents.Length);
+   if (SUCCEEDED(hr))
+      hr = HashFinish(&Hash, Digest->Digest);
+
+   if (SUCCEEDED(hr))
+   {
+      Digest->UsesTimeMacros = UsesTimeMacros(
+         Contents.Buffer,
+         Contents.Length
+      );
+   }
+
+   HashFree(&Hash);
+   FreeBuffer(&Contents);
+   return hr;
+}
+
+//
+// Computes the key the manifest for a compile is stored under.  Returns
+// S_FALSE if the source can't be handled in direct mode.
+//
+HRESULT
+ManifestComputeKey(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   PCWSTR Cwd,
+   BYTE Digest[HASH_LENGTH]
+)
+{
+   HRESULT hr = S_OK;
+   PWSTR SourcePath = NULL;
+   PWSTR Include = NULL;
+   FILE_DIGEST Source = {0};
+   HASH_CONTEXT Hash = {0};
+   PSTRING_LIST List;
+
+   hr = MakeAbsolute(Cwd, Args->Inputs->String, &SourcePath);
+
+   if (SUCCEEDED(hr))
+      hr = ManifestGetFileDigest(SourcePath, &Source);
+   if (SUCCEEDED(hr) && Source.UsesTimeMacros)
+      hr = S_FALSE;
+
+   if (hr == S_OK)
+      hr = HashInit(&Hash);
+   if (hr == S_OK)
+      hr = HashDword(&Hash, MANIFEST_VERSION);
+   if (hr == S_OK)
+      hr = CacheHashCompileContext(&Hash, Args, Toolset);
+
+   // Where headers will be searched for...
+   //
+   if (hr == S_OK)
+      hr = HashStringList(&Hash, Args->IncludePaths);
+   if (hr == S_OK)
+      hr = HashStringList(&Hash, Toolset->IncludePaths);
+   if (hr == S_OK)
+   {
+      hr = GetEnvironmentString(L"INCLUDE", &Include);
+      if (SUCCEEDED(hr))
+         hr = HashString(&Hash, Include);
+   }
+   if (hr == S_OK)
+      hr = HashString(&Hash, Cwd);
+
+   // -include headers, by name and by where they are if they're in the
+   // current directory; otherwise they're found on the include path, like
+   // any other header.
+   //
+   for (List = Args->ForcedIncludes; hr == S_OK && List; List = List->Next)
+   {
+      PWSTR Path = NULL;
+
+      hr = HashString(&Hash, List->String);
+      if (hr == S_OK)
+         hr = MakeAbsolute(Cwd, List->String, &Path);
+      if (hr == S_OK)
+      {
+         hr = HashString(
+            &Hash,
+            GetFileAttributes(Path) != INVALID_FILE_ATTRIBUTES ? Path : NULL
+         );
+      }
+
+      free(Path);
+   }
+
+   // And the source itself.
+   //
+   if (hr == S_OK)
+      hr = HashString(&Hash, Args->Inputs->String);
+   if (hr == S_OK)
+      hr = HashData(&Hash, Source.Digest, HASH_LENGTH);
+
+   if (hr == S_OK)
+      hr = HashFinish(&Hash, Digest);
+
+   HashFree(&Hash);
+   free(Include);
+   free(SourcePath);
+   return hr;
+}
+
+//
+// Returns S_FALSE if there is no manifest, or if any of the headers it
+// lists have changed.
+//
+HRESULT
+ManifestLookup(
+   PCWSTR Path,
+   PCWSTR Cwd,
+   BYTE ObjectDigest[HASH_LENGTH]
+)
+{
+   HRESULT hr = S_OK;
+   BYTE_BUFFER Contents = {0};
+   BUFFER_READER Reader = {0};
+   DWORD Magic = 0;
+   DWORD Version = 0;
+   DWORD Count = 0;
+
+   if (FAILED(ReadFileContents(Path, &Contents)))
+      return S_FALSE;
+
+   Reader.Data = Contents.Buffer;
+   Reader.Length = Contents.Length;
+
+   hr = ReaderReadDword(&Reader, &Magic);
+   if (SUCCEEDED(hr))
+      hr = ReaderReadDword(&Reader, &Version);
+   if (SUCCEEDED(hr) &&
+       (Magic != MANIFEST_MAGIC || Version != MANIFEST_VERSION))
+   {
+      hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+   }
+   if (SUCCEEDED(hr))
+      hr = ReaderRead(&Reader, ObjectDigest, HASH_LENGTH);
+   if (SUCCEEDED(hr))
+      hr = ReaderReadDword(&Reader, &Count);
+
+   while (hr == S_OK && Count--)
+   {
+      PWSTR Include = NULL;
+      PWSTR IncludePath = NULL;
+      ULONGLONG Size = 0;
+      ULONGLONG WriteTime = 0;
+      BYTE Expected[HASH_LENGTH];
+      WIN32_FILE_ATTRIBUTE_DATA Attributes = {0};
+
+      hr = ReaderReadString(&Reader, &Include);
+      if (SUCCEEDED(hr) && !Include)
+         hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+      if (SUCCEEDED(hr))
+         hr = ReaderReadQword(&Reader, &Size);
+      if (SUCCEEDED(hr))
+         hr = ReaderReadQword(&Reader, &WriteTime);
+      if (SUCCEEDED(hr))
+         hr = ReaderRead(&Reader, Expected, HASH_LENGTH);
+      if (SUCCEEDED(hr))
+         hr = MakeAbsolute(Cwd, Include, &IncludePath);
+
+      if (SUCCEEDED(hr) &&
+          !GetFileAttributesEx(
+             IncludePath,
+             GetFileExInfoStandard,
+             &Attributes))
+      {
+         hr = S_FALSE;
+      }
+
+      if (hr == S_OK &&
+          Size != (((ULONGLONG)Attributes.nFileSizeHigh << 32) |
+                   Attributes.nFileSizeLow))
+      {
+         hr = S_FALSE;
+      }
+
+      // Same size and timestamp is as good as the same contents.
+      // Otherwise, it might have been touched without changing.
+      //
+      if (hr == S_OK &&
+          (!WriteTime ||
+           WriteTime != FileTimeToQword(&Attributes.ftLastWriteTime)))
+      {
+         FILE_DIGEST Current = {0};
+
+         hr = ManifestGetFileDigest(IncludePath, &Current);
+         if (SUCCEEDED(hr) &&
+             (Current.UsesTimeMacros ||
+              memcmp(Current.Digest, Expected, HASH_LENGTH)))
+         {
+            hr = S_FALSE;
+         }
+      }
+
+      free(IncludePath);
+      free(Include);
+   }
+
+   // A damaged manifest, or one naming a header that's gone, is a miss.
+   //
+   if (FAILED(hr))
+      hr = S_FALSE;
+
+   FreeBuffer(&Contents);
+   return hr;
+}
+
+//
+// Lists the headers a manifest names, in the order they were recorded,
+// without checking them.
+//
+HRESULT
+ManifestGetIncludes(
+   PCWSTR Path,
+   PSTRING_LIST *Includes
+)
+{
+   HRESULT hr = S_OK;
+   BYTE_BUFFER Contents = {0};
+   BUFFER_READER Reader = {0};
+   DWORD Magic = 0;
+   DWORD Version = 0;
+   DWORD Count = 0;
+   BYTE Skipped[HASH_LENGTH];
+   PSTRING_LIST List = NULL;
+
+   hr = ReadFileContents(Path, &Contents);
+
+   Reader.Data = Contents.Buffer;
+   Reader.Length = Contents.Length;
+
+   if (SUCCEEDED(hr))
+      hr = ReaderReadDword(&Reader, &Magic);
+   if (SUCCEEDED(hr))
+      hr = ReaderReadDword(&Reader, &Version);
+   if (SUCCEEDED(hr) &&
+       (Magic != MANIFEST_MAGIC || Version != MANIFEST_VERSION))
+   {
+      hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+   }
+   if (SUCCEEDED(hr))
+      hr = ReaderRead(&Reader, Skipped, HASH_LENGTH);
+   if (SUCCEEDED(hr))
+      hr = ReaderReadDword(&Reader, &Count);
+
+   while (SUCCEEDED(hr) && Count--)
+   {
+      PWSTR Include = NULL;
+      ULONGLONG Skip = 0;
+
+      hr = ReaderReadString(&Reader, &Include);
+      if (SUCCEEDED(hr) && !Include)
+         hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+      if (SUCCEEDED(hr))
+         hr = ReaderReadQword(&Reader, &Skip);
+      if (SUCCEEDED(hr))
+         hr = ReaderReadQword(&Reader, &Skip);
+      if (SUCCEEDED(hr))
+         hr = ReaderRead(&Reader, Skipped, HASH_LENGTH);
+      if (SUCCEEDED(hr))
+         hr = StringListAllocString(Include, List, &List);
+
+      free(Include);
+   }
+
+   if (SUCCEEDED(hr))
+   {
+      StringListReverse(&List);
+      *Includes = List;
+      List = NULL;
+   }
+
+   FreeStringList(List);
+   FreeBuffer(&Contents);
+   return hr;
+}
+
+//
+// Records that, given the headers in Includes as they are now, the compile
+// started at Started produces the object cached under ObjectDigest.
+// Returns S_FALSE without writing anything if that can't be relied upon,
+// as when a header was written after the compile started, and may not be
+// what it read.
+//
+HRESULT
+ManifestStore(
+   PCWSTR Path,
+   PCWSTR Cwd,
+   const BYTE ObjectDigest[HASH_LENGTH],
+   PSTRING_LIST Includes,
+   ULONGLONG Started
+)
+{
+   HRESULT hr = S_OK;
+   BYTE_BUFFER Manifest = {0};
+   PSTRING_LIST Node;
+   DWORD Count = 0;
+   FILETIME NowFileTime;
+   ULONGLONG Now;
+
+   // Practically everything includes something.  No includes at all more
+   // likely means the notes weren't recognized (cl's messages are
+   // localized), and a manifest that claims no dependencies would be
+   // wrong.
+   //
+   if (!Includes)
+      return S_FALSE;
+
+   GetSystemTimeAsFileTime(&NowFileTime);
+   Now = FileTimeToQword(&NowFileTime);
+
+   for (Node = Includes; Node; Node = Node->Next)
+      ++Count;
+
+   hr = BufferAppendDword(&Manifest, MANIFEST_MAGIC);
+   if (SUCCEEDED(hr))
+      hr = BufferAppendDword(&Manifest, MANIFEST_VERSION);
+   if (SUCCEEDED(hr))
+      hr = BufferAppend(&Manifest, ObjectDigest, HASH_LENGTH);
+   if (SUCCEEDED(hr))
+      hr = BufferAppendDword(&Manifest, Count);
+
+   for (Node = Includes; hr == S_OK && Node; Node = Node->Next)
+   {
+      PWSTR IncludePath = NULL;
+      FILE_DIGEST Digest = {0};
+
+      hr = MakeAbsolute(Cwd, Node->String, &IncludePath);
+      if (SUCCEEDED(hr))
+         hr = ManifestGetFileDigest(IncludePath, &Digest);
+      if (SUCCEEDED(hr) &&
+          (Digest.UsesTimeMacros || Digest.WriteTime >= Started))
+      {
+         hr = S_FALSE;
+      }
+
+      // A racy timestamp isn't recorded; the contents are always checked
+      // instead.
+      //
+      if (hr == S_OK && Now - Digest.WriteTime < FILE_RACY_AGE)
+         Digest.WriteTime = 0;
+
+      if (hr == S_OK)
+         hr = BufferAppendString(&Manifest, IncludePath);
+      if (hr == S_OK)
+         hr = BufferAppendQword(&Manifest, Digest.Size);
+      if (hr == S_OK)
+         hr = BufferAppendQword(&Manifest, Digest.WriteTime);
+      if (hr == S_OK)
+         hr = BufferAppend(&Manifest, Digest.Digest, HASH_LENGTH);
+
+      free(IncludePath);
+   }
+
+   if (hr == S_OK)
+      hr = WriteFileAtomic(Path, Manifest.Buffer, Manifest.Length);
+
+   FreeBuffer(&Manifest);
+   return hr;
+}
@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2017 Andrew Sveikauskas
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ */
+
+#include "clwrapper.h"
+#include <stdlib.h>
+#include <string.h>
+
+//
+// Memory admission control.
+//
+// With CLWRAPPER_MEMORY=1, compiles wait for room in a machine-wide pool
+// (mempool.c) before starting, sized by an estimate of their peak commit.
+//
+// Estimates are what the same source peaked at last time, kept in the
+// memory directory under our data directory, one small file per source.
+// A compile that fails in a way that looks like running out of memory is
+// tried again with a larger reservation, so it has more of the machine to
+// itself.
+//
+
+#define MEMORY_DEFAULT_ESTIMATE (512ULL * 1024 * 1024)
+#define MEMORY_RETRIES          2
+
+// Estimates are kept per source file and optimization level.
+//
+static HRESULT
+GetEstimatePath(
+   PCC_ARGS Args,
+   const LAUNCH_PARAMS *Launch,
+   PWSTR *Out
+)
+{
+   HRESULT hr = S_OK;
+   HASH_CONTEXT Hash = {0};
+   BYTE Digest[HASH_LENGTH];
+   WCHAR Key[HASH_STRING_LENGTH];
+   WCHAR Source[MAX_PATH];
+   PWSTR Absolute = NULL;
+   PWSTR Directory = NULL;
+
+   if (Launch && Launch->CurrentDirectory)
+   {
+      hr = MakeAbsolute(
+         Launch->CurrentDirectory,
+         Args->Inputs->String,
+         &Absolute
+      );
+   }
+   else if (!GetFullPathName(
+               Args->Inputs->String,
+               ARRAYSIZE(Source),
+               Source,
+               NULL))
+   {
+      hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   if (SUCCEEDED(hr))
+      hr = HashInit(&Hash);
+   if (SUCCEEDED(hr))
+      hr = HashString(&Hash, Absolute ? Absolute : Source);
+   if (SUCCEEDED(hr))
+      hr = HashDword(&Hash, Args->Optimization);
+   if (SUCCEEDED(hr))
+      hr = HashFinish(&Hash, Digest);
+
+   if (SUCCEEDED(hr))
+      hr = GetDataDirectory(L"memory", &Directory);
+   if (SUCCEEDED(hr))
+   {
+      HashToString(Digest, Key);
+      hr = HeapPrintf(Out, L"%s\\%s", Directory, Key);
+   }
+
+   HashFree(&Hash);
+   free(Directory);
+   free(Absolute);
+   return hr;
+}
+
+static ULONGLONG
+ReadEstimate(
+   PCWSTR Path
+)
+{
+   BYTE_BUFFER Contents = {0};
+   ULONGLONG Peak = 0;
+
+   if (SUCCEEDED(ReadFileContents(Path, &Contents)) &&
+       Contents.Length == sizeof(Peak))
+   {
+      memcpy(&Peak, Contents.Buffer, sizeof(Peak));
+   }
+
+   FreeBuffer(&Contents);
+
+   // Leave some headroom over last time.
+   //
+   return Peak ? Peak + Peak / 8 : MEMORY_DEFAULT_ESTIMATE;
+}
+
+static BOOL
+ContainsString(
+   PBYTE_BUFFER Buffer,
+   const char *String
+)
+{
+   SIZE_T Length = strlen(String);
+   SIZE_T i;
+
+   for (i = 0; i + Length <= Buffer->Length; ++i)
+   {
+      if (!memcmp(Buffer->Buffer + i, String, Length))
+         return TRUE;
+   }
+
+   return FALSE;
+}
+
+// cl's ways of saying it ran out of memory.
+//
+static BOOL
+LooksOutOfMemory(
+   PLAUNCH_OUTPUT Output
+)
+{
+   const char *Errors[] = {"C1002:", "C1060:", "C1076:", "C3859:"};
+   DWORD i;
+
+   for (i = 0; i < ARRAYSIZE(Errors); ++i)
+   {
+      if (ContainsString(&Output->Stdout, Errors[i]) ||
+          ContainsString(&Output->Stderr, Errors[i]))
+      {
+         return TRUE;
+      }
+   }
+
+   return FALSE;
+}
+
+//
+// Runs a single-source compile under admission control, if it's enabled.
+// Returns S_FALSE if it did nothing, and the caller should compile as
+// usual.
+//
+HRESULT
+MemoryExecute(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   const LAUNCH_PARAMS *Launch,
+   PDWORD ReturnValue
+)
+{
+   HRESULT hr = S_OK;
+   ULONGLONG PoolSize = 0;
+   PWSTR EstimatePath = NULL;
+   MEMORY_BUDGET Budget = {0};
+   LAUNCH_OUTPUT Output = {0};
+   LAUNCH_PARAMS Streamed = {0};
+   LAUNCH_PARAMS Buffered = {0};
+   DWORD Attempt;
+
+   if ((Launch && Launch->Memory) ||
+       Args->OutputType != CC_OBJECT_FILE ||
+       !Args->Inputs ||
+       Args->Inputs->Next ||
+       !CcIsSourceFile(Args->Inputs->String) ||
+       MemoryOpen(&PoolSize) != S_OK)
+   {
+      return S_FALSE;
+   }
+
+   hr = GetEstimatePath(Args, Launch, &EstimatePath);
+   if (FAILED(hr))
+      return S_FALSE;
+
+   Budget.Estimate = ReadEstimate(EstimatePath);
+
+   if (Launch)
+      Streamed = *Launch;
+   Streamed.Memory = &Budget;
+   Buffered = Streamed;
+   Buffered.OutputCallback = LaunchBufferOutput;
+   Buffered.CallbackContext = &Output;
+
+   // Output is only held back from an attempt that might be retried, so
+   // that what a failed attempt said isn't shown along with the retry.
+   //
+   for (Attempt = 0; ; ++Attempt)
+   {
+      BOOL Retryable = Attempt < MEMORY_RETRIES && Budget.Estimate < PoolSize;
+
+      LaunchFreeOutput(&Output);
+
+      hr = CcExecute(
+         Args,
+         Toolset,
+         Retryable ? &Buffered : &Streamed,
+         ReturnValue
+      );
+
+      if (FAILED(hr) ||
+          !*ReturnValue ||
+          !Retryable ||
+          !LooksOutOfMemory(&Output))
+      {
+         break;
+      }
+
+      Budget.Estimate = max(Budget.Estimate, Budget.Peak) * 2;
+   }
+
+   // Failing to remember is not an error.
+   //
+   if (Budget.Peak)
+      WriteFileAtomic(EstimatePath, &Budget.Peak, sizeof(Budget.Peak));
+
+   if (SUCCEEDED(hr))
+      hr = LaunchReplayOutput(Launch, &Output);
+
+   LaunchFreeOutput(&Output);
+   free(EstimatePath);
+   return hr;
+}
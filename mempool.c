@@ -0,0 +1,315 @@
+/*
+ * Copyright (c) 2017 Andrew Sveikauskas
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ */
+
+#include "clwrapper.h"
+#include <stdlib.h>
+#include <string.h>
+#include <psapi.h>
+
+//
+// The shared memory pool behind admission control (see memory.c).
+//
+// With CLWRAPPER_MEMORY=1, every cc process on the machine (in this
+// session) draws from one pool of memory, sized to most of physical RAM,
+// or to CLWRAPPER_MEMORY_POOL megabytes.  A compiler is started only once
+// its estimated peak commit fits in what's left; otherwise it waits.  If
+// nothing is running it is always let in, however big the estimate.
+//
+// The pool is a small shared section holding one slot per running
+// compiler.  Slots belonging to processes that have gone away without
+// releasing them are reclaimed by the next process that looks.
+//
+// This is kept apart from memory.c so that LaunchProcessEx can take
+// slots without pulling the compile pipeline into every program that
+// links the library.
+//
+
+#define MEMORY_POOL_MAGIC       0x4d4d4c43 // 'CLMM'
+#define MEMORY_POOL_SLOTS       256
+#define MEMORY_POLL_INTERVAL    250
+
+typedef struct _MEMORY_SLOT
+{
+   DWORD ProcessId;
+   ULONGLONG ProcessCreated;
+   ULONGLONG Bytes;
+} MEMORY_SLOT, *PMEMORY_SLOT;
+
+typedef struct _MEMORY_POOL
+{
+   DWORD Magic;
+   ULONGLONG Size;
+   MEMORY_SLOT Slots[MEMORY_POOL_SLOTS];
+} MEMORY_POOL, *PMEMORY_POOL;
+
+static INIT_ONCE PoolOnce = INIT_ONCE_STATIC_INIT;
+static PMEMORY_POOL Pool;
+static HANDLE PoolLock;
+static HANDLE PoolFreed;
+static ULONGLONG ProcessCreated;
+
+static ULONGLONG
+GetCreationTime(
+   HANDLE Process
+)
+{
+   FILETIME Created = {0}, Exited, Kernel, User;
+
+   GetProcessTimes(Process, &Created, &Exited, &Kernel, &User);
+   return FileTimeToQword(&Created);
+}
+
+// Pool size is given in megabytes.  By default, leave a quarter of RAM for
+// everything that isn't a compiler.
+//
+static ULONGLONG
+GetPoolSize(VOID)
+{
+   PWSTR Size = NULL;
+   ULONGLONG Bytes = 0;
+   MEMORYSTATUSEX Status = {sizeof(Status)};
+
+   GetEnvironmentString(L"CLWRAPPER_MEMORY_POOL", &Size);
+   if (Size && wcstoul(Size, NULL, 10))
+      Bytes = wcstoul(Size, NULL, 10) * 1024ULL * 1024ULL;
+   else if (GlobalMemoryStatusEx(&Status))
+      Bytes = Status.ullTotalPhys / 4 * 3;
+
+   free(Size);
+   return Bytes;
+}
+
+static BOOL
+LockPool(VOID)
+{
+   switch (WaitForSingleObject(PoolLock, INFINITE))
+   {
+   case WAIT_OBJECT_0:
+   case WAIT_ABANDONED:
+      return TRUE;
+   default:
+      return FALSE;
+   }
+}
+
+static BOOL CALLBACK
+OpenPool(
+   PINIT_ONCE Once,
+   PVOID Parameter,
+   PVOID *Context
+)
+{
+   PWSTR Enabled = NULL;
+   HANDLE Section = NULL;
+   PMEMORY_POOL View = NULL;
+   ULONGLONG Size = 0;
+
+   GetEnvironmentString(L"CLWRAPPER_MEMORY", &Enabled);
+   if (Enabled && *Enabled && wcscmp(Enabled, L"0"))
+      Size = GetPoolSize();
+
+   if (Size)
+   {
+      PoolLock = CreateMutex(NULL, FALSE, L"Local\\clwrapper-memory-lock");
+      PoolFreed = CreateEvent(
+         NULL,
+         FALSE,
+         FALSE,
+         L"Local\\clwrapper-memory-freed"
+      );
+      Section = CreateFileMapping(
+         INVALID_HANDLE_VALUE,
+         NULL,
+         PAGE_READWRITE,
+         0,
+         sizeof(MEMORY_POOL),
+         L"Local\\clwrapper-memory-pool"
+      );
+   }
+
+   if (PoolLock && PoolFreed && Section)
+   {
+      View = MapViewOfFile(
+         Section,
+         FILE_MAP_READ | FILE_MAP_WRITE,
+         0,
+         0,
+         sizeof(MEMORY_POOL)
+      );
+   }
+
+   // Whoever gets here first decides the size.
+   //
+   if (View && LockPool())
+   {
+      if (View->Magic != MEMORY_POOL_MAGIC)
+      {
+         memset(View, 0, sizeof(*View));
+         View->Magic = MEMORY_POOL_MAGIC;
+         View->Size = Size;
+      }
+
+      ReleaseMutex(PoolLock);
+
+      ProcessCreated = GetCreationTime(GetCurrentProcess());
+      Pool = View;
+   }
+   else if (View)
+   {
+      UnmapViewOfFile(View);
+   }
+
+   // The view keeps the section alive.
+   //
+   if (Section)
+      CloseHandle(Section);
+   free(Enabled);
+   return TRUE;
+}
+
+// Returns S_FALSE if admission control is off.
+//
+HRESULT
+MemoryOpen(
+   PULONGLONG PoolSize
+)
+{
+   InitOnceExecuteOnce(&PoolOnce, OpenPool, NULL, NULL);
+   if (!Pool)
+      return S_FALSE;
+
+   *PoolSize = Pool->Size;
+   return S_OK;
+}
+
+static BOOL
+IsSlotLive(
+   PMEMORY_SLOT Slot
+)
+{
+   HANDLE Process = NULL;
+   DWORD ExitCode = 0;
+   BOOL Live = FALSE;
+
+   if (Slot->ProcessId == GetCurrentProcessId())
+      return Slot->ProcessCreated == ProcessCreated;
+
+   Process = OpenProcess(
+      PROCESS_QUERY_LIMITED_INFORMATION,
+      FALSE,
+      Slot->ProcessId
+   );
+   if (Process)
+   {
+      Live = GetExitCodeProcess(Process, &ExitCode) &&
+             ExitCode == STILL_ACTIVE &&
+             GetCreationTime(Process) == Slot->ProcessCreated;
+      CloseHandle(Process);
+   }
+
+   return Live;
+}
+
+//
+// Waits until Budget's estimate fits in the pool, and takes a slot for it.
+// *SlotOut is -1 if no slot was taken.
+//
+VOID
+MemoryReserve(
+   PMEMORY_BUDGET Budget,
+   PLONG SlotOut
+)
+{
+   ULONGLONG Want = Budget->Estimate;
+
+   *SlotOut = -1;
+
+   if (!Pool)
+      return;
+
+   if (Want > Pool->Size)
+      Want = Pool->Size;
+
+   while (LockPool())
+   {
+      ULONGLONG Used = 0;
+      LONG Free = -1;
+      LONG i;
+
+      for (i = 0; i < MEMORY_POOL_SLOTS; ++i)
+      {
+         PMEMORY_SLOT Slot = &Pool->Slots[i];
+
+         if (Slot->ProcessId && !IsSlotLive(Slot))
+            memset(Slot, 0, sizeof(*Slot));
+
+         if (Slot->ProcessId)
+            Used += Slot->Bytes;
+         else if (Free < 0)
+            Free = i;
+      }
+
+      // With every slot taken, there's nothing to do but go ahead
+      // uncounted.
+      //
+      if (Free < 0 || !Used || Used + Want <= Pool->Size)
+      {
+         if (Free >= 0)
+         {
+            Pool->Slots[Free].ProcessId = GetCurrentProcessId();
+            Pool->Slots[Free].ProcessCreated = ProcessCreated;
+            Pool->Slots[Free].Bytes = Want;
+         }
+
+         *SlotOut = Free;
+         ReleaseMutex(PoolLock);
+         break;
+      }
+
+      ReleaseMutex(PoolLock);
+
+      // Releases wake one waiter; the rest notice on their next poll, as
+      // do processes waiting on slots their owners abandoned.
+      //
+      WaitForSingleObject(PoolFreed, MEMORY_POLL_INTERVAL);
+   }
+}
+
+VOID
+MemoryRelease(
+   LONG Slot
+)
+{
+   if (!Pool || Slot < 0)
+      return;
+
+   if (LockPool())
+   {
+      memset(&Pool->Slots[Slot], 0, sizeof(Pool->Slots[Slot]));
+      ReleaseMutex(PoolLock);
+   }
+
+   SetEvent(PoolFreed);
+}
+
+// The commit charge is what runs out when cl fails with C1060.
+//
+VOID
+MemoryRecordPeak(
+   PMEMORY_BUDGET Budget,
+   HANDLE Process
+)
+{
+   PROCESS_MEMORY_COUNTERS Counters = {sizeof(Counters)};
+
+   if (GetProcessMemoryInfo(Process, &Counters, sizeof(Counters)) &&
+       Counters.PeakPagefileUsage > Budget->Peak)
+   {
+      Budget->Peak = Counters.PeakPagefileUsage;
+   }
+}
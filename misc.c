@@ -87,6 +87,29 @@ FreeStringList(
    }
 }
 
+// Appends a copy of each string in Source to the end of *Head.
+//
+HRESULT
+StringListAppendCopy(
+   PSTRING_LIST *Head,
+   PSTRING_LIST Source
+)
+{
+   HRESULT hr = S_OK;
+
+   while (*Head)
+      Head = &(*Head)->Next;
+
+   for (; SUCCEEDED(hr) && Source; Source = Source->Next)
+   {
+      hr = StringListAllocString(Source->String, NULL, Head);
+      if (SUCCEEDED(hr))
+         Head = &(*Head)->Next;
+   }
+
+   return hr;
+}
+
 VOID
 StringListReverse(
    PSTRING_LIST *Head
@@ -407,6 +430,265 @@ EnumKey(
    return hr;
 }
 
+//
+// The compile server runs each request with its client's environment
+// rather than its own.  While a thread has one set, the variables we read
+// and the environment we give to children come from it.
+//
+static __declspec(thread) PCWSTR ThreadEnvironment;
+
+VOID
+SetThreadEnvironment(
+   PCWSTR Environment
+)
+{
+   ThreadEnvironment = Environment;
+}
+
+PCWSTR
+GetThreadEnvironment(VOID)
+{
+   return ThreadEnvironment;
+}
+
+// Returns S_FALSE and a NULL string if the variable is not set.
+//
+HRESULT
+GetEnvironmentString(
+   PCWSTR Name,
+   PWSTR *Out
+)
+{
+   HRESULT hr = S_OK;
+   PWSTR Value = NULL;
+   DWORD Length = 0;
+
+   *Out = NULL;
+
+   if (ThreadEnvironment)
+   {
+      SIZE_T NameLength = wcslen(Name);
+      PCWSTR Var;
+
+      for (Var = ThreadEnvironment; *Var; Var += wcslen(Var) + 1)
+      {
+         if (!_wcsnicmp(Var, Name, NameLength) && Var[NameLength] == L'=')
+            break;
+      }
+
+      if (!*Var)
+         return S_FALSE;
+
+      Value = _wcsdup(Var + NameLength + 1);
+      if (!Value)
+         hr = E_OUTOFMEMORY;
+
+      *Out = Value;
+      return hr;
+   }
+
+   Length = GetEnvironmentVariable(Name, NULL, 0);
+   if (!Length)
+      return S_FALSE;
+
+   Value = malloc(Length * sizeof(WCHAR));
+   if (!Value)
+      hr = E_OUTOFMEMORY;
+
+   if (SUCCEEDED(hr) &&
+       !GetEnvironmentVariable(Name, Value, Length))
+   {
+      // Raced with someone clearing it?
+      //
+      free(Value);
+      Value = NULL;
+      hr = S_FALSE;
+   }
+
+   *Out = Value;
+   return hr;
+}
+
+// Per-user state lives under %LOCALAPPDATA%\clwrapper, or wherever
+// CLWRAPPER_DATA_DIR points.  Creates the directory (and Child, if given) if
+// it doesn't already exist.
+//
+HRESULT
+GetDataDirectory(
+   PCWSTR Child,
+   PWSTR *Out
+)
+{
+   HRESULT hr = S_OK;
+   PWSTR Base = NULL;
+   PWSTR Path = NULL;
+
+   hr = GetEnvironmentString(L"CLWRAPPER_DATA_DIR", &Path);
+
+   if (SUCCEEDED(hr) && !Path)
+   {
+      hr = GetEnvironmentString(L"LOCALAPPDATA", &Base);
+      if (SUCCEEDED(hr) && !Base)
+         hr = HRESULT_FROM_WIN32(ERROR_ENVVAR_NOT_FOUND);
+      if (SUCCEEDED(hr))
+         hr = HeapPrintf(&Path, L"%s\\clwrapper", Base);
+   }
+
+   if (SUCCEEDED(hr) &&
+       !CreateDirectory(Path, NULL) &&
+       GetLastError() != ERROR_ALREADY_EXISTS)
+   {
+      hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   if (SUCCEEDED(hr) && Child)
+   {
+      PWSTR ChildPath = NULL;
+
+      hr = HeapPrintf(&ChildPath, L"%s\\%s", Path, Child);
+      if (SUCCEEDED(hr))
+      {
+         free(Path);
+         Path = ChildPath;
+
+         if (!CreateDirectory(Path, NULL) &&
+             GetLastError() != ERROR_ALREADY_EXISTS)
+         {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+         }
+      }
+   }
+
+   if (FAILED(hr))
+   {
+      free(Path);
+      Path = NULL;
+   }
+
+   free(Base);
+   *Out = Path;
+   return hr;
+}
+
+ULONGLONG
+FileTimeToQword(
+   const FILETIME *Time
+)
+{
+   return ((ULONGLONG)Time->dwHighDateTime << 32) | Time->dwLowDateTime;
+}
+
+BOOL
+IsAbsolutePath(
+   PCWSTR Path
+)
+{
+   return Path[0] == L'\\' || Path[0] == L'/' ||
+          (Path[0] && Path[1] == L':');
+}
+
+// Whether Path names a directory by ending in a separator, as in -o dir\.
+//
+BOOL
+IsDirectoryName(
+   PCWSTR Path
+)
+{
+   SIZE_T Length = wcslen(Path);
+
+   return Length && (Path[Length - 1] == L'\\' || Path[Length - 1] == L'/');
+}
+
+// Sets Path's write time to now.
+//
+HRESULT
+TouchFile(
+   PCWSTR Path
+)
+{
+   HRESULT hr = S_OK;
+   HANDLE File = INVALID_HANDLE_VALUE;
+   FILETIME Now;
+
+   File = CreateFile(
+      Path,
+      FILE_WRITE_ATTRIBUTES,
+      FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+      NULL,
+      OPEN_EXISTING,
+      FILE_ATTRIBUTE_NORMAL,
+      NULL
+   );
+   if (File == INVALID_HANDLE_VALUE)
+      hr = HRESULT_FROM_WIN32(GetLastError());
+
+   if (SUCCEEDED(hr))
+   {
+      GetSystemTimeAsFileTime(&Now);
+      if (!SetFileTime(File, NULL, NULL, &Now))
+         hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   if (File != INVALID_HANDLE_VALUE)
+      CloseHandle(File);
+   return hr;
+}
+
+HRESULT
+MakeAbsolute(
+   PCWSTR Cwd,
+   PCWSTR Path,
+   PWSTR *Out
+)
+{
+   if (IsAbsolutePath(Path))
+      return HeapPrintf(Out, L"%s", Path);
+   return HeapPrintf(Out, L"%s\\%s", Cwd, Path);
+}
+
+// The directory the compiler runs in, which relative paths in the
+// arguments and in its output are relative to.
+//
+HRESULT
+GetLaunchDirectory(
+   const LAUNCH_PARAMS *Launch,
+   PWSTR *Out
+)
+{
+   HRESULT hr = S_OK;
+   PWSTR Directory = NULL;
+   DWORD Length = 0;
+
+   if (Launch && Launch->CurrentDirectory)
+      return HeapPrintf(Out, L"%s", Launch->CurrentDirectory);
+
+   Length = GetCurrentDirectory(0, NULL);
+   if (!Length)
+      hr = HRESULT_FROM_WIN32(GetLastError());
+
+   if (SUCCEEDED(hr))
+   {
+      Directory = malloc(Length * sizeof(WCHAR));
+      if (!Directory)
+         hr = E_OUTOFMEMORY;
+   }
+
+   if (SUCCEEDED(hr) &&
+       !GetCurrentDirectory(Length, Directory))
+   {
+      hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   if (FAILED(hr))
+   {
+      free(Directory);
+      Directory = NULL;
+   }
+
+   *Out = Directory;
+   return hr;
+}
+
 HRESULT
 AddToPath(
    PCWSTR NewPath
@@ -458,51 +740,472 @@ AddToPath(
    return hr;
 }
 
+// Builds a copy of the current environment block (or the thread's, if it
+// has one), with Directory appended to PATH, suitable for CreateProcess()
+// with CREATE_UNICODE_ENVIRONMENT.
+//
+HRESULT
+BuildEnvironmentBlock(
+   PCWSTR Directory,
+   PWSTR *Output
+)
+{
+   HRESULT hr = S_OK;
+   PWSTR Env = NULL;
+   PCWSTR Var;
+   OUTPUT_STRING Block = {0};
+   BOOL SawPath = FALSE;
+
+   if (ThreadEnvironment)
+      Var = ThreadEnvironment;
+   else if (!(Var = Env = GetEnvironmentStrings()))
+      hr = HRESULT_FROM_WIN32(GetLastError());
+
+   for (; SUCCEEDED(hr) && *Var; Var += wcslen(Var) + 1)
+   {
+      if (!_wcsnicmp(Var, L"PATH=", 5))
+      {
+         SawPath = TRUE;
+
+         hr = AppendString(Var, &Block);
+         if (SUCCEEDED(hr) && Var[5])
+            hr = AppendString(L";", &Block);
+         if (SUCCEEDED(hr))
+            hr = AppendString(Directory, &Block);
+      }
+      else
+      {
+         hr = AppendString(Var, &Block);
+      }
+
+      // AppendString() always leaves a terminator after the string; claim
+      // it as the separator between variables.
+      //
+      if (SUCCEEDED(hr))
+         hr = AllocateString(0, &Block, NULL);
+      if (SUCCEEDED(hr))
+         ++Block.Length;
+   }
+
+   if (SUCCEEDED(hr) && !SawPath)
+   {
+      hr = AppendString(L"PATH=", &Block);
+      if (SUCCEEDED(hr))
+         hr = AppendString(Directory, &Block);
+      if (SUCCEEDED(hr))
+         hr = AllocateString(0, &Block, NULL);
+      if (SUCCEEDED(hr))
+         ++Block.Length;
+   }
+
+   // Final terminator for the block.
+   //
+   if (SUCCEEDED(hr))
+      hr = AllocateString(0, &Block, NULL);
+
+   if (FAILED(hr))
+   {
+      FreeString(&Block);
+      Block.Buffer = NULL;
+   }
+
+   if (Env)
+      FreeEnvironmentStrings(Env);
+
+   *Output = Block.Buffer;
+   return hr;
+}
+
+typedef struct _OUTPUT_PUMP
+{
+   HANDLE Pipe;
+   DWORD Stream;
+   const LAUNCH_PARAMS *Params;
+   PCRITICAL_SECTION Lock;
+   HRESULT Result;
+} OUTPUT_PUMP, *POUTPUT_PUMP;
+
+static DWORD WINAPI
+PumpOutput(
+   PVOID Context
+)
+{
+   POUTPUT_PUMP Pump = Context;
+   BYTE Buffer[4096];
+   DWORD Read = 0;
+
+   // Keep draining even if the callback fails, so the child never blocks
+   // on a full pipe.
+   //
+   while (ReadFile(Pump->Pipe, Buffer, sizeof(Buffer), &Read, NULL) && Read)
+   {
+      if (SUCCEEDED(Pump->Result))
+      {
+         EnterCriticalSection(Pump->Lock);
+         Pump->Result = Pump->Params->OutputCallback(
+            Pump->Params->CallbackContext,
+            Pump->Stream,
+            Buffer,
+            Read
+         );
+         LeaveCriticalSection(Pump->Lock);
+      }
+   }
+
+   return 0;
+}
+
+//
+// Inheritable handles are only ever created while holding this, and closed
+// before it is released, so that a child started on one thread never
+// inherits the pipe meant for a child started on another.
+//
+static SRWLOCK InheritLock = SRWLOCK_INIT;
+
+static HRESULT
+CreateInheritablePipe(
+   PHANDLE ReadEnd,
+   PHANDLE WriteEnd
+)
+{
+   HRESULT hr = S_OK;
+   SECURITY_ATTRIBUTES Sa = {sizeof(Sa), NULL, TRUE};
+
+   if (!CreatePipe(ReadEnd, WriteEnd, &Sa, 0))
+   {
+      hr = HRESULT_FROM_WIN32(GetLastError());
+      *ReadEnd = *WriteEnd = NULL;
+   }
+   else if (!SetHandleInformation(*ReadEnd, HANDLE_FLAG_INHERIT, 0))
+   {
+      hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   return hr;
+}
+
 HRESULT
 LaunchProcess(
    PCWSTR CommandLine,
    PDWORD ReturnValue
 )
+{
+   return LaunchProcessEx(CommandLine, NULL, ReturnValue);
+}
+
+HRESULT
+LaunchProcessEx(
+   PCWSTR CommandLine,
+   const LAUNCH_PARAMS *Params,
+   PDWORD ReturnValue
+)
 {
    HRESULT hr = S_OK;
 
    BOOL Res;
    PROCESS_INFORMATION ProcessInfo = {0};
-   STARTUPINFO StartupInfo = {0};
-
-   StartupInfo.cb = sizeof(StartupInfo);
-   StartupInfo.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
-   StartupInfo.hStdOutput = GetStdHandle(STD_OUTPUT_HANDLE);
-   StartupInfo.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+   STARTUPINFOEX StartupInfoEx = {0};
+   LPSTARTUPINFO StartupInfo = &StartupInfoEx.StartupInfo;
+   PLACEMENT Placement = {0};
+   DWORD Flags = 0;
+   BOOL Capture = Params && Params->OutputCallback;
+   HANDLE OutRead = NULL, OutWrite = NULL;
+   HANDLE ErrRead = NULL, ErrWrite = NULL;
+   HANDLE NullInput = INVALID_HANDLE_VALUE;
+   HANDLE ErrThread = NULL;
+   CRITICAL_SECTION CallbackLock;
+   OUTPUT_PUMP OutPump = {0}, ErrPump = {0};
+   LONG MemorySlot = -1;
+
+   StartupInfo->cb = sizeof(*StartupInfo);
+   StartupInfo->hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+   StartupInfo->hStdOutput = GetStdHandle(STD_OUTPUT_HANDLE);
+   StartupInfo->hStdError = GetStdHandle(STD_ERROR_HANDLE);
+
+   if (Params && Params->Environment)
+      Flags |= CREATE_UNICODE_ENVIRONMENT;
+   if (Params && Params->Job)
+      Flags |= CREATE_SUSPENDED;
+
+   // Wait for room in the memory pool before anything else, and certainly
+   // not while holding InheritLock.
+   //
+   if (Params && Params->Memory)
+      MemoryReserve(Params->Memory, &MemorySlot);
+
+   // Not being able to place the child only means it runs where we do.
+   //
+   if (PlacementAcquire(&Placement) == S_OK &&
+       SUCCEEDED(PlacementBuildAttributes(
+          &Placement,
+          &StartupInfoEx.lpAttributeList)))
+   {
+      StartupInfo->cb = sizeof(StartupInfoEx);
+      Flags |= EXTENDED_STARTUPINFO_PRESENT;
+   }
 
-   Res = CreateProcess(
-      NULL,
-      CommandLine,
-      NULL,
-      NULL,
-      TRUE,
-      0,
-      NULL,
-      NULL,
-      &StartupInfo,
-      &ProcessInfo
-   );
+   AcquireSRWLockExclusive(&InheritLock);
 
-   if (!Res)
+   if (Capture)
    {
-      hr = HRESULT_FROM_WIN32(GetLastError());
+      SECURITY_ATTRIBUTES Sa = {sizeof(Sa), NULL, TRUE};
+
+      hr = CreateInheritablePipe(&OutRead, &OutWrite);
+      if (SUCCEEDED(hr))
+         hr = CreateInheritablePipe(&ErrRead, &ErrWrite);
+
+      // When capturing output we may not have a console; the compiler
+      // should never want input anyway.
+      //
+      if (SUCCEEDED(hr))
+      {
+         NullInput = CreateFile(
+            L"NUL",
+            GENERIC_READ,
+            FILE_SHARE_READ | FILE_SHARE_WRITE,
+            &Sa,
+            OPEN_EXISTING,
+            0,
+            NULL
+         );
+         if (NullInput == INVALID_HANDLE_VALUE)
+            hr = HRESULT_FROM_WIN32(GetLastError());
+      }
+
+      StartupInfo->dwFlags |= STARTF_USESTDHANDLES;
+      StartupInfo->hStdInput = NullInput;
+      StartupInfo->hStdOutput = OutWrite;
+      StartupInfo->hStdError = ErrWrite;
    }
 
    if (SUCCEEDED(hr))
+   {
+      Res = CreateProcess(
+         NULL,
+         (PWSTR)CommandLine,
+         NULL,
+         NULL,
+         TRUE,
+         Flags,
+         Params ? Params->Environment : NULL,
+         Params ? Params->CurrentDirectory : NULL,
+         StartupInfo,
+         &ProcessInfo
+      );
+
+      if (!Res)
+      {
+         hr = HRESULT_FROM_WIN32(GetLastError());
+      }
+   }
+
+   // Not being able to join the job only means the child can't be killed
+   // along with it.
+   //
+   if (SUCCEEDED(hr) && Params && Params->Job)
+   {
+      AssignProcessToJobObject(Params->Job, ProcessInfo.hProcess);
+      ResumeThread(ProcessInfo.hThread);
+   }
+
+   // Once the child has them, we must let go of our copies of the write
+   // ends, or we will never see EOF.
+   //
+   if (OutWrite)
+      CloseHandle(OutWrite);
+   if (ErrWrite)
+      CloseHandle(ErrWrite);
+   if (NullInput != INVALID_HANDLE_VALUE)
+      CloseHandle(NullInput);
+
+   ReleaseSRWLockExclusive(&InheritLock);
+
+   if (SUCCEEDED(hr) && Capture)
+   {
+      InitializeCriticalSection(&CallbackLock);
+
+      OutPump.Pipe = OutRead;
+      OutPump.Stream = LAUNCH_STDOUT;
+      OutPump.Params = Params;
+      OutPump.Lock = &CallbackLock;
+
+      ErrPump = OutPump;
+      ErrPump.Pipe = ErrRead;
+      ErrPump.Stream = LAUNCH_STDERR;
+
+      ErrThread = CreateThread(NULL, 0, PumpOutput, &ErrPump, 0, NULL);
+
+      PumpOutput(&OutPump);
+
+      // If we couldn't get a thread, pick up stderr after stdout is done.
+      //
+      if (ErrThread)
+      {
+         WaitForSingleObject(ErrThread, INFINITE);
+         CloseHandle(ErrThread);
+      }
+      else
+      {
+         PumpOutput(&ErrPump);
+      }
+
+      DeleteCriticalSection(&CallbackLock);
+
+      if (FAILED(OutPump.Result))
+         hr = OutPump.Result;
+      else if (FAILED(ErrPump.Result))
+         hr = ErrPump.Result;
+   }
+
+   if (ProcessInfo.hProcess)
    {
       WaitForSingleObject(ProcessInfo.hProcess, INFINITE);
       GetExitCodeProcess(ProcessInfo.hProcess, ReturnValue);
+
+      if (Params && Params->Memory)
+         MemoryRecordPeak(Params->Memory, ProcessInfo.hProcess);
    }
 
+   MemoryRelease(MemorySlot);
+   PlacementRelease(&Placement);
+   PlacementFreeAttributes(StartupInfoEx.lpAttributeList);
+
    if (ProcessInfo.hProcess)
       CloseHandle(ProcessInfo.hProcess);
    if (ProcessInfo.hThread)
       CloseHandle(ProcessInfo.hThread);
+   if (OutRead)
+      CloseHandle(OutRead);
+   if (ErrRead)
+      CloseHandle(ErrRead);
+
+   return hr;
+}
+
+//
+// Passes output on the way a child launched with Launch would have: to
+// its OutputCallback, or else to our own stdout or stderr.
+//
+HRESULT
+LaunchWriteOutput(
+   const LAUNCH_PARAMS *Launch,
+   DWORD Stream,
+   const VOID *Data,
+   SIZE_T Length
+)
+{
+   if (!Length)
+      return S_OK;
+
+   if (Launch && Launch->OutputCallback)
+   {
+      return Launch->OutputCallback(
+         Launch->CallbackContext,
+         Stream,
+         Data,
+         (DWORD)Length
+      );
+   }
+
+   return WriteAll(
+      GetStdHandle(
+         Stream == LAUNCH_STDERR ? STD_ERROR_HANDLE : STD_OUTPUT_HANDLE
+      ),
+      Data,
+      (DWORD)Length
+   );
+}
+
+typedef struct _OUTPUT_RUN
+{
+   DWORD Stream;
+   DWORD Length;
+} OUTPUT_RUN, *POUTPUT_RUN;
+
+//
+// An OutputCallback that keeps a child's output in the LAUNCH_OUTPUT given
+// as its context.
+//
+HRESULT
+LaunchBufferOutput(
+   PVOID Context,
+   DWORD Stream,
+   const BYTE *Data,
+   DWORD Length
+)
+{
+   HRESULT hr = S_OK;
+   PLAUNCH_OUTPUT Output = Context;
+   POUTPUT_RUN Last = NULL;
+
+   hr = BufferAppend(
+      Stream == LAUNCH_STDERR ? &Output->Stderr : &Output->Stdout,
+      Data,
+      Length
+   );
+
+   if (SUCCEEDED(hr) && Output->Runs.Length)
+   {
+      Last = (POUTPUT_RUN)
+         (Output->Runs.Buffer + Output->Runs.Length - sizeof(*Last));
+   }
+
+   if (SUCCEEDED(hr) && Last && Last->Stream == Stream)
+   {
+      Last->Length += Length;
+   }
+   else if (SUCCEEDED(hr))
+   {
+      OUTPUT_RUN Run = {Stream, Length};
+
+      hr = BufferAppend(&Output->Runs, &Run, sizeof(Run));
+   }
+
+   if (SUCCEEDED(hr) && Output->Forward)
+      hr = LaunchWriteOutput(Output->Launch, Stream, Data, Length);
 
    return hr;
 }
+
+//
+// Passes on what LaunchBufferOutput() kept, in the order it arrived.
+//
+HRESULT
+LaunchReplayOutput(
+   const LAUNCH_PARAMS *Launch,
+   PLAUNCH_OUTPUT Output
+)
+{
+   HRESULT hr = S_OK;
+   SIZE_T Offsets[2] = {0};
+   SIZE_T i;
+
+   for (i = 0;
+        SUCCEEDED(hr) && i + sizeof(OUTPUT_RUN) <= Output->Runs.Length;
+        i += sizeof(OUTPUT_RUN))
+   {
+      POUTPUT_RUN Run = (POUTPUT_RUN)(Output->Runs.Buffer + i);
+      BOOL Stderr = Run->Stream == LAUNCH_STDERR;
+      PBYTE_BUFFER Buffer = Stderr ? &Output->Stderr : &Output->Stdout;
+
+      hr = LaunchWriteOutput(
+         Launch,
+         Run->Stream,
+         Buffer->Buffer + Offsets[Stderr],
+         Run->Length
+      );
+      Offsets[Stderr] += Run->Length;
+   }
+
+   return hr;
+}
+
+VOID
+LaunchFreeOutput(
+   PLAUNCH_OUTPUT Output
+)
+{
+   FreeBuffer(&Output->Stdout);
+   FreeBuffer(&Output->Stderr);
+   FreeBuffer(&Output->Runs);
+}
@@ -0,0 +1,1212 @@
+/*
+ * Copyright (c) 2017 Andrew Sveikauskas
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ */
+
+#include "clwrapper.h"
+#include <stdlib.h>
+#include <string.h>
+
+//
+// C++ modules.
+//
+// With -fmodules-ts, a compile of several sources to objects is put in
+// order first.  Each source is scanned (cl's /scanDependencies, which
+// writes P1689 JSON) for the modules it provides and the ones it imports,
+// and is compiled once everything it imports from the others has been.
+// Sources that don't depend on each other are compiled together, in
+// parallel with -j.  The interfaces' .ifc files go where -fmodule-output=
+// says, or next to the objects, and that directory is searched first for
+// the modules the others import.
+//
+// A compile of one source, or of one header into a header unit, goes
+// through a cache of its own, since the object cache can't see what an
+// import brings in.  cl is run with /sourceDependencies, which lists the
+// headers it read and the .ifc files it imported, and a manifest like the
+// object cache's direct mode ones records those, keyed on the source, the
+// options and the toolset.  What the compile produced (the object, the
+// .ifc of an interface or header unit, and what cl printed) is kept under
+// the ifc directory in our data directory, in a directory named after a
+// hash of its contents, so the same interface built twice is kept once.
+// If none of the files a manifest records have changed, the outputs are
+// copied out instead of running cl.
+//
+// Entries look like:
+//
+//    <data>\ifc\<key>.manifest     which entry the compile gives
+//    <data>\ifc\<digest>\object.obj
+//    <data>\ifc\<digest>\<name>.ifc
+//    <data>\ifc\<digest>\stdout, stderr
+//
+
+#define MODULES_VERSION 1
+
+typedef struct _MODULE_SOURCE
+{
+   PCWSTR Path;
+   PSTRING_LIST Provides;
+   PSTRING_LIST Requires;
+   BOOL Queued;
+   BOOL Built;
+} MODULE_SOURCE, *PMODULE_SOURCE;
+
+static HRESULT
+RunCompiler(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   const LAUNCH_PARAMS *Launch,
+   PDWORD ReturnValue
+)
+{
+   HRESULT hr = S_OK;
+   OUTPUT_STRING CommandLine = {0};
+
+   hr = CcBuildCommandLine(Args, Toolset, &CommandLine);
+   if (SUCCEEDED(hr))
+      hr = LaunchProcessEx(CommandLine.Buffer, Launch, ReturnValue);
+
+   FreeString(&CommandLine);
+   return hr;
+}
+
+// A name in Directory that no other compile is using.
+//
+static HRESULT
+GetTempName(
+   PCWSTR Directory,
+   PCWSTR Suffix,
+   PWSTR *Out
+)
+{
+   static volatile LONG Counter;
+
+   return HeapPrintf(
+      Out,
+      L"%s\\tmp-%u-%u%s",
+      Directory,
+      GetCurrentProcessId(),
+      (DWORD)InterlockedIncrement(&Counter),
+      Suffix
+   );
+}
+
+static const char *
+JsonSkipBlanks(
+   const char *p,
+   const char *End
+)
+{
+   while (p < End && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+      ++p;
+   return p;
+}
+
+// Reads a string whose opening quote has been read, leaving *Position past
+// its closing quote.  Out gets it as UTF-8, with a terminating NUL.
+//
+static HRESULT
+JsonReadString(
+   const char **Position,
+   const char *End,
+   PBYTE_BUFFER Out
+)
+{
+   HRESULT hr = S_OK;
+   const char *p = *Position;
+
+   Out->Length = 0;
+
+   while (SUCCEEDED(hr) && p < End && *p != '"')
+   {
+      BYTE Utf8[3];
+      SIZE_T Length = 1;
+
+      Utf8[0] = *p++;
+      if (Utf8[0] == '\\' && p < End)
+      {
+         Utf8[0] = *p++;
+
+         switch (Utf8[0])
+         {
+         case 'b':
+            Utf8[0] = '\b';
+            break;
+         case 'f':
+            Utf8[0] = '\f';
+            break;
+         case 'n':
+            Utf8[0] = '\n';
+            break;
+         case 'r':
+            Utf8[0] = '\r';
+            break;
+         case 't':
+            Utf8[0] = '\t';
+            break;
+         case 'u':
+            if (End - p >= 4)
+            {
+               char Hex[5] = {0};
+               ULONG Code;
+
+               memcpy(Hex, p, 4);
+               p += 4;
+               Code = strtoul(Hex, NULL, 16);
+
+               if (Code < 0x80)
+               {
+                  Utf8[0] = (BYTE)Code;
+               }
+               else if (Code < 0x800)
+               {
+                  Utf8[0] = (BYTE)(0xc0 | (Code >> 6));
+                  Utf8[1] = (BYTE)(0x80 | (Code & 0x3f));
+                  Length = 2;
+               }
+               else
+               {
+                  Utf8[0] = (BYTE)(0xe0 | (Code >> 12));
+                  Utf8[1] = (BYTE)(0x80 | ((Code >> 6) & 0x3f));
+                  Utf8[2] = (BYTE)(0x80 | (Code & 0x3f));
+                  Length = 3;
+               }
+            }
+            break;
+         }
+      }
+
+      hr = BufferAppend(Out, Utf8, Length);
+   }
+
+   if (SUCCEEDED(hr) && p >= End)
+      hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+   if (SUCCEEDED(hr))
+      hr = BufferAppend(Out, "", 1);
+
+   *Position = p + 1;
+   return hr;
+}
+
+static HRESULT
+JsonAddString(
+   const BYTE_BUFFER *String,
+   PSTRING_LIST *List
+)
+{
+   HRESULT hr = S_OK;
+   INT Bytes = (INT)String->Length - 1;
+   INT Chars = 0;
+   PSTRING_LIST Node = NULL;
+
+   if (Bytes <= 0)
+      return S_OK;
+
+   Chars = MultiByteToWideChar(
+      CP_UTF8,
+      0,
+      (LPCSTR)String->Buffer,
+      Bytes,
+      NULL,
+      0
+   );
+   if (!Chars)
+      hr = HRESULT_FROM_WIN32(GetLastError());
+
+   if (SUCCEEDED(hr))
+      hr = StringListAlloc(Chars, *List, &Node);
+
+   if (SUCCEEDED(hr))
+   {
+      MultiByteToWideChar(
+         CP_UTF8,
+         0,
+         (LPCSTR)String->Buffer,
+         Bytes,
+         Node->String,
+         Chars
+      );
+      Node->String[Chars] = 0;
+      *List = Node;
+   }
+
+   return hr;
+}
+
+//
+// Appends to *Out, in order, the strings in Json that are values of Key
+// inside the array that's the value of Section (or anywhere, if Section is
+// NULL).  The strings in an array count as values of its key.  This is
+// enough for what cl writes, not for JSON in general.
+//
+static HRESULT
+JsonGetStrings(
+   const BYTE_BUFFER *Json,
+   PCSTR Section,
+   PCSTR Key,
+   PSTRING_LIST *Out
+)
+{
+   HRESULT hr = S_OK;
+   const char *p = (const char *)Json->Buffer;
+   const char *End = p + Json->Length;
+   BYTE_BUFFER String = {0};
+   BYTE_BUFFER CurrentKey = {0};
+   BYTE_BUFFER CurrentSection = {0};
+   PSTRING_LIST List = NULL;
+
+   while (SUCCEEDED(hr) && (p = JsonSkipBlanks(p, End)) < End)
+   {
+      const char *Next;
+
+      if (*p++ != '"')
+         continue;
+
+      hr = JsonReadString(&p, End, &String);
+      if (FAILED(hr))
+         break;
+
+      Next = JsonSkipBlanks(p, End);
+      if (Next < End && *Next == ':')
+      {
+         CurrentKey.Length = 0;
+         hr = BufferAppend(&CurrentKey, String.Buffer, String.Length);
+
+         p = JsonSkipBlanks(Next + 1, End);
+         if (SUCCEEDED(hr) && p < End && *p == '[')
+         {
+            CurrentSection.Length = 0;
+            hr = BufferAppend(&CurrentSection, String.Buffer, String.Length);
+         }
+      }
+      else if (CurrentKey.Length &&
+               !strcmp((PCSTR)CurrentKey.Buffer, Key) &&
+               (!Section ||
+                (CurrentSection.Length &&
+                 !strcmp((PCSTR)CurrentSection.Buffer, Section))))
+      {
+         hr = JsonAddString(&String, &List);
+      }
+   }
+
+   if (SUCCEEDED(hr))
+   {
+      StringListReverse(&List);
+      hr = StringListAppendCopy(Out, List);
+   }
+
+   FreeStringList(List);
+   FreeBuffer(&CurrentSection);
+   FreeBuffer(&CurrentKey);
+   FreeBuffer(&String);
+   return hr;
+}
+
+//
+// Runs cl's scanner on one source, for the modules it provides and the
+// ones it imports.  What cl prints is only passed on if the scan fails.
+//
+static HRESULT
+ScanSource(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   const LAUNCH_PARAMS *Launch,
+   PCWSTR Directory,
+   PMODULE_SOURCE Source,
+   PDWORD ReturnValue
+)
+{
+   HRESULT hr = S_OK;
+   CC_ARGS Scan = *Args;
+   LAUNCH_PARAMS Quiet = {0};
+   LAUNCH_OUTPUT Output = {0};
+   BYTE_BUFFER Json = {0};
+   PSTRING_LIST Inputs = NULL;
+   PWSTR ScanFile = NULL;
+
+   hr = GetTempName(Directory, L".json", &ScanFile);
+   if (SUCCEEDED(hr))
+      hr = StringListAllocString(Source->Path, NULL, &Inputs);
+
+   if (SUCCEEDED(hr))
+   {
+      Scan.Inputs = Inputs;
+      Scan.ScanFile = ScanFile;
+
+      if (Launch)
+         Quiet = *Launch;
+      Quiet.OutputCallback = LaunchBufferOutput;
+      Quiet.CallbackContext = &Output;
+
+      hr = RunCompiler(&Scan, Toolset, &Quiet, ReturnValue);
+   }
+
+   if (SUCCEEDED(hr) && *ReturnValue)
+      hr = LaunchReplayOutput(Launch, &Output);
+   else if (SUCCEEDED(hr))
+   {
+      hr = ReadFileContents(ScanFile, &Json);
+      if (SUCCEEDED(hr))
+      {
+         hr = JsonGetStrings(
+            &Json,
+            "provides",
+            "logical-name",
+            &Source->Provides
+         );
+      }
+      if (SUCCEEDED(hr))
+      {
+         hr = JsonGetStrings(
+            &Json,
+            "requires",
+            "logical-name",
+            &Source->Requires
+         );
+      }
+   }
+
+   if (ScanFile)
+      DeleteFile(ScanFile);
+
+   FreeBuffer(&Json);
+   LaunchFreeOutput(&Output);
+   FreeStringList(Inputs);
+   free(ScanFile);
+   return hr;
+}
+
+// Everything Source imports that another of the sources provides has been
+// built.
+//
+static BOOL
+IsReady(
+   PMODULE_SOURCE Sources,
+   DWORD Count,
+   PMODULE_SOURCE Source
+)
+{
+   PSTRING_LIST Require, Provide;
+   DWORD i;
+
+   for (Require = Source->Requires; Require; Require = Require->Next)
+   {
+      for (i = 0; i < Count; ++i)
+      {
+         if (Sources[i].Built || &Sources[i] == Source)
+            continue;
+
+         for (Provide = Sources[i].Provides; Provide; Provide = Provide->Next)
+         {
+            if (!wcscmp(Provide->String, Require->String))
+               return FALSE;
+         }
+      }
+   }
+
+   return TRUE;
+}
+
+// Several sources to objects, with the objects in the current directory or
+// the one named by -o, as with -j.
+//
+static BOOL
+IsOrderable(
+   PCC_ARGS Args
+)
+{
+   PSTRING_LIST List;
+
+   if (Args->ModulesOrdered ||
+       Args->OutputType != CC_OBJECT_FILE ||
+       Args->ShowIncludes ||
+       !Args->Inputs ||
+       !Args->Inputs->Next)
+   {
+      return FALSE;
+   }
+
+   if (Args->OutputName && !IsDirectoryName(Args->OutputName))
+      return FALSE;
+
+   for (List = Args->Inputs; List; List = List->Next)
+   {
+      if (!CcIsSourceFile(List->String))
+         return FALSE;
+   }
+
+   return TRUE;
+}
+
+//
+// Scans the sources, then compiles them in waves, each wave being the
+// sources whose imports the earlier waves built.
+//
+static HRESULT
+CompileInOrder(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   const LAUNCH_PARAMS *Launch,
+   PDWORD ReturnValue
+)
+{
+   HRESULT hr = S_OK;
+   CC_ARGS Ordered = *Args;
+   PMODULE_SOURCE Sources = NULL;
+   PSTRING_LIST ModulePaths = NULL;
+   PSTRING_LIST Wave = NULL;
+   PSTRING_LIST Single = NULL;
+   PSTRING_LIST List;
+   PWSTR Directory = NULL;
+   PCWSTR Output = Args->ModuleOutput;
+   DWORD Count = 0;
+   DWORD Left = 0;
+   DWORD i;
+
+   *ReturnValue = 0;
+
+   for (List = Args->Inputs; List; List = List->Next)
+      ++Count;
+
+   Sources = calloc(Count, sizeof(*Sources));
+   if (!Sources)
+      hr = E_OUTOFMEMORY;
+
+   for (List = Args->Inputs, i = 0; SUCCEEDED(hr) && List; List = List->Next)
+      Sources[i++].Path = List->String;
+
+   if (SUCCEEDED(hr))
+      hr = GetDataDirectory(L"ifc", &Directory);
+
+   for (i = 0; SUCCEEDED(hr) && !*ReturnValue && i < Count; ++i)
+   {
+      hr = ScanSource(
+         Args,
+         Toolset,
+         Launch,
+         Directory,
+         &Sources[i],
+         ReturnValue
+      );
+   }
+
+   // The interfaces' .ifc files go next to the objects unless
+   // -fmodule-output= says otherwise, and the sources importing them look
+   // there first.
+   //
+   if (!Output)
+      Output = Args->OutputName ? Args->OutputName : L".\\";
+
+   if (SUCCEEDED(hr))
+      hr = StringListAllocString(Output, NULL, &ModulePaths);
+   if (SUCCEEDED(hr))
+      hr = StringListAppendCopy(&ModulePaths, Args->ModulePaths);
+
+   if (SUCCEEDED(hr))
+   {
+      Ordered.ModuleOutput = Output;
+      Ordered.ModulePaths = ModulePaths;
+      Ordered.ModulesOrdered = TRUE;
+      Left = Count;
+   }
+
+   while (SUCCEEDED(hr) && !*ReturnValue && Left)
+   {
+      for (i = Count; SUCCEEDED(hr) && i--; )
+      {
+         if (!Sources[i].Queued && IsReady(Sources, Count, &Sources[i]))
+         {
+            Sources[i].Queued = TRUE;
+            hr = StringListAllocString(Sources[i].Path, Wave, &Wave);
+         }
+      }
+
+      // If nothing is ready, the imports go round in a circle; what's left
+      // is compiled anyway, for cl to say so.
+      //
+      for (i = Count; SUCCEEDED(hr) && !Wave && i--; )
+      {
+         if (!Sources[i].Queued)
+         {
+            Sources[i].Queued = TRUE;
+            hr = StringListAllocString(Sources[i].Path, Wave, &Wave);
+         }
+      }
+
+      // With -j, the wave is compiled in parallel.  Otherwise each source
+      // still gets a cl of its own, so that an interface can be told it is
+      // one.
+      //
+      if (SUCCEEDED(hr) && Args->Jobs >= 2)
+      {
+         Ordered.Inputs = Wave;
+         hr = CcExecute(&Ordered, Toolset, Launch, ReturnValue);
+      }
+
+      for (List = Wave;
+           SUCCEEDED(hr) && Args->Jobs < 2 && !*ReturnValue && List;
+           List = List->Next)
+      {
+         hr = StringListAllocString(List->String, NULL, &Single);
+         if (SUCCEEDED(hr))
+         {
+            Ordered.Inputs = Single;
+            hr = CcExecute(&Ordered, Toolset, Launch, ReturnValue);
+         }
+
+         FreeStringList(Single);
+         Single = NULL;
+      }
+
+      for (i = 0; i < Count; ++i)
+      {
+         if (Sources[i].Queued && !Sources[i].Built)
+         {
+            Sources[i].Built = TRUE;
+            --Left;
+         }
+      }
+
+      FreeStringList(Wave);
+      Wave = NULL;
+   }
+
+   for (i = 0; Sources && i < Count; ++i)
+   {
+      FreeStringList(Sources[i].Provides);
+      FreeStringList(Sources[i].Requires);
+   }
+
+   FreeStringList(ModulePaths);
+   free(Sources);
+   free(Directory);
+   return hr;
+}
+
+// One source, or one header with -fmodule-header, to an object.
+//
+static BOOL
+IsModuleCompile(
+   PCC_ARGS Args
+)
+{
+   return !Args->ModuleCompile &&
+          Args->OutputType == CC_OBJECT_FILE &&
+          !Args->ShowIncludes &&
+          !Args->PchThrough &&
+          Args->Inputs &&
+          !Args->Inputs->Next &&
+          (Args->HeaderUnit || CcIsSourceFile(Args->Inputs->String));
+}
+
+//
+// The key the manifest for a compile is stored under: what the object
+// cache's direct mode would use, plus what decides which modules it
+// finds.  Returns S_FALSE if the compile can't be looked up.
+//
+static HRESULT
+ComputeKey(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   PCWSTR Cwd,
+   BYTE Digest[HASH_LENGTH]
+)
+{
+   HRESULT hr = S_OK;
+   HASH_CONTEXT Hash = {0};
+   BYTE Source[HASH_LENGTH];
+   PWSTR Identity = NULL;
+
+   hr = ManifestComputeKey(Args, Toolset, Cwd, Source);
+
+   if (hr == S_OK)
+      hr = HashInit(&Hash);
+   if (hr == S_OK)
+      hr = HashDword(&Hash, MODULES_VERSION);
+   if (hr == S_OK)
+      hr = HashData(&Hash, Source, HASH_LENGTH);
+   if (hr == S_OK)
+      hr = ToolsetGetIdentity(Toolset, &Identity);
+   if (hr == S_OK)
+      hr = HashString(&Hash, Identity);
+
+   if (hr == S_OK)
+      hr = HashDword(&Hash, Args->HeaderUnit);
+   if (hr == S_OK)
+      hr = HashStringList(&Hash, Args->ModuleFiles);
+   if (hr == S_OK)
+      hr = HashStringList(&Hash, Args->ModulePaths);
+
+   if (hr == S_OK)
+      hr = HashFinish(&Hash, Digest);
+
+   HashFree(&Hash);
+   free(Identity);
+   return hr;
+}
+
+// The .ifc file in an entry, if there is one.
+//
+static HRESULT
+FindIfc(
+   PCWSTR Directory,
+   PWSTR *Name
+)
+{
+   HRESULT hr = S_OK;
+   WIN32_FIND_DATA Data;
+   HANDLE Find = INVALID_HANDLE_VALUE;
+   PWSTR Pattern = NULL;
+
+   hr = HeapPrintf(&Pattern, L"%s\\*.ifc", Directory);
+   if (SUCCEEDED(hr))
+   {
+      Find = FindFirstFile(Pattern, &Data);
+      if (Find == INVALID_HANDLE_VALUE)
+         hr = S_FALSE;
+   }
+
+   if (hr == S_OK)
+   {
+      hr = HeapPrintf(Name, L"%s", Data.cFileName);
+      FindClose(Find);
+   }
+
+   free(Pattern);
+   return hr;
+}
+
+static VOID
+RemoveEntryDirectory(
+   PCWSTR Directory
+)
+{
+   WIN32_FIND_DATA Data;
+   HANDLE Find = INVALID_HANDLE_VALUE;
+   PWSTR Pattern = NULL;
+
+   if (FAILED(HeapPrintf(&Pattern, L"%s\\*", Directory)))
+      return;
+
+   Find = FindFirstFile(Pattern, &Data);
+   while (Find != INVALID_HANDLE_VALUE)
+   {
+      PWSTR Path = NULL;
+
+      if (!(Data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) &&
+          SUCCEEDED(HeapPrintf(&Path, L"%s\\%s", Directory, Data.cFileName)))
+      {
+         DeleteFile(Path);
+      }
+      free(Path);
+
+      if (!FindNextFile(Find, &Data))
+      {
+         FindClose(Find);
+         Find = INVALID_HANDLE_VALUE;
+      }
+   }
+
+   RemoveDirectory(Directory);
+   free(Pattern);
+}
+
+// CopyFile() keeps the source's timestamp, which would leave the output
+// looking older than its source to make.
+//
+static HRESULT
+CopyOut(
+   PCWSTR Source,
+   PCWSTR Destination
+)
+{
+   HRESULT hr = S_OK;
+   HANDLE File = INVALID_HANDLE_VALUE;
+   FILETIME Now;
+
+   DeleteFile(Destination);
+
+   if (!CopyFile(Source, Destination, FALSE))
+      hr = HRESULT_FROM_WIN32(GetLastError());
+
+   if (SUCCEEDED(hr))
+   {
+      File = CreateFile(
+         Destination,
+         FILE_WRITE_ATTRIBUTES,
+         0,
+         NULL,
+         OPEN_EXISTING,
+         0,
+         NULL
+      );
+      if (File == INVALID_HANDLE_VALUE)
+         hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   if (SUCCEEDED(hr))
+   {
+      GetSystemTimeAsFileTime(&Now);
+      if (!SetFileTime(File, NULL, NULL, &Now))
+         hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   if (File != INVALID_HANDLE_VALUE)
+      CloseHandle(File);
+   return hr;
+}
+
+// Where the .ifc named Name goes: -fmodule-output=, as a file or a
+// directory, or else next to the object.
+//
+static HRESULT
+GetIfcDestination(
+   PCC_ARGS Args,
+   PCWSTR Cwd,
+   PCWSTR Object,
+   PCWSTR Name,
+   PWSTR *Out
+)
+{
+   HRESULT hr = S_OK;
+   PWSTR Directory = NULL;
+   PCWSTR Base = CcBaseName(Object);
+
+   if (Args->ModuleOutput && !IsDirectoryName(Args->ModuleOutput))
+      return MakeAbsolute(Cwd, Args->ModuleOutput, Out);
+
+   if (Args->ModuleOutput)
+      hr = MakeAbsolute(Cwd, Args->ModuleOutput, &Directory);
+   else
+      hr = HeapPrintf(&Directory, L"%.*s", (INT)(Base - Object), Object);
+
+   if (SUCCEEDED(hr))
+      hr = HeapPrintf(Out, L"%s%s", Directory, Name);
+
+   free(Directory);
+   return hr;
+}
+
+static HRESULT
+HashEntry(
+   PCWSTR Entry,
+   PCWSTR IfcName,
+   BYTE Digest[HASH_LENGTH]
+)
+{
+   HRESULT hr = S_OK;
+   HASH_CONTEXT Hash = {0};
+   PCWSTR Names[] = {L"object.obj", L"stdout", L"stderr", IfcName};
+   DWORD i;
+
+   hr = HashInit(&Hash);
+   if (SUCCEEDED(hr))
+      hr = HashDword(&Hash, MODULES_VERSION);
+
+   for (i = 0; SUCCEEDED(hr) && i < ARRAYSIZE(Names) && Names[i]; ++i)
+   {
+      PWSTR Path = NULL;
+
+      hr = HeapPrintf(&Path, L"%s\\%s", Entry, Names[i]);
+      if (SUCCEEDED(hr))
+         hr = HashString(&Hash, Names[i]);
+
+      if (SUCCEEDED(hr) && GetFileAttributes(Path) != INVALID_FILE_ATTRIBUTES)
+         hr = HashFileContents(&Hash, Path);
+      else if (SUCCEEDED(hr))
+         hr = HashDword(&Hash, 0);
+
+      free(Path);
+   }
+
+   if (SUCCEEDED(hr))
+      hr = HashFinish(&Hash, Digest);
+
+   HashFree(&Hash);
+   return hr;
+}
+
+static HRESULT
+ReplayOutput(
+   const LAUNCH_PARAMS *Launch,
+   PCWSTR Entry,
+   PCWSTR Name,
+   DWORD Stream
+)
+{
+   HRESULT hr = S_OK;
+   BYTE_BUFFER Contents = {0};
+   PWSTR Path = NULL;
+
+   hr = HeapPrintf(&Path, L"%s\\%s", Entry, Name);
+   if (SUCCEEDED(hr) && SUCCEEDED(ReadFileContents(Path, &Contents)))
+   {
+      hr = LaunchWriteOutput(
+         Launch,
+         Stream,
+         Contents.Buffer,
+         Contents.Length
+      );
+   }
+
+   FreeBuffer(&Contents);
+   free(Path);
+   return hr;
+}
+
+// Copies the .ifc in an entry, if there is one, to where it belongs.
+//
+static HRESULT
+PlaceIfc(
+   PCC_ARGS Args,
+   PCWSTR Entry,
+   PCWSTR Cwd,
+   PCWSTR Object
+)
+{
+   HRESULT hr = S_OK;
+   PWSTR IfcName = NULL;
+   PWSTR Source = NULL;
+   PWSTR Destination = NULL;
+
+   if (FindIfc(Entry, &IfcName) != S_OK)
+      return S_OK;
+
+   hr = HeapPrintf(&Source, L"%s\\%s", Entry, IfcName);
+   if (SUCCEEDED(hr))
+      hr = GetIfcDestination(Args, Cwd, Object, IfcName, &Destination);
+   if (SUCCEEDED(hr))
+      hr = CopyOut(Source, Destination);
+
+   free(Destination);
+   free(Source);
+   free(IfcName);
+   return hr;
+}
+
+//
+// Copies a cache entry's outputs to where the compile would have written
+// them, and prints what it printed.
+//
+static HRESULT
+RestoreEntry(
+   PCC_ARGS Args,
+   const LAUNCH_PARAMS *Launch,
+   PCWSTR Directory,
+   const BYTE Digest[HASH_LENGTH],
+   PCWSTR Cwd,
+   PCWSTR Object
+)
+{
+   HRESULT hr = S_OK;
+   WCHAR DigestString[HASH_STRING_LENGTH];
+   PWSTR Entry = NULL;
+   PWSTR Source = NULL;
+
+   HashToString(Digest, DigestString);
+
+   hr = HeapPrintf(&Entry, L"%s\\%s", Directory, DigestString);
+   if (SUCCEEDED(hr) && GetFileAttributes(Entry) == INVALID_FILE_ATTRIBUTES)
+      hr = HRESULT_FROM_WIN32(GetLastError());
+
+   if (SUCCEEDED(hr))
+      hr = HeapPrintf(&Source, L"%s\\object.obj", Entry);
+   if (SUCCEEDED(hr) && GetFileAttributes(Source) != INVALID_FILE_ATTRIBUTES)
+      hr = CopyOut(Source, Object);
+   if (SUCCEEDED(hr))
+      hr = PlaceIfc(Args, Entry, Cwd, Object);
+
+   if (SUCCEEDED(hr))
+      hr = ReplayOutput(Launch, Entry, L"stdout", LAUNCH_STDOUT);
+   if (SUCCEEDED(hr))
+      hr = ReplayOutput(Launch, Entry, L"stderr", LAUNCH_STDERR);
+
+   free(Source);
+   free(Entry);
+   return hr;
+}
+
+static HRESULT
+WriteEntryOutput(
+   PCWSTR Entry,
+   PCWSTR Name,
+   PBYTE_BUFFER Output
+)
+{
+   HRESULT hr = S_OK;
+   PWSTR Path = NULL;
+
+   if (!Output->Length)
+      return S_OK;
+
+   hr = HeapPrintf(&Path, L"%s\\%s", Entry, Name);
+   if (SUCCEEDED(hr))
+      hr = WriteFileAtomic(Path, Output->Buffer, Output->Length);
+
+   free(Path);
+   return hr;
+}
+
+//
+// Keeps what the compile in Staging, started at Started, produced as an
+// entry, and records in the manifest which files it read: the headers, and
+// the .ifc files of what it imported.  *Includes gets those.
+//
+static HRESULT
+StoreEntry(
+   PCWSTR Directory,
+   PCWSTR Staging,
+   PCWSTR SourceDeps,
+   PCWSTR Manifest,
+   PCWSTR Cwd,
+   PCWSTR Object,
+   PLAUNCH_OUTPUT Output,
+   ULONGLONG Started,
+   PSTRING_LIST *Includes
+)
+{
+   HRESULT hr = S_OK;
+   BYTE Digest[HASH_LENGTH];
+   WCHAR DigestString[HASH_STRING_LENGTH];
+   BYTE_BUFFER Json = {0};
+   PWSTR IfcName = NULL;
+   PWSTR Path = NULL;
+   PWSTR Entry = NULL;
+
+   hr = ReadFileContents(SourceDeps, &Json);
+   if (SUCCEEDED(hr))
+      hr = JsonGetStrings(&Json, "Includes", "Includes", Includes);
+   if (SUCCEEDED(hr))
+      hr = JsonGetStrings(&Json, NULL, "BMI", Includes);
+
+   if (SUCCEEDED(hr))
+      hr = HeapPrintf(&Path, L"%s\\object.obj", Staging);
+   if (SUCCEEDED(hr) &&
+       GetFileAttributes(Object) != INVALID_FILE_ATTRIBUTES &&
+       !CopyFile(Object, Path, FALSE))
+   {
+      hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   if (SUCCEEDED(hr))
+      hr = WriteEntryOutput(Staging, L"stdout", &Output->Stdout);
+   if (SUCCEEDED(hr))
+      hr = WriteEntryOutput(Staging, L"stderr", &Output->Stderr);
+
+   // If there's an entry with these contents already, this one is thrown
+   // away and the manifest points at that.
+   //
+   if (SUCCEEDED(hr))
+      hr = FindIfc(Staging, &IfcName);
+   if (SUCCEEDED(hr))
+      hr = HashEntry(Staging, IfcName, Digest);
+   if (SUCCEEDED(hr))
+   {
+      HashToString(Digest, DigestString);
+      hr = HeapPrintf(&Entry, L"%s\\%s", Directory, DigestString);
+   }
+
+   if (SUCCEEDED(hr) &&
+       !MoveFile(Staging, Entry) &&
+       GetFileAttributes(Entry) == INVALID_FILE_ATTRIBUTES)
+   {
+      hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   if (SUCCEEDED(hr))
+      hr = ManifestStore(Manifest, Cwd, Digest, *Includes, Started);
+
+   FreeBuffer(&Json);
+   free(Entry);
+   free(Path);
+   free(IfcName);
+   return hr;
+}
+
+//
+// Compiles one source or header, or takes what it would produce from the
+// cache.  With -MD, the make rule lists the .ifc files it imported as well
+// as its headers.
+//
+static HRESULT
+CompileModule(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   const LAUNCH_PARAMS *Launch,
+   PDWORD ReturnValue
+)
+{
+   HRESULT hr = S_OK;
+   CC_ARGS Compile = *Args;
+   LAUNCH_PARAMS Capture = {0};
+   LAUNCH_OUTPUT Output = {0};
+   BYTE Key[HASH_LENGTH];
+   BYTE Recorded[HASH_LENGTH];
+   WCHAR KeyString[HASH_STRING_LENGTH];
+   PSTRING_LIST Includes = NULL;
+   PWSTR Cwd = NULL;
+   PWSTR Name = NULL;
+   PWSTR Object = NULL;
+   PWSTR ObjectDirectory = NULL;
+   PWSTR Directory = NULL;
+   PWSTR Manifest = NULL;
+   PWSTR Staging = NULL;
+   PWSTR StagingOutput = NULL;
+   PWSTR SourceDeps = NULL;
+   BOOL Interface = FALSE;
+   BOOL Cacheable = FALSE;
+   BOOL Cached = FALSE;
+   FILETIME StartedFileTime = {0};
+
+   *ReturnValue = 0;
+
+   Interface = Args->HeaderUnit || CcIsModuleInterface(Args->Inputs->String);
+
+   hr = GetLaunchDirectory(Launch, &Cwd);
+   if (SUCCEEDED(hr))
+      hr = CcGetObjectName(Args, &Name);
+   if (SUCCEEDED(hr))
+      hr = MakeAbsolute(Cwd, Name, &Object);
+   if (SUCCEEDED(hr))
+   {
+      hr = HeapPrintf(
+         &ObjectDirectory,
+         L"%.*s",
+         (INT)(CcBaseName(Object) - Object),
+         Object
+      );
+   }
+
+   if (SUCCEEDED(hr) &&
+       ComputeKey(Args, Toolset, Cwd, Key) == S_OK &&
+       SUCCEEDED(GetDataDirectory(L"ifc", &Directory)))
+   {
+      HashToString(Key, KeyString);
+      hr = HeapPrintf(&Manifest, L"%s\\%s.manifest", Directory, KeyString);
+      Cacheable = SUCCEEDED(hr);
+   }
+
+   if (Cacheable &&
+       ManifestLookup(Manifest, Cwd, Recorded) == S_OK &&
+       SUCCEEDED(
+          RestoreEntry(Args, Launch, Directory, Recorded, Cwd, Object)
+       ))
+   {
+      Cached = TRUE;
+      hr = ManifestGetIncludes(Manifest, &Includes);
+   }
+
+   // A compile that can't be looked up, or kept, is still run from here,
+   // so that its .ifc goes to the same place.
+   //
+   if (Cacheable && !Cached)
+   {
+      Cacheable = SUCCEEDED(GetTempName(Directory, L"", &Staging)) &&
+                  CreateDirectory(Staging, NULL) &&
+                  SUCCEEDED(HeapPrintf(&StagingOutput, L"%s\\", Staging)) &&
+                  SUCCEEDED(GetTempName(Directory, L".json", &SourceDeps));
+   }
+
+   Compile.ModuleCompile = TRUE;
+   if (Interface && !Args->ModuleOutput)
+      Compile.ModuleOutput = ObjectDirectory;
+
+   if (SUCCEEDED(hr) && !Cached && Cacheable)
+   {
+      Compile.OutputName = Object;
+      Compile.EmbedDebugInfo = TRUE;
+      Compile.SourceDepsFile = SourceDeps;
+      Compile.Deps = CC_DEPS_NONE;
+      if (Interface)
+         Compile.ModuleOutput = StagingOutput;
+
+      if (Launch)
+         Capture = *Launch;
+      Output.Launch = Launch;
+      Output.Forward = TRUE;
+      Capture.OutputCallback = LaunchBufferOutput;
+      Capture.CallbackContext = &Output;
+
+      GetSystemTimeAsFileTime(&StartedFileTime);
+      hr = CcExecute(&Compile, Toolset, &Capture, ReturnValue);
+
+      if (SUCCEEDED(hr) && !*ReturnValue)
+         hr = PlaceIfc(Args, Staging, Cwd, Object);
+
+      // If it can't be kept, the compile still did what was asked.
+      //
+      if (SUCCEEDED(hr) && !*ReturnValue)
+      {
+         StoreEntry(
+            Directory,
+            Staging,
+            SourceDeps,
+            Manifest,
+            Cwd,
+            Object,
+            &Output,
+            FileTimeToQword(&StartedFileTime),
+            &Includes
+         );
+      }
+   }
+   else if (SUCCEEDED(hr) && !Cached)
+   {
+      hr = CcExecute(&Compile, Toolset, Launch, ReturnValue);
+   }
+
+   // Otherwise, DepsExecute() wrote the rule.
+   //
+   if (SUCCEEDED(hr) && !*ReturnValue && Args->Deps && Cacheable)
+      hr = DepsWriteRule(Args, Toolset, Launch, Includes);
+
+   if (Staging)
+      RemoveEntryDirectory(Staging);
+   if (SourceDeps)
+      DeleteFile(SourceDeps);
+
+   LaunchFreeOutput(&Output);
+   FreeStringList(Includes);
+   free(SourceDeps);
+   free(StagingOutput);
+   free(Staging);
+   free(Manifest);
+   free(Directory);
+   free(ObjectDirectory);
+   free(Object);
+   free(Name);
+   free(Cwd);
+   return hr;
+}
+
+//
+// Handles -fmodules-ts: puts a compile of several sources in order, and
+// looks up or caches a compile of one.  Returns S_FALSE if it did nothing,
+// and the caller should compile as usual.
+//
+HRESULT
+ModulesExecute(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   const LAUNCH_PARAMS *Launch,
+   PDWORD ReturnValue
+)
+{
+   if (!Args->Modules || Args->PreprocessOnly)
+      return S_FALSE;
+
+   // -fdeps-file= only runs the scanner, which writes nothing else.
+   //
+   if (Args->ScanFile)
+      return RunCompiler(Args, Toolset, Launch, ReturnValue);
+
+   if (IsOrderable(Args))
+      return CompileInOrder(Args, Toolset, Launch, ReturnValue);
+
+   if (IsModuleCompile(Args))
+      return CompileModule(Args, Toolset, Launch, ReturnValue);
+
+   return S_FALSE;
+}
@@ -0,0 +1,1395 @@
+/*
+ * Copyright (c) 2017 Andrew Sveikauskas
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ */
+
+#include "clwrapper.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+//
+// Precompiled headers.
+//
+// -include-pch names a PCH of the first -include header.  -fpch-auto
+// makes one, in the data directory, of the #include lines that every
+// source of a link starts with.  With CLWRAPPER_PCH_HEADERS set, sources
+// that start with system headers from that list share a PCH of them with
+// everything else built by the same toolset, options and macros.
+//
+// Whichever it is, it's built here, with /Yc, from a generated source
+// next to the PCH, and built again whenever the options or any header it
+// read change; a manifest like the object cache's direct mode ones records
+// which headers those were.
+//
+// Compiles using it get /Yu, and their debug info goes in the objects
+// (/Z7) so that no PDB has to be shared with the compile that built it.
+// The debug info for what was precompiled is in the PCH's own object,
+// which has to be linked too; cc adds it to any link it does.  The objects
+// of system header PCHs go in a library per toolset instead, which cc links
+// against, and each object using one refers to the symbol that pulls in
+// the right one (cl's /Yl).  So those objects only link against this
+// machine's library, and only while it still has their PCH: it keeps the
+// PCH_LIBRARY_SIZE most recently used, and the others are deleted.
+//
+
+#define PCH_VERSION 2
+#define PCH_LIBRARY_SIZE 32
+
+static const char *
+SkipBlanks(
+   const char *p,
+   const char *End
+)
+{
+   while (p < End && (*p == ' ' || *p == '\t'))
+      ++p;
+   return p;
+}
+
+static const char *
+SkipLine(
+   const char *p,
+   const char *End
+)
+{
+   while (p < End && *p++ != '\n')
+      ;
+   return p;
+}
+
+//
+// Reads the #include lines a source starts with, up to the first line
+// that's anything else; blank lines and comments in between are skipped.
+// Each comes back as `#include <name>` or `#include "name"`.
+//
+static HRESULT
+ReadLeadingIncludes(
+   PCWSTR Path,
+   PSTRING_LIST *Out
+)
+{
+   HRESULT hr = S_OK;
+   BYTE_BUFFER Contents = {0};
+   PSTRING_LIST Lines = NULL;
+   const char *p, *End;
+
+   hr = ReadFileContents(Path, &Contents);
+
+   p = (const char *)Contents.Buffer;
+   End = p + Contents.Length;
+
+   if (End - p >= 3 && !memcmp(p, "\xef\xbb\xbf", 3))
+      p += 3;
+
+   while (SUCCEEDED(hr) && p < End)
+   {
+      const char *Name;
+      char Close;
+      PWSTR Line = NULL;
+
+      if (isspace((unsigned char)*p))
+      {
+         ++p;
+         continue;
+      }
+
+      if (End - p >= 2 && p[0] == '/' && p[1] == '/')
+      {
+         p = SkipLine(p, End);
+         continue;
+      }
+
+      if (End - p >= 2 && p[0] == '/' && p[1] == '*')
+      {
+         for (p += 2; End - p >= 2 && (p[0] != '*' || p[1] != '/'); ++p)
+            ;
+         if (End - p < 2)
+            break;
+         p += 2;
+         continue;
+      }
+
+      if (*p != '#')
+         break;
+      p = SkipBlanks(p + 1, End);
+      if (End - p < 7 || memcmp(p, "include", 7))
+         break;
+      p = SkipBlanks(p + 7, End);
+      if (p == End || (*p != '"' && *p != '<'))
+         break;
+
+      // Only names in plain ASCII, so that they mean the same whatever
+      // the code page.
+      //
+      Close = *p == '<' ? '>' : '"';
+      for (Name = ++p; p < End && *p != Close && *p >= ' ' && *p < 0x7f; ++p)
+         ;
+      if (p == End || *p != Close || p == Name)
+         break;
+
+      hr = HeapPrintf(
+         &Line,
+         Close == '>' ? L"#include <%.*hs>" : L"#include \"%.*hs\"",
+         (INT)(p - Name),
+         Name
+      );
+      if (SUCCEEDED(hr))
+         hr = StringListAllocString(Line, Lines, &Lines);
+      free(Line);
+
+      // Nothing but a comment can follow it.
+      //
+      p = SkipBlanks(p + 1, End);
+      if (p < End &&
+          *p != '\r' &&
+          *p != '\n' &&
+          (End - p < 2 || p[0] != '/' || p[1] != '/'))
+      {
+         break;
+      }
+      p = SkipLine(p, End);
+   }
+
+   if (SUCCEEDED(hr))
+   {
+      StringListReverse(&Lines);
+      *Out = Lines;
+      Lines = NULL;
+   }
+
+   FreeStringList(Lines);
+   FreeBuffer(&Contents);
+   return hr;
+}
+
+static VOID
+TruncateList(
+   PSTRING_LIST *List,
+   DWORD Count
+)
+{
+   while (*List && Count--)
+      List = &(*List)->Next;
+
+   FreeStringList(*List);
+   *List = NULL;
+}
+
+// The name in `#include <name>` or `#include "name"`.
+//
+static PCWSTR
+GetIncludeName(
+   PCWSTR Line,
+   PINT Length
+)
+{
+   *Length = (INT)wcslen(Line) - 11;
+   return Line + 10;
+}
+
+// The PCH ends at the first #include of the last name, so that has to be
+// the end of the #include lines it's made of.
+//
+static VOID
+EndAtThroughHeader(
+   PSTRING_LIST *Lines
+)
+{
+   PSTRING_LIST Line;
+   PCWSTR Last, Name;
+   INT LastLength, Length;
+   DWORD i;
+
+   for (Line = *Lines; Line && Line->Next; Line = Line->Next)
+      ;
+   if (!Line)
+      return;
+
+   Last = GetIncludeName(Line->String, &LastLength);
+
+   for (i = 1, Line = *Lines; ; ++i, Line = Line->Next)
+   {
+      Name = GetIncludeName(Line->String, &Length);
+      if (Length == LastLength && !wcsncmp(Name, Last, Length))
+         break;
+   }
+
+   TruncateList(Lines, i);
+}
+
+static BOOL
+IsCppSource(
+   PCWSTR Path
+)
+{
+   PCWSTR Dot = wcsrchr(CcBaseName(Path), L'.');
+
+   return Dot && _wcsicmp(Dot, L".c");
+}
+
+//
+// Finds the #include lines every source starts with.  Quoted names are
+// looked up next to the source first, so those are only shared by sources
+// in the same directory, which is returned in *SourceDirectory.  Returns
+// S_FALSE if there's nothing worth precompiling.
+//
+static HRESULT
+FindCommonIncludes(
+   PCC_ARGS Args,
+   PCWSTR Cwd,
+   PSTRING_LIST *Prefix,
+   PWSTR *SourceDirectory,
+   PBOOL Cpp
+)
+{
+   HRESULT hr = S_OK;
+   PSTRING_LIST Common = NULL;
+   PSTRING_LIST List, Line;
+   PWSTR Directory = NULL;
+   BOOL SameDirectory = TRUE;
+   DWORD NumSources = 0;
+   DWORD i;
+
+   for (List = Args->Inputs; hr == S_OK && List; List = List->Next)
+   {
+      PWSTR Path = NULL;
+      PSTRING_LIST Lines = NULL;
+      PSTRING_LIST Other;
+      INT DirectoryLength;
+
+      if (!CcIsSourceFile(List->String))
+         continue;
+
+      hr = MakeAbsolute(Cwd, List->String, &Path);
+      if (SUCCEEDED(hr))
+         hr = ReadLeadingIncludes(Path, &Lines);
+
+      if (SUCCEEDED(hr))
+      {
+         DirectoryLength = (INT)(CcBaseName(Path) - Path);
+
+         if (!NumSources++)
+         {
+            *Cpp = IsCppSource(Path);
+            hr = HeapPrintf(&Directory, L"%.*s", DirectoryLength, Path);
+            Common = Lines;
+            Lines = NULL;
+         }
+         else if (*Cpp != IsCppSource(Path))
+         {
+            // One PCH can't serve both C and C++.
+            //
+            hr = S_FALSE;
+         }
+         else
+         {
+            if ((INT)wcslen(Directory) != DirectoryLength ||
+                _wcsnicmp(Directory, Path, DirectoryLength))
+            {
+               SameDirectory = FALSE;
+            }
+
+            for (i = 0, Line = Common, Other = Lines;
+                 Line && Other && !wcscmp(Line->String, Other->String);
+                 ++i, Line = Line->Next, Other = Other->Next)
+               ;
+            TruncateList(&Common, i);
+         }
+      }
+
+      FreeStringList(Lines);
+      free(Path);
+   }
+
+   if (hr == S_OK && !SameDirectory)
+   {
+      for (i = 0, Line = Common; Line && Line->String[9] == L'<'; ++i)
+         Line = Line->Next;
+      TruncateList(&Common, i);
+
+      free(Directory);
+      Directory = NULL;
+   }
+
+   if (hr == S_OK)
+      EndAtThroughHeader(&Common);
+
+   if (hr == S_OK && (NumSources < 2 || !Common))
+      hr = S_FALSE;
+
+   if (hr == S_OK)
+   {
+      *Prefix = Common;
+      *SourceDirectory = Directory;
+      Common = NULL;
+      Directory = NULL;
+   }
+
+   FreeStringList(Common);
+   free(Directory);
+   return hr;
+}
+
+//
+// The system headers worth precompiling, from CLWRAPPER_PCH_HEADERS
+// (names separated by semicolons).  Returns S_FALSE if there are none.
+//
+static HRESULT
+GetSystemHeaders(
+   PSTRING_LIST *Headers
+)
+{
+   HRESULT hr = S_OK;
+   PWSTR Value = NULL;
+   PWSTR Context = NULL;
+   PWSTR Name;
+   PSTRING_LIST List = NULL;
+
+   hr = GetEnvironmentString(L"CLWRAPPER_PCH_HEADERS", &Value);
+
+   for (Name = Value ? wcstok_s(Value, L";", &Context) : NULL;
+        SUCCEEDED(hr) && Name;
+        Name = wcstok_s(NULL, L";", &Context))
+   {
+      hr = StringListAllocString(Name, List, &List);
+   }
+
+   if (SUCCEEDED(hr) && !List)
+      hr = S_FALSE;
+
+   if (hr == S_OK)
+   {
+      StringListReverse(&List);
+      *Headers = List;
+      List = NULL;
+   }
+
+   FreeStringList(List);
+   free(Value);
+   return hr;
+}
+
+// Whether an #include line names, in angle brackets, one of the headers
+// CLWRAPPER_PCH_HEADERS lists.  This goes by name only; a header that an
+// -I directory has its own copy of is ruled out by MatchSystemHeaders().
+//
+static BOOL
+IsListedHeader(
+   PSTRING_LIST Headers,
+   PCWSTR Line
+)
+{
+   INT Length;
+   PCWSTR Name = GetIncludeName(Line, &Length);
+
+   if (Line[9] != L'<')
+      return FALSE;
+
+   for (; Headers; Headers = Headers->Next)
+   {
+      if ((INT)wcslen(Headers->String) == Length &&
+          !_wcsnicmp(Headers->String, Name, Length))
+      {
+         return TRUE;
+      }
+   }
+
+   return FALSE;
+}
+
+//
+// Finds the system headers, out of those in Headers, that every source
+// starts by including, in the same order.  A header that one of the -I
+// directories has its own copy of isn't the system's, and ends the list.
+// Returns S_FALSE if there aren't any.
+//
+static HRESULT
+MatchSystemHeaders(
+   PCC_ARGS Args,
+   PCWSTR Cwd,
+   PSTRING_LIST Headers,
+   PSTRING_LIST *Out,
+   PBOOL Cpp
+)
+{
+   HRESULT hr = S_OK;
+   PSTRING_LIST Common = NULL;
+   PSTRING_LIST List, Line, Directory;
+   DWORD NumSources = 0;
+   DWORD i;
+
+   for (List = Args->Inputs; hr == S_OK && List; List = List->Next)
+   {
+      PWSTR Path = NULL;
+      PSTRING_LIST Lines = NULL;
+
+      if (!CcIsSourceFile(List->String))
+         continue;
+
+      hr = MakeAbsolute(Cwd, List->String, &Path);
+      if (SUCCEEDED(hr))
+         hr = ReadLeadingIncludes(Path, &Lines);
+
+      if (SUCCEEDED(hr))
+      {
+         for (i = 0, Line = Lines;
+              Line && IsListedHeader(Headers, Line->String);
+              ++i, Line = Line->Next)
+            ;
+         TruncateList(&Lines, i);
+
+         if (!NumSources++)
+         {
+            *Cpp = IsCppSource(Path);
+            Common = Lines;
+            Lines = NULL;
+         }
+         else if (*Cpp != IsCppSource(Path))
+         {
+            hr = S_FALSE;
+         }
+         else
+         {
+            PSTRING_LIST Other;
+
+            for (Line = Common, Other = Lines;
+                 Line && Other && !wcscmp(Line->String, Other->String);
+                 Line = Line->Next, Other = Other->Next)
+               ;
+
+            // Sources starting differently would need PCHs of their own.
+            //
+            if (Line || Other)
+               hr = S_FALSE;
+         }
+      }
+
+      FreeStringList(Lines);
+      free(Path);
+   }
+
+   for (i = 0, Line = Common; hr == S_OK && Line; ++i, Line = Line->Next)
+   {
+      INT Length;
+      PCWSTR Name = GetIncludeName(Line->String, &Length);
+
+      for (Directory = Args->IncludePaths;
+           hr == S_OK && Directory;
+           Directory = Directory->Next)
+      {
+         PWSTR Base = NULL;
+         PWSTR Path = NULL;
+
+         hr = MakeAbsolute(Cwd, Directory->String, &Base);
+         if (SUCCEEDED(hr))
+            hr = HeapPrintf(&Path, L"%s\\%.*s", Base, Length, Name);
+         if (SUCCEEDED(hr) &&
+             GetFileAttributes(Path) != INVALID_FILE_ATTRIBUTES)
+         {
+            hr = S_FALSE;
+         }
+
+         free(Path);
+         free(Base);
+      }
+
+      if (hr == S_FALSE)
+      {
+         TruncateList(&Common, i);
+         hr = S_OK;
+         break;
+      }
+   }
+
+   if (hr == S_OK)
+      EndAtThroughHeader(&Common);
+
+   if (hr == S_OK && !Common)
+      hr = S_FALSE;
+
+   if (hr == S_OK)
+   {
+      *Out = Common;
+      Common = NULL;
+   }
+
+   FreeStringList(Common);
+   return hr;
+}
+
+// System header PCHs, and the library of their objects, are named after
+// the toolset: <stem>-<key>.pch and <stem>.lib, where <stem> is returned
+// here.
+//
+static HRESULT
+GetSystemStem(
+   PCLWRAPPER_TOOLSET Toolset,
+   PWSTR *Out
+)
+{
+   HRESULT hr = S_OK;
+   HASH_CONTEXT Hash = {0};
+   BYTE Digest[HASH_LENGTH];
+   WCHAR Key[HASH_STRING_LENGTH];
+   PWSTR Identity = NULL;
+   PWSTR Directory = NULL;
+
+   hr = ToolsetGetIdentity(Toolset, &Identity);
+   if (SUCCEEDED(hr))
+      hr = HashInit(&Hash);
+   if (SUCCEEDED(hr))
+      hr = HashDword(&Hash, PCH_VERSION);
+   if (SUCCEEDED(hr))
+      hr = HashString(&Hash, Identity);
+   if (SUCCEEDED(hr))
+      hr = HashString(&Hash, Toolset->Sdk ? Toolset->Sdk->InstallDir : NULL);
+   if (SUCCEEDED(hr))
+      hr = HashString(&Hash, Toolset->Win10SdkVersion);
+   if (SUCCEEDED(hr))
+      hr = HashFinish(&Hash, Digest);
+   if (SUCCEEDED(hr))
+      hr = GetDataDirectory(L"pch", &Directory);
+
+   if (SUCCEEDED(hr))
+   {
+      HashToString(Digest, Key);
+      hr = HeapPrintf(Out, L"%s\\system-%s", Directory, Key);
+   }
+
+   HashFree(&Hash);
+   free(Directory);
+   free(Identity);
+   return hr;
+}
+
+typedef struct _SYSTEM_PCH
+{
+   PWSTR Object;
+   ULONGLONG WriteTime;
+} SYSTEM_PCH, *PSYSTEM_PCH;
+
+static int __cdecl
+CompareNewest(
+   const void *a,
+   const void *b
+)
+{
+   const SYSTEM_PCH *Left = a;
+   const SYSTEM_PCH *Right = b;
+
+   if (Left->WriteTime != Right->WriteTime)
+      return Left->WriteTime > Right->WriteTime ? -1 : 1;
+   return 0;
+}
+
+// Finds the objects of the toolset's system header PCHs, most recently
+// used first.
+//
+static HRESULT
+FindSystemPchs(
+   PCWSTR Stem,
+   PSYSTEM_PCH *Out,
+   PDWORD Count
+)
+{
+   HRESULT hr = S_OK;
+   PWSTR Pattern = NULL;
+   HANDLE Find = INVALID_HANDLE_VALUE;
+   WIN32_FIND_DATA Data;
+   PSYSTEM_PCH Pchs = NULL;
+   DWORD Allocated = 0;
+   INT DirectoryLength = (INT)(CcBaseName(Stem) - Stem);
+
+   *Out = NULL;
+   *Count = 0;
+
+   hr = HeapPrintf(&Pattern, L"%s-*.pch.obj", Stem);
+   if (SUCCEEDED(hr))
+   {
+      Find = FindFirstFile(Pattern, &Data);
+      if (Find == INVALID_HANDLE_VALUE)
+         hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   while (SUCCEEDED(hr))
+   {
+      if (*Count == Allocated)
+      {
+         PSYSTEM_PCH Grown;
+
+         Allocated = Allocated ? Allocated * 2 : 16;
+         Grown = realloc(Pchs, Allocated * sizeof(*Pchs));
+         if (!Grown)
+         {
+            hr = E_OUTOFMEMORY;
+            break;
+         }
+         Pchs = Grown;
+      }
+
+      hr = HeapPrintf(
+         &Pchs[*Count].Object,
+         L"%.*s%s",
+         DirectoryLength,
+         Stem,
+         Data.cFileName
+      );
+      if (SUCCEEDED(hr))
+      {
+         Pchs[*Count].WriteTime = FileTimeToQword(&Data.ftLastWriteTime);
+         ++*Count;
+      }
+
+      if (SUCCEEDED(hr) && !FindNextFile(Find, &Data))
+         break;
+   }
+
+   if (SUCCEEDED(hr))
+      qsort(Pchs, *Count, sizeof(*Pchs), CompareNewest);
+
+   if (FAILED(hr))
+   {
+      while (*Count)
+         free(Pchs[--*Count].Object);
+      free(Pchs);
+      Pchs = NULL;
+   }
+
+   if (Find != INVALID_HANDLE_VALUE)
+      FindClose(Find);
+   free(Pattern);
+   *Out = Pchs;
+   return hr;
+}
+
+// Deletes what's left of a PCH that's been dropped from the library.  Any
+// of it still in use stays.
+//
+static VOID
+DeleteSystemPch(
+   PCWSTR Object
+)
+{
+   PCWSTR Suffixes[] = {L"", L".manifest", L".c", L".cpp"};
+   INT Length = (INT)wcslen(Object) - 4;
+   INT i;
+
+   for (i = 0; i < ARRAYSIZE(Suffixes); ++i)
+   {
+      PWSTR Path = NULL;
+
+      if (SUCCEEDED(HeapPrintf(&Path, L"%.*s%s", Length, Object, Suffixes[i])))
+         DeleteFile(Path);
+      free(Path);
+   }
+
+   DeleteFile(Object);
+}
+
+//
+// Rebuilds the toolset's library from the objects of its system header
+// PCHs, after one has been built.  Only the PCH_LIBRARY_SIZE most recently
+// used are kept; the rest are deleted, so the library doesn't grow with
+// every set of options and macros it has ever seen.  The library is built
+// beside the old one and moved into place, so a link reading it meanwhile
+// sees one or the other.
+//
+static HRESULT
+UpdateSystemLibrary(
+   PCLWRAPPER_TOOLSET Toolset,
+   const LAUNCH_PARAMS *Launch
+)
+{
+   HRESULT hr = S_OK;
+   PWSTR Stem = NULL;
+   PWSTR Library = NULL;
+   PWSTR NewLibrary = NULL;
+   PWSTR LibPath = NULL;
+   OUTPUT_STRING CommandLine = {0};
+   PSYSTEM_PCH Pchs = NULL;
+   HANDLE Mutex = NULL;
+   DWORD Count = 0;
+   DWORD ExitCode = 0;
+   DWORD i;
+
+   hr = GetSystemStem(Toolset, &Stem);
+   if (SUCCEEDED(hr))
+      hr = HeapPrintf(&Library, L"%s.lib", Stem);
+   if (SUCCEEDED(hr))
+      hr = HeapPrintf(&NewLibrary, L"%s.new", Library);
+   if (SUCCEEDED(hr))
+      hr = ToolsetGetToolPath(Toolset, L"lib.exe", &LibPath);
+
+   if (SUCCEEDED(hr))
+   {
+      Mutex = CreateMutex(NULL, FALSE, L"Local\\clwrapper-pch-library");
+      if (!Mutex)
+         hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   if (SUCCEEDED(hr))
+   {
+      WaitForSingleObject(Mutex, INFINITE);
+      hr = FindSystemPchs(Stem, &Pchs, &Count);
+   }
+
+   if (SUCCEEDED(hr))
+      hr = AppendString(L"\"", &CommandLine);
+   if (SUCCEEDED(hr))
+      hr = AppendString(LibPath, &CommandLine);
+   if (SUCCEEDED(hr))
+      hr = AppendString(L"\" /nologo /out:\"", &CommandLine);
+   if (SUCCEEDED(hr))
+      hr = AppendString(NewLibrary, &CommandLine);
+   if (SUCCEEDED(hr))
+      hr = AppendString(L"\"", &CommandLine);
+
+   for (i = 0; SUCCEEDED(hr) && i < Count && i < PCH_LIBRARY_SIZE; ++i)
+   {
+      hr = AppendString(L" \"", &CommandLine);
+      if (SUCCEEDED(hr))
+         hr = AppendString(Pchs[i].Object, &CommandLine);
+      if (SUCCEEDED(hr))
+         hr = AppendString(L"\"", &CommandLine);
+   }
+
+   if (SUCCEEDED(hr))
+      hr = LaunchProcessEx(CommandLine.Buffer, Launch, &ExitCode);
+   if (SUCCEEDED(hr) && ExitCode)
+      hr = E_FAIL;
+   if (SUCCEEDED(hr) &&
+       !MoveFileEx(NewLibrary, Library, MOVEFILE_REPLACE_EXISTING))
+   {
+      hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   for (i = PCH_LIBRARY_SIZE; SUCCEEDED(hr) && i < Count; ++i)
+      DeleteSystemPch(Pchs[i].Object);
+
+   if (NewLibrary)
+      DeleteFile(NewLibrary);
+
+   if (Mutex)
+   {
+      ReleaseMutex(Mutex);
+      CloseHandle(Mutex);
+   }
+
+   for (i = 0; i < Count; ++i)
+      free(Pchs[i].Object);
+   free(Pchs);
+   FreeString(&CommandLine);
+   free(LibPath);
+   free(NewLibrary);
+   free(Library);
+   free(Stem);
+   return hr;
+}
+
+//
+// Hashes everything that goes into the PCH: the toolset, the options, and
+// what the generated source says.
+//
+static HRESULT
+ComputeKey(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   PCWSTR Cwd,
+   PSTRING_LIST Lines,
+   PCWSTR SourceDirectory,
+   BOOL Cpp,
+   BOOL System,
+   BYTE Digest[HASH_LENGTH]
+)
+{
+   HRESULT hr = S_OK;
+   HASH_CONTEXT Hash = {0};
+   PWSTR Identity = NULL;
+   PWSTR Include = NULL;
+
+   hr = HashInit(&Hash);
+   if (SUCCEEDED(hr))
+      hr = HashDword(&Hash, PCH_VERSION);
+   if (SUCCEEDED(hr))
+      hr = CacheHashCompileContext(&Hash, Args, Toolset);
+   if (SUCCEEDED(hr))
+      hr = ToolsetGetIdentity(Toolset, &Identity);
+   if (SUCCEEDED(hr))
+      hr = HashString(&Hash, Identity);
+
+   // A system header PCH is shared by everything built with the toolset,
+   // wherever it is and whatever its -I directories.
+   //
+   if (SUCCEEDED(hr))
+      hr = HashDword(&Hash, System);
+   if (SUCCEEDED(hr) && !System)
+      hr = HashStringList(&Hash, Args->IncludePaths);
+   if (SUCCEEDED(hr))
+      hr = HashStringList(&Hash, Toolset->IncludePaths);
+   if (SUCCEEDED(hr))
+      hr = GetEnvironmentString(L"INCLUDE", &Include);
+   if (SUCCEEDED(hr))
+      hr = HashString(&Hash, Include);
+   if (SUCCEEDED(hr))
+      hr = HashStringList(&Hash, Args->PrefixMaps);
+   if (SUCCEEDED(hr) && !System)
+      hr = HashString(&Hash, Cwd);
+
+   if (SUCCEEDED(hr))
+      hr = HashStringList(&Hash, Args->ForcedIncludes);
+   if (SUCCEEDED(hr))
+      hr = HashStringList(&Hash, Lines);
+   if (SUCCEEDED(hr))
+      hr = HashString(&Hash, SourceDirectory);
+   if (SUCCEEDED(hr))
+      hr = HashDword(&Hash, Cpp);
+
+   if (SUCCEEDED(hr))
+      hr = HashFinish(&Hash, Digest);
+
+   HashFree(&Hash);
+   free(Include);
+   free(Identity);
+   return hr;
+}
+
+// cl reads a file with a byte order mark as UTF-8, whatever the code page.
+//
+static HRESULT
+WriteSource(
+   PCWSTR Path,
+   PSTRING_LIST Lines
+)
+{
+   HRESULT hr = S_OK;
+   BYTE_BUFFER Contents = {0};
+   PSTR Line = NULL;
+   static const char Banner[] =
+      "\xef\xbb\xbf/* Generated by cc for a precompiled header. */\r\n";
+
+   hr = BufferAppend(&Contents, Banner, sizeof(Banner) - 1);
+
+   for (; SUCCEEDED(hr) && Lines; Lines = Lines->Next)
+   {
+      INT Length = WideCharToMultiByte(
+         CP_UTF8,
+         0,
+         Lines->String,
+         -1,
+         NULL,
+         0,
+         NULL,
+         NULL
+      );
+
+      Line = Length ? malloc(Length) : NULL;
+      if (!Line)
+      {
+         hr = Length ? E_OUTOFMEMORY : HRESULT_FROM_WIN32(GetLastError());
+         break;
+      }
+
+      WideCharToMultiByte(
+         CP_UTF8,
+         0,
+         Lines->String,
+         -1,
+         Line,
+         Length,
+         NULL,
+         NULL
+      );
+
+      hr = BufferAppend(&Contents, Line, Length - 1);
+      if (SUCCEEDED(hr))
+         hr = BufferAppend(&Contents, "\r\n", 2);
+
+      free(Line);
+      Line = NULL;
+   }
+
+   if (SUCCEEDED(hr))
+      hr = WriteFileAtomic(Path, Contents.Buffer, Contents.Length);
+
+   FreeBuffer(&Contents);
+   return hr;
+}
+
+static HRESULT
+DiscardOutput(
+   PVOID Context,
+   DWORD Stream,
+   const BYTE *Data,
+   DWORD Length
+)
+{
+   return S_OK;
+}
+
+//
+// Builds Args->PchFile, unless it's there already and nothing it was built
+// from has changed.  Compiles sharing a PCH wait for whichever of them
+// builds it.
+//
+static HRESULT
+BuildPch(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   const LAUNCH_PARAMS *Launch,
+   PCWSTR Cwd,
+   PSTRING_LIST Lines,
+   PCWSTR SourceDirectory,
+   BOOL Cpp,
+   BOOL System,
+   const BYTE Key[HASH_LENGTH],
+   PDWORD ReturnValue
+)
+{
+   HRESULT hr = S_OK;
+   CC_ARGS Create = *Args;
+   HASH_CONTEXT Hash = {0};
+   BYTE PathDigest[HASH_LENGTH];
+   BYTE Recorded[HASH_LENGTH];
+   WCHAR PathKey[HASH_STRING_LENGTH];
+   PWSTR MutexName = NULL;
+   PWSTR Manifest = NULL;
+   PWSTR Object = NULL;
+   PWSTR Source = NULL;
+   PSTRING_LIST Inputs = NULL;
+   PSTRING_LIST IncludePaths = NULL;
+   PSTRING_LIST Includes = NULL;
+   HANDLE Mutex = NULL;
+   BOOL Fresh = FALSE;
+   FILETIME StartedFileTime = {0};
+
+   *ReturnValue = 0;
+
+   hr = HashInit(&Hash);
+   if (SUCCEEDED(hr))
+      hr = HashString(&Hash, Args->PchFile);
+   if (SUCCEEDED(hr))
+      hr = HashFinish(&Hash, PathDigest);
+   if (SUCCEEDED(hr))
+   {
+      HashToString(PathDigest, PathKey);
+      hr = HeapPrintf(&MutexName, L"Local\\clwrapper-pch-%s", PathKey);
+   }
+
+   if (SUCCEEDED(hr))
+      hr = HeapPrintf(&Manifest, L"%s.manifest", Args->PchFile);
+   if (SUCCEEDED(hr))
+      hr = HeapPrintf(&Object, L"%s.obj", Args->PchFile);
+   if (SUCCEEDED(hr))
+   {
+      hr = HeapPrintf(
+         &Source,
+         L"%s.%s",
+         Args->PchFile,
+         Cpp ? L"cpp" : L"c"
+      );
+   }
+
+   if (SUCCEEDED(hr))
+   {
+      Mutex = CreateMutex(NULL, FALSE, MutexName);
+      if (!Mutex)
+         hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   // The manifest is written last, so one left behind by a build that died
+   // holding the lock still describes a whole PCH.
+   //
+   if (SUCCEEDED(hr))
+      WaitForSingleObject(Mutex, INFINITE);
+
+   if (SUCCEEDED(hr) &&
+       ManifestLookup(Manifest, Cwd, Recorded) == S_OK &&
+       !memcmp(Recorded, Key, HASH_LENGTH) &&
+       GetFileAttributes(Args->PchFile) != INVALID_FILE_ATTRIBUTES &&
+       GetFileAttributes(Object) != INVALID_FILE_ATTRIBUTES)
+   {
+      Fresh = TRUE;
+   }
+
+   // A system header PCH's object's write time says when it was last used,
+   // which decides which ones the library keeps.
+   //
+   if (SUCCEEDED(hr) && Fresh && System)
+      TouchFile(Object);
+
+   if (SUCCEEDED(hr) && !Fresh)
+   {
+      DeleteFile(Manifest);
+
+      hr = WriteSource(Source, Lines);
+      if (SUCCEEDED(hr))
+         hr = StringListAllocString(Source, NULL, &Inputs);
+
+      // The generated source isn't next to the real ones, so their
+      // directory is searched first, as it would be for them.
+      //
+      if (SUCCEEDED(hr) && System)
+      {
+         Create.IncludePaths = NULL;
+      }
+      else if (SUCCEEDED(hr) && SourceDirectory)
+      {
+         hr = StringListAllocString(SourceDirectory, NULL, &IncludePaths);
+         if (SUCCEEDED(hr))
+            hr = StringListAppendCopy(&IncludePaths, Args->IncludePaths);
+         if (SUCCEEDED(hr))
+            Create.IncludePaths = IncludePaths;
+      }
+   }
+
+   if (SUCCEEDED(hr) && !Fresh)
+   {
+      Create.OutputType = CC_OBJECT_FILE;
+      Create.OutputName = Object;
+      Create.Inputs = Inputs;
+      Create.PchCreate = TRUE;
+      Create.Jobs = 0;
+      Create.UnitySize = 0;
+      Create.Deps = CC_DEPS_NONE;
+      Create.Restat = FALSE;
+
+      GetSystemTimeAsFileTime(&StartedFileTime);
+      hr = DepsCompile(&Create, Toolset, Launch, ReturnValue, &Includes);
+
+      // Objects using a system header PCH can be linked by any later cc,
+      // which finds the PCH's object in the toolset's library.
+      //
+      if (SUCCEEDED(hr) && !*ReturnValue && System)
+         hr = UpdateSystemLibrary(Toolset, Launch);
+
+      // If the manifest can't be written, the PCH is only built again
+      // next time.
+      //
+      if (SUCCEEDED(hr) && !*ReturnValue)
+      {
+         ManifestStore(
+            Manifest,
+            Cwd,
+            Key,
+            Includes,
+            FileTimeToQword(&StartedFileTime)
+         );
+      }
+   }
+
+   if (Mutex)
+   {
+      ReleaseMutex(Mutex);
+      CloseHandle(Mutex);
+   }
+
+   FreeStringList(Includes);
+   FreeStringList(IncludePaths);
+   FreeStringList(Inputs);
+   HashFree(&Hash);
+   free(Source);
+   free(Object);
+   free(Manifest);
+   free(MutexName);
+   return hr;
+}
+
+static BOOL
+HasSource(
+   PCC_ARGS Args
+)
+{
+   PSTRING_LIST List;
+
+   for (List = Args->Inputs; List; List = List->Next)
+   {
+      if (CcIsSourceFile(List->String))
+         return TRUE;
+   }
+
+   return FALSE;
+}
+
+// Where the objects of the toolset's system header PCHs are kept, for cc
+// to add to its links.  Returns S_FALSE if they aren't in use.
+//
+static HRESULT
+GetSystemLibrary(
+   PCLWRAPPER_TOOLSET Toolset,
+   PWSTR *Out
+)
+{
+   HRESULT hr = S_OK;
+   PWSTR Value = NULL;
+   PWSTR Stem = NULL;
+   PWSTR Library = NULL;
+
+   hr = GetEnvironmentString(L"CLWRAPPER_PCH_HEADERS", &Value);
+   if (SUCCEEDED(hr) && (!Value || !*Value))
+      hr = S_FALSE;
+
+   if (hr == S_OK)
+      hr = GetSystemStem(Toolset, &Stem);
+   if (hr == S_OK)
+      hr = HeapPrintf(&Library, L"%s.lib", Stem);
+
+   if (hr == S_OK)
+   {
+      *Out = Library;
+      Library = NULL;
+   }
+
+   free(Library);
+   free(Stem);
+   free(Value);
+   return hr;
+}
+
+//
+// Builds or updates the PCH asked for, then compiles using it.  Returns
+// S_FALSE if it did nothing, and the caller should compile as usual.
+//
+HRESULT
+PchExecute(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   const LAUNCH_PARAMS *Launch,
+   PDWORD ReturnValue
+)
+{
+   HRESULT hr = S_OK;
+   CC_ARGS Use = *Args;
+   LAUNCH_PARAMS Quiet = {0};
+   const LAUNCH_PARAMS *BuildLaunch = Launch;
+   BYTE Key[HASH_LENGTH];
+   WCHAR KeyString[HASH_STRING_LENGTH];
+   PSTRING_LIST Lines = NULL;
+   PSTRING_LIST ForcedIncludes = NULL;
+   PSTRING_LIST Inputs = NULL;
+   PWSTR Cwd = NULL;
+   PWSTR Directory = NULL;
+   PWSTR Stem = NULL;
+   PWSTR SourceDirectory = NULL;
+   PWSTR PchFile = NULL;
+   PWSTR Through = NULL;
+   PWSTR Object = NULL;
+   PWSTR Library = NULL;
+   PSTRING_LIST Headers = NULL;
+   BOOL Auto = FALSE;
+   BOOL System = FALSE;
+   BOOL Cpp = FALSE;
+
+   // Links take along the library of system header PCH objects, since
+   // any of the objects might have been built with one.
+   //
+   if (Args->OutputType != CC_OBJECT_FILE &&
+       !Args->PchLibrary &&
+       GetSystemLibrary(Toolset, &Library) == S_OK)
+   {
+      Use.PchLibrary = Library;
+      hr = CcExecute(&Use, Toolset, Launch, ReturnValue);
+      free(Library);
+      return hr;
+   }
+
+   // Module units get their headers from header units instead.
+   //
+   if (Args->PchThrough ||
+       Args->Modules ||
+       Args->PreprocessOnly ||
+       !HasSource(Args))
+   {
+      return S_FALSE;
+   }
+
+   // -fpch-auto only applies to a link, which can take the PCH's object
+   // along with the rest.  System headers can be precompiled for any
+   // compile, as long as nothing is included ahead of them.
+   //
+   Auto = Args->AutoPch && Args->OutputType != CC_OBJECT_FILE;
+   if (!Args->PchFile && !Args->ForcedIncludes)
+      GetSystemHeaders(&Headers);
+
+   if (!Args->PchFile && !Auto && !Headers)
+      return S_FALSE;
+
+   hr = GetLaunchDirectory(Launch, &Cwd);
+
+   // The first -include is what's precompiled.  It's named by full path
+   // both when the PCH is built and when it's used, since cl wants the
+   // same name each time.
+   //
+   if (SUCCEEDED(hr) && Args->PchFile)
+   {
+      PSTRING_LIST List;
+
+      for (List = Args->Inputs; !CcIsSourceFile(List->String); )
+         List = List->Next;
+      Cpp = IsCppSource(List->String);
+
+      hr = MakeAbsolute(Cwd, Args->PchFile, &PchFile);
+      if (SUCCEEDED(hr))
+         hr = MakeAbsolute(Cwd, Args->ForcedIncludes->String, &Through);
+      if (SUCCEEDED(hr))
+         hr = StringListAllocString(Through, NULL, &ForcedIncludes);
+      if (SUCCEEDED(hr))
+      {
+         hr = StringListAppendCopy(
+            &ForcedIncludes,
+            Args->ForcedIncludes->Next
+         );
+      }
+      if (SUCCEEDED(hr))
+         Use.ForcedIncludes = ForcedIncludes;
+   }
+   else if (SUCCEEDED(hr))
+   {
+      INT Length;
+      PSTRING_LIST Last;
+
+      hr = S_FALSE;
+      if (Auto)
+         hr = FindCommonIncludes(Args, Cwd, &Lines, &SourceDirectory, &Cpp);
+
+      if (hr == S_FALSE && Headers)
+      {
+         hr = MatchSystemHeaders(Args, Cwd, Headers, &Lines, &Cpp);
+         System = hr == S_OK;
+      }
+
+      for (Last = Lines; hr == S_OK && Last->Next; Last = Last->Next)
+         ;
+      if (hr == S_OK)
+      {
+         PCWSTR Name = GetIncludeName(Last->String, &Length);
+
+         hr = HeapPrintf(&Through, L"%.*s", Length, Name);
+      }
+
+      if (Launch)
+         Quiet = *Launch;
+      Quiet.OutputCallback = DiscardOutput;
+      Quiet.CallbackContext = NULL;
+      BuildLaunch = &Quiet;
+   }
+
+   if (hr == S_OK)
+   {
+      Use.EmbedDebugInfo = TRUE;
+      hr = ComputeKey(
+         &Use,
+         Toolset,
+         Cwd,
+         Lines,
+         SourceDirectory,
+         Cpp,
+         System,
+         Key
+      );
+   }
+
+   // System header PCHs are named after the toolset's library, which is
+   // rebuilt from them.
+   //
+   if (hr == S_OK && !PchFile && System)
+   {
+      hr = GetSystemStem(Toolset, &Stem);
+      if (SUCCEEDED(hr))
+      {
+         HashToString(Key, KeyString);
+         hr = HeapPrintf(&PchFile, L"%s-%s.pch", Stem, KeyString);
+      }
+   }
+   else if (hr == S_OK && !PchFile)
+   {
+      hr = GetDataDirectory(L"pch", &Directory);
+      if (SUCCEEDED(hr))
+      {
+         HashToString(Key, KeyString);
+         hr = HeapPrintf(&PchFile, L"%s\\%s.pch", Directory, KeyString);
+      }
+   }
+
+   if (hr == S_OK)
+   {
+      Use.PchFile = PchFile;
+      Use.PchThrough = Through;
+
+      hr = BuildPch(
+         &Use,
+         Toolset,
+         BuildLaunch,
+         Cwd,
+         Lines,
+         SourceDirectory,
+         Cpp,
+         System,
+         Key,
+         ReturnValue
+      );
+   }
+
+   // What -fpch-auto and system header PCHs do is meant to go unnoticed;
+   // if the PCH can't be built, the sources are compiled as they would
+   // have been without it.
+   //
+   if (!Args->PchFile && (FAILED(hr) || (hr == S_OK && *ReturnValue)))
+      hr = S_FALSE;
+
+   // A system header PCH's object is found in the toolset's library.
+   //
+   if (hr == S_OK &&
+       !*ReturnValue &&
+       !System &&
+       Use.OutputType != CC_OBJECT_FILE)
+   {
+      hr = HeapPrintf(&Object, L"%s.obj", PchFile);
+      if (SUCCEEDED(hr))
+         hr = StringListAllocString(Object, NULL, &Inputs);
+      if (SUCCEEDED(hr))
+         hr = StringListAppendCopy(&Inputs, Args->Inputs);
+      if (SUCCEEDED(hr))
+         Use.Inputs = Inputs;
+   }
+
+   if (hr == S_OK && !*ReturnValue)
+      hr = CcExecute(&Use, Toolset, Launch, ReturnValue);
+
+   FreeStringList(Inputs);
+   FreeStringList(ForcedIncludes);
+   FreeStringList(Lines);
+   FreeStringList(Headers);
+   free(Object);
+   free(Through);
+   free(PchFile);
+   free(SourceDirectory);
+   free(Stem);
+   free(Directory);
+   free(Cwd);
+   return hr;
+}
+
+//
+// The headers in the PCH a compile uses, as recorded when it was built.
+// Compiles using it don't report them.
+//
+HRESULT
+PchGetIncludes(
+   PCC_ARGS Args,
+   PSTRING_LIST *Includes
+)
+{
+   HRESULT hr = S_OK;
+   PWSTR Manifest = NULL;
+
+   hr = HeapPrintf(&Manifest, L"%s.manifest", Args->PchFile);
+   if (SUCCEEDED(hr))
+      hr = ManifestGetIncludes(Manifest, Includes);
+
+   free(Manifest);
+   return hr;
+}
@@ -0,0 +1,330 @@
+/*
+ * Copyright (c) 2017 Andrew Sveikauskas
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ */
+
+#include "clwrapper.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//
+// `cc a.c b.c c.c -o app.exe` would have one cl compile each source in
+// turn and then link.  Instead, the sources are compiled in parallel (as
+// with -jN -c, one per processor unless -j says otherwise) into a
+// temporary directory, and then the objects are linked, along with any
+// objects and libraries from the command line, in their original order.
+// Both steps go through CcExecute(), so each gets the object cache.
+//
+// With -MD or -MMD, each compile leaves a rule next to its object, and
+// once the link has succeeded those become the rule for its output.
+//
+// The temporary objects are deleted afterwards, unless -save-temps was
+// given, in which case we say where they are.
+//
+
+typedef struct _PIPELINE_INPUTS
+{
+   PSTRING_LIST Sources;
+   PSTRING_LIST Link;
+   PSTRING_LIST Objects;
+   PSTRING_LIST Rules;
+} PIPELINE_INPUTS, *PPIPELINE_INPUTS;
+
+// Several sources to an executable or DLL.  The objects are named after
+// the sources, so two sources with the same name can't both go in one
+// directory.  Their debug info goes in the objects (/Z7), so that they
+// can be compiled in parallel.
+//
+static BOOL
+IsPipelinable(
+   PCC_ARGS Args
+)
+{
+   PSTRING_LIST List, Other;
+   DWORD NumSources = 0;
+
+   if (Args->OutputType == CC_OBJECT_FILE || Args->PreprocessOnly)
+      return FALSE;
+
+   for (List = Args->Inputs; List; List = List->Next)
+   {
+      PCWSTR Base = CcBaseName(List->String);
+      PCWSTR Dot = wcsrchr(Base, L'.');
+
+      if (!CcIsSourceFile(Base))
+         continue;
+      ++NumSources;
+
+      for (Other = List->Next; Other; Other = Other->Next)
+      {
+         PCWSTR OtherBase = CcBaseName(Other->String);
+         PCWSTR OtherDot = wcsrchr(OtherBase, L'.');
+
+         if (CcIsSourceFile(OtherBase) &&
+             Dot - Base == OtherDot - OtherBase &&
+             !_wcsnicmp(Base, OtherBase, Dot - Base))
+         {
+            return FALSE;
+         }
+      }
+   }
+
+   return NumSources >= 2;
+}
+
+static HRESULT
+CreateTempDirectory(
+   PWSTR *Out
+)
+{
+   HRESULT hr = S_OK;
+   WCHAR Temp[MAX_PATH];
+   static volatile LONG Counter;
+
+   if (!GetTempPath(ARRAYSIZE(Temp), Temp))
+      hr = HRESULT_FROM_WIN32(GetLastError());
+
+   if (SUCCEEDED(hr))
+   {
+      hr = HeapPrintf(
+         Out,
+         L"%sclwrapper-link-%u-%u\\",
+         Temp,
+         GetCurrentProcessId(),
+         (DWORD)InterlockedIncrement(&Counter)
+      );
+   }
+
+   if (SUCCEEDED(hr) && !CreateDirectory(*Out, NULL))
+   {
+      hr = HRESULT_FROM_WIN32(GetLastError());
+      free(*Out);
+      *Out = NULL;
+   }
+
+   return hr;
+}
+
+// Splits the inputs into sources to compile and what to link: each
+// source's object, in its place, and everything else as it was.
+//
+static HRESULT
+SplitInputs(
+   PCC_ARGS Args,
+   PCWSTR Directory,
+   PPIPELINE_INPUTS Inputs
+)
+{
+   HRESULT hr = S_OK;
+   PSTRING_LIST List;
+
+   for (List = Args->Inputs; SUCCEEDED(hr) && List; List = List->Next)
+   {
+      PCWSTR Base = CcBaseName(List->String);
+      PCWSTR Dot = wcsrchr(Base, L'.');
+      PWSTR Object = NULL;
+      PWSTR Rule = NULL;
+
+      if (!CcIsSourceFile(Base))
+      {
+         hr = StringListAllocString(
+            List->String,
+            Inputs->Link,
+            &Inputs->Link
+         );
+         continue;
+      }
+
+      hr = HeapPrintf(
+         &Object,
+         L"%s%.*s.obj",
+         Directory,
+         (INT)(Dot - Base),
+         Base
+      );
+      if (SUCCEEDED(hr))
+      {
+         hr = StringListAllocString(
+            List->String,
+            Inputs->Sources,
+            &Inputs->Sources
+         );
+      }
+      if (SUCCEEDED(hr))
+         hr = StringListAllocString(Object, Inputs->Link, &Inputs->Link);
+      if (SUCCEEDED(hr))
+      {
+         hr = StringListAllocString(
+            Object,
+            Inputs->Objects,
+            &Inputs->Objects
+         );
+      }
+
+      // Where JobsExecute() has the compile put its rule.
+      //
+      if (SUCCEEDED(hr) && Args->Deps != CC_DEPS_NONE)
+      {
+         hr = HeapPrintf(
+            &Rule,
+            L"%s%.*s.d",
+            Directory,
+            (INT)(Dot - Base),
+            Base
+         );
+         if (SUCCEEDED(hr))
+            hr = StringListAllocString(Rule, Inputs->Rules, &Inputs->Rules);
+      }
+
+      free(Rule);
+      free(Object);
+   }
+
+   if (SUCCEEDED(hr))
+   {
+      StringListReverse(&Inputs->Sources);
+      StringListReverse(&Inputs->Link);
+      StringListReverse(&Inputs->Rules);
+   }
+
+   return hr;
+}
+
+// With -fmodules-ts, the interfaces' .ifc files go next to their objects
+// unless -fmodule-output= says otherwise.
+//
+static VOID
+DeleteModuleFiles(
+   PCWSTR Directory
+)
+{
+   WIN32_FIND_DATA Data;
+   HANDLE Find = INVALID_HANDLE_VALUE;
+   PWSTR Pattern = NULL;
+
+   if (FAILED(HeapPrintf(&Pattern, L"%s*.ifc", Directory)))
+      return;
+
+   Find = FindFirstFile(Pattern, &Data);
+   while (Find != INVALID_HANDLE_VALUE)
+   {
+      PWSTR Path = NULL;
+
+      if (SUCCEEDED(HeapPrintf(&Path, L"%s%s", Directory, Data.cFileName)))
+         DeleteFile(Path);
+      free(Path);
+
+      if (!FindNextFile(Find, &Data))
+      {
+         FindClose(Find);
+         Find = INVALID_HANDLE_VALUE;
+      }
+   }
+
+   free(Pattern);
+}
+
+// Goes to the client's stderr, when we're the compile server.
+//
+static VOID
+ReportKept(
+   const LAUNCH_PARAMS *Launch,
+   PCWSTR Directory
+)
+{
+   char Message[MAX_PATH + 64];
+   INT Length = _snprintf(
+      Message,
+      sizeof(Message),
+      "cc: objects kept in %ls\n",
+      Directory
+   );
+
+   if (Length < 0)
+      return;
+
+   LaunchWriteOutput(Launch, LAUNCH_STDERR, Message, Length);
+}
+
+//
+// Compiles the sources of a multi-source link in parallel, then links.
+// Returns S_FALSE if it did nothing, and the caller should compile as
+// usual.
+//
+HRESULT
+PipelineExecute(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   const LAUNCH_PARAMS *Launch,
+   PDWORD ReturnValue
+)
+{
+   HRESULT hr = S_OK;
+   CC_ARGS Compile = *Args;
+   CC_ARGS Link = *Args;
+   PIPELINE_INPUTS Inputs = {0};
+   PWSTR Directory = NULL;
+   PSTRING_LIST List;
+
+   if (!IsPipelinable(Args))
+      return S_FALSE;
+
+   hr = CreateTempDirectory(&Directory);
+   if (SUCCEEDED(hr))
+      hr = SplitInputs(Args, Directory, &Inputs);
+
+   // Without somewhere to put the objects, cl can do it all as before.
+   //
+   if (FAILED(hr))
+      hr = S_FALSE;
+
+   if (hr == S_OK)
+   {
+      Compile.OutputType = CC_OBJECT_FILE;
+      Compile.OutputName = Directory;
+      Compile.Inputs = Inputs.Sources;
+      Compile.EmbedDebugInfo = TRUE;
+      Compile.UnitySize = 0;
+      if (Compile.Jobs < 2)
+         Compile.Jobs = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+
+      hr = CcExecute(&Compile, Toolset, Launch, ReturnValue);
+   }
+
+   if (hr == S_OK && !*ReturnValue)
+   {
+      Link.Inputs = Inputs.Link;
+      Link.Jobs = 0;
+
+      hr = CcExecute(&Link, Toolset, Launch, ReturnValue);
+   }
+
+   if (hr == S_OK && !*ReturnValue && Inputs.Rules)
+      hr = DepsWriteLinkRule(Args, Launch, Inputs.Rules);
+
+   if (Directory && Args->SaveTemps && hr != S_FALSE)
+   {
+      ReportKept(Launch, Directory);
+   }
+   else if (Directory)
+   {
+      for (List = Inputs.Objects; List; List = List->Next)
+         DeleteFile(List->String);
+      for (List = Inputs.Rules; List; List = List->Next)
+         DeleteFile(List->String);
+      if (Args->Modules)
+         DeleteModuleFiles(Directory);
+      RemoveDirectory(Directory);
+   }
+
+   FreeStringList(Inputs.Sources);
+   FreeStringList(Inputs.Link);
+   FreeStringList(Inputs.Objects);
+   FreeStringList(Inputs.Rules);
+   free(Directory);
+   return hr;
+}
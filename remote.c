@@ -0,0 +1,348 @@
+/*
+ * Copyright (c) 2017 Andrew Sveikauskas
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ */
+
+#include "clwrapper.h"
+#include <winhttp.h>
+#include <compressapi.h>
+#include <stdlib.h>
+#include <string.h>
+
+//
+// Transport for the remote object cache: plain HTTP GET and PUT of
+// compressed blobs, named by their key, under a base URL.  Distributed
+// compiles POST to workers the same way.
+//
+
+// Nothing we store should come anywhere near this; it's here so a confused
+// server can't make us allocate without bound.
+//
+#define REMOTE_MAX_RESPONSE (256 * 1024 * 1024)
+
+//
+// Sends Verb to <Base>/<Key>, with Body if it's given.  Any 2xx response
+// is success, and its body is returned in Response.  Returns S_FALSE for
+// 404.
+//
+// Timeout applies separately to name resolution, connecting, sending and
+// receiving.
+//
+HRESULT
+RemoteRequest(
+   PCWSTR Base,
+   PCWSTR Verb,
+   PCWSTR Key,
+   DWORD Timeout,
+   const VOID *Body,
+   DWORD BodyLength,
+   PBYTE_BUFFER Response
+)
+{
+   return RemoteRequestEx(
+      Base,
+      Verb,
+      Key,
+      Timeout,
+      Timeout,
+      Body,
+      BodyLength,
+      Response
+   );
+}
+
+// Like RemoteRequest(), but a server that's down can be given up on
+// sooner than one that's slow to answer: ConnectTimeout is for name
+// resolution and connecting, and Timeout for sending and receiving.
+//
+HRESULT
+RemoteRequestEx(
+   PCWSTR Base,
+   PCWSTR Verb,
+   PCWSTR Key,
+   DWORD ConnectTimeout,
+   DWORD Timeout,
+   const VOID *Body,
+   DWORD BodyLength,
+   PBYTE_BUFFER Response
+)
+{
+   HRESULT hr = S_OK;
+   HINTERNET Session = NULL;
+   HINTERNET Connection = NULL;
+   HINTERNET Request = NULL;
+   URL_COMPONENTS Url = {0};
+   PWSTR Host = NULL;
+   PWSTR Path = NULL;
+   DWORD Status = 0;
+   DWORD StatusSize = sizeof(Status);
+   DWORD PathLength = 0;
+
+   Url.dwStructSize = sizeof(Url);
+   Url.dwHostNameLength = (DWORD)-1;
+   Url.dwUrlPathLength = (DWORD)-1;
+
+   if (!WinHttpCrackUrl(Base, 0, 0, &Url))
+      hr = HRESULT_FROM_WIN32(GetLastError());
+
+   if (SUCCEEDED(hr))
+   {
+      PathLength = Url.dwUrlPathLength;
+      while (PathLength && Url.lpszUrlPath[PathLength - 1] == L'/')
+         --PathLength;
+
+      hr = HeapPrintf(
+         &Host,
+         L"%.*s",
+         (INT)Url.dwHostNameLength,
+         Url.lpszHostName
+      );
+   }
+   if (SUCCEEDED(hr))
+   {
+      hr = HeapPrintf(
+         &Path,
+         L"%.*s/%s",
+         (INT)PathLength,
+         Url.lpszUrlPath,
+         Key
+      );
+   }
+
+   if (SUCCEEDED(hr))
+   {
+      Session = WinHttpOpen(
+         L"clwrapper",
+         WINHTTP_ACCESS_TYPE_DEFAULT_PROXY,
+         WINHTTP_NO_PROXY_NAME,
+         WINHTTP_NO_PROXY_BYPASS,
+         0
+      );
+      if (!Session)
+         hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   if (SUCCEEDED(hr) &&
+       !WinHttpSetTimeouts(
+          Session,
+          ConnectTimeout,
+          ConnectTimeout,
+          Timeout,
+          Timeout))
+   {
+      hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   if (SUCCEEDED(hr))
+   {
+      Connection = WinHttpConnect(Session, Host, Url.nPort, 0);
+      if (!Connection)
+         hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   if (SUCCEEDED(hr))
+   {
+      Request = WinHttpOpenRequest(
+         Connection,
+         Verb,
+         Path,
+         NULL,
+         WINHTTP_NO_REFERER,
+         WINHTTP_DEFAULT_ACCEPT_TYPES,
+         Url.nScheme == INTERNET_SCHEME_HTTPS ? WINHTTP_FLAG_SECURE : 0
+      );
+      if (!Request)
+         hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   if (SUCCEEDED(hr) &&
+       !WinHttpSendRequest(
+          Request,
+          WINHTTP_NO_ADDITIONAL_HEADERS,
+          0,
+          (PVOID)Body,
+          BodyLength,
+          BodyLength,
+          0))
+   {
+      hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   if (SUCCEEDED(hr) &&
+       !WinHttpReceiveResponse(Request, NULL))
+   {
+      hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   if (SUCCEEDED(hr) &&
+       !WinHttpQueryHeaders(
+          Request,
+          WINHTTP_QUERY_STATUS_CODE | WINHTTP_QUERY_FLAG_NUMBER,
+          WINHTTP_HEADER_NAME_BY_INDEX,
+          &Status,
+          &StatusSize,
+          WINHTTP_NO_HEADER_INDEX))
+   {
+      hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   if (SUCCEEDED(hr))
+   {
+      if (Status == 404)
+         hr = S_FALSE;
+      else if (Status < 200 || Status >= 300)
+         hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+   }
+
+   while (hr == S_OK && Response)
+   {
+      DWORD Available = 0;
+      DWORD Read = 0;
+
+      if (!WinHttpQueryDataAvailable(Request, &Available))
+      {
+         hr = HRESULT_FROM_WIN32(GetLastError());
+         break;
+      }
+
+      if (!Available)
+         break;
+
+      if (Response->Length + Available > REMOTE_MAX_RESPONSE)
+         hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+      if (SUCCEEDED(hr))
+         hr = BufferReserve(Response, Available);
+
+      if (SUCCEEDED(hr) &&
+          !WinHttpReadData(
+             Request,
+             Response->Buffer + Response->Length,
+             Available,
+             &Read))
+      {
+         hr = HRESULT_FROM_WIN32(GetLastError());
+      }
+
+      if (SUCCEEDED(hr))
+         Response->Length += Read;
+   }
+
+   if (Request)
+      WinHttpCloseHandle(Request);
+   if (Connection)
+      WinHttpCloseHandle(Connection);
+   if (Session)
+      WinHttpCloseHandle(Session);
+   free(Path);
+   free(Host);
+   return hr;
+}
+
+//
+// Compression, using the Windows compression API.  The compressed form is
+// the uncompressed length followed by an XPRESS+Huffman stream.
+//
+
+HRESULT
+RemoteCompress(
+   const BYTE *Data,
+   SIZE_T Length,
+   PBYTE_BUFFER Output
+)
+{
+   HRESULT hr = S_OK;
+   COMPRESSOR_HANDLE Compressor = NULL;
+   SIZE_T Needed = 0;
+   SIZE_T Written = 0;
+
+   if (!CreateCompressor(COMPRESS_ALGORITHM_XPRESS_HUFF, NULL, &Compressor))
+      hr = HRESULT_FROM_WIN32(GetLastError());
+
+   if (SUCCEEDED(hr) &&
+       !Compress(Compressor, Data, Length, NULL, 0, &Needed) &&
+       GetLastError() != ERROR_INSUFFICIENT_BUFFER)
+   {
+      hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   if (SUCCEEDED(hr))
+      hr = BufferAppendQword(Output, Length);
+   if (SUCCEEDED(hr))
+      hr = BufferReserve(Output, Needed);
+
+   if (SUCCEEDED(hr) &&
+       !Compress(
+          Compressor,
+          Data,
+          Length,
+          Output->Buffer + Output->Length,
+          Needed,
+          &Written))
+   {
+      hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   if (SUCCEEDED(hr))
+      Output->Length += Written;
+
+   if (Compressor)
+      CloseCompressor(Compressor);
+   return hr;
+}
+
+HRESULT
+RemoteDecompress(
+   const BYTE *Data,
+   SIZE_T Length,
+   PBYTE_BUFFER Output
+)
+{
+   HRESULT hr = S_OK;
+   DECOMPRESSOR_HANDLE Decompressor = NULL;
+   BUFFER_READER Reader = {0};
+   ULONGLONG Expected = 0;
+   SIZE_T Written = 0;
+
+   Reader.Data = Data;
+   Reader.Length = Length;
+
+   hr = ReaderReadQword(&Reader, &Expected);
+   if (SUCCEEDED(hr) && Expected > REMOTE_MAX_RESPONSE)
+      hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+
+   if (SUCCEEDED(hr) &&
+       !CreateDecompressor(
+          COMPRESS_ALGORITHM_XPRESS_HUFF,
+          NULL,
+          &Decompressor))
+   {
+      hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   if (SUCCEEDED(hr))
+      hr = BufferReserve(Output, (SIZE_T)Expected);
+
+   if (SUCCEEDED(hr) &&
+       !Decompress(
+          Decompressor,
+          Data + Reader.Offset,
+          Length - Reader.Offset,
+          Output->Buffer + Output->Length,
+          (SIZE_T)Expected,
+          &Written))
+   {
+      hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   if (SUCCEEDED(hr) && Written != Expected)
+      hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+   if (SUCCEEDED(hr))
+      Output->Length += Written;
+
+   if (Decompressor)
+      CloseDecompressor(Decompressor);
+   return hr;
+}
@@ -0,0 +1,229 @@
+/*
+ * Copyright (c) 2017 Andrew Sveikauskas
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ */
+
+#include "clwrapper.h"
+#include <stdlib.h>
+#include <string.h>
+
+//
+// -frestat: leave an object or import library alone if rebuilding it
+// didn't change it.
+//
+// A comment-only edit still gives the object a new write time, and make
+// relinks everything downstream.  With -frestat, objects and import
+// libraries that already exist are moved aside first, the compile or link
+// writes new ones where cl and link would anyway (so the names recorded in
+// debug info and in the DLL are unchanged), and if a new one matches the
+// old, the old one is put back, write time and all.  Whatever ninja's
+// restat or make sees then says nothing downstream needs doing.
+//
+// Timestamps written into the files are ignored in the comparison; with
+// -ffile-prefix-map there are none anyway (/Brepro).
+//
+
+// Only objects and import libraries; an image, its .pdb and .exp are
+// always replaced.
+//
+static BOOL
+IsRestatOutput(
+   PCWSTR Path
+)
+{
+   PCWSTR Dot = wcsrchr(CcBaseName(Path), L'.');
+
+   return Dot && (!_wcsicmp(Dot, L".obj") || !_wcsicmp(Dot, L".lib"));
+}
+
+// COFF objects and import objects (and /bigobj objects, which start like
+// import objects) each carry the time they were written.
+//
+static VOID
+ClearObjectTimestamp(
+   PBYTE Data,
+   SIZE_T Length
+)
+{
+   PIMPORT_OBJECT_HEADER Import = (PIMPORT_OBJECT_HEADER)Data;
+
+   if (Length >= sizeof(IMPORT_OBJECT_HEADER) &&
+       Import->Sig1 == IMAGE_FILE_MACHINE_UNKNOWN &&
+       Import->Sig2 == IMPORT_OBJECT_HDR_SIG2)
+   {
+      Import->TimeDateStamp = 0;
+   }
+   else if (Length >= sizeof(IMAGE_FILE_HEADER))
+   {
+      ((PIMAGE_FILE_HEADER)Data)->TimeDateStamp = 0;
+   }
+}
+
+// Libraries are archives of objects, each with its own header saying
+// when it was added.
+//
+static VOID
+ClearTimestamps(
+   PBYTE Data,
+   SIZE_T Length
+)
+{
+   SIZE_T Offset = IMAGE_ARCHIVE_START_SIZE;
+
+   if (Length < IMAGE_ARCHIVE_START_SIZE ||
+       memcmp(Data, IMAGE_ARCHIVE_START, IMAGE_ARCHIVE_START_SIZE))
+   {
+      ClearObjectTimestamp(Data, Length);
+      return;
+   }
+
+   while (Length - Offset >= IMAGE_SIZEOF_ARCHIVE_MEMBER_HDR)
+   {
+      PIMAGE_ARCHIVE_MEMBER_HEADER Member =
+         (PIMAGE_ARCHIVE_MEMBER_HEADER)(Data + Offset);
+      SIZE_T Size = 0;
+      DWORD i;
+
+      for (i = 0; i < sizeof(Member->Size); ++i)
+      {
+         if (Member->Size[i] < '0' || Member->Size[i] > '9')
+            break;
+         Size = Size * 10 + (Member->Size[i] - '0');
+      }
+
+      memset(Member->Date, ' ', sizeof(Member->Date));
+      Offset += IMAGE_SIZEOF_ARCHIVE_MEMBER_HDR;
+
+      if (Size > Length - Offset)
+         break;
+
+      // The linker members ("/") and the long names member ("//") aren't
+      // objects.
+      //
+      if (Member->Name[0] != '/' ||
+          (Member->Name[1] != ' ' && Member->Name[1] != '/'))
+      {
+         ClearObjectTimestamp(Data + Offset, Size);
+      }
+
+      Offset += Size + (Size & 1);
+      if (Offset > Length)
+         break;
+   }
+}
+
+static BOOL
+IsSameOutput(
+   PCWSTR Path,
+   PCWSTR OtherPath
+)
+{
+   BYTE_BUFFER Contents = {0};
+   BYTE_BUFFER Other = {0};
+   BOOL Same = FALSE;
+
+   if (SUCCEEDED(ReadFileContents(Path, &Contents)) &&
+       SUCCEEDED(ReadFileContents(OtherPath, &Other)) &&
+       Contents.Length == Other.Length)
+   {
+      ClearTimestamps(Contents.Buffer, Contents.Length);
+      ClearTimestamps(Other.Buffer, Other.Length);
+
+      Same = !memcmp(Contents.Buffer, Other.Buffer, Contents.Length);
+   }
+
+   FreeBuffer(&Other);
+   FreeBuffer(&Contents);
+   return Same;
+}
+
+//
+// Builds, then puts back any object or import library that came out the
+// same as before.  Returns S_FALSE if it did nothing, and the caller should
+// build as usual.
+//
+HRESULT
+RestatExecute(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   const LAUNCH_PARAMS *Launch,
+   PDWORD ReturnValue
+)
+{
+   HRESULT hr = S_OK;
+   PSTRING_LIST Outputs = NULL;
+   PSTRING_LIST Saved = NULL;
+   PSTRING_LIST List;
+   PWSTR Cwd = NULL;
+
+   if (!Args->Restat || Args->PreprocessOnly)
+      return S_FALSE;
+
+   hr = GetLaunchDirectory(Launch, &Cwd);
+   if (SUCCEEDED(hr))
+      hr = CcGetExpectedOutputs(Args, &Outputs);
+
+   // Move aside what's there now.
+   //
+   for (List = Outputs; SUCCEEDED(hr) && List; List = List->Next)
+   {
+      PWSTR Path = NULL;
+      PWSTR Backup = NULL;
+
+      if (!IsRestatOutput(List->String))
+         continue;
+
+      hr = MakeAbsolute(Cwd, List->String, &Path);
+      if (SUCCEEDED(hr))
+         hr = HeapPrintf(&Backup, L"%s.restat", Path);
+
+      if (SUCCEEDED(hr) &&
+          MoveFileEx(Path, Backup, MOVEFILE_REPLACE_EXISTING))
+      {
+         hr = StringListAllocString(Path, Saved, &Saved);
+      }
+
+      free(Backup);
+      free(Path);
+   }
+
+   if (SUCCEEDED(hr))
+   {
+      Args->Restat = FALSE;
+      hr = CcExecute(Args, Toolset, Launch, ReturnValue);
+      Args->Restat = TRUE;
+   }
+
+   // Put back whatever didn't change, or wasn't rebuilt because the build
+   // failed.
+   //
+   for (List = Saved; List; List = List->Next)
+   {
+      PWSTR Backup = NULL;
+
+      if (FAILED(HeapPrintf(&Backup, L"%s.restat", List->String)))
+         continue;
+
+      if (GetFileAttributes(List->String) == INVALID_FILE_ATTRIBUTES ||
+          (SUCCEEDED(hr) &&
+           !*ReturnValue &&
+           IsSameOutput(List->String, Backup)))
+      {
+         MoveFileEx(Backup, List->String, MOVEFILE_REPLACE_EXISTING);
+      }
+      else
+      {
+         DeleteFile(Backup);
+      }
+
+      free(Backup);
+   }
+
+   FreeStringList(Saved);
+   FreeStringList(Outputs);
+   free(Cwd);
+   return hr;
+}
@@ -0,0 +1,1078 @@
+/*
+ * Copyright (c) 2017 Andrew Sveikauskas
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ */
+
+#include "clwrapper.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+//
+// `cc --server` keeps resolved toolsets in memory, and runs compiles on
+// behalf of `cc` clients that connect over a named pipe.  Clients opt in
+// by setting CLWRAPPER_SERVER=1; if no server is listening they quietly do
+// the work themselves.
+//
+// Every message on the pipe is a frame:
+//
+//    DWORD Type
+//    DWORD Length
+//    BYTE  Payload[Length]
+//
+// The client sends one SERVER_MSG_REQUEST; the server answers with any
+// number of SERVER_MSG_STDOUT/SERVER_MSG_STDERR frames and then one
+// SERVER_MSG_EXIT.  The request carries the client's environment, which
+// the server uses in place of its own for everything it does on the
+// client's behalf.
+//
+// Each connection gets a thread, up to SERVER_MAX_THREADS at once; clients
+// beyond that wait for the pipe, and in the end do the work themselves.
+//
+
+#define SERVER_PROTOCOL_VERSION 2
+#define SERVER_MAX_FRAME        (64 * 1024 * 1024)
+#define SERVER_MAX_THREADS      64
+
+enum
+{
+   SERVER_MSG_REQUEST = 1,    // DWORD version, STRING cwd, STRING_LIST argv,
+                              // STRING_LIST environment
+   SERVER_MSG_STDOUT,         // raw bytes
+   SERVER_MSG_STDERR,         // raw bytes
+   SERVER_MSG_EXIT            // DWORD exit code, DWORD HRESULT
+};
+
+typedef struct _SERVER_TOOLSET
+{
+   struct _SERVER_TOOLSET *Next;
+   volatile LONG RefCount;
+   LONG Generation;
+   PWSTR Key;
+   CLWRAPPER_TOOLSET Toolset;
+   PWSTR DllDirectory;
+
+   //
+   // Change notifications on the install directories.  If any of these
+   // fire, the entry is stale.
+   //
+   HANDLE Watches[2];
+} SERVER_TOOLSET, *PSERVER_TOOLSET;
+
+static CRITICAL_SECTION ToolsetLock;
+static PSERVER_TOOLSET Toolsets;
+static volatile LONG ToolsetGeneration;
+static HANDLE ThreadSlots;
+
+static HRESULT
+GetPipeName(
+   PWSTR *Name
+)
+{
+   HRESULT hr = S_OK;
+   PWSTR User = NULL;
+
+   hr = GetEnvironmentString(L"CLWRAPPER_SERVER_PIPE", Name);
+
+   if (SUCCEEDED(hr) && !*Name)
+   {
+      GetEnvironmentString(L"USERNAME", &User);
+
+      hr = HeapPrintf(
+         Name,
+         L"\\\\.\\pipe\\clwrapper-%s",
+         User ? User : L"default"
+      );
+   }
+
+   free(User);
+   return hr;
+}
+
+static HRESULT
+ReadAll(
+   HANDLE Handle,
+   PVOID Data,
+   DWORD Length
+)
+{
+   PBYTE p = Data;
+
+   while (Length)
+   {
+      DWORD Read = 0;
+
+      if (!ReadFile(Handle, p, Length, &Read, NULL))
+         return HRESULT_FROM_WIN32(GetLastError());
+      if (!Read)
+         return HRESULT_FROM_WIN32(ERROR_BROKEN_PIPE);
+
+      p += Read;
+      Length -= Read;
+   }
+
+   return S_OK;
+}
+
+HRESULT
+PipeWriteFrame(
+   HANDLE Pipe,
+   DWORD Type,
+   const VOID *Data,
+   DWORD Length
+)
+{
+   HRESULT hr = S_OK;
+   DWORD Header[2];
+
+   Header[0] = Type;
+   Header[1] = Length;
+
+   hr = WriteAll(Pipe, Header, sizeof(Header));
+   if (SUCCEEDED(hr) && Length)
+      hr = WriteAll(Pipe, Data, Length);
+
+   return hr;
+}
+
+HRESULT
+PipeReadFrame(
+   HANDLE Pipe,
+   PDWORD Type,
+   PBYTE_BUFFER Payload
+)
+{
+   HRESULT hr = S_OK;
+   DWORD Header[2];
+
+   Payload->Length = 0;
+
+   hr = ReadAll(Pipe, Header, sizeof(Header));
+   if (SUCCEEDED(hr) && Header[1] > SERVER_MAX_FRAME)
+      hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+
+   if (SUCCEEDED(hr))
+      hr = BufferReserve(Payload, Header[1]);
+
+   if (SUCCEEDED(hr))
+      hr = ReadAll(Pipe, Payload->Buffer, Header[1]);
+
+   if (SUCCEEDED(hr))
+   {
+      *Type = Header[0];
+      Payload->Length = Header[1];
+   }
+
+   return hr;
+}
+
+//
+// Server side.
+//
+
+static VOID
+ReleaseServerToolset(
+   PSERVER_TOOLSET Entry
+)
+{
+   INT i;
+
+   if (InterlockedDecrement(&Entry->RefCount))
+      return;
+
+   for (i = 0; i < ARRAYSIZE(Entry->Watches); ++i)
+   {
+      if (Entry->Watches[i] != INVALID_HANDLE_VALUE)
+         FindCloseChangeNotification(Entry->Watches[i]);
+   }
+
+   ToolsetFree(&Entry->Toolset);
+   free(Entry->DllDirectory);
+   free(Entry->Key);
+   free(Entry);
+}
+
+static BOOL
+IsServerToolsetStale(
+   PSERVER_TOOLSET Entry
+)
+{
+   INT i;
+
+   if (Entry->Generation != ToolsetGeneration)
+      return TRUE;
+
+   for (i = 0; i < ARRAYSIZE(Entry->Watches); ++i)
+   {
+      if (Entry->Watches[i] != INVALID_HANDLE_VALUE &&
+          WaitForSingleObject(Entry->Watches[i], 0) == WAIT_OBJECT_0)
+      {
+         return TRUE;
+      }
+   }
+
+   return FALSE;
+}
+
+static HRESULT
+GetToolsetKey(
+   PCLWRAPPER_ARGS_BASE Args,
+   PWSTR *Key
+)
+{
+   return HeapPrintf(
+      Key,
+      L"%d:%d.%d|%d:%d.%d|%s|%s|%s|%d",
+      Args->CompilerVersion.Specified,
+      Args->CompilerVersion.DesiredMajor,
+      Args->CompilerVersion.DesiredMinor,
+      Args->SdkVersion.Specified,
+      Args->SdkVersion.DesiredMajor,
+      Args->SdkVersion.DesiredMinor,
+      Args->DesiredArchitecture ? Args->DesiredArchitecture : L"",
+      Args->DesiredHost ? Args->DesiredHost : L"",
+      Args->ToolsetProfile ? Args->ToolsetProfile : L"",
+      Args->NoToolsetCache
+   );
+}
+
+static HRESULT
+CreateServerToolset(
+   PCLWRAPPER_ARGS_BASE Args,
+   PWSTR Key,
+   PSERVER_TOOLSET *Out
+)
+{
+   HRESULT hr = S_OK;
+   PSERVER_TOOLSET Entry = malloc(sizeof(*Entry));
+   LONG Generation = ToolsetGeneration;
+
+   if (!Entry)
+   {
+      free(Key);
+      return E_OUTOFMEMORY;
+   }
+
+   memset(Entry, 0, sizeof(*Entry));
+   Entry->RefCount = 1;
+   Entry->Generation = Generation;
+   Entry->Key = Key;
+   Entry->Watches[0] = Entry->Watches[1] = INVALID_HANDLE_VALUE;
+
+   hr = ToolsetAcquire(Args, &Entry->Toolset);
+
+   if (SUCCEEDED(hr))
+      hr = ToolsetGetDllDirectory(&Entry->Toolset, &Entry->DllDirectory);
+
+   if (SUCCEEDED(hr))
+   {
+      PWSTR VcDir = NULL;
+
+      if (SUCCEEDED(HeapPrintf(
+             &VcDir,
+             L"%s\\..\\..\\VC",
+             Entry->Toolset.Compiler->InstallDir)))
+      {
+         Entry->Watches[0] = FindFirstChangeNotification(
+            VcDir,
+            TRUE,
+            FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_FILE_NAME |
+               FILE_NOTIFY_CHANGE_LAST_WRITE
+         );
+      }
+      free(VcDir);
+
+      Entry->Watches[1] = FindFirstChangeNotification(
+         Entry->Toolset.Sdk->InstallDir,
+         FALSE,
+         FILE_NOTIFY_CHANGE_DIR_NAME
+      );
+   }
+
+   if (FAILED(hr))
+   {
+      ReleaseServerToolset(Entry);
+      Entry = NULL;
+   }
+
+   *Out = Entry;
+   return hr;
+}
+
+static HRESULT
+GetServerToolset(
+   PCLWRAPPER_ARGS_BASE Args,
+   PSERVER_TOOLSET *Out
+)
+{
+   HRESULT hr = S_OK;
+   PWSTR Key = NULL;
+   PSERVER_TOOLSET *Link;
+   PSERVER_TOOLSET Found = NULL;
+
+   hr = GetToolsetKey(Args, &Key);
+   if (FAILED(hr))
+      return hr;
+
+   EnterCriticalSection(&ToolsetLock);
+
+   Link = &Toolsets;
+   while (*Link)
+   {
+      PSERVER_TOOLSET Entry = *Link;
+
+      if (IsServerToolsetStale(Entry))
+      {
+         *Link = Entry->Next;
+         ReleaseServerToolset(Entry);
+         continue;
+      }
+
+      if (!wcscmp(Entry->Key, Key))
+      {
+         Found = Entry;
+         InterlockedIncrement(&Found->RefCount);
+         break;
+      }
+
+      Link = &Entry->Next;
+   }
+
+   LeaveCriticalSection(&ToolsetLock);
+
+   // Resolve outside the lock; discovery is the slow part and we don't want
+   // to hold up clients who want something we already have.  If two
+   // threads race to add the same key, both entries work, and the extra
+   // one just ages out with the rest.
+   //
+   if (!Found)
+   {
+      hr = CreateServerToolset(Args, Key, &Found);
+      Key = NULL;
+
+      if (SUCCEEDED(hr))
+      {
+         EnterCriticalSection(&ToolsetLock);
+         InterlockedIncrement(&Found->RefCount);
+         Found->Next = Toolsets;
+         Toolsets = Found;
+         LeaveCriticalSection(&ToolsetLock);
+      }
+   }
+
+   free(Key);
+   *Out = Found;
+   return hr;
+}
+
+// Registry changes anywhere under the VS or SDK keys invalidate every
+// toolset we hold.
+//
+static DWORD WINAPI
+WatchRegistry(
+   PVOID Context
+)
+{
+   PCWSTR KeyNames[] = {VS_ROOT_KEY, SDK_ROOT_KEY};
+   HKEY Keys[ARRAYSIZE(KeyNames)] = {0};
+   HANDLE Events[ARRAYSIZE(KeyNames)] = {0};
+   DWORD Count = 0;
+   INT i;
+
+   for (i = 0; i < ARRAYSIZE(KeyNames); ++i)
+   {
+      if (RegOpenKeyEx(
+             HKEY_LOCAL_MACHINE,
+             KeyNames[i],
+             0,
+             KEY_NOTIFY,
+             &Keys[Count]))
+      {
+         continue;
+      }
+
+      Events[Count] = CreateEvent(NULL, FALSE, FALSE, NULL);
+      if (!Events[Count])
+      {
+         RegCloseKey(Keys[Count]);
+         continue;
+      }
+
+      ++Count;
+   }
+
+   while (Count)
+   {
+      DWORD Result;
+
+      for (i = 0; i < (INT)Count; ++i)
+      {
+         RegNotifyChangeKeyValue(
+            Keys[i],
+            TRUE,
+            REG_NOTIFY_CHANGE_NAME | REG_NOTIFY_CHANGE_LAST_SET,
+            Events[i],
+            TRUE
+         );
+      }
+
+      Result = WaitForMultipleObjects(Count, Events, FALSE, INFINITE);
+      if (Result >= WAIT_OBJECT_0 + Count)
+         break;
+
+      InterlockedIncrement(&ToolsetGeneration);
+   }
+
+   return 0;
+}
+
+// Whether Path is relative to the current directory, rather than a name
+// that the compiler or linker looks for on its own (kernel32.lib, or a
+// header -include finds on the include path).
+//
+static BOOL
+IsLocalPath(
+   PCWSTR Cwd,
+   PCWSTR Path
+)
+{
+   PWSTR Absolute = NULL;
+   BOOL Local = CcBaseName(Path) != Path;
+
+   if (!Local && SUCCEEDED(MakeAbsolute(Cwd, Path, &Absolute)))
+      Local = GetFileAttributes(Absolute) != INVALID_FILE_ATTRIBUTES;
+
+   free(Absolute);
+   return Local;
+}
+
+static HRESULT
+RebaseLocalPath(
+   PCWSTR Cwd,
+   PCWSTR Path,
+   PWSTR *Out
+)
+{
+   if (!IsLocalPath(Cwd, Path))
+      return HeapPrintf(Out, L"%s", Path);
+   return MakeAbsolute(Cwd, Path, Out);
+}
+
+// -funity-exclude= names without a directory match sources by name alone.
+//
+static HRESULT
+RebaseUnityExclude(
+   PCWSTR Cwd,
+   PCWSTR Path,
+   PWSTR *Out
+)
+{
+   if (CcBaseName(Path) == Path)
+      return HeapPrintf(Out, L"%s", Path);
+   return MakeAbsolute(Cwd, Path, Out);
+}
+
+// -fmodule-file=[NAME=]PATH, where NAME may be a header in <> or "".
+//
+static HRESULT
+RebaseModuleFile(
+   PCWSTR Cwd,
+   PCWSTR ModuleFile,
+   PWSTR *Out
+)
+{
+   HRESULT hr = S_OK;
+   PCWSTR Close = NULL;
+   PCWSTR Path = ModuleFile;
+   PWSTR Absolute = NULL;
+
+   if (*ModuleFile == L'<')
+      Close = wcschr(ModuleFile + 1, L'>');
+   else if (*ModuleFile == L'"')
+      Close = wcschr(ModuleFile + 1, L'"');
+
+   if (Close && Close[1] == L'=')
+      Path = Close + 2;
+   else if (!Close && wcschr(ModuleFile, L'='))
+      Path = wcschr(ModuleFile, L'=') + 1;
+
+   hr = MakeAbsolute(Cwd, Path, &Absolute);
+   if (SUCCEEDED(hr))
+   {
+      hr = HeapPrintf(
+         Out,
+         L"%.*s%s",
+         (INT)(Path - ModuleFile),
+         ModuleFile,
+         Absolute
+      );
+   }
+
+   free(Absolute);
+   return hr;
+}
+
+static HRESULT
+RebaseList(
+   PCWSTR Cwd,
+   PSTRING_LIST *List,
+   HRESULT (*Rebase)(PCWSTR Cwd, PCWSTR Path, PWSTR *Out)
+)
+{
+   HRESULT hr = S_OK;
+   PSTRING_LIST Old = *List;
+   PSTRING_LIST New = NULL;
+   PSTRING_LIST Node;
+
+   for (Node = Old; SUCCEEDED(hr) && Node; Node = Node->Next)
+   {
+      PWSTR Path = NULL;
+
+      hr = Rebase(Cwd, Node->String, &Path);
+      if (SUCCEEDED(hr))
+         hr = StringListAllocString(Path, New, &New);
+      free(Path);
+   }
+
+   if (SUCCEEDED(hr))
+   {
+      StringListReverse(&New);
+      FreeStringList(Old);
+      *List = New;
+   }
+   else
+   {
+      FreeStringList(New);
+   }
+
+   return hr;
+}
+
+// The absolute path is kept in Owned, which the caller frees after the
+// arguments.
+//
+static HRESULT
+RebasePath(
+   PCWSTR Cwd,
+   PCWSTR *Path,
+   PSTRING_LIST *Owned
+)
+{
+   HRESULT hr = S_OK;
+   PWSTR Absolute = NULL;
+
+   if (!*Path)
+      return S_OK;
+
+   hr = MakeAbsolute(Cwd, *Path, &Absolute);
+   if (SUCCEEDED(hr))
+      hr = StringListAllocString(Absolute, *Owned, Owned);
+   if (SUCCEEDED(hr))
+      *Path = (*Owned)->String;
+
+   free(Absolute);
+   return hr;
+}
+
+//
+// The server has a different working directory from the client.  The child
+// compiler is started in the client's directory, but anything we resolve
+// ourselves has to be made absolute first.  Inputs and -include headers
+// that don't name a file here are left alone, for the linker or compiler
+// to look for.
+//
+static HRESULT
+RebaseArgs(
+   PCC_ARGS Args,
+   PCWSTR Cwd,
+   PSTRING_LIST *Owned
+)
+{
+   HRESULT hr = S_OK;
+   PCWSTR *Paths[] =
+   {
+      &Args->Base.ToolsetProfile,
+      &Args->OutputName,
+      &Args->DepsFile,
+      &Args->PchFile,
+      &Args->ModuleOutput,
+      &Args->ScanFile
+   };
+   INT i;
+
+   for (i = 0; SUCCEEDED(hr) && i < ARRAYSIZE(Paths); ++i)
+      hr = RebasePath(Cwd, Paths[i], Owned);
+
+   if (SUCCEEDED(hr) && Args->PdbFile)
+   {
+      PWSTR PdbFile = NULL;
+
+      hr = MakeAbsolute(Cwd, Args->PdbFile, &PdbFile);
+      if (SUCCEEDED(hr))
+      {
+         free(Args->PdbFile);
+         Args->PdbFile = PdbFile;
+      }
+   }
+
+   if (SUCCEEDED(hr))
+      hr = RebaseList(Cwd, &Args->Inputs, RebaseLocalPath);
+   if (SUCCEEDED(hr))
+      hr = RebaseList(Cwd, &Args->ForcedIncludes, RebaseLocalPath);
+   if (SUCCEEDED(hr))
+      hr = RebaseList(Cwd, &Args->UnityExcludes, RebaseUnityExclude);
+   if (SUCCEEDED(hr))
+      hr = RebaseList(Cwd, &Args->ModuleFiles, RebaseModuleFile);
+   if (SUCCEEDED(hr))
+      hr = RebaseList(Cwd, &Args->ModulePaths, MakeAbsolute);
+   if (SUCCEEDED(hr))
+      hr = RebaseList(Cwd, &Args->IncludePaths, MakeAbsolute);
+   if (SUCCEEDED(hr))
+      hr = RebaseList(Cwd, &Args->Base.LibraryPaths, MakeAbsolute);
+
+   return hr;
+}
+
+// Turns the client's variables back into an environment block.
+//
+static HRESULT
+JoinEnvironment(
+   PSTRING_LIST List,
+   PWSTR *Out
+)
+{
+   PSTRING_LIST Node;
+   SIZE_T Length = 1;
+   PWSTR Block;
+   PWSTR p;
+
+   for (Node = List; Node; Node = Node->Next)
+      Length += wcslen(Node->String) + 1;
+
+   Block = malloc(Length * sizeof(WCHAR));
+   if (!Block)
+      return E_OUTOFMEMORY;
+
+   p = Block;
+   for (Node = List; Node; Node = Node->Next)
+   {
+      if (!*Node->String)
+         continue;
+
+      wcscpy(p, Node->String);
+      p += wcslen(p) + 1;
+   }
+   *p = 0;
+
+   *Out = Block;
+   return S_OK;
+}
+
+static HRESULT
+SendOutput(
+   PVOID Context,
+   DWORD Stream,
+   const BYTE *Data,
+   DWORD Length
+)
+{
+   return PipeWriteFrame(
+      Context,
+      Stream == LAUNCH_STDERR ? SERVER_MSG_STDERR : SERVER_MSG_STDOUT,
+      Data,
+      Length
+   );
+}
+
+static HRESULT
+ServeRequest(
+   HANDLE Pipe,
+   PBUFFER_READER Request,
+   PDWORD ExitCode
+)
+{
+   HRESULT hr = S_OK;
+   DWORD Version = 0;
+   PWSTR Cwd = NULL;
+   PSTRING_LIST ArgList = NULL;
+   PSTRING_LIST Node;
+   PWSTR *Argv = NULL;
+   DWORD Argc = 0;
+   PSTRING_LIST EnvList = NULL;
+   PWSTR ClientEnvironment = NULL;
+   PWSTR Environment = NULL;
+   CC_ARGS Args = {0};
+   PSTRING_LIST Owned = NULL;
+   PSERVER_TOOLSET Toolset = NULL;
+   LAUNCH_PARAMS Launch = {0};
+
+   hr = ReaderReadDword(Request, &Version);
+   if (SUCCEEDED(hr) && Version != SERVER_PROTOCOL_VERSION)
+      hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+   if (SUCCEEDED(hr))
+      hr = ReaderReadString(Request, &Cwd);
+   if (SUCCEEDED(hr) && !Cwd)
+      hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+   if (SUCCEEDED(hr))
+      hr = ReaderReadStringList(Request, &ArgList);
+   if (SUCCEEDED(hr))
+      hr = ReaderReadStringList(Request, &EnvList);
+   if (SUCCEEDED(hr))
+      hr = JoinEnvironment(EnvList, &ClientEnvironment);
+
+   // From here on, CL, MAKEFLAGS, INCLUDE, CLWRAPPER_* and the rest are
+   // the client's.
+   //
+   if (SUCCEEDED(hr))
+      SetThreadEnvironment(ClientEnvironment);
+
+   if (SUCCEEDED(hr))
+   {
+      for (Node = ArgList; Node; Node = Node->Next)
+         ++Argc;
+
+      Argv = malloc((Argc + 1) * sizeof(*Argv));
+      if (!Argv)
+         hr = E_OUTOFMEMORY;
+   }
+
+   if (SUCCEEDED(hr))
+   {
+      Argc = 0;
+      for (Node = ArgList; Node; Node = Node->Next)
+         Argv[Argc++] = Node->String;
+      Argv[Argc] = NULL;
+
+      hr = CcParseArgs(&Args, Argv);
+   }
+
+   if (SUCCEEDED(hr))
+      hr = RebaseArgs(&Args, Cwd, &Owned);
+
+   if (SUCCEEDED(hr))
+      hr = GetServerToolset(&Args.Base, &Toolset);
+   if (SUCCEEDED(hr))
+      hr = BuildEnvironmentBlock(Toolset->DllDirectory, &Environment);
+
+   if (SUCCEEDED(hr))
+   {
+      Launch.CurrentDirectory = Cwd;
+      Launch.Environment = Environment;
+      Launch.OutputCallback = SendOutput;
+      Launch.CallbackContext = Pipe;
+
+      hr = CcExecute(&Args, &Toolset->Toolset, &Launch, ExitCode);
+   }
+
+   SetThreadEnvironment(NULL);
+
+   if (Toolset)
+      ReleaseServerToolset(Toolset);
+   CcArgsFree(&Args);
+   FreeStringList(Owned);
+   FreeStringList(ArgList);
+   FreeStringList(EnvList);
+   free(Argv);
+   free(Environment);
+   free(ClientEnvironment);
+   free(Cwd);
+   return hr;
+}
+
+static DWORD WINAPI
+ServerThread(
+   PVOID Context
+)
+{
+   HANDLE Pipe = Context;
+   HRESULT hr = S_OK;
+   BYTE_BUFFER Request = {0};
+   BUFFER_READER Reader = {0};
+   DWORD Type = 0;
+   DWORD Result[2] = {0};
+
+   hr = PipeReadFrame(Pipe, &Type, &Request);
+   if (SUCCEEDED(hr) && Type != SERVER_MSG_REQUEST)
+      hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+
+   if (SUCCEEDED(hr))
+   {
+      Reader.Data = Request.Buffer;
+      Reader.Length = Request.Length;
+
+      hr = ServeRequest(Pipe, &Reader, &Result[0]);
+      Result[1] = hr;
+
+      hr = PipeWriteFrame(Pipe, SERVER_MSG_EXIT, Result, sizeof(Result));
+   }
+
+   if (SUCCEEDED(hr))
+      FlushFileBuffers(Pipe);
+
+   DisconnectNamedPipe(Pipe);
+   CloseHandle(Pipe);
+   FreeBuffer(&Request);
+   ReleaseSemaphore(ThreadSlots, 1, NULL);
+   return 0;
+}
+
+HRESULT
+ServerMain(VOID)
+{
+   HRESULT hr = S_OK;
+   PWSTR Name = NULL;
+   HANDLE Watcher = NULL;
+   BOOL First = TRUE;
+
+   InitializeCriticalSection(&ToolsetLock);
+
+   hr = GetPipeName(&Name);
+
+   if (SUCCEEDED(hr))
+   {
+      ThreadSlots = CreateSemaphore(
+         NULL,
+         SERVER_MAX_THREADS,
+         SERVER_MAX_THREADS,
+         NULL
+      );
+      if (!ThreadSlots)
+         hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   if (SUCCEEDED(hr))
+   {
+      Watcher = CreateThread(NULL, 0, WatchRegistry, NULL, 0, NULL);
+      if (Watcher)
+         CloseHandle(Watcher);
+   }
+
+   if (SUCCEEDED(hr))
+      fprintf(stderr, "Listening on %ls\n", Name);
+
+   while (SUCCEEDED(hr))
+   {
+      HANDLE Pipe;
+      HANDLE Thread;
+
+      WaitForSingleObject(ThreadSlots, INFINITE);
+
+      Pipe = CreateNamedPipe(
+         Name,
+         PIPE_ACCESS_DUPLEX | (First ? FILE_FLAG_FIRST_PIPE_INSTANCE : 0),
+         PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT |
+            PIPE_REJECT_REMOTE_CLIENTS,
+         PIPE_UNLIMITED_INSTANCES,
+         65536,
+         65536,
+         0,
+         NULL
+      );
+      if (Pipe == INVALID_HANDLE_VALUE)
+      {
+         hr = HRESULT_FROM_WIN32(GetLastError());
+         if (First && hr == HRESULT_FROM_WIN32(ERROR_ACCESS_DENIED))
+            fprintf(stderr, "Is another server already running?\n");
+         break;
+      }
+
+      First = FALSE;
+
+      if (!ConnectNamedPipe(Pipe, NULL) &&
+          GetLastError() != ERROR_PIPE_CONNECTED)
+      {
+         CloseHandle(Pipe);
+         ReleaseSemaphore(ThreadSlots, 1, NULL);
+         continue;
+      }
+
+      Thread = CreateThread(NULL, 0, ServerThread, Pipe, 0, NULL);
+      if (Thread)
+      {
+         CloseHandle(Thread);
+      }
+      else
+      {
+         CloseHandle(Pipe);
+         ReleaseSemaphore(ThreadSlots, 1, NULL);
+      }
+   }
+
+   if (ThreadSlots)
+      CloseHandle(ThreadSlots);
+   free(Name);
+   return hr;
+}
+
+//
+// Client side.
+//
+
+static HRESULT
+WriteToStdHandle(
+   DWORD Which,
+   PBYTE_BUFFER Data
+)
+{
+   return WriteAll(GetStdHandle(Which), Data->Buffer, (DWORD)Data->Length);
+}
+
+//
+// Returns S_FALSE if the request should be handled locally instead: no
+// server was asked for, none is running, or it failed before it got as far
+// as running the compiler (in which case running locally will produce the
+// appropriate diagnostics).
+//
+HRESULT
+ServerClientRun(
+   PWSTR *Argv,
+   PDWORD ExitCode
+)
+{
+   HRESULT hr = S_OK;
+   PWSTR Enabled = NULL;
+   PWSTR Name = NULL;
+   HANDLE Pipe = INVALID_HANDLE_VALUE;
+   BYTE_BUFFER Frame = {0};
+   WCHAR Cwd[MAX_PATH * 2];
+   BOOL Done = FALSE;
+   BOOL SawOutput = FALSE;
+   INT Tries = 0;
+
+   GetEnvironmentString(L"CLWRAPPER_SERVER", &Enabled);
+   if (!Enabled || !*Enabled || !wcscmp(Enabled, L"0"))
+   {
+      free(Enabled);
+      return S_FALSE;
+   }
+   free(Enabled);
+
+   hr = GetPipeName(&Name);
+
+   while (SUCCEEDED(hr) && Pipe == INVALID_HANDLE_VALUE)
+   {
+      Pipe = CreateFile(
+         Name,
+         GENERIC_READ | GENERIC_WRITE,
+         0,
+         NULL,
+         OPEN_EXISTING,
+         0,
+         NULL
+      );
+      if (Pipe != INVALID_HANDLE_VALUE)
+         break;
+
+      if (GetLastError() != ERROR_PIPE_BUSY || ++Tries > 10 ||
+          !WaitNamedPipe(Name, 5000))
+      {
+         hr = S_FALSE;
+      }
+   }
+
+   if (hr == S_OK &&
+       !GetCurrentDirectory(ARRAYSIZE(Cwd), Cwd))
+   {
+      hr = S_FALSE;
+   }
+
+   if (hr == S_OK)
+   {
+      PSTRING_LIST List = NULL;
+      PSTRING_LIST EnvList = NULL;
+      PWSTR Env = GetEnvironmentStrings();
+      PCWSTR Var;
+      PWSTR *p;
+
+      for (p = Argv + 1; SUCCEEDED(hr) && *p; ++p)
+         hr = StringListAllocString(*p, List, &List);
+      StringListReverse(&List);
+
+      if (!Env)
+         hr = HRESULT_FROM_WIN32(GetLastError());
+      for (Var = Env; SUCCEEDED(hr) && *Var; Var += wcslen(Var) + 1)
+         hr = StringListAllocString(Var, EnvList, &EnvList);
+      StringListReverse(&EnvList);
+
+      if (SUCCEEDED(hr))
+         hr = BufferAppendDword(&Frame, SERVER_PROTOCOL_VERSION);
+      if (SUCCEEDED(hr))
+         hr = BufferAppendString(&Frame, Cwd);
+      if (SUCCEEDED(hr))
+         hr = BufferAppendStringList(&Frame, List);
+      if (SUCCEEDED(hr))
+         hr = BufferAppendStringList(&Frame, EnvList);
+
+      if (Env)
+         FreeEnvironmentStrings(Env);
+      FreeStringList(EnvList);
+      FreeStringList(List);
+   }
+
+   if (hr == S_OK)
+   {
+      hr = PipeWriteFrame(
+         Pipe,
+         SERVER_MSG_REQUEST,
+         Frame.Buffer,
+         (DWORD)Frame.Length
+      );
+      if (FAILED(hr))
+         hr = S_FALSE;
+   }
+
+   while (hr == S_OK && !Done)
+   {
+      DWORD Type = 0;
+
+      hr = PipeReadFrame(Pipe, &Type, &Frame);
+      if (FAILED(hr))
+      {
+         // If the server went away before saying anything, we can still
+         // do the job ourselves.
+         //
+         if (!SawOutput)
+            hr = S_FALSE;
+         break;
+      }
+
+      switch (Type)
+      {
+      case SERVER_MSG_STDOUT:
+         SawOutput = TRUE;
+         hr = WriteToStdHandle(STD_OUTPUT_HANDLE, &Frame);
+         break;
+      case SERVER_MSG_STDERR:
+         SawOutput = TRUE;
+         hr = WriteToStdHandle(STD_ERROR_HANDLE, &Frame);
+         break;
+      case SERVER_MSG_EXIT:
+         if (Frame.Length < 2 * sizeof(DWORD))
+         {
+            hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+         }
+         else
+         {
+            PDWORD Result = (PDWORD)Frame.Buffer;
+
+            *ExitCode = Result[0];
+            hr = (HRESULT)Result[1];
+            if (FAILED(hr) && !SawOutput)
+               hr = S_FALSE;
+         }
+         Done = TRUE;
+         break;
+      default:
+         hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+      }
+   }
+
+   if (Pipe != INVALID_HANDLE_VALUE)
+      CloseHandle(Pipe);
+   FreeBuffer(&Frame);
+   free(Name);
+   return hr;
+}
@@ -0,0 +1,514 @@
+/*
+ * Copyright (c) 2017 Andrew Sveikauskas
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ */
+
+#include "clwrapper.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+//
+// Discovering the installed compilers and SDKs means walking a good chunk of
+// the registry and poking at the filesystem for every known cl.exe.  We do
+// that on every single compile, so the results are kept in a small binary
+// file that is memory-mapped on the next run.
+//
+// The cache is considered valid as long as the "stamps" recorded alongside
+// it are unchanged: the last-write times of the registry keys we enumerated,
+// and the modification times of the install directories we found.
+//
+// The cache file is only ever mapped for reading, and is replaced as a
+// whole when it goes stale.  The hit and miss counts that dumpinfo reports
+// change on every run, so they're kept in a small file of their own
+// (toolset.counters) that is updated in place.
+//
+
+#define TOOLSET_CACHE_MAGIC   0x43544c43 // 'CLTC'
+#define TOOLSET_CACHE_VERSION 3
+
+#define TOOLSET_COUNTERS_MAGIC   0x4e544c43 // 'CLTN'
+#define TOOLSET_COUNTERS_VERSION 1
+
+typedef struct _TOOLSET_CACHE_HEADER
+{
+   DWORD Magic;
+   DWORD Version;
+   DWORD PayloadLength;
+   DWORD Reserved;
+} TOOLSET_CACHE_HEADER, *PTOOLSET_CACHE_HEADER;
+
+typedef struct _TOOLSET_CACHE_COUNTERS
+{
+   DWORD Magic;
+   DWORD Version;
+   volatile LONG Hits;
+   volatile LONG Misses;
+} TOOLSET_CACHE_COUNTERS, *PTOOLSET_CACHE_COUNTERS;
+
+typedef enum _STAMP_KIND
+{
+   STAMP_REGISTRY_KEY,
+   STAMP_DIRECTORY
+} STAMP_KIND;
+
+static DWORD CacheHits, CacheMisses;
+
+static VOID
+GetStamp(
+   STAMP_KIND Kind,
+   PCWSTR Path,
+   PULONGLONG Stamp
+)
+{
+   FILETIME Time = {0};
+
+   if (Kind == STAMP_REGISTRY_KEY)
+   {
+      HKEY Key = NULL;
+
+      if (!RegOpenKeyEx(HKEY_LOCAL_MACHINE, Path, 0, KEY_QUERY_VALUE, &Key))
+      {
+         RegQueryInfoKey(
+            Key,
+            NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+            &Time
+         );
+         RegCloseKey(Key);
+      }
+   }
+   else
+   {
+      WIN32_FILE_ATTRIBUTE_DATA Data = {0};
+
+      if (GetFileAttributesEx(Path, GetFileExInfoStandard, &Data))
+         Time = Data.ftLastWriteTime;
+   }
+
+   *Stamp = FileTimeToQword(&Time);
+}
+
+static HRESULT
+AppendStamp(
+   PBYTE_BUFFER Buffer,
+   PDWORD Count,
+   STAMP_KIND Kind,
+   PCWSTR Path
+)
+{
+   HRESULT hr = S_OK;
+   ULONGLONG Stamp = 0;
+
+   GetStamp(Kind, Path, &Stamp);
+
+   hr = BufferAppendDword(Buffer, Kind);
+   if (SUCCEEDED(hr))
+      hr = BufferAppendString(Buffer, Path);
+   if (SUCCEEDED(hr))
+      hr = BufferAppendQword(Buffer, Stamp);
+   if (SUCCEEDED(hr))
+      ++*Count;
+
+   return hr;
+}
+
+static HRESULT
+AppendVersionStamps(
+   PBYTE_BUFFER Buffer,
+   PDWORD Count,
+   PVS_VERSION Versions,
+   PCWSTR KeyFormat,
+   PCWSTR VcBinFormat
+)
+{
+   HRESULT hr = S_OK;
+   PVS_VERSION Node;
+
+   for (Node = Versions; SUCCEEDED(hr) && Node; Node = Node->Next)
+   {
+      PWSTR Path = NULL;
+
+      hr = HeapPrintf(&Path, KeyFormat, Node->Major, Node->Minor);
+      if (SUCCEEDED(hr))
+         hr = AppendStamp(Buffer, Count, STAMP_REGISTRY_KEY, Path);
+      free(Path);
+      Path = NULL;
+
+      if (SUCCEEDED(hr))
+         hr = AppendStamp(Buffer, Count, STAMP_DIRECTORY, Node->InstallDir);
+
+      // Adding a new cross compiler shows up as a new directory here.
+      //
+      if (SUCCEEDED(hr) && VcBinFormat)
+      {
+         hr = HeapPrintf(&Path, VcBinFormat, Node->InstallDir);
+         if (SUCCEEDED(hr))
+            hr = AppendStamp(Buffer, Count, STAMP_DIRECTORY, Path);
+         free(Path);
+      }
+   }
+
+   return hr;
+}
+
+//
+// Payload layout:
+//
+//    DWORD NumStamps
+//    { DWORD Kind; STRING Path; ULONGLONG Stamp; } [NumStamps]
+//    VS_VERSION list (compilers)
+//    VS_VERSION list (SDKs)
+//
+static HRESULT
+BuildCache(
+   PBYTE_BUFFER Output,
+   PVS_VERSION *Compilers,
+   PVS_VERSION *Sdks
+)
+{
+   HRESULT hr = S_OK;
+   BYTE_BUFFER Stamps = {0};
+   DWORD NumStamps = 0;
+   TOOLSET_CACHE_HEADER Header = {0};
+
+   // Stamp the root keys before probing, so that anything that changes while
+   // we probe causes the next run to probe again.
+   //
+   hr = AppendStamp(&Stamps, &NumStamps, STAMP_REGISTRY_KEY, VS_ROOT_KEY);
+   if (SUCCEEDED(hr))
+      hr = AppendStamp(&Stamps, &NumStamps, STAMP_REGISTRY_KEY, SDK_ROOT_KEY);
+
+   if (SUCCEEDED(hr))
+      hr = GetInstalledVsVersions(Compilers);
+   if (SUCCEEDED(hr))
+      hr = GetInstalledSdks(FALSE, Sdks);
+
+   if (SUCCEEDED(hr))
+   {
+      hr = AppendVersionStamps(
+         &Stamps,
+         &NumStamps,
+         *Compilers,
+         VS_ROOT_KEY L"\\%d.%d",
+         L"%s\\..\\..\\VC\\bin"
+      );
+   }
+   if (SUCCEEDED(hr))
+   {
+      hr = AppendVersionStamps(
+         &Stamps,
+         &NumStamps,
+         *Sdks,
+         SDK_ROOT_KEY L"\\v%d.%d",
+         NULL
+      );
+   }
+
+   if (SUCCEEDED(hr))
+   {
+      Header.Magic = TOOLSET_CACHE_MAGIC;
+      Header.Version = TOOLSET_CACHE_VERSION;
+
+      hr = BufferAppend(Output, &Header, sizeof(Header));
+   }
+   if (SUCCEEDED(hr))
+      hr = BufferAppendDword(Output, NumStamps);
+   if (SUCCEEDED(hr))
+      hr = BufferAppend(Output, Stamps.Buffer, Stamps.Length);
+   if (SUCCEEDED(hr))
+      hr = WriteVsVersions(*Compilers, Output);
+   if (SUCCEEDED(hr))
+      hr = WriteVsVersions(*Sdks, Output);
+
+   if (SUCCEEDED(hr))
+   {
+      ((PTOOLSET_CACHE_HEADER)Output->Buffer)->PayloadLength =
+         (DWORD)(Output->Length - sizeof(Header));
+   }
+
+   FreeBuffer(&Stamps);
+   return hr;
+}
+
+// Returns S_FALSE if any of the stamps no longer match.
+//
+static HRESULT
+CheckStamps(
+   PBUFFER_READER Reader
+)
+{
+   HRESULT hr = S_OK;
+   DWORD Count = 0;
+
+   hr = ReaderReadDword(Reader, &Count);
+
+   while (hr == S_OK && Count--)
+   {
+      DWORD Kind = 0;
+      PWSTR Path = NULL;
+      ULONGLONG Recorded = 0;
+      ULONGLONG Current = 0;
+
+      hr = ReaderReadDword(Reader, &Kind);
+      if (SUCCEEDED(hr))
+         hr = ReaderReadString(Reader, &Path);
+      if (SUCCEEDED(hr))
+         hr = ReaderReadQword(Reader, &Recorded);
+
+      if (SUCCEEDED(hr) && Path)
+      {
+         GetStamp(Kind, Path, &Current);
+         if (Current != Recorded)
+            hr = S_FALSE;
+      }
+
+      free(Path);
+   }
+
+   return hr;
+}
+
+// Returns S_FALSE on a cache miss.
+//
+static HRESULT
+LoadCache(
+   PCWSTR Path,
+   PVS_VERSION *Compilers,
+   PVS_VERSION *Sdks
+)
+{
+   HRESULT hr = S_OK;
+   MAPPED_FILE Mapping = {0};
+   PTOOLSET_CACHE_HEADER Header = NULL;
+   BUFFER_READER Reader = {0};
+
+   hr = MapFile(Path, FALSE, &Mapping);
+   if (FAILED(hr))
+      return S_FALSE;
+
+   if (Mapping.Length >= sizeof(*Header))
+      Header = (PTOOLSET_CACHE_HEADER)Mapping.Data;
+
+   if (!Header ||
+       Header->Magic != TOOLSET_CACHE_MAGIC ||
+       Header->Version != TOOLSET_CACHE_VERSION ||
+       Header->PayloadLength != Mapping.Length - sizeof(*Header))
+   {
+      hr = S_FALSE;
+   }
+
+   if (hr == S_OK)
+   {
+      Reader.Data = Mapping.Data + sizeof(*Header);
+      Reader.Length = Header->PayloadLength;
+
+      hr = CheckStamps(&Reader);
+   }
+
+   if (hr == S_OK)
+      hr = ReadVsVersions(&Reader, Compilers);
+   if (hr == S_OK)
+      hr = ReadVsVersions(&Reader, Sdks);
+
+   if (hr != S_OK)
+   {
+      FreeVsVersions(*Compilers);
+      FreeVsVersions(*Sdks);
+      *Compilers = *Sdks = NULL;
+      hr = S_FALSE;
+   }
+
+   UnmapFile(&Mapping);
+   return hr;
+}
+
+// Adds one to the hits or misses in the counters file at Path, creating
+// it if need be, and notes both counts for GetToolsetCacheCounters().  A
+// file from another version starts again from zero.  Nothing depends on
+// the counts, so failing to update them is ignored.
+//
+static VOID
+CountLookup(
+   PCWSTR Path,
+   BOOL Hit
+)
+{
+   HANDLE File = INVALID_HANDLE_VALUE;
+   LARGE_INTEGER Size = {0};
+   MAPPED_FILE Mapping = {0};
+   PTOOLSET_CACHE_COUNTERS Counters = NULL;
+
+   File = CreateFile(
+      Path,
+      GENERIC_READ | GENERIC_WRITE,
+      FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+      NULL,
+      OPEN_ALWAYS,
+      FILE_ATTRIBUTE_NORMAL,
+      NULL
+   );
+   if (File == INVALID_HANDLE_VALUE)
+      return;
+
+   // A new file is extended with zeroes, which the version check below
+   // takes as counters that haven't been set up yet.
+   //
+   if (GetFileSizeEx(File, &Size) &&
+       (ULONGLONG)Size.QuadPart < sizeof(*Counters))
+   {
+      Size.QuadPart = sizeof(*Counters);
+      if (SetFilePointerEx(File, Size, NULL, FILE_BEGIN))
+         SetEndOfFile(File);
+   }
+
+   CloseHandle(File);
+
+   if (SUCCEEDED(MapFile(Path, TRUE, &Mapping)) &&
+       Mapping.Length >= sizeof(*Counters))
+   {
+      Counters = (PTOOLSET_CACHE_COUNTERS)Mapping.Data;
+
+      if (Counters->Magic != TOOLSET_COUNTERS_MAGIC ||
+          Counters->Version != TOOLSET_COUNTERS_VERSION)
+      {
+         Counters->Hits = Counters->Misses = 0;
+         Counters->Version = TOOLSET_COUNTERS_VERSION;
+         Counters->Magic = TOOLSET_COUNTERS_MAGIC;
+      }
+
+      if (Hit)
+         InterlockedIncrement(&Counters->Hits);
+      else
+         InterlockedIncrement(&Counters->Misses);
+
+      CacheHits = Counters->Hits;
+      CacheMisses = Counters->Misses;
+   }
+
+   UnmapFile(&Mapping);
+}
+
+HRESULT
+GetCachedVsVersionsAndSdks(
+   BOOL UseCache,
+   PVS_VERSION *CompilersOut,
+   PVS_VERSION *SdksOut
+)
+{
+   HRESULT hr = S_OK;
+   PWSTR Dir = NULL;
+   PWSTR Path = NULL;
+   PWSTR CountersPath = NULL;
+   PWSTR Disable = NULL;
+   PVS_VERSION Compilers = NULL;
+   PVS_VERSION Sdks = NULL;
+   BYTE_BUFFER NewCache = {0};
+
+   if (UseCache)
+   {
+      GetEnvironmentString(L"CLWRAPPER_NO_TOOLSET_CACHE", &Disable);
+      if (Disable && *Disable && wcscmp(Disable, L"0"))
+         UseCache = FALSE;
+   }
+
+   // If we can't figure out where the cache goes, we can still do the
+   // expensive thing.
+   //
+   if (UseCache &&
+       FAILED(GetDataDirectory(NULL, &Dir)))
+   {
+      UseCache = FALSE;
+   }
+
+   if (UseCache)
+   {
+      hr = HeapPrintf(&Path, L"%s\\toolset.cache", Dir);
+      if (SUCCEEDED(hr))
+         hr = HeapPrintf(&CountersPath, L"%s\\toolset.counters", Dir);
+   }
+
+   if (SUCCEEDED(hr) && UseCache)
+   {
+      hr = LoadCache(Path, &Compilers, &Sdks);
+      if (SUCCEEDED(hr))
+         CountLookup(CountersPath, hr == S_OK);
+   }
+   else if (SUCCEEDED(hr))
+   {
+      ++CacheMisses;
+      hr = S_FALSE;
+   }
+
+   if (hr == S_FALSE)
+   {
+      hr = BuildCache(&NewCache, &Compilers, &Sdks);
+
+      // Failing to write the cache is not fatal; we already have the
+      // answer.  The old file's stamps still don't match, so the next run
+      // builds the cache again and has another go at writing it.
+      //
+      if (SUCCEEDED(hr) && UseCache)
+         WriteFileAtomic(Path, NewCache.Buffer, NewCache.Length);
+   }
+
+   if (SUCCEEDED(hr))
+   {
+      *CompilersOut = Compilers;
+      *SdksOut = Sdks;
+      Compilers = Sdks = NULL;
+   }
+
+   FreeVsVersions(Compilers);
+   FreeVsVersions(Sdks);
+   FreeBuffer(&NewCache);
+   free(Disable);
+   free(CountersPath);
+   free(Path);
+   free(Dir);
+   return hr;
+}
+
+// Reports the counters kept next to the cache, as of the last call to
+// GetCachedVsVersionsAndSdks() or by reading the file if there was no such
+// call.
+//
+VOID
+GetToolsetCacheCounters(
+   PDWORD Hits,
+   PDWORD Misses
+)
+{
+   if (!CacheHits && !CacheMisses)
+   {
+      PWSTR Dir = NULL;
+      PWSTR Path = NULL;
+      MAPPED_FILE Mapping = {0};
+
+      if (SUCCEEDED(GetDataDirectory(NULL, &Dir)) &&
+          SUCCEEDED(HeapPrintf(&Path, L"%s\\toolset.counters", Dir)) &&
+          SUCCEEDED(MapFile(Path, FALSE, &Mapping)))
+      {
+         if (Mapping.Length >= sizeof(TOOLSET_CACHE_COUNTERS))
+         {
+            PTOOLSET_CACHE_COUNTERS Counters = (PVOID)Mapping.Data;
+
+            if (Counters->Magic == TOOLSET_COUNTERS_MAGIC &&
+                Counters->Version == TOOLSET_COUNTERS_VERSION)
+            {
+               CacheHits = Counters->Hits;
+               CacheMisses = Counters->Misses;
+            }
+         }
+         UnmapFile(&Mapping);
+      }
+
+      free(Path);
+      free(Dir);
+   }
+
+   *Hits = CacheHits;
+   *Misses = CacheMisses;
+}
@@ -0,0 +1,737 @@
+/*
+ * Copyright (c) 2017 Andrew Sveikauskas
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ */
+
+#include "clwrapper.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define TOOLSET_PROFILE_MAGIC   0x50544c43 // 'CLTP'
+#define TOOLSET_PROFILE_VERSION 1
+
+static HRESULT
+FindInterestingWin10Version(
+   PCWSTR SdkInstallDir,
+   PWSTR *Result
+);
+
+// FindToolset() hands back every candidate, best first.  Only keep the one we
+// are going to use, along with the cl.exe it selected.
+//
+static VOID
+TrimToFirst(
+   PVS_VERSION Version
+)
+{
+   FreeVsVersions(Version->Next);
+   Version->Next = NULL;
+
+   if (Version->Configurations)
+   {
+      FreeStringList(Version->Configurations->Next);
+      Version->Configurations->Next = NULL;
+   }
+
+   if (Version->ClPaths)
+   {
+      FreeStringList(Version->ClPaths->Next);
+      Version->ClPaths->Next = NULL;
+   }
+}
+
+// SDK and compiler specific includes...
+//
+static HRESULT
+ResolveIncludePaths(
+   PCLWRAPPER_TOOLSET Toolset
+)
+{
+   HRESULT hr = S_OK;
+   PVS_VERSION SdkInfo = Toolset->Sdk;
+   PVS_VERSION CompilerInfo = Toolset->Compiler;
+   PWSTR Includes[32], *p = Includes;
+
+   if (SdkInfo->Major == 10)
+   {
+      *p++ = L"%s\\include\\%s\\shared";
+      *p++ = SdkInfo->InstallDir;
+      *p++ = L"%s\\include\\%s\\ucrt";
+      *p++ = SdkInfo->InstallDir;
+      *p++ = L"%s\\include\\%s\\um";
+      *p++ = SdkInfo->InstallDir;
+      *p++ = L"%s\\include\\%s\\winrt";
+      *p++ = SdkInfo->InstallDir;
+   }
+   else
+   {
+      *p++ = L"%s\\include";
+      *p++ = SdkInfo->InstallDir;
+   }
+
+   *p++ = L"%s\\..\\..\\VC\\include";
+   *p++ = CompilerInfo->InstallDir;
+
+   *p = NULL;
+
+   p = Includes;
+
+   while (SUCCEEDED(hr) && *p)
+   {
+      PWSTR Path = NULL;
+
+      hr = HeapPrintf(&Path, p[0], p[1], Toolset->Win10SdkVersion);
+      if (SUCCEEDED(hr))
+      {
+         hr = StringListAllocString(
+            Path,
+            Toolset->IncludePaths,
+            &Toolset->IncludePaths
+         );
+      }
+      free(Path);
+
+      p += 2;
+   }
+
+   StringListReverse(&Toolset->IncludePaths);
+
+   return hr;
+}
+
+// SDK and compiler libraries...
+//
+static HRESULT
+ResolveLibraryPaths(
+   PCLWRAPPER_ARGS_BASE Args,
+   PCLWRAPPER_TOOLSET Toolset
+)
+{
+   HRESULT hr = S_OK;
+   PVS_VERSION SdkInfo = Toolset->Sdk;
+   PVS_VERSION CompilerInfo = Toolset->Compiler;
+   const ARCHITECTURE *Arch = FindArchByConfiguration(
+      Args->DesiredArchitecture
+   );
+   PCWSTR LibPaths[32], *p = LibPaths;
+   PCWSTR SdkVersion = Toolset->Win10SdkVersion;
+
+   if (SdkInfo->Major == 10)
+   {
+      *p++ = L"%s\\lib\\%s\\ucrt";
+      *p++ = SdkInfo->InstallDir,
+      *p++ = Arch ? Arch->SdkArchName : L"x86";
+      *p++ = SdkVersion;
+
+      *p++ = L"%s\\lib\\%s\\um";
+      *p++ = SdkInfo->InstallDir,
+      *p++ = Arch ? Arch->SdkArchName : L"x86";
+      *p++ = SdkVersion;
+   }
+   else
+   {
+      *p++ = L"%s\\lib";
+      *p++ = SdkInfo->InstallDir,
+      *p++ = Arch ? Arch->SdkArchName : NULL;
+      *p++ = NULL;
+   }
+
+   *p++ = L"%s\\..\\..\\VC\\lib";
+   *p++ = CompilerInfo->InstallDir,
+   *p++ = Arch ? Arch->ClArchName : NULL;
+   *p++ = NULL;
+
+   *p = NULL;
+   p = LibPaths;
+
+   while (SUCCEEDED(hr) && *p)
+   {
+      PWSTR Path = NULL;
+      PWSTR OnHeap = NULL;
+      PCWSTR Fmt = p[0]; 
+      PCWSTR InstallDir = p[1];
+      PCWSTR ArchString = p[2];
+      PCWSTR Sdk = p[3];
+
+      if (ArchString)
+      {
+         hr = HeapPrintf(&OnHeap, L"%s\\%%s", Fmt);
+         Fmt = OnHeap;
+
+         if (Sdk)
+         {
+            PCWSTR c = Sdk;
+            Sdk = ArchString;
+            ArchString = c;
+         }
+      }
+
+      if (SUCCEEDED(hr))
+         hr = HeapPrintf(&Path, Fmt, InstallDir, ArchString, Sdk);
+      if (SUCCEEDED(hr))
+      {
+         hr = StringListAllocString(
+            Path,
+            Toolset->LibraryPaths,
+            &Toolset->LibraryPaths
+         );
+      }
+
+      free(Path);
+      free(OnHeap);
+
+      p += 4;
+   }
+
+   StringListReverse(&Toolset->LibraryPaths);
+
+   return hr;
+}
+
+static HRESULT
+CheckProfileMatchesArgs(
+   PCLWRAPPER_ARGS_BASE Args,
+   PCLWRAPPER_TOOLSET Toolset
+)
+{
+   HRESULT hr = S_OK;
+   PCWSTR Configuration = Toolset->Compiler->Configurations->String;
+
+   if (Args->DesiredArchitecture &&
+       wcscmp(Args->DesiredArchitecture, Configuration))
+   {
+      fprintf(
+         stderr,
+         "-m%ls conflicts with toolset profile (-m%ls)\n",
+         Args->DesiredArchitecture,
+         Configuration
+      );
+      hr = E_INVALIDARG;
+   }
+
+   if (SUCCEEDED(hr) && Args->DesiredHost)
+   {
+      const ARCHITECTURE *Arch = FindArchByClPath(
+         Toolset->Compiler->InstallDir,
+         Toolset->Compiler->ClPaths->String
+      );
+      PCWSTR Host = Arch ? Arch->HostArchName : L"x86";
+
+      if (wcscmp(Args->DesiredHost, Host))
+      {
+         fprintf(
+            stderr,
+            "-host=%ls conflicts with toolset profile (-host=%ls)\n",
+            Args->DesiredHost,
+            Host
+         );
+         hr = E_INVALIDARG;
+      }
+   }
+
+   if (SUCCEEDED(hr) &&
+       Args->CompilerVersion.Specified &&
+       (Args->CompilerVersion.DesiredMajor != Toolset->Compiler->Major ||
+        Args->CompilerVersion.DesiredMinor != Toolset->Compiler->Minor))
+   {
+      fprintf(
+         stderr,
+         "-V %d.%d conflicts with toolset profile (%d.%d)\n",
+         Args->CompilerVersion.DesiredMajor,
+         Args->CompilerVersion.DesiredMinor,
+         Toolset->Compiler->Major,
+         Toolset->Compiler->Minor
+      );
+      hr = E_INVALIDARG;
+   }
+
+   if (SUCCEEDED(hr) &&
+       Args->SdkVersion.Specified &&
+       (Args->SdkVersion.DesiredMajor != Toolset->Sdk->Major ||
+        Args->SdkVersion.DesiredMinor != Toolset->Sdk->Minor))
+   {
+      fprintf(
+         stderr,
+         "-sdkversion %d.%d conflicts with toolset profile (%d.%d)\n",
+         Args->SdkVersion.DesiredMajor,
+         Args->SdkVersion.DesiredMinor,
+         Toolset->Sdk->Major,
+         Toolset->Sdk->Minor
+      );
+      hr = E_INVALIDARG;
+   }
+
+   return hr;
+}
+
+//
+// Picks a compiler and SDK, and works out the include and library paths
+// that go with them.  If the arguments name a toolset profile, all of
+// that comes from the profile and nothing is probed.
+//
+HRESULT
+ToolsetAcquire(
+   PCLWRAPPER_ARGS_BASE Args,
+   PCLWRAPPER_TOOLSET Toolset
+)
+{
+   HRESULT hr = S_OK;
+
+   memset(Toolset, 0, sizeof(*Toolset));
+
+   if (Args->ToolsetProfile)
+   {
+      hr = ToolsetImport(Args->ToolsetProfile, Toolset);
+      if (FAILED(hr))
+      {
+         fprintf(
+            stderr,
+            "Could not load toolset profile %ls\n",
+            Args->ToolsetProfile
+         );
+      }
+
+      if (SUCCEEDED(hr))
+         hr = CheckProfileMatchesArgs(Args, Toolset);
+   }
+   else
+   {
+      hr = FindToolset(Args, &Toolset->Compiler, &Toolset->Sdk);
+      if (FAILED(hr))
+      {
+         fprintf(stderr, "Failure to locate VS tools!\n");
+      }
+
+      if (SUCCEEDED(hr))
+      {
+         TrimToFirst(Toolset->Compiler);
+         TrimToFirst(Toolset->Sdk);
+
+         if (Toolset->Sdk->Major == 10)
+         {
+            hr = FindInterestingWin10Version(
+               Toolset->Sdk->InstallDir,
+               &Toolset->Win10SdkVersion
+            );
+         }
+      }
+
+      if (SUCCEEDED(hr))
+         hr = ResolveIncludePaths(Toolset);
+      if (SUCCEEDED(hr))
+         hr = ResolveLibraryPaths(Args, Toolset);
+   }
+
+   if (FAILED(hr))
+      ToolsetFree(Toolset);
+
+   return hr;
+}
+
+VOID
+ToolsetFree(
+   PCLWRAPPER_TOOLSET Toolset
+)
+{
+   FreeVsVersions(Toolset->Compiler);
+   FreeVsVersions(Toolset->Sdk);
+   free(Toolset->Win10SdkVersion);
+   FreeStringList(Toolset->IncludePaths);
+   FreeStringList(Toolset->LibraryPaths);
+
+   memset(Toolset, 0, sizeof(*Toolset));
+}
+
+// Finds a tool that lives next to the selected cl.exe, eg. lib.exe or
+// link.exe.
+//
+HRESULT
+ToolsetGetToolPath(
+   PCLWRAPPER_TOOLSET Toolset,
+   PCWSTR ToolName,
+   PWSTR *Out
+)
+{
+   HRESULT hr = S_OK;
+   PCWSTR ClPath = Toolset->Compiler->ClPaths->String;
+   PCWSTR Slash = wcsrchr(ClPath, L'\\');
+   INT DirLength = Slash ? (INT)(Slash - ClPath) : 0;
+
+   if (Slash)
+      hr = HeapPrintf(Out, L"%.*s\\%s", DirLength, ClPath, ToolName);
+   else
+      hr = HeapPrintf(Out, L"%s", ToolName);
+
+   return hr;
+}
+
+//
+// Where cl and link find the DLLs they don't keep beside them, for PATH.
+// That's VS's IDE dir for the x86-hosted tools; the 64-bit ones can't
+// load what's there, and use their host's bin dir instead.
+//
+HRESULT
+ToolsetGetDllDirectory(
+   PCLWRAPPER_TOOLSET Toolset,
+   PWSTR *Out
+)
+{
+   PCWSTR InstallDir = Toolset->Compiler->InstallDir;
+   const ARCHITECTURE *Arch = FindArchByClPath(
+      InstallDir,
+      Toolset->Compiler->ClPaths->String
+   );
+
+   if (Arch && Arch->HostDirectory)
+      return HeapPrintf(Out, L"%s\\%s", InstallDir, Arch->HostDirectory);
+
+   return HeapPrintf(Out, L"%s", InstallDir);
+}
+
+//
+// Appends a compiler binary's full file version, down to the build and
+// QFE numbers, and its size, to Out.  One that isn't there is recorded as
+// such; older compilers don't have all of them.
+//
+static HRESULT
+AppendBinaryIdentity(
+   PCWSTR Directory,
+   PCWSTR Name,
+   POUTPUT_STRING Out
+)
+{
+   HRESULT hr = S_OK;
+   PWSTR Path = NULL;
+   PWSTR Identity = NULL;
+   PVOID Info = NULL;
+   VS_FIXEDFILEINFO *Fixed = NULL;
+   UINT FixedLength = 0;
+   DWORD InfoLength = 0;
+   DWORD Handle = 0;
+   WIN32_FILE_ATTRIBUTE_DATA Attributes;
+
+   hr = HeapPrintf(&Path, L"%s\\%s", Directory, Name);
+
+   if (SUCCEEDED(hr) &&
+       !GetFileAttributesEx(Path, GetFileExInfoStandard, &Attributes))
+   {
+      hr = HeapPrintf(&Identity, L"-%s-none", Name);
+   }
+   else if (SUCCEEDED(hr))
+   {
+      InfoLength = GetFileVersionInfoSize(Path, &Handle);
+      if (!InfoLength)
+         hr = HRESULT_FROM_WIN32(GetLastError());
+
+      if (SUCCEEDED(hr))
+      {
+         Info = malloc(InfoLength);
+         if (!Info)
+            hr = E_OUTOFMEMORY;
+      }
+
+      if (SUCCEEDED(hr) &&
+          !GetFileVersionInfo(Path, 0, InfoLength, Info))
+      {
+         hr = HRESULT_FROM_WIN32(GetLastError());
+      }
+
+      if (SUCCEEDED(hr) &&
+          (!VerQueryValue(Info, L"\\", (PVOID *)&Fixed, &FixedLength) ||
+           FixedLength < sizeof(*Fixed)))
+      {
+         hr = HRESULT_FROM_WIN32(ERROR_RESOURCE_TYPE_NOT_FOUND);
+      }
+
+      if (SUCCEEDED(hr))
+      {
+         hr = HeapPrintf(
+            &Identity,
+            L"-%s-%u.%u.%u.%u-%I64u",
+            Name,
+            HIWORD(Fixed->dwFileVersionMS),
+            LOWORD(Fixed->dwFileVersionMS),
+            HIWORD(Fixed->dwFileVersionLS),
+            LOWORD(Fixed->dwFileVersionLS),
+            ((ULONGLONG)Attributes.nFileSizeHigh << 32) |
+               Attributes.nFileSizeLow
+         );
+      }
+   }
+
+   if (SUCCEEDED(hr))
+      hr = AppendString(Identity, Out);
+
+   free(Identity);
+   free(Info);
+   free(Path);
+   return hr;
+}
+
+//
+// Describes the compiler well enough for another machine to tell whether
+// its own would produce the same objects: its version, what it targets,
+// and the file version and size of cl.exe and of the front and back ends
+// it loads, which change with every update, hotfixes included.  Where
+// it's installed is left out, since that needn't match.
+//
+HRESULT
+ToolsetGetIdentity(
+   PCLWRAPPER_TOOLSET Toolset,
+   PWSTR *Out
+)
+{
+   HRESULT hr = S_OK;
+   PCWSTR Binaries[] = {L"cl.exe", L"c1.dll", L"c1xx.dll", L"c2.dll"};
+   PCWSTR ClPath = Toolset->Compiler->ClPaths->String;
+   INT DirectoryLength = (INT)(CcBaseName(ClPath) - ClPath);
+   PWSTR Directory = NULL;
+   PWSTR Version = NULL;
+   OUTPUT_STRING Identity = {0};
+   INT i;
+
+   // CcBaseName() leaves the separator on.
+   //
+   if (DirectoryLength)
+      --DirectoryLength;
+
+   hr = HeapPrintf(&Directory, L"%.*s", DirectoryLength, ClPath);
+   if (SUCCEEDED(hr))
+   {
+      hr = HeapPrintf(
+         &Version,
+         L"cl-%u.%u-%s",
+         Toolset->Compiler->Major,
+         Toolset->Compiler->Minor,
+         Toolset->Compiler->Configurations->String
+      );
+   }
+   if (SUCCEEDED(hr))
+      hr = AppendString(Version, &Identity);
+
+   for (i = 0; SUCCEEDED(hr) && i < ARRAYSIZE(Binaries); ++i)
+      hr = AppendBinaryIdentity(Directory, Binaries[i], &Identity);
+
+   if (SUCCEEDED(hr))
+   {
+      *Out = Identity.Buffer;
+      Identity.Buffer = NULL;
+   }
+
+   FreeString(&Identity);
+   free(Version);
+   free(Directory);
+   return hr;
+}
+
+//
+// Whether Path is a header from the toolset's include directories: the
+// CRT, the SDK and so on.
+//
+BOOL
+ToolsetIsSystemHeader(
+   PCLWRAPPER_TOOLSET Toolset,
+   PCWSTR Path
+)
+{
+   PSTRING_LIST List;
+
+   for (List = Toolset->IncludePaths; List; List = List->Next)
+   {
+      SIZE_T Length = wcslen(List->String);
+
+      while (Length &&
+             (List->String[Length - 1] == L'\\' ||
+              List->String[Length - 1] == L'/'))
+      {
+         --Length;
+      }
+
+      if (Length &&
+          !_wcsnicmp(Path, List->String, Length) &&
+          (Path[Length] == L'\\' || Path[Length] == L'/'))
+      {
+         return TRUE;
+      }
+   }
+
+   return FALSE;
+}
+
+//
+// Profile layout:
+//
+//    DWORD Magic, Version
+//    VS_VERSION list (compiler; exactly one)
+//    VS_VERSION list (SDK; exactly one)
+//    STRING Win10SdkVersion
+//    STRING_LIST IncludePaths
+//    STRING_LIST LibraryPaths
+//
+HRESULT
+ToolsetExport(
+   PCLWRAPPER_TOOLSET Toolset,
+   PCWSTR Path
+)
+{
+   HRESULT hr = S_OK;
+   BYTE_BUFFER Buffer = {0};
+
+   hr = BufferAppendDword(&Buffer, TOOLSET_PROFILE_MAGIC);
+   if (SUCCEEDED(hr))
+      hr = BufferAppendDword(&Buffer, TOOLSET_PROFILE_VERSION);
+   if (SUCCEEDED(hr))
+      hr = WriteVsVersions(Toolset->Compiler, &Buffer);
+   if (SUCCEEDED(hr))
+      hr = WriteVsVersions(Toolset->Sdk, &Buffer);
+   if (SUCCEEDED(hr))
+      hr = BufferAppendString(&Buffer, Toolset->Win10SdkVersion);
+   if (SUCCEEDED(hr))
+      hr = BufferAppendStringList(&Buffer, Toolset->IncludePaths);
+   if (SUCCEEDED(hr))
+      hr = BufferAppendStringList(&Buffer, Toolset->LibraryPaths);
+
+   if (SUCCEEDED(hr))
+      hr = WriteFileAtomic(Path, Buffer.Buffer, Buffer.Length);
+
+   FreeBuffer(&Buffer);
+   return hr;
+}
+
+HRESULT
+ToolsetImport(
+   PCWSTR Path,
+   PCLWRAPPER_TOOLSET Toolset
+)
+{
+   HRESULT hr = S_OK;
+   BYTE_BUFFER Buffer = {0};
+   BUFFER_READER Reader = {0};
+   DWORD Magic = 0, Version = 0;
+
+   memset(Toolset, 0, sizeof(*Toolset));
+
+   hr = ReadFileContents(Path, &Buffer);
+   if (SUCCEEDED(hr))
+   {
+      Reader.Data = Buffer.Buffer;
+      Reader.Length = Buffer.Length;
+
+      hr = ReaderReadDword(&Reader, &Magic);
+   }
+   if (SUCCEEDED(hr))
+      hr = ReaderReadDword(&Reader, &Version);
+   if (SUCCEEDED(hr) &&
+       (Magic != TOOLSET_PROFILE_MAGIC || Version != TOOLSET_PROFILE_VERSION))
+   {
+      hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+   }
+
+   if (SUCCEEDED(hr))
+      hr = ReadVsVersions(&Reader, &Toolset->Compiler);
+   if (SUCCEEDED(hr))
+      hr = ReadVsVersions(&Reader, &Toolset->Sdk);
+   if (SUCCEEDED(hr))
+      hr = ReaderReadString(&Reader, &Toolset->Win10SdkVersion);
+   if (SUCCEEDED(hr))
+      hr = ReaderReadStringList(&Reader, &Toolset->IncludePaths);
+   if (SUCCEEDED(hr))
+      hr = ReaderReadStringList(&Reader, &Toolset->LibraryPaths);
+
+   if (SUCCEEDED(hr) &&
+       (!Toolset->Compiler ||
+        !Toolset->Compiler->ClPaths ||
+        !Toolset->Compiler->Configurations ||
+        !Toolset->Sdk))
+   {
+      hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+   }
+
+   if (FAILED(hr))
+      ToolsetFree(Toolset);
+
+   FreeBuffer(&Buffer);
+   return hr;
+}
+
+// Starting with Win10, it seems the directory structure of non-CRT headers and
+// libraries changes, with several target versions and not all of them usable.
+// This function should find the highest number target where windows.h exists.
+//
+static HRESULT
+FindInterestingWin10Version(
+   PCWSTR SdkInstallDir,
+   PWSTR *Result
+)
+{
+   HRESULT hr = S_OK;
+   PWSTR FindPath = NULL;
+   PWSTR TempPath = NULL;
+   WIN32_FIND_DATA FindData = {0};
+   HANDLE FindHandle = INVALID_HANDLE_VALUE;
+   WCHAR ResultBuffer[MAX_PATH] = {0};
+
+   hr = HeapPrintf(&FindPath, L"%s\\include\\*", SdkInstallDir);
+   if (SUCCEEDED(hr))
+   {
+      FindHandle = FindFirstFile(FindPath, &FindData);
+      if (FindHandle == INVALID_HANDLE_VALUE)
+         hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   if (SUCCEEDED(hr)) do
+   {
+      DWORD Attrs = 0;
+
+      if (!(FindData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ||
+          (FindData.cFileName[0] == L'.' &&
+           (!FindData.cFileName[1] || !wcscmp(FindData.cFileName + 1, L"."))))
+      {
+         continue;
+      }
+
+      free(TempPath);
+      TempPath = NULL;
+
+      hr = HeapPrintf(
+         &TempPath,
+         L"%s\\include\\%s\\um\\windows.h",
+         SdkInstallDir,
+         FindData.cFileName
+      );
+      if (FAILED(hr))
+         break;
+
+      Attrs = GetFileAttributes(TempPath);
+      if (Attrs == INVALID_FILE_ATTRIBUTES)
+         continue;
+
+      wcscpy(ResultBuffer, FindData.cFileName);
+
+   } while (FindNextFile(FindHandle, &FindData));
+
+   if (SUCCEEDED(hr))
+   {
+      if (!*ResultBuffer)
+         hr = HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
+      else
+      {
+         DWORD Length = (wcslen(ResultBuffer) + 1) * sizeof(WCHAR);
+         *Result = malloc(Length);
+         if (!*Result)
+            hr = E_OUTOFMEMORY;
+         else
+            memcpy(*Result, ResultBuffer, Length);
+      }
+   }
+   
+   if (FindHandle != INVALID_HANDLE_VALUE)
+      FindClose(FindHandle);
+   free(FindPath);
+   free(TempPath);
+   return hr;
+}
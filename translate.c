@@ -0,0 +1,1452 @@
+/*
+ * Copyright (c) 2017 Andrew Sveikauskas
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ */
+
+#include "clwrapper.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <intsafe.h>
+
+static BOOL
+IsLinkInput(
+   PCWSTR Path
+)
+{
+   PCWSTR Extensions[] = {L".obj", L".lib", L".res"};
+   PCWSTR Dot = wcsrchr(Path, L'.');
+   DWORD i;
+
+   for (i = 0; Dot && i < ARRAYSIZE(Extensions); ++i)
+   {
+      if (!_wcsicmp(Dot, Extensions[i]))
+         return TRUE;
+   }
+
+   return FALSE;
+}
+
+// Nothing to compile, so cl would only turn around and run link.  If CL or
+// _CL_ is set, cl might have something to add, so it gets to do that.
+//
+static BOOL
+IsLinkOnly(
+   PCC_ARGS Args
+)
+{
+   PCWSTR Variables[] = {L"CL", L"_CL_"};
+   PSTRING_LIST List;
+   DWORD i;
+
+   if (Args->OutputType == CC_OBJECT_FILE ||
+       Args->PreprocessOnly ||
+       !Args->Inputs)
+   {
+      return FALSE;
+   }
+
+   for (List = Args->Inputs; List; List = List->Next)
+   {
+      if (!IsLinkInput(List->String))
+         return FALSE;
+   }
+
+   for (i = 0; i < ARRAYSIZE(Variables); ++i)
+   {
+      PWSTR Value = NULL;
+      BOOL Set = FALSE;
+
+      GetEnvironmentString(Variables[i], &Value);
+      Set = Value && *Value;
+      free(Value);
+
+      if (Set)
+         return FALSE;
+   }
+
+   return TRUE;
+}
+
+// Objects built with a system header PCH need its object, which is in a
+// library cc keeps for the toolset.  It's only there once a PCH has been
+// built, which may have been earlier in this same run.
+//
+static HRESULT
+AppendPchLibrary(
+   PCC_ARGS Args,
+   POUTPUT_STRING CommandLine
+)
+{
+   HRESULT hr = S_OK;
+
+   if (Args->PchLibrary &&
+       GetFileAttributes(Args->PchLibrary) != INVALID_FILE_ATTRIBUTES)
+   {
+      hr = AppendString(L"\"", CommandLine);
+      if (SUCCEEDED(hr))
+         hr = AppendString(Args->PchLibrary, CommandLine);
+      if (SUCCEEDED(hr))
+         hr = AppendString(L"\" ", CommandLine);
+   }
+
+   return hr;
+}
+
+static HRESULT
+AppendQuotedOption(
+   PCWSTR Option,
+   PCWSTR Value,
+   POUTPUT_STRING CommandLine
+)
+{
+   HRESULT hr = S_OK;
+
+   hr = AppendString(Option, CommandLine);
+   if (SUCCEEDED(hr))
+      hr = AppendString(L"\"", CommandLine);
+   if (SUCCEEDED(hr))
+      hr = AppendString(Value, CommandLine);
+   if (SUCCEEDED(hr))
+      hr = AppendString(L"\" ", CommandLine);
+
+   return hr;
+}
+
+// What link does with debug info: by default, what the objects have
+// (/DEBUG), or none with -g0.  When cl runs link, it goes by /Zi or /Z7
+// instead, unless told otherwise.
+//
+static HRESULT
+AppendLinkDebugOptions(
+   PCC_ARGS Args,
+   BOOL LinkOnly,
+   POUTPUT_STRING CommandLine
+)
+{
+   HRESULT hr = S_OK;
+   PCWSTR Option = L"";
+
+   switch (Args->LinkDebug)
+   {
+   case CC_LINK_DEBUG_NONE:
+      Option = L"/DEBUG:NONE ";
+      break;
+   case CC_LINK_DEBUG_FASTLINK:
+      Option = L"/DEBUG:FASTLINK ";
+      break;
+   case CC_LINK_DEBUG_FULL:
+      Option = L"/DEBUG:FULL ";
+      break;
+   default:
+      if (LinkOnly && Args->DebugInfo == CC_DEBUG_NONE)
+         Option = L"/DEBUG:NONE ";
+      else if (LinkOnly)
+         Option = L"/DEBUG ";
+   }
+
+   hr = AppendString(Option, CommandLine);
+
+   if (SUCCEEDED(hr) &&
+       Args->PdbFile &&
+       Args->LinkDebug != CC_LINK_DEBUG_NONE)
+   {
+      hr = AppendQuotedOption(L"/PDB:", Args->PdbFile, CommandLine);
+   }
+
+   return hr;
+}
+
+// What cl would have passed to link.exe for the same arguments: /Fe
+// becomes /OUT, /LD becomes /DLL, and /Zi becomes /DEBUG (unless -g0 or -s
+// says otherwise).  The CRT is left to the objects, which name it as a
+// default library.  With prefix maps, link gets the same options we pass
+// after /link when cl does the linking.
+//
+static HRESULT
+BuildLinkCommandLine(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   POUTPUT_STRING CommandLine
+)
+{
+   HRESULT hr = S_OK;
+   PSTRING_LIST List = NULL;
+   PWSTR LinkPath = NULL;
+   PSTRING_LIST LibraryPaths[] =
+   {
+      Args->Base.LibraryPaths,
+      Toolset->LibraryPaths
+   };
+   DWORD i;
+
+   if (!Args->OutputName)
+      Args->OutputName = L"a.exe";
+
+   hr = ToolsetGetToolPath(Toolset, L"link.exe", &LinkPath);
+
+   if (SUCCEEDED(hr))
+      hr = AppendString(L"\"", CommandLine);
+   if (SUCCEEDED(hr))
+      hr = AppendString(LinkPath, CommandLine);
+   if (SUCCEEDED(hr))
+      hr = AppendString(L"\" /nologo ", CommandLine);
+   if (SUCCEEDED(hr))
+      hr = AppendLinkDebugOptions(Args, TRUE, CommandLine);
+
+   if (SUCCEEDED(hr) && Args->OutputType == CC_SHARED_LIBRARY)
+      hr = AppendString(L"/DLL ", CommandLine);
+
+   if (SUCCEEDED(hr))
+      hr = AppendString(L"/OUT:\"", CommandLine);
+   if (SUCCEEDED(hr))
+      hr = AppendString(Args->OutputName, CommandLine);
+   if (SUCCEEDED(hr))
+      hr = AppendString(L"\" ", CommandLine);
+
+   // The image would otherwise name its .pdb by full path.
+   //
+   if (SUCCEEDED(hr) && Args->PrefixMaps)
+      hr = AppendString(L"/Brepro /PDBALTPATH:%_PDB% ", CommandLine);
+
+   for (List = Args->LinkerOptions; SUCCEEDED(hr) && List; List = List->Next)
+   {
+      hr = AppendString(List->String, CommandLine);
+      if (SUCCEEDED(hr))
+         hr = AppendString(L" ", CommandLine);
+   }
+
+   for (List = Args->Inputs; SUCCEEDED(hr) && List; List = List->Next)
+   {
+      hr = AppendString(L"\"", CommandLine);
+      if (SUCCEEDED(hr))
+         hr = AppendString(List->String, CommandLine);
+      if (SUCCEEDED(hr))
+         hr = AppendString(L"\" ", CommandLine);
+   }
+
+   for (List = Args->Base.Libraries;
+        SUCCEEDED(hr) && List;
+        List = List->Next)
+   {
+      hr = AppendString(List->String, CommandLine);
+      if (SUCCEEDED(hr))
+         hr = AppendString(L".LIB ", CommandLine);
+   }
+
+   if (SUCCEEDED(hr))
+      hr = AppendPchLibrary(Args, CommandLine);
+
+   for (i = 0; SUCCEEDED(hr) && i < ARRAYSIZE(LibraryPaths); ++i)
+   {
+      for (List = LibraryPaths[i]; SUCCEEDED(hr) && List; List = List->Next)
+      {
+         hr = AppendString(L"/LIBPATH:\"", CommandLine);
+         if (SUCCEEDED(hr))
+            hr = AppendString(List->String, CommandLine);
+         if (SUCCEEDED(hr))
+            hr = AppendString(L"\" ", CommandLine);
+      }
+   }
+
+   free(LinkPath);
+   return hr;
+}
+
+// -fmodule-file=[NAME=]PATH is /reference, except that a NAME in <> or ""
+// is a header, which makes it /headerUnit:angle or /headerUnit:quote.
+//
+static HRESULT
+AppendModuleFile(
+   PCWSTR ModuleFile,
+   POUTPUT_STRING CommandLine
+)
+{
+   HRESULT hr = S_OK;
+   PCWSTR Close = NULL;
+   PWSTR Reference = NULL;
+
+   if (*ModuleFile == L'<')
+      Close = wcschr(ModuleFile + 1, L'>');
+   else if (*ModuleFile == L'"')
+      Close = wcschr(ModuleFile + 1, L'"');
+
+   if (!Close || Close[1] != L'=')
+      return AppendQuotedOption(L"/reference ", ModuleFile, CommandLine);
+
+   hr = HeapPrintf(
+      &Reference,
+      L"%.*s%s",
+      (INT)(Close - ModuleFile - 1),
+      ModuleFile + 1,
+      Close + 1
+   );
+   if (SUCCEEDED(hr))
+   {
+      hr = AppendQuotedOption(
+         *ModuleFile == L'<' ? L"/headerUnit:angle " : L"/headerUnit:quote ",
+         Reference,
+         CommandLine
+      );
+   }
+
+   free(Reference);
+   return hr;
+}
+
+// cl has modules from C++20 on.  A single interface unit is told it is
+// one, whatever its extension; so is a header being made a header unit.
+//
+static HRESULT
+AppendModuleOptions(
+   PCC_ARGS Args,
+   POUTPUT_STRING CommandLine
+)
+{
+   HRESULT hr = S_OK;
+   PSTRING_LIST List;
+
+   hr = AppendString(L"/std:c++latest ", CommandLine);
+
+   if (SUCCEEDED(hr) && Args->HeaderUnit)
+   {
+      hr = AppendString(L"/exportHeader ", CommandLine);
+      if (SUCCEEDED(hr) && Args->HeaderUnit == CC_HEADER_UNIT_USER)
+         hr = AppendString(L"/headerName:quote ", CommandLine);
+      else if (SUCCEEDED(hr) && Args->HeaderUnit == CC_HEADER_UNIT_SYSTEM)
+         hr = AppendString(L"/headerName:angle ", CommandLine);
+   }
+   else if (SUCCEEDED(hr) &&
+            Args->Inputs &&
+            !Args->Inputs->Next &&
+            CcIsModuleInterface(Args->Inputs->String))
+   {
+      hr = AppendString(L"/interface /TP ", CommandLine);
+   }
+
+   for (List = Args->ModulePaths; SUCCEEDED(hr) && List; List = List->Next)
+      hr = AppendQuotedOption(L"/ifcSearchDir ", List->String, CommandLine);
+
+   for (List = Args->ModuleFiles; SUCCEEDED(hr) && List; List = List->Next)
+      hr = AppendModuleFile(List->String, CommandLine);
+
+   if (Args->PreprocessOnly)
+      return hr;
+
+   if (SUCCEEDED(hr) && Args->ModuleOutput)
+   {
+      hr = AppendQuotedOption(
+         L"/ifcOutput ",
+         Args->ModuleOutput,
+         CommandLine
+      );
+   }
+
+   if (SUCCEEDED(hr) && Args->ScanFile)
+   {
+      hr = AppendQuotedOption(
+         L"/scanDependencies ",
+         Args->ScanFile,
+         CommandLine
+      );
+   }
+
+   if (SUCCEEDED(hr) && Args->SourceDepsFile)
+   {
+      hr = AppendQuotedOption(
+         L"/sourceDependencies ",
+         Args->SourceDepsFile,
+         CommandLine
+      );
+   }
+
+   return hr;
+}
+
+// cl's debug info option.  There's been no line-numbers-only /Zd since
+// Visual C++ 2005 (8.0), so -g1 is /Z7 after that: full debug info, but
+// at least kept in each object.
+//
+static PCWSTR
+GetDebugInfoOption(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset
+)
+{
+   switch (Args->DebugInfo)
+   {
+   case CC_DEBUG_NONE:
+      return L"";
+   case CC_DEBUG_LINES:
+      return Toolset->Compiler->Major < 8 ? L"/Zd " : L"/Z7 ";
+   case CC_DEBUG_EMBED:
+      return L"/Z7 ";
+   default:
+      return Args->EmbedDebugInfo ? L"/Z7 " : L"/Zi /FS ";
+   }
+}
+
+// The program CcBuildCommandLine() gives a command line for: link.exe if
+// there's nothing to compile, otherwise cl.exe.
+//
+HRESULT
+CcGetToolPath(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   PWSTR *Out
+)
+{
+   if (IsLinkOnly(Args))
+      return ToolsetGetToolPath(Toolset, L"link.exe", Out);
+   return HeapPrintf(Out, L"%s", Toolset->Compiler->ClPaths->String);
+}
+
+//
+// Translates our args struct into a CL command line, using the include and
+// library directories that go with Toolset.  If there's nothing to
+// compile, the command line is for link.exe instead.
+//
+HRESULT
+CcBuildCommandLine(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   POUTPUT_STRING CommandLine
+)
+{
+   HRESULT hr = S_OK;
+   PSTRING_LIST List = NULL;
+   BOOL Link = TRUE;
+   PSTRING_LIST IncludePaths[] = {Args->IncludePaths, Toolset->IncludePaths};
+   PSTRING_LIST LibraryPaths[] =
+   {
+      Args->Base.LibraryPaths,
+      Toolset->LibraryPaths
+   };
+   DWORD i;
+
+   if (IsLinkOnly(Args))
+      return BuildLinkCommandLine(Args, Toolset, CommandLine);
+
+   // Build path to CL
+   //
+   hr = AppendString(L"\"", CommandLine);
+   if (SUCCEEDED(hr))
+      hr = AppendString(Toolset->Compiler->ClPaths->String, CommandLine);
+   if (SUCCEEDED(hr))
+      hr = AppendString(L"\" ", CommandLine);
+
+   //
+   // Now we translate our args struct into a CL command line...
+   //
+
+   if (SUCCEEDED(hr))
+      hr = AppendString(L"/nologo /EHsc ", CommandLine);
+
+   if (SUCCEEDED(hr) && Args->Optimization)
+   {
+      WCHAR Output = Args->Optimization;
+      WCHAR Buffer[] = L"/O? ";
+
+      if (Output != L's')
+      {
+         INT Level = Output - L'0';
+
+         if (Level > 2)
+            Output = L'x';
+      }
+
+      Buffer[2] = Output;
+      hr = AppendString(Buffer, CommandLine);
+   }
+
+   if (SUCCEEDED(hr) && Args->Wall)
+      hr = AppendString(L"/W3 ", CommandLine);
+
+   if (SUCCEEDED(hr) && Args->Werror)
+      hr = AppendString(L"/WX ", CommandLine);
+
+   if (SUCCEEDED(hr))
+   {
+      WCHAR CrtFlag[] = L"/M? ";
+
+      CrtFlag[2] = Args->Base.StaticCrt ? L'T' : L'D';
+
+      hr = AppendString(CrtFlag, CommandLine);
+   }
+
+   if (SUCCEEDED(hr) && Args->DisableRtti)
+   {
+      hr = AppendString(L"/GR- ", CommandLine);
+   }
+
+   if (SUCCEEDED(hr) && Args->ShowIncludes)
+   {
+      hr = AppendString(L"/showIncludes ", CommandLine);
+   }
+
+   // Paths in the object are rewritten, and its timestamp left out, so that
+   // building the same sources somewhere else gives the same bytes.
+   //
+   if (SUCCEEDED(hr) && Args->PrefixMaps)
+      hr = AppendString(L"/Brepro ", CommandLine);
+
+   for (List = Args->PrefixMaps; SUCCEEDED(hr) && List; List = List->Next)
+   {
+      hr = AppendString(L"/pathmap:\"", CommandLine);
+      if (SUCCEEDED(hr))
+         hr = AppendString(List->String, CommandLine);
+      if (SUCCEEDED(hr))
+         hr = AppendString(L"\" ", CommandLine);
+   }
+
+   if (SUCCEEDED(hr))
+   {
+      WCHAR Type = 0;
+
+      switch (Args->OutputType)
+      {
+      case CC_EXECUTABLE:
+         Type = L'e';
+         if (!Args->OutputName)
+         {
+            Args->OutputName = L"a.exe";
+         }
+         break;
+      case CC_OBJECT_FILE:
+         Type = L'o';
+         hr = AppendString(
+            Args->PreprocessOnly ? L"/E " : L"/c ",
+            CommandLine
+         );
+         Link = FALSE;
+         break;
+      case CC_SHARED_LIBRARY:
+         Type = L'e';
+         hr = AppendString(L"/LD ", CommandLine);
+         break;
+      default:
+         fprintf(stderr, "Unrecognized output type %x\n", Args->OutputType);
+         hr = E_INVALIDARG;
+      }
+
+      if (SUCCEEDED(hr) && !Args->PreprocessOnly)
+      {
+         hr = AppendString(
+            GetDebugInfoOption(Args, Toolset),
+            CommandLine
+         );
+      }
+
+      if (SUCCEEDED(hr) && Args->OutputName && !Args->PreprocessOnly)
+      {
+         WCHAR Prefix[] = L"/F?";
+
+         Prefix[2] = Type;
+         hr = AppendString(Prefix, CommandLine);
+         if (SUCCEEDED(hr))
+            hr = AppendString(Args->OutputName, CommandLine);
+         if (SUCCEEDED(hr))
+            hr = AppendString(L" ", CommandLine);
+
+         if (SUCCEEDED(hr) && Link && Args->DebugInfo != CC_DEBUG_NONE)
+         {
+            Prefix[2] = L'd';
+
+            hr = AppendString(Prefix, CommandLine);
+            if (SUCCEEDED(hr) && Args->PdbFile)
+            {
+               hr = AppendString(Args->PdbFile, CommandLine);
+               if (SUCCEEDED(hr))
+                  hr = AppendString(L" ", CommandLine);
+            }
+            else if (SUCCEEDED(hr))
+            {
+               PCWSTR p = wcsrchr(Args->OutputName, L'.');
+               PWSTR Pdb = NULL;
+               INT Length = p ? (INT)(p - Args->OutputName) :
+                                (INT)wcslen(Args->OutputName);
+
+               hr = HeapPrintf(&Pdb, L"%.*s.pdb ", Length, Args->OutputName);
+               if (SUCCEEDED(hr))
+                  hr = AppendString(Pdb, CommandLine);
+               free(Pdb);
+            }
+         }
+      }
+   }
+
+   if (SUCCEEDED(hr))
+   {
+      for (List = Args->Macros; List; List = List->Next)
+      {
+         hr = AppendString(L"/D", CommandLine);
+         if (SUCCEEDED(hr))
+            hr = AppendString(List->String, CommandLine);
+         if (SUCCEEDED(hr))
+            hr = AppendString(L" ", CommandLine);
+         if (FAILED(hr))
+            break;
+      }
+   }
+
+   for (List = Args->ForcedIncludes; SUCCEEDED(hr) && List; List = List->Next)
+   {
+      hr = AppendString(L"/FI\"", CommandLine);
+      if (SUCCEEDED(hr))
+         hr = AppendString(List->String, CommandLine);
+      if (SUCCEEDED(hr))
+         hr = AppendString(L"\" ", CommandLine);
+   }
+
+   if (SUCCEEDED(hr) && Args->PchThrough && !Args->PreprocessOnly)
+   {
+      hr = AppendString(Args->PchCreate ? L"/Yc\"" : L"/Yu\"", CommandLine);
+      if (SUCCEEDED(hr))
+         hr = AppendString(Args->PchThrough, CommandLine);
+      if (SUCCEEDED(hr))
+         hr = AppendString(L"\" /Fp\"", CommandLine);
+      if (SUCCEEDED(hr))
+         hr = AppendString(Args->PchFile, CommandLine);
+      if (SUCCEEDED(hr))
+         hr = AppendString(L"\" ", CommandLine);
+   }
+
+   if (SUCCEEDED(hr) && Args->Modules)
+      hr = AppendModuleOptions(Args, CommandLine);
+
+   for (i = 0; SUCCEEDED(hr) && i < ARRAYSIZE(IncludePaths); ++i)
+   {
+      for (List = IncludePaths[i]; List; List = List->Next)
+      {
+         hr = AppendString(L"/I\"", CommandLine);
+         if (SUCCEEDED(hr))
+            hr = AppendString(List->String, CommandLine);
+         if (SUCCEEDED(hr))
+            hr = AppendString(L"\" ", CommandLine);
+         if (FAILED(hr))
+            break;
+      }
+   }
+
+   if (SUCCEEDED(hr))
+   {
+      for (List = Args->Inputs; List; List = List->Next)
+      {
+         hr = AppendString(List->String, CommandLine);
+         if (SUCCEEDED(hr))
+            hr = AppendString(L" ", CommandLine);
+         if (FAILED(hr))
+            break;
+      }
+   }
+
+   if (SUCCEEDED(hr) && Link)
+   {
+      for (List = Args->Base.Libraries; List; List = List->Next)
+      {
+         hr = AppendString(List->String, CommandLine);
+         if (SUCCEEDED(hr))
+            hr = AppendString(L".LIB ", CommandLine);
+         if (FAILED(hr))
+            break;
+      }
+   }
+
+   if (SUCCEEDED(hr) && Link)
+      hr = AppendPchLibrary(Args, CommandLine);
+
+   if (SUCCEEDED(hr) &&
+       Link &&
+       (LibraryPaths[0] ||
+        LibraryPaths[1] ||
+        Args->PrefixMaps ||
+        Args->LinkDebug ||
+        Args->PdbFile ||
+        Args->LinkerOptions))
+   {
+      hr = AppendString(L"/link ", CommandLine);
+   }
+
+   // The image would otherwise name its .pdb by full path.
+   //
+   if (SUCCEEDED(hr) && Link && Args->PrefixMaps)
+      hr = AppendString(L"/Brepro /PDBALTPATH:%_PDB% ", CommandLine);
+
+   if (SUCCEEDED(hr) && Link)
+      hr = AppendLinkDebugOptions(Args, FALSE, CommandLine);
+
+   for (List = Args->LinkerOptions;
+        SUCCEEDED(hr) && Link && List;
+        List = List->Next)
+   {
+      hr = AppendString(List->String, CommandLine);
+      if (SUCCEEDED(hr))
+         hr = AppendString(L" ", CommandLine);
+   }
+
+   for (i = 0; SUCCEEDED(hr) && Link && i < ARRAYSIZE(LibraryPaths); ++i)
+   {
+      for (List = LibraryPaths[i]; List; List = List->Next)
+      {
+         hr = AppendString(L"/LIBPATH:\"", CommandLine);
+         if (SUCCEEDED(hr))
+            hr = AppendString(List->String, CommandLine);
+         if (SUCCEEDED(hr))
+            hr = AppendString(L"\" ", CommandLine);
+         if (FAILED(hr))
+            break;
+      }
+   }
+
+   return hr;
+}
+
+static HRESULT
+AddOutput(
+   PSTRING_LIST *Outputs,
+   PCWSTR Name,
+   INT NameLength,
+   PCWSTR Extension
+)
+{
+   HRESULT hr = S_OK;
+   PWSTR Path = NULL;
+
+   hr = HeapPrintf(&Path, L"%.*s%s", NameLength, Name, Extension);
+   if (SUCCEEDED(hr))
+      hr = StringListAllocString(Path, *Outputs, Outputs);
+
+   free(Path);
+   return hr;
+}
+
+// Length of Path without its extension, if any.
+//
+static INT
+StemLength(
+   PCWSTR Path
+)
+{
+   PCWSTR Dot = wcsrchr(Path, L'.');
+   PCWSTR Slash = wcsrchr(Path, L'\\');
+   PCWSTR Slash2 = wcsrchr(Path, L'/');
+
+   if (Slash2 > Slash)
+      Slash = Slash2;
+   if (!Dot || (Slash && Dot < Slash))
+      return (INT)wcslen(Path);
+   return (INT)(Dot - Path);
+}
+
+// Name of Path with no directory.
+//
+PCWSTR
+CcBaseName(
+   PCWSTR Path
+)
+{
+   PCWSTR p;
+
+   for (p = Path; *p; ++p)
+   {
+      if (*p == L'\\' || *p == L'/' || *p == L':')
+         Path = p + 1;
+   }
+
+   return Path;
+}
+
+BOOL
+CcIsSourceFile(
+   PCWSTR Path
+)
+{
+   PCWSTR Extensions[] = {L".c", L".cc", L".cpp", L".cxx", L".c++", NULL};
+   PCWSTR Dot = wcsrchr(Path, L'.');
+   PCWSTR *p;
+
+   if (Dot)
+   {
+      for (p = Extensions; *p; ++p)
+      {
+         if (!_wcsicmp(Dot, *p))
+            return TRUE;
+      }
+   }
+
+   return CcIsModuleInterface(Path);
+}
+
+//
+// A C++ module interface unit, going by its extension.  cl only knows
+// .ixx; the others are what other compilers use.
+//
+BOOL
+CcIsModuleInterface(
+   PCWSTR Path
+)
+{
+   PCWSTR Extensions[] = {L".ixx", L".cppm", L".mpp", L".mxx", NULL};
+   PCWSTR Dot = wcsrchr(Path, L'.');
+   PCWSTR *p;
+
+   if (Dot)
+   {
+      for (p = Extensions; *p; ++p)
+      {
+         if (!_wcsicmp(Dot, *p))
+            return TRUE;
+      }
+   }
+
+   return FALSE;
+}
+
+//
+// The object a compile of one source (with -c) produces.
+//
+HRESULT
+CcGetObjectName(
+   PCC_ARGS Args,
+   PWSTR *Out
+)
+{
+   PCWSTR Name = Args->OutputName;
+   PCWSTR Base = CcBaseName(Args->Inputs->String);
+   PCWSTR Dot = wcsrchr(Base, L'.');
+   SIZE_T Length = Name ? wcslen(Name) : 0;
+
+   if (Length && Name[Length - 1] != L'\\' && Name[Length - 1] != L'/')
+      return HeapPrintf(Out, L"%s", Name);
+
+   // No -o, or -o naming a directory.
+   //
+   if (!Dot)
+      Dot = Base + wcslen(Base);
+
+   return HeapPrintf(
+      Out,
+      L"%s%.*s.obj",
+      Name ? Name : L"",
+      (INT)(Dot - Base),
+      Base
+   );
+}
+
+//
+// The files that running the command built by CcBuildCommandLine() is
+// expected to produce, in the order cl would write them.
+//
+HRESULT
+CcGetExpectedOutputs(
+   PCC_ARGS Args,
+   PSTRING_LIST *OutputsOut
+)
+{
+   HRESULT hr = S_OK;
+   PSTRING_LIST Outputs = NULL;
+   PSTRING_LIST Input;
+   PCWSTR Name = Args->OutputName;
+
+   // Object files; cl puts these in the current directory unless told
+   // otherwise with /Fo.
+   //
+   if (Args->OutputType == CC_OBJECT_FILE && Name)
+   {
+      hr = StringListAllocString(Name, Outputs, &Outputs);
+   }
+   else
+   {
+      for (Input = Args->Inputs; SUCCEEDED(hr) && Input; Input = Input->Next)
+      {
+         PCWSTR Base = CcBaseName(Input->String);
+
+         if (CcIsSourceFile(Base))
+            hr = AddOutput(&Outputs, Base, StemLength(Base), L".obj");
+      }
+   }
+
+   if (SUCCEEDED(hr) && Args->OutputType != CC_OBJECT_FILE)
+   {
+      if (!Name)
+         Name = L"a.exe";
+
+      hr = StringListAllocString(Name, Outputs, &Outputs);
+      if (SUCCEEDED(hr) && Args->PdbFile)
+         hr = StringListAllocString(Args->PdbFile, Outputs, &Outputs);
+      else if (SUCCEEDED(hr))
+         hr = AddOutput(&Outputs, Name, StemLength(Name), L".pdb");
+
+      if (SUCCEEDED(hr) && Args->OutputType == CC_SHARED_LIBRARY)
+      {
+         hr = AddOutput(&Outputs, Name, StemLength(Name), L".lib");
+         if (SUCCEEDED(hr))
+            hr = AddOutput(&Outputs, Name, StemLength(Name), L".exp");
+      }
+   }
+
+   if (SUCCEEDED(hr))
+   {
+      StringListReverse(&Outputs);
+   }
+   else
+   {
+      FreeStringList(Outputs);
+      Outputs = NULL;
+   }
+
+   *OutputsOut = Outputs;
+   return hr;
+}
+
+HRESULT
+CcParseArgs(
+   PCC_ARGS Args,
+   PWSTR *CurrentArg
+)
+{
+   HRESULT hr = S_OK;
+
+   // Attempt to parse arguments...
+   //
+   while (*CurrentArg)
+   {
+      INT NumConsumed = 0;
+
+      hr = CcParseArg(Args, CurrentArg, &NumConsumed);
+      if (FAILED(hr))
+         break;
+
+      if (NumConsumed)
+      {
+         CurrentArg += NumConsumed;
+      }
+      else
+      {
+         hr = StringListAllocString(
+            *CurrentArg++,
+            Args->Inputs,
+            &Args->Inputs
+         );
+         if (FAILED(hr))
+            break;
+      }
+   }
+
+   // Go through all the string lists and make sure they are in order.
+   //
+   if (SUCCEEDED(hr))
+   {
+      PSTRING_LIST *StringLists[] =
+      {
+         &Args->Base.LibraryPaths,
+         &Args->Base.Libraries,
+         &Args->Macros,
+         &Args->IncludePaths,
+         &Args->LinkerOptions,
+         &Args->Inputs,
+         &Args->PrefixMaps,
+         &Args->UnityExcludes,
+         &Args->ForcedIncludes,
+         &Args->ModuleFiles,
+         &Args->ModulePaths,
+         NULL
+      }, **p = StringLists;
+
+      while (*p)
+         StringListReverse(*p++);
+   }
+
+   if (SUCCEEDED(hr) && Args->PchFile && !Args->ForcedIncludes)
+   {
+      fprintf(stderr, "-include-pch requires -include\n");
+      hr = E_INVALIDARG;
+   }
+
+   // The other module options only make sense with modules.
+   //
+   if (Args->ModuleFiles ||
+       Args->ModulePaths ||
+       Args->ModuleOutput ||
+       Args->HeaderUnit ||
+       Args->ScanFile)
+   {
+      Args->Modules = TRUE;
+   }
+
+   if (SUCCEEDED(hr) &&
+       (Args->HeaderUnit || Args->ScanFile) &&
+       Args->OutputType != CC_OBJECT_FILE)
+   {
+      fprintf(
+         stderr,
+         "%s requires -c\n",
+         Args->HeaderUnit ? "-fmodule-header" : "-fdeps-file"
+      );
+      hr = E_INVALIDARG;
+   }
+
+   return hr;
+}
+
+//
+// -Wl,A,B,...: each option is for link, except that those for debug info
+// (GNU ld's -s, --strip-all, --strip-debug and --pdb=, and link's own
+// /DEBUG:NONE, FASTLINK or FULL) are kept apart, so that the rest of cc
+// knows what link will write.
+//
+static HRESULT
+ParseLinkerOptions(
+   PCC_ARGS Context,
+   PCWSTR Options
+)
+{
+   HRESULT hr = S_OK;
+
+   while (SUCCEEDED(hr) && *Options)
+   {
+      PCWSTR End = wcschr(Options, L',');
+      PWSTR Option = NULL;
+
+      if (!End)
+         End = Options + wcslen(Options);
+
+      hr = HeapPrintf(&Option, L"%.*s", (INT)(End - Options), Options);
+
+      if (FAILED(hr))
+      {
+         break;
+      }
+      else if (!wcscmp(Option, L"-s") ||
+               !wcscmp(Option, L"--strip-all") ||
+               !wcscmp(Option, L"--strip-debug"))
+      {
+         Context->LinkDebug = CC_LINK_DEBUG_NONE;
+      }
+      else if (!wcsncmp(Option, L"--pdb=", 6))
+      {
+         free(Context->PdbFile);
+         Context->PdbFile = NULL;
+         if (Option[6])
+            hr = HeapPrintf(&Context->PdbFile, L"%s", Option + 6);
+      }
+      else if ((*Option == L'/' || *Option == L'-') &&
+               !_wcsicmp(Option + 1, L"DEBUG:NONE"))
+      {
+         Context->LinkDebug = CC_LINK_DEBUG_NONE;
+      }
+      else if ((*Option == L'/' || *Option == L'-') &&
+               !_wcsicmp(Option + 1, L"DEBUG:FASTLINK"))
+      {
+         Context->LinkDebug = CC_LINK_DEBUG_FASTLINK;
+      }
+      else if ((*Option == L'/' || *Option == L'-') &&
+               !_wcsicmp(Option + 1, L"DEBUG:FULL"))
+      {
+         Context->LinkDebug = CC_LINK_DEBUG_FULL;
+      }
+      else if (*Option)
+      {
+         hr = StringListAllocString(
+            Option,
+            Context->LinkerOptions,
+            &Context->LinkerOptions
+         );
+      }
+
+      free(Option);
+      Options = *End ? End + 1 : End;
+   }
+
+   return hr;
+}
+
+HRESULT
+CcParseArg(
+   PCC_ARGS Context,
+   PWSTR *Arg,
+   INT *NumConsumedOut
+)
+{
+   HRESULT hr = S_OK;
+
+   *NumConsumedOut = 0;
+
+   hr = BaseParseArg(&Context->Base, Arg, NumConsumedOut);
+   if (SUCCEEDED(hr) &&
+       *NumConsumedOut)
+   {
+      Arg += *NumConsumedOut;
+   }
+
+   while (SUCCEEDED(hr) && *Arg)
+   {
+      if (!wcscmp(*Arg, L"-shared"))
+      {
+         if (Context->OutputType == CC_OBJECT_FILE)
+         {
+            fprintf(stderr, "-shared conflicts with -c\n");
+            hr = E_INVALIDARG;
+         }
+         Context->OutputType = CC_SHARED_LIBRARY;
+         ++*NumConsumedOut;
+         ++Arg;
+      } 
+      else if (!wcscmp(*Arg, L"-c"))
+      {
+         if (Context->OutputType == CC_SHARED_LIBRARY)
+         {
+            fprintf(stderr, "-c conflicts with -shared\n");
+            hr = E_INVALIDARG;
+         }
+         Context->OutputType = CC_OBJECT_FILE;
+         ++*NumConsumedOut;
+         ++Arg;
+      }
+      else if (!wcscmp(*Arg, L"-o"))
+      {
+         Context->OutputName = Arg[1];
+         if (!Context->OutputName)
+         {
+            fprintf(stderr, "-o requires argument\n");
+            hr = E_INVALIDARG;
+         }
+         *NumConsumedOut += 2;
+         Arg += 2;
+      }
+      else if (!wcscmp(*Arg, L"-Wall"))
+      {
+         Context->Wall = TRUE;
+         ++*NumConsumedOut;
+         ++Arg;
+      }
+      else if (!wcscmp(*Arg, L"-Werror"))
+      {
+         Context->Werror = TRUE;
+         ++*NumConsumedOut;
+         ++Arg;
+      }
+      else if (!wcsncmp(*Arg, L"-D", 2))
+      {
+         hr = StringListAllocString(
+            *Arg + 2,
+            Context->Macros,
+            &Context->Macros
+         );
+         ++*NumConsumedOut;
+         ++Arg;
+      }
+      else if (!wcsncmp(*Arg, L"-I", 2))
+      {
+         hr = StringListAllocString(
+            *Arg + 2,
+            Context->IncludePaths,
+            &Context->IncludePaths
+         );
+         ++*NumConsumedOut;
+         ++Arg;
+      }
+      else if (!wcsncmp(*Arg, L"-O", 2))
+      {
+         PCWSTR Type = *Arg + 2;
+
+         if (Type[1] ||
+             !wcschr(L"s0123456789", Context->Optimization = Type[0]))
+         {
+            fprintf(stderr, "Unrecognized optimization: %ls\n", Type);
+            hr = E_INVALIDARG;
+            break;
+         }
+
+         ++*NumConsumedOut;
+         ++Arg;
+      }
+      else if (!wcscmp(*Arg, L"-MD") || !wcscmp(*Arg, L"-MMD"))
+      {
+         Context->Deps = (*Arg)[2] == L'M' ? CC_DEPS_USER : CC_DEPS_ALL;
+         ++*NumConsumedOut;
+         ++Arg;
+      }
+      else if (!wcscmp(*Arg, L"-MF") || !wcscmp(*Arg, L"-MT"))
+      {
+         if (!Arg[1])
+         {
+            fprintf(stderr, "%ls requires argument\n", *Arg);
+            hr = E_INVALIDARG;
+            break;
+         }
+
+         if ((*Arg)[2] == L'F')
+            Context->DepsFile = Arg[1];
+         else
+            Context->DepsTarget = Arg[1];
+
+         *NumConsumedOut += 2;
+         Arg += 2;
+      }
+      else if (!wcscmp(*Arg, L"-save-temps"))
+      {
+         Context->SaveTemps = TRUE;
+         ++*NumConsumedOut;
+         ++Arg;
+      }
+      else if (!wcscmp(*Arg, L"-include") ||
+               !wcscmp(*Arg, L"-include-pch"))
+      {
+         if (!Arg[1])
+         {
+            fprintf(stderr, "%ls requires argument\n", *Arg);
+            hr = E_INVALIDARG;
+            break;
+         }
+
+         if ((*Arg)[8])
+         {
+            Context->PchFile = Arg[1];
+         }
+         else
+         {
+            hr = StringListAllocString(
+               Arg[1],
+               Context->ForcedIncludes,
+               &Context->ForcedIncludes
+            );
+         }
+
+         *NumConsumedOut += 2;
+         Arg += 2;
+      }
+      else if (!wcscmp(*Arg, L"-fpch-auto"))
+      {
+         Context->AutoPch = TRUE;
+         ++*NumConsumedOut;
+         ++Arg;
+      }
+      else if (!wcscmp(*Arg, L"-fmodules-ts"))
+      {
+         Context->Modules = TRUE;
+         ++*NumConsumedOut;
+         ++Arg;
+      }
+      else if (!wcsncmp(*Arg, L"-fmodule-file=", 14) ||
+               !wcsncmp(*Arg, L"-fprebuilt-module-path=", 23))
+      {
+         PSTRING_LIST *List = (*Arg)[2] == L'm' ?
+            &Context->ModuleFiles :
+            &Context->ModulePaths;
+
+         hr = StringListAllocString(wcschr(*Arg, L'=') + 1, *List, List);
+         ++*NumConsumedOut;
+         ++Arg;
+      }
+      else if (!wcsncmp(*Arg, L"-fmodule-output=", 16))
+      {
+         Context->ModuleOutput = *Arg + 16;
+         ++*NumConsumedOut;
+         ++Arg;
+      }
+      else if (!wcscmp(*Arg, L"-fmodule-header") ||
+               !wcsncmp(*Arg, L"-fmodule-header=", 16))
+      {
+         PCWSTR Kind = (*Arg)[15] ? *Arg + 16 : L"";
+
+         if (!*Kind)
+         {
+            Context->HeaderUnit = CC_HEADER_UNIT_PATH;
+         }
+         else if (!wcscmp(Kind, L"user"))
+         {
+            Context->HeaderUnit = CC_HEADER_UNIT_USER;
+         }
+         else if (!wcscmp(Kind, L"system"))
+         {
+            Context->HeaderUnit = CC_HEADER_UNIT_SYSTEM;
+         }
+         else
+         {
+            fprintf(stderr, "Unrecognized header unit kind: %ls\n", Kind);
+            hr = E_INVALIDARG;
+            break;
+         }
+
+         ++*NumConsumedOut;
+         ++Arg;
+      }
+      else if (!wcsncmp(*Arg, L"-fdeps-file=", 12))
+      {
+         Context->ScanFile = *Arg + 12;
+         ++*NumConsumedOut;
+         ++Arg;
+      }
+      else if (!wcsncmp(*Arg, L"-fdeps-format=", 14))
+      {
+         if (wcscmp(*Arg + 14, L"p1689r5"))
+         {
+            fprintf(stderr, "Unrecognized deps format: %ls\n", *Arg + 14);
+            hr = E_INVALIDARG;
+            break;
+         }
+
+         ++*NumConsumedOut;
+         ++Arg;
+      }
+      else if (!wcscmp(*Arg, L"-frestat"))
+      {
+         Context->Restat = TRUE;
+         ++*NumConsumedOut;
+         ++Arg;
+      }
+      else if (!wcscmp(*Arg, L"-pthread"))
+      {
+         ++*NumConsumedOut;
+         ++Arg;
+      }
+      else if (!wcsncmp(*Arg, L"-ffile-prefix-map=", 18) ||
+               !wcsncmp(*Arg, L"-fdebug-prefix-map=", 19) ||
+               !wcsncmp(*Arg, L"-fmacro-prefix-map=", 19))
+      {
+         PCWSTR Map = wcschr(*Arg, L'=') + 1;
+
+         if (!wcschr(Map, L'='))
+         {
+            fprintf(stderr, "%ls: expected OLD=NEW\n", *Arg);
+            hr = E_INVALIDARG;
+            break;
+         }
+
+         hr = StringListAllocString(
+            Map,
+            Context->PrefixMaps,
+            &Context->PrefixMaps
+         );
+         ++*NumConsumedOut;
+         ++Arg;
+      }
+      else if (!wcsncmp(*Arg, L"-funity-exclude=", 16))
+      {
+         hr = StringListAllocString(
+            *Arg + 16,
+            Context->UnityExcludes,
+            &Context->UnityExcludes
+         );
+         ++*NumConsumedOut;
+         ++Arg;
+      }
+      else if (!wcscmp(*Arg, L"-funity") || !wcsncmp(*Arg, L"-funity=", 8))
+      {
+         PWSTR End = NULL;
+
+         Context->UnitySize = UNITY_DEFAULT_SIZE;
+         if ((*Arg)[7])
+         {
+            Context->UnitySize = wcstoul(*Arg + 8, &End, 10);
+            if (*End || !Context->UnitySize)
+            {
+               fprintf(stderr, "Unrecognized batch size: %ls\n", *Arg + 8);
+               hr = E_INVALIDARG;
+               break;
+            }
+         }
+
+         ++*NumConsumedOut;
+         ++Arg;
+      }
+      else if (!wcsncmp(*Arg, L"-j", 2))
+      {
+         PCWSTR Count = *Arg + 2;
+         PWSTR End = NULL;
+
+         // Plain -j means one per processor.
+         //
+         if (!*Count)
+         {
+            Context->Jobs = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+         }
+         else
+         {
+            Context->Jobs = wcstoul(Count, &End, 10);
+            if (*End || !Context->Jobs)
+            {
+               fprintf(stderr, "Unrecognized job count: %ls\n", Count);
+               hr = E_INVALIDARG;
+               break;
+            }
+         }
+
+         ++*NumConsumedOut;
+         ++Arg;
+      }
+      else if (!wcscmp(*Arg, L"-fno-rtti"))
+      {
+         Context->DisableRtti = TRUE;
+         ++*NumConsumedOut;
+         ++Arg;
+      }
+      else if (!wcscmp(*Arg, L"-g") ||
+               !wcscmp(*Arg, L"-g2") ||
+               !wcscmp(*Arg, L"-g3"))
+      {
+         Context->DebugInfo = CC_DEBUG_FULL;
+         ++*NumConsumedOut;
+         ++Arg;
+      }
+      else if (!wcscmp(*Arg, L"-g0"))
+      {
+         Context->DebugInfo = CC_DEBUG_NONE;
+         ++*NumConsumedOut;
+         ++Arg;
+      }
+      else if (!wcscmp(*Arg, L"-g1") ||
+               !wcscmp(*Arg, L"-gline-tables-only"))
+      {
+         Context->DebugInfo = CC_DEBUG_LINES;
+         ++*NumConsumedOut;
+         ++Arg;
+      }
+      else if (!wcscmp(*Arg, L"-gembed"))
+      {
+         Context->DebugInfo = CC_DEBUG_EMBED;
+         ++*NumConsumedOut;
+         ++Arg;
+      }
+      else if (!wcscmp(*Arg, L"-s"))
+      {
+         Context->LinkDebug = CC_LINK_DEBUG_NONE;
+         ++*NumConsumedOut;
+         ++Arg;
+      }
+      else if (!wcsncmp(*Arg, L"-Wl,", 4))
+      {
+         hr = ParseLinkerOptions(Context, *Arg + 4);
+         ++*NumConsumedOut;
+         ++Arg;
+      }
+      else
+      {
+         break;
+      }
+   }
+
+   return hr;
+}
+
+VOID
+CcArgsFree(
+   PCC_ARGS Context
+)
+{
+   BaseArgsFree(&Context->Base);
+
+   FreeStringList(Context->Macros);
+   FreeStringList(Context->IncludePaths);
+   FreeStringList(Context->LinkerOptions);
+   FreeStringList(Context->Inputs);
+   FreeStringList(Context->PrefixMaps);
+   FreeStringList(Context->UnityExcludes);
+   FreeStringList(Context->ForcedIncludes);
+   FreeStringList(Context->ModuleFiles);
+   FreeStringList(Context->ModulePaths);
+   free(Context->PdbFile);
+}
@@ -0,0 +1,583 @@
+/*
+ * Copyright (c) 2017 Andrew Sveikauskas
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ */
+
+#include "clwrapper.h"
+#include <stdlib.h>
+#include <string.h>
+
+//
+// Unity builds.
+//
+// With -funity, sources are compiled in batches: each batch is a generated
+// file that #includes several of them by full path, so the headers they
+// share are parsed once per batch rather than once per source.  Since the
+// sources are included by their own paths, cl's diagnostics still name
+// them.
+//
+// C and C++ sources are batched separately.  Each batch gets about N
+// sources, though with -j there are at least as many batches as jobs (so
+// long as each still has two sources).  Sources are dealt out largest
+// first to whichever batch is smallest so far, so that batches take
+// about as long to compile as each other; within a batch they keep their
+// command line order.
+//
+// Batch files live under the unity directory in our data directory, in a
+// subdirectory named after the output and the sources being batched, and
+// are only rewritten when their contents change, so the object cache sees
+// the same file next time.  Their objects are named after them:
+// unityN-<key>.obj for -c, where the key is that of the subdirectory, so
+// that two compiles of different sources into one directory don't write
+// the same objects, or <output>-unityN.obj for an executable or DLL.
+//
+
+typedef struct _UNITY_SOURCE
+{
+   PWSTR Path;
+   ULONGLONG Size;
+   BOOL Cpp;
+   BOOL Batched;
+   DWORD Batch;
+} UNITY_SOURCE, *PUNITY_SOURCE;
+
+typedef struct _UNITY_BATCH
+{
+   ULONGLONG Size;
+   PWSTR Path;
+   BOOL Added;
+} UNITY_BATCH, *PUNITY_BATCH;
+
+static HRESULT
+GetAbsolutePath(
+   const LAUNCH_PARAMS *Launch,
+   PCWSTR Path,
+   PWSTR *Out
+)
+{
+   WCHAR Buffer[MAX_PATH];
+
+   if (Launch && Launch->CurrentDirectory)
+      return MakeAbsolute(Launch->CurrentDirectory, Path, Out);
+
+   if (!GetFullPathName(Path, ARRAYSIZE(Buffer), Buffer, NULL))
+      return HRESULT_FROM_WIN32(GetLastError());
+
+   return HeapPrintf(Out, L"%s", Buffer);
+}
+
+// An exclusion without a directory matches by name alone; otherwise it has
+// to name the same file.
+//
+static BOOL
+IsExcluded(
+   PCC_ARGS Args,
+   const LAUNCH_PARAMS *Launch,
+   PCWSTR Path
+)
+{
+   PSTRING_LIST List;
+   BOOL Excluded = FALSE;
+
+   for (List = Args->UnityExcludes; !Excluded && List; List = List->Next)
+   {
+      PWSTR Absolute = NULL;
+
+      if (CcBaseName(List->String) == List->String)
+      {
+         Excluded = !_wcsicmp(List->String, CcBaseName(Path));
+      }
+      else if (SUCCEEDED(GetAbsolutePath(Launch, List->String, &Absolute)))
+      {
+         Excluded = !_wcsicmp(Absolute, Path);
+      }
+
+      free(Absolute);
+   }
+
+   return Excluded;
+}
+
+static int __cdecl
+CompareSize(
+   const void *a,
+   const void *b
+)
+{
+   const UNITY_SOURCE *Left = *(const UNITY_SOURCE **)a;
+   const UNITY_SOURCE *Right = *(const UNITY_SOURCE **)b;
+
+   if (Left->Size != Right->Size)
+      return Left->Size > Right->Size ? -1 : 1;
+
+   // Keep the outcome independent of qsort().
+   //
+   return Left < Right ? -1 : Left > Right;
+}
+
+// Deals out the sources of one language.  Sorted is scratch space for
+// Count pointers.
+//
+static VOID
+AssignBatches(
+   PCC_ARGS Args,
+   PUNITY_SOURCE Sources,
+   DWORD Count,
+   BOOL Cpp,
+   PUNITY_SOURCE *Sorted,
+   PUNITY_BATCH Batches,
+   PDWORD NumBatches
+)
+{
+   DWORD First = *NumBatches;
+   DWORD Wanted = 0;
+   DWORD n = 0;
+   DWORD i, j;
+
+   for (i = 0; i < Count; ++i)
+   {
+      if (Sources[i].Batched && Sources[i].Cpp == Cpp)
+         Sorted[n++] = &Sources[i];
+   }
+
+   // A batch of one gains nothing.
+   //
+   if (n < 2)
+   {
+      for (i = 0; i < n; ++i)
+         Sorted[i]->Batched = FALSE;
+      return;
+   }
+
+   Wanted = (n + Args->UnitySize - 1) / Args->UnitySize;
+   if (Args->Jobs > Wanted)
+      Wanted = max(Wanted, min(Args->Jobs, n / 2));
+
+   qsort(Sorted, n, sizeof(*Sorted), CompareSize);
+
+   for (i = 0; i < n; ++i)
+   {
+      DWORD Best = First;
+
+      for (j = First + 1; j < First + Wanted; ++j)
+      {
+         if (Batches[j].Size < Batches[Best].Size)
+            Best = j;
+      }
+
+      Sorted[i]->Batch = Best;
+      Batches[Best].Size += max(Sorted[i]->Size, 1);
+   }
+
+   *NumBatches = First + Wanted;
+}
+
+static int __cdecl
+ComparePath(
+   const void *a,
+   const void *b
+)
+{
+   const UNITY_SOURCE *Left = *(const UNITY_SOURCE **)a;
+   const UNITY_SOURCE *Right = *(const UNITY_SOURCE **)b;
+
+   return _wcsicmp(Left->Path, Right->Path);
+}
+
+// Where batch files for this compile go.  Named after the output and the
+// set of sources being batched, so that unrelated compiles in the same
+// directory don't share batches.  Sorted is scratch space for Count
+// pointers.
+//
+static HRESULT
+GetBatchDirectory(
+   PCC_ARGS Args,
+   const LAUNCH_PARAMS *Launch,
+   PUNITY_SOURCE Sources,
+   DWORD Count,
+   PUNITY_SOURCE *Sorted,
+   WCHAR Key[HASH_STRING_LENGTH],
+   PWSTR *Out
+)
+{
+   HRESULT hr = S_OK;
+   HASH_CONTEXT Hash = {0};
+   PWSTR Output = NULL;
+   PWSTR Directory = NULL;
+   BYTE Digest[HASH_LENGTH];
+   DWORD n = 0;
+   DWORD i;
+
+   for (i = 0; i < Count; ++i)
+   {
+      if (Sources[i].Batched)
+         Sorted[n++] = &Sources[i];
+   }
+
+   qsort(Sorted, n, sizeof(*Sorted), ComparePath);
+
+   hr = GetAbsolutePath(
+      Launch,
+      Args->OutputName ? Args->OutputName : L".\\",
+      &Output
+   );
+
+   if (SUCCEEDED(hr))
+      hr = HashInit(&Hash);
+   if (SUCCEEDED(hr))
+      hr = HashDword(&Hash, Args->OutputType);
+   if (SUCCEEDED(hr))
+      hr = HashString(&Hash, Output);
+   for (i = 0; SUCCEEDED(hr) && i < n; ++i)
+      hr = HashString(&Hash, Sorted[i]->Path);
+   if (SUCCEEDED(hr))
+      hr = HashFinish(&Hash, Digest);
+
+   if (SUCCEEDED(hr))
+      hr = GetDataDirectory(L"unity", &Directory);
+   if (SUCCEEDED(hr))
+   {
+      HashToString(Digest, Key);
+      hr = HeapPrintf(Out, L"%s\\%s", Directory, Key);
+   }
+   if (SUCCEEDED(hr) &&
+       !CreateDirectory(*Out, NULL) &&
+       GetLastError() != ERROR_ALREADY_EXISTS)
+   {
+      hr = HRESULT_FROM_WIN32(GetLastError());
+   }
+
+   free(Directory);
+   free(Output);
+   HashFree(&Hash);
+   return hr;
+}
+
+static HRESULT
+WriteBatch(
+   PCWSTR Path,
+   PUNITY_SOURCE Sources,
+   DWORD Count,
+   DWORD Batch
+)
+{
+   HRESULT hr = S_OK;
+   BYTE_BUFFER Contents = {0};
+   BYTE_BUFFER Existing = {0};
+   PSTR Line = NULL;
+   DWORD i;
+   // cl reads a file with a byte order mark as UTF-8, whatever the code
+   // page, so any path can be written.
+   //
+   static const char Banner[] =
+      "\xef\xbb\xbf/* Generated by cc -funity. */\r\n";
+
+   hr = BufferAppend(&Contents, Banner, sizeof(Banner) - 1);
+
+   for (i = 0; SUCCEEDED(hr) && i < Count; ++i)
+   {
+      INT Length = 0;
+
+      if (!Sources[i].Batched || Sources[i].Batch != Batch)
+         continue;
+
+      Length = WideCharToMultiByte(
+         CP_UTF8,
+         0,
+         Sources[i].Path,
+         -1,
+         NULL,
+         0,
+         NULL,
+         NULL
+      );
+      Line = Length ? malloc(Length) : NULL;
+      if (!Line)
+      {
+         hr = Length ? E_OUTOFMEMORY : HRESULT_FROM_WIN32(GetLastError());
+         break;
+      }
+
+      WideCharToMultiByte(
+         CP_UTF8,
+         0,
+         Sources[i].Path,
+         -1,
+         Line,
+         Length,
+         NULL,
+         NULL
+      );
+
+      hr = BufferAppend(&Contents, "#include \"", 10);
+      if (SUCCEEDED(hr))
+         hr = BufferAppend(&Contents, Line, Length - 1);
+      if (SUCCEEDED(hr))
+         hr = BufferAppend(&Contents, "\"\r\n", 3);
+
+      free(Line);
+      Line = NULL;
+   }
+
+   // An unchanged batch keeps its timestamp.
+   //
+   if (SUCCEEDED(hr) &&
+       (FAILED(ReadFileContents(Path, &Existing)) ||
+        Existing.Length != Contents.Length ||
+        memcmp(Existing.Buffer, Contents.Buffer, Contents.Length)))
+   {
+      hr = WriteFileAtomic(Path, Contents.Buffer, Contents.Length);
+   }
+
+   FreeBuffer(&Existing);
+   FreeBuffer(&Contents);
+   return hr;
+}
+
+// Builds the input list for the batched compile: each batch takes the
+// place of its first source, and everything else stays where it was.
+//
+static HRESULT
+BuildInputs(
+   PCC_ARGS Args,
+   PUNITY_SOURCE Sources,
+   PUNITY_BATCH Batches,
+   PSTRING_LIST *Out
+)
+{
+   HRESULT hr = S_OK;
+   PSTRING_LIST List;
+   PSTRING_LIST Inputs = NULL;
+   DWORD i = 0;
+
+   for (List = Args->Inputs; SUCCEEDED(hr) && List; List = List->Next)
+   {
+      PCWSTR Input = List->String;
+
+      if (CcIsSourceFile(Input))
+      {
+         PUNITY_SOURCE Source = &Sources[i++];
+
+         if (Source->Batched)
+         {
+            PUNITY_BATCH Batch = &Batches[Source->Batch];
+
+            if (Batch->Added)
+               continue;
+
+            Input = Batch->Path;
+            Batch->Added = TRUE;
+         }
+      }
+
+      hr = StringListAllocString(Input, Inputs, &Inputs);
+   }
+
+   if (SUCCEEDED(hr))
+   {
+      StringListReverse(&Inputs);
+   }
+   else
+   {
+      FreeStringList(Inputs);
+      Inputs = NULL;
+   }
+
+   *Out = Inputs;
+   return hr;
+}
+
+//
+// Compiles sources in batches, if -funity asked for that.  Returns S_FALSE
+// if it did nothing, and the caller should compile as usual.
+//
+HRESULT
+UnityExecute(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   const LAUNCH_PARAMS *Launch,
+   PDWORD ReturnValue
+)
+{
+   HRESULT hr = S_OK;
+   CC_ARGS Batched = *Args;
+   PUNITY_SOURCE Sources = NULL;
+   PUNITY_SOURCE *Sorted = NULL;
+   PUNITY_BATCH Batches = NULL;
+   PSTRING_LIST Inputs = NULL;
+   PSTRING_LIST List;
+   PWSTR Directory = NULL;
+   WCHAR Key[HASH_STRING_LENGTH];
+   PCWSTR Stem = NULL;
+   INT StemLength = 0;
+   DWORD NumSources = 0;
+   DWORD NumBatches = 0;
+   DWORD i;
+
+   // Module units can't be #included into one another.
+   //
+   if (!Args->UnitySize ||
+       Args->Modules ||
+       Args->PreprocessOnly ||
+       (Args->OutputType == CC_OBJECT_FILE &&
+        Args->OutputName &&
+        !IsDirectoryName(Args->OutputName)))
+   {
+      return S_FALSE;
+   }
+
+   for (List = Args->Inputs; List; List = List->Next)
+   {
+      if (CcIsSourceFile(List->String))
+         ++NumSources;
+   }
+   if (NumSources < 2)
+      return S_FALSE;
+
+   Sources = calloc(NumSources, sizeof(*Sources));
+   Sorted = calloc(NumSources, sizeof(*Sorted));
+   Batches = calloc(NumSources, sizeof(*Batches));
+   if (!Sources || !Sorted || !Batches)
+      hr = E_OUTOFMEMORY;
+
+   for (List = Args->Inputs, i = 0;
+        SUCCEEDED(hr) && List;
+        List = List->Next)
+   {
+      PUNITY_SOURCE Source = &Sources[i];
+      WIN32_FILE_ATTRIBUTE_DATA Attributes;
+      PCWSTR Dot = wcsrchr(List->String, L'.');
+
+      if (!CcIsSourceFile(List->String))
+         continue;
+      ++i;
+
+      Source->Cpp = _wcsicmp(Dot, L".c") != 0;
+
+      hr = GetAbsolutePath(Launch, List->String, &Source->Path);
+
+      // A source we can't see is left for cl to complain about.
+      //
+      if (SUCCEEDED(hr) &&
+          GetFileAttributesEx(
+             Source->Path,
+             GetFileExInfoStandard,
+             &Attributes))
+      {
+         Source->Size = ((ULONGLONG)Attributes.nFileSizeHigh << 32) |
+                        Attributes.nFileSizeLow;
+         Source->Batched = !IsExcluded(Args, Launch, Source->Path);
+      }
+   }
+
+   if (SUCCEEDED(hr))
+   {
+      AssignBatches(
+         Args,
+         Sources,
+         NumSources,
+         FALSE,
+         Sorted,
+         Batches,
+         &NumBatches
+      );
+      AssignBatches(
+         Args,
+         Sources,
+         NumSources,
+         TRUE,
+         Sorted,
+         Batches,
+         &NumBatches
+      );
+
+      if (!NumBatches)
+         hr = S_FALSE;
+   }
+
+   if (hr == S_OK)
+   {
+      hr = GetBatchDirectory(
+         Args,
+         Launch,
+         Sources,
+         NumSources,
+         Sorted,
+         Key,
+         &Directory
+      );
+   }
+
+   if (hr == S_OK && Args->OutputType != CC_OBJECT_FILE)
+   {
+      PCWSTR Dot = NULL;
+
+      Stem = CcBaseName(Args->OutputName ? Args->OutputName : L"a.exe");
+      Dot = wcsrchr(Stem, L'.');
+      StemLength = Dot ? (INT)(Dot - Stem) : (INT)wcslen(Stem);
+   }
+
+   for (i = 0; hr == S_OK && i < NumSources; ++i)
+   {
+      PUNITY_BATCH Batch = &Batches[Sources[i].Batch];
+
+      if (!Sources[i].Batched || Batch->Path)
+         continue;
+
+      if (Args->OutputType == CC_OBJECT_FILE)
+      {
+         hr = HeapPrintf(
+            &Batch->Path,
+            L"%s\\unity%u-%.8s.%s",
+            Directory,
+            Sources[i].Batch,
+            Key,
+            Sources[i].Cpp ? L"cpp" : L"c"
+         );
+      }
+      else
+      {
+         hr = HeapPrintf(
+            &Batch->Path,
+            L"%s\\%.*s-unity%u.%s",
+            Directory,
+            StemLength,
+            Stem,
+            Sources[i].Batch,
+            Sources[i].Cpp ? L"cpp" : L"c"
+         );
+      }
+      if (SUCCEEDED(hr))
+         hr = WriteBatch(Batch->Path, Sources, NumSources, Sources[i].Batch);
+   }
+
+   if (hr == S_OK)
+      hr = BuildInputs(Args, Sources, Batches, &Inputs);
+
+   // Problems up to here just mean compiling the sources one by one.
+   //
+   if (FAILED(hr))
+      hr = S_FALSE;
+
+   if (hr == S_OK)
+   {
+      Batched.Inputs = Inputs;
+      Batched.UnitySize = 0;
+
+      hr = CcExecute(&Batched, Toolset, Launch, ReturnValue);
+   }
+
+   for (i = 0; Sources && i < NumSources; ++i)
+      free(Sources[i].Path);
+   for (i = 0; Batches && i < NumBatches; ++i)
+      free(Batches[i].Path);
+   FreeStringList(Inputs);
+   free(Directory);
+   free(Batches);
+   free(Sorted);
+   free(Sources);
+   return hr;
+}
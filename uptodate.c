@@ -0,0 +1,901 @@
+/*
+ * Copyright (c) 2017 Andrew Sveikauskas
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ */
+
+#include "clwrapper.h"
+#include <stdlib.h>
+#include <string.h>
+
+//
+// Up-to-date checks.
+//
+// With CLWRAPPER_UPTODATE set, a compile of one source to an object
+// succeeds without running cl if nothing that went into the object has
+// changed since cc last built it: the source, the headers cl reported
+// with /showIncludes, the options and the toolset.  This goes by what
+// files contain rather than when they were written, so a fresh checkout
+// or a touched header doesn't cause a rebuild the way it would with make
+// alone.
+//
+// What each object was built from is kept in one file in the data
+// directory, which every cc maps, guarded by a named mutex.  It holds two
+// kinds of record, each found by its key in an open-addressed table:
+//
+//    object   a hash of the options; the object's size and write time;
+//             and for each input, the key of its file record and a hash
+//             of what it contained
+//    file     a path, with its size, write time and content hash when it
+//             was last looked at
+//
+// File records are shared, so a header touched by a checkout is hashed
+// once rather than once for every object that includes it.  The file
+// doesn't grow; when it fills up it's compacted, and if that isn't
+// enough, emptied.
+//
+// Format:
+//
+//    UPTODATE_HEADER Header
+//    UPTODATE_SLOT Slots[UPTODATE_SLOTS]
+//    BYTE Data[UPTODATE_DATA_SIZE]
+//
+// An object record is:
+//
+//    BYTE Options[HASH_LENGTH]
+//    ULONGLONG Size, WriteTime
+//    DWORD Count
+//    Count times:
+//       BYTE FileKey[HASH_LENGTH]
+//       BYTE Digest[HASH_LENGTH]
+//
+// and a file record:
+//
+//    String Path
+//    ULONGLONG Size, WriteTime
+//    BYTE Digest[HASH_LENGTH]
+//
+
+#define UPTODATE_MAGIC     0x42444c43 // 'CLDB'
+#define UPTODATE_VERSION   1
+#define UPTODATE_SLOTS     65536
+#define UPTODATE_DATA_SIZE (64 * 1024 * 1024)
+
+// Keys for the two kinds of record are hashed from different starting
+// points, so that they can't collide.
+//
+#define UPTODATE_OBJECT 1
+#define UPTODATE_FILE   2
+
+typedef struct _UPTODATE_HEADER
+{
+   DWORD Magic;
+   DWORD Version;
+   DWORD Used;
+   DWORD Count;
+} UPTODATE_HEADER, *PUPTODATE_HEADER;
+
+typedef struct _UPTODATE_SLOT
+{
+   BYTE Key[HASH_LENGTH];
+   DWORD Offset;
+   DWORD Length;
+} UPTODATE_SLOT, *PUPTODATE_SLOT;
+
+#define UPTODATE_FILE_SIZE \
+   (sizeof(UPTODATE_HEADER) + \
+    UPTODATE_SLOTS * sizeof(UPTODATE_SLOT) + \
+    UPTODATE_DATA_SIZE)
+
+typedef struct _UPTODATE_DB
+{
+   HANDLE Mutex;
+   MAPPED_FILE File;
+   PUPTODATE_HEADER Header;
+   PUPTODATE_SLOT Slots;
+   PBYTE Data;
+} UPTODATE_DB, *PUPTODATE_DB;
+
+static BOOL
+IsEnabled(VOID)
+{
+   PWSTR Value = NULL;
+   BOOL Set = FALSE;
+
+   GetEnvironmentString(L"CLWRAPPER_UPTODATE", &Value);
+   Set = Value && *Value && wcscmp(Value, L"0");
+
+   free(Value);
+   return Set;
+}
+
+// One source to one object, as with the object cache.  The .ifc files a
+// module imports aren't among the files checked.
+//
+static BOOL
+IsCheckable(
+   PCC_ARGS Args
+)
+{
+   return Args->OutputType == CC_OBJECT_FILE &&
+          !Args->PreprocessOnly &&
+          !Args->Modules &&
+          !Args->ShowIncludes &&
+          Args->Inputs &&
+          !Args->Inputs->Next &&
+          CcIsSourceFile(Args->Inputs->String);
+}
+
+static HRESULT
+GetFileStamp(
+   PCWSTR Path,
+   PULONGLONG Size,
+   PULONGLONG WriteTime
+)
+{
+   WIN32_FILE_ATTRIBUTE_DATA Attributes = {0};
+
+   if (!GetFileAttributesEx(Path, GetFileExInfoStandard, &Attributes))
+      return HRESULT_FROM_WIN32(GetLastError());
+
+   *Size = ((ULONGLONG)Attributes.nFileSizeHigh << 32) |
+           Attributes.nFileSizeLow;
+   *WriteTime = FileTimeToQword(&Attributes.ftLastWriteTime);
+   return S_OK;
+}
+
+// Paths are compared without regard to case.
+//
+static HRESULT
+ComputePathKey(
+   DWORD Kind,
+   PCWSTR Path,
+   BYTE Key[HASH_LENGTH]
+)
+{
+   HRESULT hr = S_OK;
+   HASH_CONTEXT Hash = {0};
+   PWSTR Lower = NULL;
+
+   hr = HeapPrintf(&Lower, L"%s", Path);
+   if (SUCCEEDED(hr))
+   {
+      _wcslwr(Lower);
+      hr = HashInit(&Hash);
+   }
+   if (SUCCEEDED(hr))
+      hr = HashDword(&Hash, Kind);
+   if (SUCCEEDED(hr))
+      hr = HashString(&Hash, Lower);
+   if (SUCCEEDED(hr))
+      hr = HashFinish(&Hash, Key);
+
+   HashFree(&Hash);
+   free(Lower);
+   return hr;
+}
+
+// Everything besides the inputs' contents that decides what's in the
+// object.
+//
+static HRESULT
+ComputeOptions(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   PCWSTR Cwd,
+   BYTE Digest[HASH_LENGTH]
+)
+{
+   HRESULT hr = S_OK;
+   HASH_CONTEXT Hash = {0};
+   PWSTR Identity = NULL;
+   PWSTR Include = NULL;
+
+   hr = HashInit(&Hash);
+   if (SUCCEEDED(hr))
+      hr = HashDword(&Hash, UPTODATE_VERSION);
+   if (SUCCEEDED(hr))
+      hr = CacheHashCompileContext(&Hash, Args, Toolset);
+   if (SUCCEEDED(hr))
+      hr = ToolsetGetIdentity(Toolset, &Identity);
+   if (SUCCEEDED(hr))
+      hr = HashString(&Hash, Identity);
+
+   if (SUCCEEDED(hr))
+      hr = HashStringList(&Hash, Args->IncludePaths);
+   if (SUCCEEDED(hr))
+      hr = HashStringList(&Hash, Toolset->IncludePaths);
+   if (SUCCEEDED(hr))
+      hr = GetEnvironmentString(L"INCLUDE", &Include);
+   if (SUCCEEDED(hr))
+      hr = HashString(&Hash, Include);
+   if (SUCCEEDED(hr))
+      hr = HashStringList(&Hash, Args->PrefixMaps);
+   if (SUCCEEDED(hr))
+      hr = HashString(&Hash, Cwd);
+   if (SUCCEEDED(hr))
+      hr = HashStringList(&Hash, Args->ForcedIncludes);
+   if (SUCCEEDED(hr))
+      hr = HashString(&Hash, Args->PchFile);
+   if (SUCCEEDED(hr))
+      hr = HashString(&Hash, Args->PchThrough);
+
+   if (SUCCEEDED(hr))
+      hr = HashString(&Hash, Args->Inputs->String);
+   if (SUCCEEDED(hr))
+      hr = HashString(&Hash, Args->OutputName);
+   if (SUCCEEDED(hr))
+      hr = HashDword(&Hash, Args->EmbedDebugInfo);
+
+   // The make rule is an output too.
+   //
+   if (SUCCEEDED(hr))
+      hr = HashDword(&Hash, Args->Deps);
+   if (SUCCEEDED(hr))
+      hr = HashString(&Hash, Args->DepsFile);
+   if (SUCCEEDED(hr))
+      hr = HashString(&Hash, Args->DepsTarget);
+
+   if (SUCCEEDED(hr))
+      hr = HashFinish(&Hash, Digest);
+
+   HashFree(&Hash);
+   free(Include);
+   free(Identity);
+   return hr;
+}
+
+static VOID
+DbReset(
+   PUPTODATE_DB Db
+)
+{
+   memset(Db->Slots, 0, UPTODATE_SLOTS * sizeof(UPTODATE_SLOT));
+   Db->Header->Magic = UPTODATE_MAGIC;
+   Db->Header->Version = UPTODATE_VERSION;
+   Db->Header->Used = 0;
+   Db->Header->Count = 0;
+}
+
+// If whoever last held the lock died holding it, what they were writing
+// can't be trusted, so everything is thrown away.
+//
+static VOID
+DbLock(
+   PUPTODATE_DB Db
+)
+{
+   if (WaitForSingleObject(Db->Mutex, INFINITE) == WAIT_ABANDONED)
+      DbReset(Db);
+}
+
+static VOID
+DbUnlock(
+   PUPTODATE_DB Db
+)
+{
+   ReleaseMutex(Db->Mutex);
+}
+
+static VOID
+DbClose(
+   PUPTODATE_DB Db
+)
+{
+   UnmapFile(&Db->File);
+   if (Db->Mutex)
+      CloseHandle(Db->Mutex);
+   memset(Db, 0, sizeof(*Db));
+}
+
+// Creates the file at its full size, if it isn't already.
+//
+static HRESULT
+DbCreateFile(
+   PCWSTR Path
+)
+{
+   HRESULT hr = S_OK;
+   HANDLE File = INVALID_HANDLE_VALUE;
+   LARGE_INTEGER Size = {0};
+
+   File = CreateFile(
+      Path,
+      GENERIC_READ | GENERIC_WRITE,
+      FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+      NULL,
+      OPEN_ALWAYS,
+      FILE_ATTRIBUTE_NORMAL,
+      NULL
+   );
+   if (File == INVALID_HANDLE_VALUE)
+      hr = HRESULT_FROM_WIN32(GetLastError());
+
+   if (SUCCEEDED(hr) && !GetFileSizeEx(File, &Size))
+      hr = HRESULT_FROM_WIN32(GetLastError());
+
+   if (SUCCEEDED(hr) && Size.QuadPart != UPTODATE_FILE_SIZE)
+   {
+      Size.QuadPart = UPTODATE_FILE_SIZE;
+
+      if (!SetFilePointerEx(File, Size, NULL, FILE_BEGIN) ||
+          !SetEndOfFile(File))
+      {
+         hr = HRESULT_FROM_WIN32(GetLastError());
+      }
+   }
+
+   if (File != INVALID_HANDLE_VALUE)
+      CloseHandle(File);
+   return hr;
+}
+
+static HRESULT
+DbOpen(
+   PUPTODATE_DB Db
+)
+{
+   HRESULT hr = S_OK;
+   PWSTR Directory = NULL;
+   PWSTR Path = NULL;
+
+   memset(Db, 0, sizeof(*Db));
+   Db->File.File = INVALID_HANDLE_VALUE;
+
+   Db->Mutex = CreateMutex(NULL, FALSE, L"Local\\clwrapper-uptodate");
+   if (!Db->Mutex)
+      hr = HRESULT_FROM_WIN32(GetLastError());
+
+   if (SUCCEEDED(hr))
+      hr = GetDataDirectory(NULL, &Directory);
+   if (SUCCEEDED(hr))
+      hr = HeapPrintf(&Path, L"%s\\uptodate.db", Directory);
+
+   if (SUCCEEDED(hr))
+   {
+      BOOL Abandoned =
+         WaitForSingleObject(Db->Mutex, INFINITE) == WAIT_ABANDONED;
+
+      hr = DbCreateFile(Path);
+      if (SUCCEEDED(hr))
+         hr = MapFile(Path, TRUE, &Db->File);
+
+      if (SUCCEEDED(hr))
+      {
+         Db->Header = (PUPTODATE_HEADER)Db->File.Data;
+         Db->Slots = (PUPTODATE_SLOT)(Db->Header + 1);
+         Db->Data = (PBYTE)(Db->Slots + UPTODATE_SLOTS);
+
+         if (Abandoned ||
+             Db->Header->Magic != UPTODATE_MAGIC ||
+             Db->Header->Version != UPTODATE_VERSION)
+         {
+            DbReset(Db);
+         }
+      }
+
+      DbUnlock(Db);
+   }
+
+   if (FAILED(hr))
+      DbClose(Db);
+
+   free(Path);
+   free(Directory);
+   return hr;
+}
+
+// Returns the slot holding Key, or the free slot where it would go.  The
+// table is never allowed to fill, so there always is one.
+//
+static PUPTODATE_SLOT
+DbFind(
+   PUPTODATE_DB Db,
+   const BYTE Key[HASH_LENGTH]
+)
+{
+   DWORD Index = 0;
+
+   memcpy(&Index, Key, sizeof(Index));
+   Index %= UPTODATE_SLOTS;
+
+   while (Db->Slots[Index].Length &&
+          memcmp(Db->Slots[Index].Key, Key, HASH_LENGTH))
+   {
+      Index = (Index + 1) % UPTODATE_SLOTS;
+   }
+
+   return &Db->Slots[Index];
+}
+
+// Moves the records still in use to the start of Data, leaving out those
+// that have been replaced.
+//
+static HRESULT
+DbCompact(
+   PUPTODATE_DB Db
+)
+{
+   PBYTE Buffer = malloc(Db->Header->Used);
+   DWORD Used = 0;
+   DWORD i;
+
+   if (!Buffer)
+      return E_OUTOFMEMORY;
+
+   for (i = 0; i < UPTODATE_SLOTS; ++i)
+   {
+      PUPTODATE_SLOT Slot = &Db->Slots[i];
+
+      if (Slot->Length)
+      {
+         memcpy(Buffer + Used, Db->Data + Slot->Offset, Slot->Length);
+         Slot->Offset = Used;
+         Used += Slot->Length;
+      }
+   }
+
+   memcpy(Db->Data, Buffer, Used);
+   Db->Header->Used = Used;
+
+   free(Buffer);
+   return S_OK;
+}
+
+// Returns S_FALSE if there's no record for Key.
+//
+static HRESULT
+DbGet(
+   PUPTODATE_DB Db,
+   const BYTE Key[HASH_LENGTH],
+   PBYTE_BUFFER Record
+)
+{
+   HRESULT hr = S_OK;
+   PUPTODATE_SLOT Slot;
+
+   Record->Length = 0;
+
+   DbLock(Db);
+
+   Slot = DbFind(Db, Key);
+   if (!Slot->Length)
+      hr = S_FALSE;
+   else if (Slot->Offset > UPTODATE_DATA_SIZE ||
+            Slot->Length > UPTODATE_DATA_SIZE - Slot->Offset)
+      hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+   else
+      hr = BufferAppend(Record, Db->Data + Slot->Offset, Slot->Length);
+
+   DbUnlock(Db);
+   return hr;
+}
+
+static HRESULT
+DbPut(
+   PUPTODATE_DB Db,
+   const BYTE Key[HASH_LENGTH],
+   const BYTE_BUFFER *Record
+)
+{
+   HRESULT hr = S_OK;
+   PUPTODATE_SLOT Slot;
+   DWORD Length = (DWORD)Record->Length;
+
+   if (!Length || Record->Length > UPTODATE_DATA_SIZE / 4)
+      return E_INVALIDARG;
+
+   DbLock(Db);
+
+   Slot = DbFind(Db, Key);
+
+   if (!Slot->Length && Db->Header->Count >= UPTODATE_SLOTS / 4 * 3)
+   {
+      DbReset(Db);
+      Slot = DbFind(Db, Key);
+   }
+
+   if (Length > UPTODATE_DATA_SIZE - Db->Header->Used)
+   {
+      hr = DbCompact(Db);
+      if (SUCCEEDED(hr) && Length > UPTODATE_DATA_SIZE - Db->Header->Used)
+      {
+         DbReset(Db);
+         Slot = DbFind(Db, Key);
+      }
+   }
+
+   // The record goes in before the slot points at it.
+   //
+   if (SUCCEEDED(hr))
+   {
+      memcpy(Db->Data + Db->Header->Used, Record->Buffer, Length);
+
+      if (!Slot->Length)
+      {
+         memcpy(Slot->Key, Key, HASH_LENGTH);
+         ++Db->Header->Count;
+      }
+      Slot->Offset = Db->Header->Used;
+      Slot->Length = Length;
+      Db->Header->Used += Length;
+   }
+
+   DbUnlock(Db);
+   return hr;
+}
+
+//
+// Finds what's in Path now.  If its size and write time are what its file
+// record says, the recorded hash will do; otherwise it's hashed again, and
+// the record updated.
+//
+static HRESULT
+LookupFileDigest(
+   PUPTODATE_DB Db,
+   PCWSTR Path,
+   const BYTE Key[HASH_LENGTH],
+   BYTE Digest[HASH_LENGTH]
+)
+{
+   HRESULT hr = S_OK;
+   BYTE_BUFFER Record = {0};
+   BUFFER_READER Reader = {0};
+   PWSTR RecordedPath = NULL;
+   ULONGLONG Size = 0, RecordedSize = 0;
+   ULONGLONG WriteTime = 0, RecordedWriteTime = 0;
+   BYTE RecordedDigest[HASH_LENGTH];
+   FILE_DIGEST Current = {0};
+   BOOL Known = FALSE;
+   FILETIME NowFileTime;
+
+   hr = GetFileStamp(Path, &Size, &WriteTime);
+
+   if (SUCCEEDED(hr) && DbGet(Db, Key, &Record) == S_OK)
+   {
+      Reader.Data = Record.Buffer;
+      Reader.Length = Record.Length;
+
+      Known = SUCCEEDED(ReaderReadString(&Reader, &RecordedPath)) &&
+              SUCCEEDED(ReaderReadQword(&Reader, &RecordedSize)) &&
+              SUCCEEDED(ReaderReadQword(&Reader, &RecordedWriteTime)) &&
+              SUCCEEDED(ReaderRead(&Reader, RecordedDigest, HASH_LENGTH)) &&
+              RecordedWriteTime &&
+              RecordedSize == Size &&
+              RecordedWriteTime == WriteTime;
+   }
+
+   if (SUCCEEDED(hr) && Known)
+   {
+      memcpy(Digest, RecordedDigest, HASH_LENGTH);
+   }
+   else if (SUCCEEDED(hr))
+   {
+      hr = ManifestGetFileDigest(Path, &Current);
+      if (SUCCEEDED(hr))
+         memcpy(Digest, Current.Digest, HASH_LENGTH);
+
+      GetSystemTimeAsFileTime(&NowFileTime);
+      if (FileTimeToQword(&NowFileTime) - Current.WriteTime < FILE_RACY_AGE)
+         Current.WriteTime = 0;
+
+      // Failing to remember it only means hashing it again next time.
+      //
+      Record.Length = 0;
+      if (SUCCEEDED(hr) &&
+          SUCCEEDED(BufferAppendString(&Record, Path)) &&
+          SUCCEEDED(BufferAppendQword(&Record, Current.Size)) &&
+          SUCCEEDED(BufferAppendQword(&Record, Current.WriteTime)) &&
+          SUCCEEDED(BufferAppend(&Record, Digest, HASH_LENGTH)))
+      {
+         DbPut(Db, Key, &Record);
+      }
+   }
+
+   free(RecordedPath);
+   FreeBuffer(&Record);
+   return hr;
+}
+
+// Reads the path out of a file record.
+//
+static HRESULT
+GetFilePath(
+   PUPTODATE_DB Db,
+   const BYTE Key[HASH_LENGTH],
+   PWSTR *Path
+)
+{
+   HRESULT hr = S_OK;
+   BYTE_BUFFER Record = {0};
+   BUFFER_READER Reader = {0};
+
+   hr = DbGet(Db, Key, &Record);
+   if (hr == S_OK)
+   {
+      Reader.Data = Record.Buffer;
+      Reader.Length = Record.Length;
+
+      hr = ReaderReadString(&Reader, Path);
+      if (SUCCEEDED(hr) && !*Path)
+         hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+   }
+
+   FreeBuffer(&Record);
+   return hr;
+}
+
+//
+// Returns S_OK if the object was built from what's there now, and sets
+// *Includes to the headers it was built from, or S_FALSE if it needs
+// building.
+//
+static HRESULT
+CheckObject(
+   PUPTODATE_DB Db,
+   const BYTE Key[HASH_LENGTH],
+   const BYTE Options[HASH_LENGTH],
+   PCWSTR Object,
+   PSTRING_LIST *Includes
+)
+{
+   HRESULT hr = S_OK;
+   BYTE_BUFFER Record = {0};
+   BUFFER_READER Reader = {0};
+   BYTE RecordedOptions[HASH_LENGTH];
+   ULONGLONG Size = 0, RecordedSize = 0;
+   ULONGLONG WriteTime = 0, RecordedWriteTime = 0;
+   DWORD Count = 0;
+   DWORD i;
+
+   hr = DbGet(Db, Key, &Record);
+
+   if (hr == S_OK)
+   {
+      Reader.Data = Record.Buffer;
+      Reader.Length = Record.Length;
+
+      hr = ReaderRead(&Reader, RecordedOptions, HASH_LENGTH);
+   }
+   if (hr == S_OK)
+      hr = ReaderReadQword(&Reader, &RecordedSize);
+   if (hr == S_OK)
+      hr = ReaderReadQword(&Reader, &RecordedWriteTime);
+   if (hr == S_OK)
+      hr = ReaderReadDword(&Reader, &Count);
+
+   if (hr == S_OK && memcmp(Options, RecordedOptions, HASH_LENGTH))
+      hr = S_FALSE;
+
+   // The object itself must be the one we built.
+   //
+   if (hr == S_OK)
+      hr = GetFileStamp(Object, &Size, &WriteTime);
+   if (hr == S_OK && (Size != RecordedSize || WriteTime != RecordedWriteTime))
+      hr = S_FALSE;
+
+   for (i = 0; hr == S_OK && i < Count; ++i)
+   {
+      BYTE FileKey[HASH_LENGTH];
+      BYTE Expected[HASH_LENGTH];
+      BYTE Digest[HASH_LENGTH];
+      PWSTR Path = NULL;
+
+      hr = ReaderRead(&Reader, FileKey, HASH_LENGTH);
+      if (SUCCEEDED(hr))
+         hr = ReaderRead(&Reader, Expected, HASH_LENGTH);
+      if (SUCCEEDED(hr))
+         hr = GetFilePath(Db, FileKey, &Path);
+      if (hr == S_OK)
+         hr = LookupFileDigest(Db, Path, FileKey, Digest);
+      if (hr == S_OK && memcmp(Digest, Expected, HASH_LENGTH))
+         hr = S_FALSE;
+
+      // The first input is the source.
+      //
+      if (hr == S_OK && i)
+      {
+         hr = StringListAllocString(Path, *Includes, Includes);
+      }
+
+      free(Path);
+   }
+
+   if (hr == S_OK)
+      StringListReverse(Includes);
+
+   // A damaged record, or one naming a file that's gone, means the object
+   // gets built.
+   //
+   if (hr != S_OK)
+   {
+      FreeStringList(*Includes);
+      *Includes = NULL;
+      hr = S_FALSE;
+   }
+
+   FreeBuffer(&Record);
+   return hr;
+}
+
+// Adds an input to an object record.  Returns S_FALSE if it was written
+// after cl started, since then it may not be what cl read.
+//
+static HRESULT
+AppendInput(
+   PUPTODATE_DB Db,
+   PBYTE_BUFFER Record,
+   PCWSTR Cwd,
+   PCWSTR Input,
+   ULONGLONG Started
+)
+{
+   HRESULT hr = S_OK;
+   PWSTR Path = NULL;
+   BYTE FileKey[HASH_LENGTH];
+   BYTE Digest[HASH_LENGTH];
+   ULONGLONG Size = 0;
+   ULONGLONG WriteTime = 0;
+
+   hr = MakeAbsolute(Cwd, Input, &Path);
+   if (SUCCEEDED(hr))
+      hr = GetFileStamp(Path, &Size, &WriteTime);
+   if (SUCCEEDED(hr) && WriteTime >= Started)
+      hr = S_FALSE;
+
+   if (hr == S_OK)
+      hr = ComputePathKey(UPTODATE_FILE, Path, FileKey);
+   if (hr == S_OK)
+      hr = LookupFileDigest(Db, Path, FileKey, Digest);
+   if (hr == S_OK)
+      hr = BufferAppend(Record, FileKey, HASH_LENGTH);
+   if (hr == S_OK)
+      hr = BufferAppend(Record, Digest, HASH_LENGTH);
+
+   free(Path);
+   return hr;
+}
+
+//
+// Records what the object was just built from.  Returns S_FALSE without
+// recording anything if that can't be relied upon.
+//
+static HRESULT
+RecordObject(
+   PUPTODATE_DB Db,
+   const BYTE Key[HASH_LENGTH],
+   const BYTE Options[HASH_LENGTH],
+   PCWSTR Object,
+   PCWSTR Cwd,
+   PCWSTR Source,
+   PSTRING_LIST Includes,
+   ULONGLONG Started
+)
+{
+   HRESULT hr = S_OK;
+   BYTE_BUFFER Record = {0};
+   PSTRING_LIST Node;
+   ULONGLONG Size = 0;
+   ULONGLONG WriteTime = 0;
+   DWORD Count = 1;
+
+   // As with the object cache's manifests, no includes at all more likely
+   // means the notes weren't recognized than that there were none.
+   //
+   if (!Includes)
+      return S_FALSE;
+
+   for (Node = Includes; Node; Node = Node->Next)
+      ++Count;
+
+   hr = BufferAppend(&Record, Options, HASH_LENGTH);
+   if (SUCCEEDED(hr))
+      hr = GetFileStamp(Object, &Size, &WriteTime);
+   if (SUCCEEDED(hr))
+      hr = BufferAppendQword(&Record, Size);
+   if (SUCCEEDED(hr))
+      hr = BufferAppendQword(&Record, WriteTime);
+   if (SUCCEEDED(hr))
+      hr = BufferAppendDword(&Record, Count);
+
+   // The source first, then the headers.
+   //
+   if (SUCCEEDED(hr))
+      hr = AppendInput(Db, &Record, Cwd, Source, Started);
+   for (Node = Includes; hr == S_OK && Node; Node = Node->Next)
+      hr = AppendInput(Db, &Record, Cwd, Node->String, Started);
+
+   if (hr == S_OK)
+      hr = DbPut(Db, Key, &Record);
+
+   FreeBuffer(&Record);
+   return hr;
+}
+
+//
+// Skips a compile whose object is already up to date, and otherwise
+// compiles with /showIncludes and records what went into the object.
+// Returns S_FALSE if it did nothing, and the caller should compile as
+// usual.
+//
+HRESULT
+UpToDateExecute(
+   PCC_ARGS Args,
+   PCLWRAPPER_TOOLSET Toolset,
+   const LAUNCH_PARAMS *Launch,
+   PDWORD ReturnValue
+)
+{
+   HRESULT hr = S_OK;
+   UPTODATE_DB Db = {0};
+   PWSTR Cwd = NULL;
+   PWSTR ObjectName = NULL;
+   PWSTR Object = NULL;
+   PSTRING_LIST Includes = NULL;
+   BYTE Key[HASH_LENGTH];
+   BYTE Options[HASH_LENGTH];
+   FILETIME StartedFileTime;
+
+   if (!IsCheckable(Args) || !IsEnabled())
+      return S_FALSE;
+
+   hr = GetLaunchDirectory(Launch, &Cwd);
+   if (SUCCEEDED(hr))
+      hr = CcGetObjectName(Args, &ObjectName);
+   if (SUCCEEDED(hr))
+      hr = MakeAbsolute(Cwd, ObjectName, &Object);
+   if (SUCCEEDED(hr))
+      hr = ComputePathKey(UPTODATE_OBJECT, Object, Key);
+   if (SUCCEEDED(hr))
+      hr = ComputeOptions(Args, Toolset, Cwd, Options);
+   if (SUCCEEDED(hr))
+      hr = DbOpen(&Db);
+
+   // Without the database, compile as if we'd never been asked.
+   //
+   if (FAILED(hr))
+      hr = S_FALSE;
+
+   if (hr == S_OK &&
+       CheckObject(&Db, Key, Options, Object, &Includes) == S_OK)
+   {
+      *ReturnValue = 0;
+
+      if (Args->Deps)
+         hr = DepsWriteRule(Args, Toolset, Launch, Includes);
+   }
+   else if (hr == S_OK)
+   {
+      GetSystemTimeAsFileTime(&StartedFileTime);
+
+      hr = DepsCompile(Args, Toolset, Launch, ReturnValue, &Includes);
+
+      if (SUCCEEDED(hr) && !*ReturnValue && Args->Deps)
+         hr = DepsWriteRule(Args, Toolset, Launch, Includes);
+
+      // Not being able to record it only means building it next time.
+      //
+      if (SUCCEEDED(hr) && !*ReturnValue)
+      {
+         RecordObject(
+            &Db,
+            Key,
+            Options,
+            Object,
+            Cwd,
+            Args->Inputs->String,
+            Includes,
+            FileTimeToQword(&StartedFileTime)
+         );
+      }
+   }
+
+   DbClose(&Db);
+   FreeStringList(Includes);
+   free(Object);
+   free(ObjectName);
+   free(Cwd);
+   return hr;
+}
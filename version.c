@@ -11,25 +11,31 @@
 #include <stdio.h>
 #include <intsafe.h>
 
-#if _M_IX86
-#define WOW64NODE
-#else
-#define WOW64NODE L"Wow6432Node\\"
-#endif
-
 static HRESULT
 SortByVersion(
    PVS_VERSION *Versions
 );
 
+//
+// A configuration may have a cl.exe for each host.  The 64-bit ones don't
+// run out of address space on big sources or LTCG links, so they're used
+// wherever they can run; see MatchConfiguration().
+//
+#define VC_BIN     L"..\\..\\VC\\bin\\"
+#define X86_HOST   L"x86",   NULL
+#define AMD64_HOST L"amd64", VC_BIN L"amd64"
+
 static const ARCHITECTURE
 Arches[] =
 {
-   {L"..\\..\\VC\\ce\\bin\\x86_arm\\cl.exe", L"ce",    L"arm",   L"arm"},
-   {L"..\\..\\VC\\bin\\x86_arm\\cl.exe",     L"woa",   L"arm",   L"arm"},
-   {L"..\\..\\VC\\bin\\x86_amd64\\cl.exe",   L"amd64", L"amd64", L"x64"},
-   {L"..\\..\\VC\\bin\\cl.exe",              L"32",    NULL,     NULL},
-   {NULL, NULL, NULL, NULL}
+   {L"..\\..\\VC\\ce\\bin\\x86_arm\\cl.exe", L"ce", L"arm", L"arm", X86_HOST},
+   {VC_BIN L"x86_arm\\cl.exe",   L"woa",   L"arm",   L"arm", X86_HOST},
+   {VC_BIN L"amd64_arm\\cl.exe", L"woa",   L"arm",   L"arm", AMD64_HOST},
+   {VC_BIN L"x86_amd64\\cl.exe", L"amd64", L"amd64", L"x64", X86_HOST},
+   {VC_BIN L"amd64\\cl.exe",     L"amd64", L"amd64", L"x64", AMD64_HOST},
+   {VC_BIN L"amd64_x86\\cl.exe", L"32",    NULL,     NULL,   AMD64_HOST},
+   {VC_BIN L"cl.exe",            L"32",    NULL,     NULL,   X86_HOST},
+   {NULL, NULL, NULL, NULL, NULL, NULL}
 };
 
 const ARCHITECTURE *
@@ -54,6 +60,47 @@ FindArchByConfiguration(
    return r;
 }
 
+//
+// Which entry in the table a cl.exe that ProbeVsVersion() found is.
+//
+const ARCHITECTURE *
+FindArchByClPath(
+   PCWSTR InstallDir,
+   PCWSTR ClPath
+)
+{
+   const ARCHITECTURE *r = NULL;
+   SIZE_T Length = wcslen(InstallDir);
+
+   if (_wcsnicmp(ClPath, InstallDir, Length) || ClPath[Length] != L'\\')
+      return NULL;
+
+   for (r = Arches; r->ClFile; ++r)
+   {
+      if (!_wcsicmp(ClPath + Length + 1, r->ClFile))
+         return r;
+   }
+
+   return NULL;
+}
+
+// What the tools we run can be built for.  An x86 cc on 64-bit Windows is
+// running under WOW64, and can start 64-bit ones too.
+//
+static PCWSTR
+GetHostArch(VOID)
+{
+#if _M_IX86
+   BOOL Wow64 = FALSE;
+
+   if (IsWow64Process(GetCurrentProcess(), &Wow64) && Wow64)
+      return L"amd64";
+   return L"x86";
+#else
+   return L"amd64";
+#endif
+}
+
 static HRESULT
 ProbeVsVersion(
    PVOID Context,
@@ -199,7 +246,7 @@ GetInstalledVsVersions(
    hr = EnumKey(
       Out,
       HKEY_LOCAL_MACHINE,
-      L"SOFTWARE\\" WOW64NODE L"Microsoft\\VisualStudio",
+      VS_ROOT_KEY,
       ProbeVsVersion
    );
    if (hr == HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND))
@@ -299,7 +346,7 @@ GetInstalledSdks(
    hr = EnumKey(
       Out,
       HKEY_LOCAL_MACHINE,
-      L"SOFTWARE\\" WOW64NODE L"Microsoft\\Microsoft SDKs\\Windows",
+      SDK_ROOT_KEY,
       ProbeSdkVersion 
    );
    if (hr == HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND))
@@ -416,6 +463,86 @@ FreeVsVersions(
    }
 }
 
+HRESULT
+WriteVsVersions(
+   PVS_VERSION Versions,
+   PBYTE_BUFFER Buffer
+)
+{
+   HRESULT hr = S_OK;
+   PVS_VERSION Node;
+   DWORD Count = 0;
+
+   for (Node = Versions; Node; Node = Node->Next)
+      ++Count;
+
+   hr = BufferAppendDword(Buffer, Count);
+
+   for (Node = Versions; SUCCEEDED(hr) && Node; Node = Node->Next)
+   {
+      hr = BufferAppendDword(Buffer, MAKELONG(Node->Minor, Node->Major));
+      if (SUCCEEDED(hr))
+         hr = BufferAppendString(Buffer, Node->InstallDir);
+      if (SUCCEEDED(hr))
+         hr = BufferAppendStringList(Buffer, Node->Configurations);
+      if (SUCCEEDED(hr))
+         hr = BufferAppendStringList(Buffer, Node->ClPaths);
+   }
+
+   return hr;
+}
+
+HRESULT
+ReadVsVersions(
+   PBUFFER_READER Reader,
+   PVS_VERSION *Out
+)
+{
+   HRESULT hr = S_OK;
+   PVS_VERSION Head = NULL;
+   PVS_VERSION *Tail = &Head;
+   DWORD Count = 0;
+
+   hr = ReaderReadDword(Reader, &Count);
+
+   while (SUCCEEDED(hr) && Count--)
+   {
+      PVS_VERSION Current = malloc(sizeof(*Current));
+      DWORD Version = 0;
+
+      if (!Current)
+      {
+         hr = E_OUTOFMEMORY;
+         break;
+      }
+
+      memset(Current, 0, sizeof(*Current));
+      *Tail = Current;
+      Tail = &Current->Next;
+
+      hr = ReaderReadDword(Reader, &Version);
+      if (SUCCEEDED(hr))
+      {
+         Current->Major = HIWORD(Version);
+         Current->Minor = LOWORD(Version);
+         hr = ReaderReadString(Reader, &Current->InstallDir);
+      }
+      if (SUCCEEDED(hr))
+         hr = ReaderReadStringList(Reader, &Current->Configurations);
+      if (SUCCEEDED(hr))
+         hr = ReaderReadStringList(Reader, &Current->ClPaths);
+   }
+
+   if (FAILED(hr))
+   {
+      FreeVsVersions(Head);
+      Head = NULL;
+   }
+
+   *Out = Head;
+   return hr;
+}
+
 static BOOL
 ContainsConfiguration(
    PVS_VERSION Version,
@@ -465,31 +592,71 @@ RemoveIf(
    }
 } 
 
+typedef struct _CONFIGURATION_SPEC
+{
+   PCWSTR Configuration;
+   PCWSTR Host;
+   BOOL ForceHost;
+} CONFIGURATION_SPEC, *PCONFIGURATION_SPEC;
+
+//
+// Keeps one cl.exe for the configuration asked for, or without -m, for the
+// first one the compiler has.  One built for Spec->Host wins; otherwise,
+// unless the host was forced, an x86 one, which runs anywhere.
+//
 static BOOL
 MatchConfiguration(
-   PVOID Configuration,
+   PVOID Specp,
    PVS_VERSION Version
 )
 {
+   PCONFIGURATION_SPEC Spec = Specp;
+   PCWSTR Configuration = Spec->Configuration;
    PSTRING_LIST *ConfigHead = &Version->Configurations;
    PSTRING_LIST *ClPathHead = &Version->ClPaths;
    PSTRING_LIST Config = *ConfigHead;
    PSTRING_LIST ClPath = *ClPathHead;
-   BOOL Found = FALSE;
+   PSTRING_LIST Keep = NULL;
+
+   if (!Configuration && Config)
+      Configuration = Config->String;
+
+   for (; Config; Config = Config->Next, ClPath = ClPath->Next)
+   {
+      const ARCHITECTURE *Arch = NULL;
+      PCWSTR Host = L"x86";
+
+      if (wcscmp(Config->String, Configuration))
+         continue;
+
+      Arch = FindArchByClPath(Version->InstallDir, ClPath->String);
+      if (Arch)
+         Host = Arch->HostArchName;
+
+      if (!wcscmp(Host, Spec->Host))
+      {
+         Keep = Config;
+         break;
+      }
+
+      if (!Keep && !Spec->ForceHost && !wcscmp(Host, L"x86"))
+         Keep = Config;
+   }
+
+   Config = *ConfigHead;
+   ClPath = *ClPathHead;
 
    while (Config)
    {
       PSTRING_LIST NextConfig = Config->Next;
       PSTRING_LIST NextCl = ClPath->Next;
 
-      if (!Found &&
-          !wcscmp(Config->String, Configuration))
+      if (Config == Keep)
       {
          // Keep this one...
          //
          ConfigHead = &Config->Next;
          ClPathHead = &ClPath->Next;
-         Found = TRUE;
       }
       else
       {
@@ -503,7 +670,7 @@ MatchConfiguration(
       ClPath = NextCl;
    }
 
-   return !Found;
+   return !Keep;
 }
 
 static BOOL
@@ -528,19 +695,53 @@ FindToolset(
    PVS_VERSION Compilers = NULL;
    PVS_VERSION Sdks = NULL;
    PCWSTR Arch = Args->DesiredArchitecture;
+   BOOL WinCE = Arch && !wcscmp(Arch, L"ce");
 
-   hr = GetInstalledVsVersions(&Compilers);
+   if (WinCE)
+   {
+      hr = GetInstalledVsVersions(&Compilers);
+      if (SUCCEEDED(hr))
+         hr = GetInstalledSdks(TRUE, &Sdks);
+   }
+   else
+   {
+      hr = GetCachedVsVersionsAndSdks(
+         !Args->NoToolsetCache,
+         &Compilers,
+         &Sdks
+      );
+   }
 
-   if (SUCCEEDED(hr) &&
-       Arch)
+   if (SUCCEEDED(hr))
    {
-      RemoveIf(&Compilers, MatchConfiguration, (PVOID)Arch);
+      CONFIGURATION_SPEC Spec = {0};
 
-      if (!Compilers)
+      Spec.Configuration = Arch;
+      Spec.Host = Args->DesiredHost ? Args->DesiredHost : GetHostArch();
+      Spec.ForceHost = Args->DesiredHost != NULL;
+
+      RemoveIf(&Compilers, MatchConfiguration, &Spec);
+
+      if (!Compilers && Arch && Spec.ForceHost)
+      {
+         fprintf(
+            stderr,
+            "No compiler found to match -m%ls -host=%ls\n",
+            Arch,
+            Spec.Host
+         );
+      }
+      else if (!Compilers && Arch)
       {
          fprintf(stderr, "No compiler found to match -m%ls\n", Arch);
-         hr = HRESULT_FROM_WIN32(ERROR_NOT_FOUND);
       }
+      else if (!Compilers && Spec.ForceHost)
+      {
+         fprintf(stderr, "No compiler found to match -host=%ls\n", Spec.Host);
+      }
+
+      if (!Compilers && (Arch || Spec.ForceHost))
+         hr = HRESULT_FROM_WIN32(ERROR_NOT_FOUND);
    }
 
    if (SUCCEEDED(hr) &&
@@ -563,14 +764,6 @@ FindToolset(
       }
    }
 
-   if (SUCCEEDED(hr))
-   {
-      hr = GetInstalledSdks(
-         Arch && !wcscmp(Arch, L"ce"),
-         &Sdks
-      );
-   }
-
    if (SUCCEEDED(hr) &&
        Args->SdkVersion.Specified)
    {
@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2017 Andrew Sveikauskas
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ */
+
+//
+// clwrapper-worker [-a address] [-p port] [-j N] [toolset options]
+//
+// Takes compiles from cc processes on other machines; see dist.c.  The
+// toolset is picked with the same options cc takes (-V, -m, -toolset=...),
+// and only compiles from clients using a matching toolset are accepted.
+// To serve more than one toolset, run more than one worker.
+//
+// Run on localhost, it stands in for a build farm when trying things out.
+//
+
+#include "clwrapper.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define WORKER_DEFAULT_ADDRESS L"127.0.0.1"
+#define WORKER_DEFAULT_PORT    L"8381"
+
+static HRESULT
+WorkerMain(
+   INT Argc,
+   PWSTR *Argv
+)
+{
+   HRESULT hr = S_OK;
+   CLWRAPPER_ARGS_BASE Args = {0};
+   CLWRAPPER_TOOLSET Toolset = {0};
+   PWSTR DllDirectory = NULL;
+   PCWSTR Address = WORKER_DEFAULT_ADDRESS;
+   PCWSTR Port = WORKER_DEFAULT_PORT;
+   DWORD MaxRunning = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+   PWSTR *CurrentArg = Argv + 1;
+
+   while (SUCCEEDED(hr) && *CurrentArg)
+   {
+      INT NumConsumed = 0;
+
+      hr = BaseParseArg(&Args, CurrentArg, &NumConsumed);
+      if (FAILED(hr))
+         break;
+
+      if (NumConsumed)
+      {
+         CurrentArg += NumConsumed;
+      }
+      else if (CurrentArg[1] && !wcscmp(*CurrentArg, L"-a"))
+      {
+         Address = CurrentArg[1];
+         CurrentArg += 2;
+      }
+      else if (CurrentArg[1] && !wcscmp(*CurrentArg, L"-p"))
+      {
+         Port = CurrentArg[1];
+         CurrentArg += 2;
+      }
+      else if (CurrentArg[1] &&
+               !wcscmp(*CurrentArg, L"-j") &&
+               wcstoul(CurrentArg[1], NULL, 10))
+      {
+         MaxRunning = wcstoul(CurrentArg[1], NULL, 10);
+         CurrentArg += 2;
+      }
+      else
+      {
+         fprintf(
+            stderr,
+            "usage: %ls [-a address] [-p port] [-j N] [toolset options]\n",
+            Argv[0]
+         );
+         hr = E_INVALIDARG;
+      }
+   }
+
+   if (SUCCEEDED(hr))
+   {
+      hr = ToolsetAcquire(&Args, &Toolset);
+   }
+
+   // CL depends on some DLLs in VS's "IDE" dir.
+   //
+   if (SUCCEEDED(hr))
+      hr = ToolsetGetDllDirectory(&Toolset, &DllDirectory);
+   if (SUCCEEDED(hr))
+      hr = AddToPath(DllDirectory);
+
+   if (SUCCEEDED(hr))
+   {
+      hr = DistServe(Address, Port, &Toolset, MaxRunning);
+   }
+
+   free(DllDirectory);
+   ToolsetFree(&Toolset);
+   BaseArgsFree(&Args);
+   return hr;
+}
+
+int main()
+{
+   INT Argc = 0;
+   PWSTR *Args = CommandLineToArgvW(GetCommandLine(), &Argc);
+   HRESULT hr = S_OK;
+
+   if (!Args)
+   {
+      DWORD Err = GetLastError();
+      fprintf(stderr, "CommandLineToArgvW failed, GetLastError=0x%.8x\n", Err);
+      return Err;
+   }
+
+   hr = WorkerMain(Argc, Args);
+
+   LocalFree(Args);
+   if (FAILED(hr))
+   {
+      fprintf(stderr, "Failed with 0x%.8x\n", hr);
+      return hr;
+   }
+   return 0;
+}